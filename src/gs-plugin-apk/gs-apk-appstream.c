@@ -0,0 +1,416 @@
+/*
+ * Copyright (C) 2024 The gnome-software-plugin-apk contributors
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#include "gs-apk-appstream.h"
+#include <string.h>
+
+#define GS_APK_APPSTREAM_ORIGIN "alpine-packages"
+#define GS_APK_APPSTREAM_ID_PREFIX "org.alpinelinux.packages."
+
+struct _GsApkAppstream
+{
+  GHashTable *components; /* (owned) (element-type utf8 Component) */
+};
+
+typedef struct
+{
+  gchar *version; /* (owned) */
+  gchar *xml;     /* (owned) (nullable): formatted when needed */
+} Component;
+
+static void
+component_free (Component *component)
+{
+  g_free (component->version);
+  g_free (component->xml);
+  g_free (component);
+}
+
+/* Subpackages which are of no interest on their own */
+static const gchar *excluded_suffixes[] = {
+  "-doc",
+  "-dev",
+  "-dbg",
+  "-static",
+  "-lang",
+  "-openrc",
+  "-bash-completion",
+  "-zsh-completion",
+  "-fish-completion",
+  "-pyc",
+  NULL
+};
+
+GsApkAppstream *
+gs_apk_appstream_new (void)
+{
+  GsApkAppstream *appstream = g_new0 (GsApkAppstream, 1);
+
+  appstream->components = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                                 (GDestroyNotify) component_free);
+  return appstream;
+}
+
+void
+gs_apk_appstream_free (GsApkAppstream *appstream)
+{
+  g_hash_table_unref (appstream->components);
+  g_free (appstream);
+}
+
+/**
+ * gs_apk_appstream_shed:
+ * @appstream: The generator
+ *
+ * Frees the XML of all components, which is most of the generator's
+ * memory. The versions are kept, so the next update still knows whether
+ * the collection changed, and only formats components again if it did.
+ **/
+void
+gs_apk_appstream_shed (GsApkAppstream *appstream)
+{
+  GHashTableIter iter;
+  Component *component;
+
+  g_hash_table_iter_init (&iter, appstream->components);
+  while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &component))
+    g_clear_pointer (&component->xml, g_free);
+}
+
+/**
+ * scan_catalog:
+ * @path: An AppStream collection, optionally gzip compressed
+ * @pkgnames: The set to add to
+ * @cancellable: (nullable): A GCancellable
+ *
+ * Adds every `<pkgname>` of @path to @pkgnames. A plain text scan is
+ * enough for this and much cheaper than parsing the whole catalog.
+ **/
+static void
+scan_catalog (const gchar *path, GHashTable *pkgnames, GCancellable *cancellable)
+{
+  g_autoptr (GFile) file = g_file_new_for_path (path);
+  g_autoptr (GInputStream) stream = NULL;
+  g_autoptr (GDataInputStream) data_stream = NULL;
+  g_autoptr (GError) local_error = NULL;
+  gchar *line;
+
+  stream = G_INPUT_STREAM (g_file_read (file, cancellable, &local_error));
+  if (stream == NULL)
+    {
+      g_debug ("Failed to read %s: %s", path, local_error->message);
+      return;
+    }
+  if (g_str_has_suffix (path, ".gz"))
+    {
+      g_autoptr (GZlibDecompressor) decompressor = NULL;
+      GInputStream *compressed = stream;
+
+      decompressor = g_zlib_decompressor_new (G_ZLIB_COMPRESSOR_FORMAT_GZIP);
+      stream = g_converter_input_stream_new (compressed, G_CONVERTER (decompressor));
+      g_object_unref (compressed);
+    }
+
+  data_stream = g_data_input_stream_new (stream);
+  while ((line = g_data_input_stream_read_line (data_stream, NULL, cancellable, &local_error)) != NULL)
+    {
+      const gchar *start = strstr (line, "<pkgname>");
+      const gchar *end;
+
+      if (start != NULL)
+        {
+          start += strlen ("<pkgname>");
+          end = strstr (start, "</pkgname>");
+          if (end != NULL)
+            g_hash_table_add (pkgnames, g_strndup (start, end - start));
+        }
+      g_free (line);
+    }
+  if (local_error != NULL)
+    g_debug ("Failed to read %s: %s", path, local_error->message);
+}
+
+/**
+ * gs_apk_appstream_scan_pkgnames:
+ * @root: The root of the system
+ * @cancellable: (nullable): A GCancellable
+ *
+ * Collects the packages the distribution's AppStream catalogs already
+ * describe. This reads and decompresses the catalogs, so it should run in
+ * a thread.
+ *
+ * Returns: (transfer full) (element-type utf8): the set of package names
+ **/
+GHashTable *
+gs_apk_appstream_scan_pkgnames (const gchar *root, GCancellable *cancellable)
+{
+  const gchar *catalog_dirs[] = {
+    "usr/share/swcatalog/xml",
+    "var/cache/swcatalog/xml",
+    "usr/share/app-info/xmls",
+    NULL
+  };
+  GHashTable *pkgnames = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+
+  for (guint i = 0; catalog_dirs[i] != NULL; i++)
+    {
+      g_autofree gchar *dir_path = g_build_filename (root, catalog_dirs[i], NULL);
+      g_autoptr (GDir) dir = g_dir_open (dir_path, 0, NULL);
+      const gchar *name;
+
+      if (dir == NULL)
+        continue;
+
+      while ((name = g_dir_read_name (dir)) != NULL)
+        {
+          g_autofree gchar *path = NULL;
+
+          if (!g_str_has_suffix (name, ".xml") && !g_str_has_suffix (name, ".xml.gz"))
+            continue;
+          path = g_build_filename (dir_path, name, NULL);
+          scan_catalog (path, pkgnames, cancellable);
+        }
+    }
+
+  return pkgnames;
+}
+
+static gboolean
+is_excluded (const gchar *name)
+{
+  for (guint i = 0; excluded_suffixes[i] != NULL; i++)
+    {
+      if (g_str_has_suffix (name, excluded_suffixes[i]))
+        return TRUE;
+    }
+  return strstr (name, "-lang-") != NULL;
+}
+
+/**
+ * collect_dependencies:
+ * @apk_index: The package index
+ * @packages: (element-type GsApkIndexPackage): All packages of @apk_index
+ *
+ * Returns: (transfer full) (element-type GsApkIndexPackage): the set of
+ * packages which another package depends on, through any of their
+ * provides. These are libraries, modules and helpers rather than software
+ * a user looks for.
+ **/
+static GHashTable *
+collect_dependencies (GsApkIndex *apk_index, GPtrArray *packages)
+{
+  GHashTable *dependencies = g_hash_table_new (NULL, NULL);
+
+  for (guint i = 0; i < packages->len; i++)
+    {
+      GsApkIndexPackage *package = g_ptr_array_index (packages, i);
+
+      for (guint j = 0; package->depends != NULL && package->depends[j] != NULL; j++)
+        {
+          GPtrArray *providers = gs_apk_index_lookup (apk_index, package->depends[j]);
+
+          for (guint k = 0; providers != NULL && k < providers->len; k++)
+            {
+              if (g_ptr_array_index (providers, k) != package)
+                g_hash_table_add (dependencies, g_ptr_array_index (providers, k));
+            }
+        }
+    }
+
+  return dependencies;
+}
+
+static void
+append_escaped (GString *xml, const gchar *format, ...) G_GNUC_PRINTF (2, 3);
+
+static void
+append_escaped (GString *xml, const gchar *format, ...)
+{
+  g_autofree gchar *escaped = NULL;
+  va_list args;
+
+  va_start (args, format);
+  escaped = g_markup_vprintf_escaped (format, args);
+  va_end (args);
+  g_string_append (xml, escaped);
+}
+
+static gchar *
+format_component (GsApkIndexPackage *package)
+{
+  GString *xml = g_string_new (NULL);
+  g_autofree gchar *id = NULL;
+
+  /* Package names may contain characters AppStream IDs must not, e.g. g++ */
+  id = g_strcanon (g_strdup (package->name), G_CSET_A_2_Z G_CSET_a_2_z G_CSET_DIGITS "-_.", '_');
+  g_string_append (xml, "  <component type=\"console-application\">\n");
+  append_escaped (xml, "    <id>" GS_APK_APPSTREAM_ID_PREFIX "%s</id>\n", id);
+  append_escaped (xml, "    <name>%s</name>\n", package->name);
+  append_escaped (xml, "    <summary>%s</summary>\n",
+                  package->description != NULL ? package->description : package->name);
+  if (package->license != NULL)
+    append_escaped (xml, "    <project_license>%s</project_license>\n", package->license);
+  if (package->url != NULL)
+    append_escaped (xml, "    <url type=\"homepage\">%s</url>\n", package->url);
+  append_escaped (xml, "    <pkgname>%s</pkgname>\n", package->name);
+  g_string_append (xml, "  </component>\n");
+
+  return g_string_free (xml, FALSE);
+}
+
+static gint
+package_cmp (gconstpointer a, gconstpointer b)
+{
+  const GsApkIndexPackage *package_a = *(const GsApkIndexPackage **) a;
+  const GsApkIndexPackage *package_b = *(const GsApkIndexPackage **) b;
+
+  return strcmp (package_a->name, package_b->name);
+}
+
+/**
+ * gs_apk_appstream_update:
+ * @appstream: The generator
+ * @apk_index: The package index
+ * @pkgnames: (element-type utf8): Packages to leave out, see
+ *   gs_apk_appstream_scan_pkgnames()
+ * @out_stats: (out) (optional): Return location for what the update did
+ *
+ * Brings the collection up to date with @apk_index. Only packages a user
+ * would look for get a component: those providing a command which no
+ * other package depends on. Whether the collection changed is
+ * decided from the package versions alone. Only then is the collection
+ * put together, formatting the packages which are new, changed version,
+ * or whose XML was shed. This only reads @apk_index, so it can run in a
+ * thread as long as nothing else uses @appstream meanwhile.
+ *
+ * Returns: (transfer full) (nullable): the new collection, or %NULL if it
+ * did not change since the last update.
+ **/
+GBytes *
+gs_apk_appstream_update (GsApkAppstream *appstream,
+                         GsApkIndex *apk_index,
+                         GHashTable *pkgnames,
+                         GsApkAppstreamStats *out_stats)
+{
+  GPtrArray *index_packages = gs_apk_index_get_packages (apk_index);
+  g_autoptr (GPtrArray) packages = g_ptr_array_sized_new (index_packages->len);
+  g_autoptr (GHashTable) components = NULL;
+  g_autoptr (GHashTable) dependencies = NULL;
+  g_autoptr (GString) xml = NULL;
+  GsApkAppstreamStats stats = { 0, };
+  guint n_changed = 0;
+
+  dependencies = collect_dependencies (apk_index, index_packages);
+  components = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                      (GDestroyNotify) component_free);
+  for (guint i = 0; i < index_packages->len; i++)
+    {
+      GsApkIndexPackage *package = g_ptr_array_index (index_packages, i);
+      gchar *name = NULL;
+      Component *component = NULL;
+
+      if (!package->has_commands || g_hash_table_contains (dependencies, package) ||
+          is_excluded (package->name) || g_hash_table_contains (pkgnames, package->name))
+        continue;
+
+      if (!g_hash_table_steal_extended (appstream->components, package->name,
+                                        (gpointer *) &name, (gpointer *) &component) ||
+          g_strcmp0 (component->version, package->version) != 0)
+        {
+          g_free (name);
+          g_clear_pointer (&component, component_free);
+          name = g_strdup (package->name);
+          component = g_new0 (Component, 1);
+          component->version = g_strdup (package->version);
+          n_changed++;
+        }
+      g_ptr_array_add (packages, package);
+      g_hash_table_insert (components, name, component);
+    }
+
+  /* Whatever is left was removed from the index */
+  stats.n_dropped = g_hash_table_size (appstream->components);
+  g_hash_table_unref (appstream->components);
+  appstream->components = g_steal_pointer (&components);
+  if (n_changed == 0 && stats.n_dropped == 0)
+    {
+      g_debug ("AppStream collection: %u components unchanged", packages->len);
+      if (out_stats != NULL)
+        *out_stats = stats;
+      return NULL;
+    }
+
+  g_ptr_array_sort (packages, package_cmp);
+  xml = g_string_new ("<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+                      "<components version=\"0.14\" origin=\"" GS_APK_APPSTREAM_ORIGIN "\">\n");
+  for (guint i = 0; i < packages->len; i++)
+    {
+      GsApkIndexPackage *package = g_ptr_array_index (packages, i);
+      Component *component = g_hash_table_lookup (appstream->components, package->name);
+
+      if (component->xml == NULL)
+        {
+          component->xml = format_component (package);
+          stats.n_formatted++;
+        }
+      else
+        {
+          stats.n_reused++;
+        }
+      g_string_append (xml, component->xml);
+    }
+  g_string_append (xml, "</components>\n");
+
+  g_debug ("AppStream collection: %u components reused, %u formatted, %u dropped",
+           stats.n_reused, stats.n_formatted, stats.n_dropped);
+  if (out_stats != NULL)
+    *out_stats = stats;
+  return g_string_free_to_bytes (g_steal_pointer (&xml));
+}
+
+/**
+ * gs_apk_appstream_write:
+ * @xml: The collection, see gs_apk_appstream_update()
+ * @path: Where to write it, gzip compressed
+ * @cancellable: (nullable): A GCancellable
+ * @error: Return location for a #GError
+ *
+ * Atomically replaces @path with @xml. This compresses the collection, so
+ * it should run in a thread.
+ *
+ * Returns: %TRUE on success
+ **/
+gboolean
+gs_apk_appstream_write (GBytes *xml,
+                        const gchar *path,
+                        GCancellable *cancellable,
+                        GError **error)
+{
+  g_autoptr (GFile) file = g_file_new_for_path (path);
+  g_autoptr (GFile) parent = g_file_get_parent (file);
+  g_autoptr (GFileOutputStream) file_stream = NULL;
+  g_autoptr (GZlibCompressor) compressor = NULL;
+  g_autoptr (GOutputStream) stream = NULL;
+  g_autoptr (GError) local_error = NULL;
+
+  if (!g_file_make_directory_with_parents (parent, cancellable, &local_error) &&
+      !g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_EXISTS))
+    {
+      g_propagate_error (error, g_steal_pointer (&local_error));
+      return FALSE;
+    }
+
+  file_stream = g_file_replace (file, NULL, FALSE, G_FILE_CREATE_REPLACE_DESTINATION,
+                                cancellable, error);
+  if (file_stream == NULL)
+    return FALSE;
+  compressor = g_zlib_compressor_new (G_ZLIB_COMPRESSOR_FORMAT_GZIP, -1);
+  stream = g_converter_output_stream_new (G_OUTPUT_STREAM (file_stream), G_CONVERTER (compressor));
+
+  return g_output_stream_write_all (stream, g_bytes_get_data (xml, NULL), g_bytes_get_size (xml),
+                                    NULL, cancellable, error) &&
+         g_output_stream_close (stream, cancellable, error);
+}
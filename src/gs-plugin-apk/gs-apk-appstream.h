@@ -0,0 +1,55 @@
+/*
+ * Copyright (C) 2024 The gnome-software-plugin-apk contributors
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#pragma once
+
+#include "gs-apk-index.h"
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+/*
+ * Generates a minimal AppStream collection for the command line tools the
+ * distribution's AppStream catalog does not describe, so the appstream
+ * plugin can list and search them like any other component. Each
+ * component only carries what the package index knows: id, name, summary,
+ * license, homepage and pkgname. Libraries and other packages something
+ * depends on, and subpackages such as `foo-doc` or `foo-dev`, are left
+ * out.
+ *
+ * The generator keeps the XML of every component it produced, keyed by
+ * package name and version, so a rebuild only formats packages that
+ * changed, and reports whether the collection changed at all. Under memory
+ * pressure the XML can be shed while the versions are kept.
+ */
+
+typedef struct _GsApkAppstream GsApkAppstream;
+
+typedef struct
+{
+  guint n_reused;    /* components whose XML was reused */
+  guint n_formatted; /* components formatted for this update */
+  guint n_dropped;   /* components of packages no longer there */
+} GsApkAppstreamStats;
+
+GsApkAppstream *gs_apk_appstream_new (void);
+void gs_apk_appstream_free (GsApkAppstream *appstream);
+void gs_apk_appstream_shed (GsApkAppstream *appstream);
+
+GHashTable *gs_apk_appstream_scan_pkgnames (const gchar *root,
+                                            GCancellable *cancellable);
+GBytes *gs_apk_appstream_update (GsApkAppstream *appstream,
+                                 GsApkIndex *apk_index,
+                                 GHashTable *pkgnames,
+                                 GsApkAppstreamStats *out_stats);
+gboolean gs_apk_appstream_write (GBytes *xml,
+                                 const gchar *path,
+                                 GCancellable *cancellable,
+                                 GError **error);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (GsApkAppstream, gs_apk_appstream_free)
+
+G_END_DECLS
@@ -0,0 +1,547 @@
+/*
+ * Copyright (C) 2024 The gnome-software-plugin-apk contributors
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#include "gs-apk-call-monitor.h"
+#include "gs-apk-trace.h"
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+/*
+ * The monitor watches the messages on the daemon's connection, rather than
+ * wrapping every apk_polkit2_call_*() site, so that no call can be missed.
+ * GDBus runs message filters in its worker thread, hence the mutex.
+ *
+ * The watchdog runs in the main context the monitor was created in, and
+ * only ticks while calls are pending.
+ */
+
+/* Methods that change the system; everything else is a read */
+static const gchar *transaction_methods[] = {
+  "AddPackages", "DeletePackages", "UpgradePackages",
+  "AddRepository", "RemoveRepository", "UpdateRepositories",
+  NULL
+};
+
+struct _GsApkCallMonitor
+{
+  GDBusConnection *connection; /* (owned) */
+  gchar *interface_name;       /* (owned) */
+  guint filter_id;
+
+  GMutex mutex;
+  GHashTable *pending; /* (owned) (element-type guint PendingCall) */
+  FILE *record_file;   /* (owned) (nullable) */
+  gint64 record_start;
+  GsApkMetrics *metrics; /* (owned) (nullable) */
+
+  GMainContext *context;   /* (owned) (nullable) NULL once freed */
+  GSource *watchdog;       /* (owned) (nullable) */
+  gint64 read_budget_usec; /* 0 if disabled */
+  gint64 transaction_budget_usec;
+  GsApkWatchdogSnapshotFunc snapshot_func;
+  gpointer snapshot_data;
+};
+
+typedef struct
+{
+  gchar *method;
+  GVariant *args;
+  gint64 start_usec;
+  gboolean is_transaction;
+  gint64 next_report_usec; /* elapsed time of the next watchdog report */
+} PendingCall;
+
+static void
+pending_call_free (PendingCall *call)
+{
+  g_free (call->method);
+  g_variant_unref (call->args);
+  g_free (call);
+}
+
+static void
+monitor_clear (gpointer data)
+{
+  GsApkCallMonitor *monitor = data;
+
+  g_clear_object (&monitor->connection);
+  g_clear_pointer (&monitor->interface_name, g_free);
+  g_clear_pointer (&monitor->pending, g_hash_table_unref);
+  g_clear_pointer (&monitor->record_file, fclose);
+  g_clear_pointer (&monitor->metrics, gs_apk_metrics_unref);
+  g_clear_pointer (&monitor->context, g_main_context_unref);
+  g_mutex_clear (&monitor->mutex);
+}
+
+static void
+monitor_release (gpointer data)
+{
+  g_atomic_rc_box_release_full (data, monitor_clear);
+}
+
+static GVariant *
+message_get_body (GDBusMessage *message)
+{
+  GVariant *body = g_dbus_message_get_body (message);
+
+  return body != NULL ? g_variant_ref (body) : g_variant_ref_sink (g_variant_new ("()"));
+}
+
+/* Number of packages or paths in a message, i.e. the length of its first
+ * argument if that is an array */
+static guint
+body_count_items (GVariant *body)
+{
+  g_autoptr (GVariant) first = NULL;
+
+  if (g_variant_n_children (body) == 0)
+    return 0;
+  first = g_variant_get_child_value (body, 0);
+  return g_variant_is_container (first) && g_variant_type_is_array (g_variant_get_type (first))
+             ? g_variant_n_children (first)
+             : 0;
+}
+
+/* Called with the mutex held */
+static void
+monitor_write_record (GsApkCallMonitor *monitor,
+                      PendingCall *call,
+                      gint64 end_usec,
+                      GDBusMessage *reply)
+{
+  g_autoptr (GVariant) record = NULL;
+  g_autoptr (GVariant) body = message_get_body (reply);
+  const gchar *error_name = "";
+  GVariant *reply_value;
+  guint32 size;
+
+  if (g_dbus_message_get_message_type (reply) == G_DBUS_MESSAGE_TYPE_ERROR)
+    {
+      const gchar *error_message = "";
+
+      error_name = g_dbus_message_get_error_name (reply);
+      if (g_variant_is_of_type (body, G_VARIANT_TYPE ("(s)")))
+        g_variant_get (body, "(&s)", &error_message);
+      reply_value = g_variant_new_string (error_message);
+    }
+  else
+    {
+      reply_value = body;
+    }
+
+  record = g_variant_ref_sink (g_variant_new ("(stt@vs@v)",
+                                              call->method,
+                                              (guint64) (call->start_usec - monitor->record_start),
+                                              (guint64) (end_usec - call->start_usec),
+                                              g_variant_new_variant (call->args),
+                                              error_name,
+                                              g_variant_new_variant (reply_value)));
+
+  size = GUINT32_TO_LE ((guint32) g_variant_get_size (record));
+  if (fwrite (&size, sizeof (size), 1, monitor->record_file) != 1 ||
+      fwrite (g_variant_get_data (record), g_variant_get_size (record), 1, monitor->record_file) != 1 ||
+      fflush (monitor->record_file) != 0)
+    {
+      g_warning ("Failed to write call recording, stopping: %s", g_strerror (errno));
+      g_clear_pointer (&monitor->record_file, fclose);
+    }
+}
+
+/* Something like "bench-pkg-1, bench-pkg-2, bench-pkg-3, … (52 items), 255" */
+static gchar *
+summarize_args (GVariant *args)
+{
+  GString *summary = g_string_new (NULL);
+
+  for (gsize i = 0; i < g_variant_n_children (args); i++)
+    {
+      g_autoptr (GVariant) arg = g_variant_get_child_value (args, i);
+
+      if (i > 0)
+        g_string_append (summary, ", ");
+
+      if (g_variant_is_of_type (arg, G_VARIANT_TYPE_STRING_ARRAY))
+        {
+          gsize n_items = g_variant_n_children (arg);
+
+          for (gsize j = 0; j < MIN (n_items, 3); j++)
+            {
+              g_autoptr (GVariant) item = g_variant_get_child_value (arg, j);
+              g_string_append_printf (summary, "%s%s", j > 0 ? ", " : "",
+                                      g_variant_get_string (item, NULL));
+            }
+          g_string_append_printf (summary, "%s(%" G_GSIZE_FORMAT " items)",
+                                  n_items > 3 ? ", … " : " ", n_items);
+        }
+      else
+        {
+          g_autofree gchar *printed = g_variant_print (arg, FALSE);
+          g_string_append (summary, printed);
+        }
+    }
+
+  return g_string_free (summary, FALSE);
+}
+
+static gint
+compare_pending_calls (gconstpointer a, gconstpointer b)
+{
+  const PendingCall *call_a = *(const PendingCall **) a;
+  const PendingCall *call_b = *(const PendingCall **) b;
+
+  return (call_a->start_usec > call_b->start_usec) - (call_a->start_usec < call_b->start_usec);
+}
+
+static gboolean
+watchdog_tick_cb (gpointer user_data)
+{
+  GsApkCallMonitor *monitor = user_data;
+  g_autoptr (GPtrArray) calls = g_ptr_array_new ();
+  g_autoptr (GPtrArray) reports = g_ptr_array_new_with_free_func (g_free);
+  g_autoptr (GPtrArray) snapshot = g_ptr_array_new_with_free_func (g_free);
+  gint64 now = g_get_monotonic_time ();
+  GHashTableIter iter;
+  gpointer value;
+
+  g_mutex_lock (&monitor->mutex);
+  if (g_hash_table_size (monitor->pending) == 0)
+    {
+      g_clear_pointer (&monitor->watchdog, g_source_unref);
+      g_mutex_unlock (&monitor->mutex);
+      return G_SOURCE_REMOVE;
+    }
+
+  g_hash_table_iter_init (&iter, monitor->pending);
+  while (g_hash_table_iter_next (&iter, NULL, &value))
+    g_ptr_array_add (calls, value);
+  g_ptr_array_sort (calls, compare_pending_calls);
+
+  for (guint i = 0; i < calls->len; i++)
+    {
+      PendingCall *call = g_ptr_array_index (calls, i);
+      gint64 budget = call->is_transaction ? monitor->transaction_budget_usec
+                                           : monitor->read_budget_usec;
+      gint64 elapsed = now - call->start_usec;
+      g_autofree gchar *summary = NULL;
+
+      if (budget == 0 || elapsed < MAX (call->next_report_usec, budget))
+        continue;
+
+      /* Report again whenever the elapsed time doubles */
+      call->next_report_usec = elapsed * 2;
+      summary = summarize_args (call->args);
+      g_ptr_array_add (reports,
+                       g_strdup_printf ("%s %s (%s) pending for %.1f s, over its %.1f s budget; "
+                                        "%u of %u calls in flight",
+                                        call->is_transaction ? "Transaction" : "Read",
+                                        call->method, summary,
+                                        elapsed / (gdouble) G_USEC_PER_SEC,
+                                        budget / (gdouble) G_USEC_PER_SEC,
+                                        i + 1, calls->len));
+    }
+
+  if (reports->len > 0 && monitor->snapshot_func != NULL)
+    {
+      for (guint i = 0; i < calls->len; i++)
+        {
+          PendingCall *call = g_ptr_array_index (calls, i);
+          g_autofree gchar *summary = summarize_args (call->args);
+
+          g_ptr_array_add (snapshot,
+                           g_strdup_printf ("  #%u %s (%s) for %.1f s", i + 1,
+                                            call->method, summary,
+                                            (now - call->start_usec) / (gdouble) G_USEC_PER_SEC));
+        }
+    }
+  g_mutex_unlock (&monitor->mutex);
+
+  for (guint i = 0; i < reports->len; i++)
+    g_warning ("%s", (const gchar *) g_ptr_array_index (reports, i));
+  if (snapshot->len > 0)
+    {
+      g_message ("Pending daemon calls:");
+      for (guint i = 0; i < snapshot->len; i++)
+        g_message ("%s", (const gchar *) g_ptr_array_index (snapshot, i));
+      monitor->snapshot_func (monitor->snapshot_data);
+    }
+
+  return G_SOURCE_CONTINUE;
+}
+
+/* Called with the mutex held */
+static void
+monitor_ensure_watchdog (GsApkCallMonitor *monitor)
+{
+  if (monitor->watchdog != NULL || monitor->context == NULL ||
+      (monitor->read_budget_usec == 0 && monitor->transaction_budget_usec == 0))
+    return;
+
+  monitor->watchdog = g_timeout_source_new_seconds (1);
+  g_source_set_name (monitor->watchdog, "[gs-plugin-apk] watchdog");
+  g_source_set_callback (monitor->watchdog, watchdog_tick_cb,
+                         g_atomic_rc_box_acquire (monitor), monitor_release);
+  g_source_attach (monitor->watchdog, monitor->context);
+}
+
+static GDBusMessage *
+monitor_filter_cb (GDBusConnection *connection,
+                   GDBusMessage *message,
+                   gboolean incoming,
+                   gpointer user_data)
+{
+  GsApkCallMonitor *monitor = user_data;
+  GDBusMessageType type = g_dbus_message_get_message_type (message);
+
+  if (!incoming)
+    {
+      PendingCall *call;
+
+      if (type != G_DBUS_MESSAGE_TYPE_METHOD_CALL ||
+          g_strcmp0 (g_dbus_message_get_interface (message), monitor->interface_name) != 0)
+        return message;
+
+      call = g_new0 (PendingCall, 1);
+      call->method = g_strdup (g_dbus_message_get_member (message));
+      call->args = message_get_body (message);
+      call->start_usec = g_get_monotonic_time ();
+      call->is_transaction = g_strv_contains (transaction_methods, call->method);
+
+      g_mutex_lock (&monitor->mutex);
+      g_hash_table_replace (monitor->pending,
+                            GUINT_TO_POINTER (g_dbus_message_get_serial (message)),
+                            call);
+      if (monitor->metrics != NULL)
+        gs_apk_metrics_call_started (monitor->metrics, call->method,
+                                     body_count_items (call->args),
+                                     g_variant_get_size (call->args));
+      monitor_ensure_watchdog (monitor);
+      g_mutex_unlock (&monitor->mutex);
+    }
+  else if (type == G_DBUS_MESSAGE_TYPE_METHOD_RETURN || type == G_DBUS_MESSAGE_TYPE_ERROR)
+    {
+      guint32 serial = g_dbus_message_get_reply_serial (message);
+      gint64 end_usec = g_get_monotonic_time ();
+      PendingCall *call = NULL;
+
+      g_mutex_lock (&monitor->mutex);
+      if (g_hash_table_steal_extended (monitor->pending, GUINT_TO_POINTER (serial),
+                                       NULL, (gpointer *) &call))
+        {
+          g_autoptr (GVariant) body = message_get_body (message);
+          guint n_items = body_count_items (body);
+
+          GS_APK_TRACE_CALL (call->method, call->start_usec * 1000,
+                             (end_usec - call->start_usec) * 1000, n_items);
+          if (monitor->metrics != NULL)
+            gs_apk_metrics_call_finished (monitor->metrics, call->method,
+                                          end_usec - call->start_usec,
+                                          n_items,
+                                          g_variant_get_size (body),
+                                          type == G_DBUS_MESSAGE_TYPE_ERROR);
+          if (monitor->record_file != NULL)
+            monitor_write_record (monitor, call, end_usec, message);
+        }
+      g_mutex_unlock (&monitor->mutex);
+
+      g_clear_pointer (&call, pending_call_free);
+    }
+
+  return message;
+}
+
+/**
+ * gs_apk_call_monitor_new:
+ * @connection: The connection the daemon is reached on
+ * @interface_name: The daemon's D-Bus interface
+ *
+ * Starts tracking every call to @interface_name made on @connection, from
+ * the moment the message is sent until its reply arrives.
+ *
+ * Returns: (transfer full): a new monitor
+ **/
+GsApkCallMonitor *
+gs_apk_call_monitor_new (GDBusConnection *connection,
+                         const gchar *interface_name)
+{
+  GsApkCallMonitor *monitor = g_atomic_rc_box_new0 (GsApkCallMonitor);
+
+  monitor->connection = g_object_ref (connection);
+  monitor->interface_name = g_strdup (interface_name);
+  g_mutex_init (&monitor->mutex);
+  monitor->pending = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL,
+                                            (GDestroyNotify) pending_call_free);
+  monitor->context = g_main_context_ref_thread_default ();
+
+  /* The filter holds its own reference, as it may still be running in the
+   * worker thread after gs_apk_call_monitor_free() removed it */
+  monitor->filter_id = g_dbus_connection_add_filter (connection,
+                                                     monitor_filter_cb,
+                                                     g_atomic_rc_box_acquire (monitor),
+                                                     monitor_release);
+
+  return monitor;
+}
+
+void
+gs_apk_call_monitor_free (GsApkCallMonitor *monitor)
+{
+  g_dbus_connection_remove_filter (monitor->connection, monitor->filter_id);
+
+  /* Stop a filter still running in the worker thread from starting the
+   * watchdog again */
+  g_mutex_lock (&monitor->mutex);
+  g_clear_pointer (&monitor->context, g_main_context_unref);
+  if (monitor->watchdog != NULL)
+    g_source_destroy (monitor->watchdog);
+  g_clear_pointer (&monitor->watchdog, g_source_unref);
+  g_mutex_unlock (&monitor->mutex);
+
+  monitor_release (monitor);
+}
+
+/**
+ * gs_apk_call_monitor_set_metrics:
+ * @monitor: The monitor
+ * @metrics: (nullable): Metrics to count every call in
+ **/
+void
+gs_apk_call_monitor_set_metrics (GsApkCallMonitor *monitor,
+                                 GsApkMetrics *metrics)
+{
+  g_mutex_lock (&monitor->mutex);
+  g_clear_pointer (&monitor->metrics, gs_apk_metrics_unref);
+  if (metrics != NULL)
+    monitor->metrics = gs_apk_metrics_ref (metrics);
+  g_mutex_unlock (&monitor->mutex);
+}
+
+/**
+ * gs_apk_call_monitor_set_watchdog:
+ * @monitor: The monitor
+ * @read_budget_ms: Time a read may take before it is reported, or 0
+ * @transaction_budget_ms: Time a transaction (adding, removing or upgrading
+ *   packages, changing or refreshing repositories) may take, or 0
+ * @snapshot_func: (nullable): Called after the reports, for the caller to
+ *   log its own state
+ * @user_data: Data for @snapshot_func
+ *
+ * Warns about calls that take longer than their budget, and again each
+ * time their pending time doubles. If @snapshot_func is set, all pending
+ * calls are logged along with the reports.
+ **/
+void
+gs_apk_call_monitor_set_watchdog (GsApkCallMonitor *monitor,
+                                  guint read_budget_ms,
+                                  guint transaction_budget_ms,
+                                  GsApkWatchdogSnapshotFunc snapshot_func,
+                                  gpointer user_data)
+{
+  g_mutex_lock (&monitor->mutex);
+  monitor->read_budget_usec = (gint64) read_budget_ms * 1000;
+  monitor->transaction_budget_usec = (gint64) transaction_budget_ms * 1000;
+  monitor->snapshot_func = snapshot_func;
+  monitor->snapshot_data = user_data;
+  if (g_hash_table_size (monitor->pending) > 0)
+    monitor_ensure_watchdog (monitor);
+  g_mutex_unlock (&monitor->mutex);
+}
+
+/**
+ * gs_apk_call_monitor_start_recording:
+ * @monitor: The monitor
+ * @path: File to write the recording to
+ * @error: Return location for a #GError
+ *
+ * Writes every call completed from now on to @path, in the format described
+ * in gs-apk-call-monitor.h. File descriptors passed along with a reply are
+ * not recorded, only their index in the message.
+ *
+ * Returns: %TRUE if recording started
+ **/
+gboolean
+gs_apk_call_monitor_start_recording (GsApkCallMonitor *monitor,
+                                     const gchar *path,
+                                     GError **error)
+{
+  FILE *file = fopen (path, "we");
+
+  if (file == NULL ||
+      fwrite (GS_APK_RECORDING_MAGIC, strlen (GS_APK_RECORDING_MAGIC), 1, file) != 1)
+    {
+      gint saved_errno = errno;
+
+      g_set_error (error, G_IO_ERROR, g_io_error_from_errno (saved_errno),
+                   "Failed to open %s for recording: %s", path, g_strerror (saved_errno));
+      g_clear_pointer (&file, fclose);
+      return FALSE;
+    }
+
+  g_mutex_lock (&monitor->mutex);
+  g_clear_pointer (&monitor->record_file, fclose);
+  monitor->record_file = file;
+  monitor->record_start = g_get_monotonic_time ();
+  g_mutex_unlock (&monitor->mutex);
+
+  return TRUE;
+}
+
+/**
+ * gs_apk_recording_load:
+ * @path: A file written by gs_apk_call_monitor_start_recording()
+ * @error: Return location for a #GError
+ *
+ * Loads a recording. A truncated last frame, as left behind when the
+ * recording process was killed, is ignored.
+ *
+ * Returns: (transfer full) (element-type GVariant): the records in the
+ *   order the calls completed, or %NULL on error
+ **/
+GPtrArray *
+gs_apk_recording_load (const gchar *path, GError **error)
+{
+  g_autoptr (GMappedFile) file = NULL;
+  g_autoptr (GBytes) bytes = NULL;
+  g_autoptr (GPtrArray) records = NULL;
+  const guint8 *data;
+  gsize len;
+  gsize offset;
+
+  file = g_mapped_file_new (path, FALSE, error);
+  if (file == NULL)
+    return NULL;
+  bytes = g_mapped_file_get_bytes (file);
+  data = g_bytes_get_data (bytes, &len);
+
+  offset = strlen (GS_APK_RECORDING_MAGIC);
+  if (len < offset || memcmp (data, GS_APK_RECORDING_MAGIC, offset) != 0)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                   "%s is not a call recording", path);
+      return NULL;
+    }
+
+  records = g_ptr_array_new_with_free_func ((GDestroyNotify) g_variant_unref);
+  while (len - offset >= sizeof (guint32))
+    {
+      g_autoptr (GBytes) frame = NULL;
+      g_autoptr (GVariant) record = NULL;
+      guint32 size;
+
+      memcpy (&size, data + offset, sizeof (size));
+      size = GUINT32_FROM_LE (size);
+      offset += sizeof (size);
+      if (size > len - offset)
+        break;
+
+      frame = g_bytes_new_from_bytes (bytes, offset, size);
+      record = g_variant_new_from_bytes (GS_APK_RECORD_TYPE, frame, FALSE);
+      g_ptr_array_add (records, g_variant_get_normal_form (record));
+      offset += size;
+    }
+
+  return g_steal_pointer (&records);
+}
@@ -0,0 +1,52 @@
+/*
+ * Copyright (C) 2024 The gnome-software-plugin-apk contributors
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#pragma once
+
+#include "gs-apk-metrics.h"
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+/*
+ * A recording starts with GS_APK_RECORDING_MAGIC, followed by one frame per
+ * completed call: a little-endian guint32 size and a serialized
+ * GS_APK_RECORD_TYPE variant of that size, holding
+ *
+ *   s  method name
+ *   t  start of the call, in µs since the recording started
+ *   t  duration of the call, in µs
+ *   v  call arguments
+ *   s  D-Bus error name, or "" if the call succeeded
+ *   v  reply body, or the error message as a string
+ */
+
+#define GS_APK_RECORDING_MAGIC "APKREC01"
+#define GS_APK_RECORD_TYPE ((const GVariantType *) "(sttvsv)")
+
+typedef struct _GsApkCallMonitor GsApkCallMonitor;
+typedef void (*GsApkWatchdogSnapshotFunc) (gpointer user_data);
+
+GsApkCallMonitor *gs_apk_call_monitor_new (GDBusConnection *connection,
+                                           const gchar *interface_name);
+void gs_apk_call_monitor_free (GsApkCallMonitor *monitor);
+void gs_apk_call_monitor_set_metrics (GsApkCallMonitor *monitor,
+                                      GsApkMetrics *metrics);
+void gs_apk_call_monitor_set_watchdog (GsApkCallMonitor *monitor,
+                                       guint read_budget_ms,
+                                       guint transaction_budget_ms,
+                                       GsApkWatchdogSnapshotFunc snapshot_func,
+                                       gpointer user_data);
+gboolean gs_apk_call_monitor_start_recording (GsApkCallMonitor *monitor,
+                                              const gchar *path,
+                                              GError **error);
+
+GPtrArray *gs_apk_recording_load (const gchar *path,
+                                  GError **error);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (GsApkCallMonitor, gs_apk_call_monitor_free)
+
+G_END_DECLS
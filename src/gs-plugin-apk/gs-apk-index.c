@@ -0,0 +1,1414 @@
+/*
+ * Copyright (C) 2024 The gnome-software-plugin-apk contributors
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#include "gs-apk-index.h"
+#include <gio/gio.h>
+#include <string.h>
+
+#define TAR_BLOCK_SIZE 512
+
+struct _GsApkIndex
+{
+  gatomicrefcount ref_count;
+  GStringChunk *strings; /* (owned) backs every string of the index */
+  GHashTable *packages;  /* (owned) (element-type utf8 GsApkIndexPackage) */
+  GHashTable *provides;  /* (owned) (element-type utf8 GPtrArray<GsApkIndexPackage>) */
+  GPtrArray *by_name;    /* (owned) (element-type GsApkIndexPackage) for scans */
+  GPtrArray *installed;  /* (owned) (element-type GsApkIndexPackage) the installed subset */
+  GHashTable *subpackages; /* (owned) (element-type utf8 GPtrArray<GsApkIndexPackage>) */
+  GHashTable *rdepends;    /* (owned) (nullable) (element-type GsApkIndexPackage GPtrArray<GsApkIndexPackage>)
+                            * installed dependents of installed packages, built on demand */
+  const gchar **world;     /* (owned) (nullable) the packages the user asked for */
+  GHashTable *reachable;   /* (owned) (nullable) (element-type GsApkIndexPackage)
+                            * installed packages the world needs, built on demand */
+  GHashTable *exclusive_sizes; /* (owned) (nullable) (element-type GsApkIndexPackage guint64)
+                                * of the packages the world reaches, built on demand */
+};
+
+/* Subpackages abuild splits off, which are shown as addons of their main
+ * package */
+static const gchar *addon_suffixes[] = {
+  "-doc",
+  "-lang",
+  "-openrc",
+  "-bash-completion",
+  "-zsh-completion",
+  "-fish-completion",
+  NULL
+};
+
+static void compute_exclusive_sizes (GsApkIndex *apk_index);
+
+static void
+index_package_free (GsApkIndexPackage *package)
+{
+  g_free (package->install_if);
+  g_free (package->depends);
+  g_free (package);
+}
+
+GsApkIndex *
+gs_apk_index_new (void)
+{
+  GsApkIndex *apk_index = g_new0 (GsApkIndex, 1);
+
+  g_atomic_ref_count_init (&apk_index->ref_count);
+  apk_index->strings = g_string_chunk_new (64 * 1024);
+  apk_index->packages = g_hash_table_new_full (g_str_hash, g_str_equal, NULL,
+                                               (GDestroyNotify) index_package_free);
+  apk_index->provides = g_hash_table_new_full (g_str_hash, g_str_equal, NULL,
+                                               (GDestroyNotify) g_ptr_array_unref);
+  apk_index->by_name = g_ptr_array_new ();
+  apk_index->installed = g_ptr_array_new ();
+  apk_index->subpackages = g_hash_table_new_full (g_str_hash, g_str_equal, NULL,
+                                                  (GDestroyNotify) g_ptr_array_unref);
+  return apk_index;
+}
+
+/**
+ * gs_apk_index_ref:
+ * @apk_index: The index
+ *
+ * Keeps @apk_index alive, e.g. for a thread reading its packages. The
+ * lookups built on demand, such as the reverse dependencies, must only be
+ * used from one thread.
+ *
+ * Returns: @apk_index
+ **/
+GsApkIndex *
+gs_apk_index_ref (GsApkIndex *apk_index)
+{
+  g_atomic_ref_count_inc (&apk_index->ref_count);
+  return apk_index;
+}
+
+void
+gs_apk_index_unref (GsApkIndex *apk_index)
+{
+  if (!g_atomic_ref_count_dec (&apk_index->ref_count))
+    return;
+
+  g_clear_pointer (&apk_index->exclusive_sizes, g_hash_table_unref);
+  g_clear_pointer (&apk_index->reachable, g_hash_table_unref);
+  g_free (apk_index->world);
+  g_clear_pointer (&apk_index->rdepends, g_hash_table_unref);
+  g_hash_table_unref (apk_index->subpackages);
+  g_ptr_array_unref (apk_index->installed);
+  g_ptr_array_unref (apk_index->by_name);
+  g_hash_table_unref (apk_index->provides);
+  g_hash_table_unref (apk_index->packages);
+  g_string_chunk_free (apk_index->strings);
+  g_free (apk_index);
+}
+
+static const gchar *
+intern (GsApkIndex *apk_index, const gchar *str, gsize len)
+{
+  return g_string_chunk_insert_len (apk_index->strings, str, len);
+}
+
+static void
+add_provider (GsApkIndex *apk_index,
+              const gchar *provides,
+              gsize len,
+              GsApkIndexPackage *package)
+{
+  g_autofree gchar *key_tmp = g_strndup (provides, len);
+  GPtrArray *providers = g_hash_table_lookup (apk_index->provides, key_tmp);
+
+  if (providers == NULL)
+    {
+      providers = g_ptr_array_sized_new (1);
+      g_hash_table_insert (apk_index->provides,
+                           (gpointer) g_string_chunk_insert_const (apk_index->strings, key_tmp),
+                           providers);
+    }
+  else if (g_ptr_array_find (providers, package, NULL))
+    {
+      return;
+    }
+  g_ptr_array_add (providers, package);
+}
+
+static guint64
+parse_uint (const gchar *str, gsize len)
+{
+  guint64 value = 0;
+
+  for (gsize i = 0; i < len && g_ascii_isdigit (str[i]); i++)
+    value = value * 10 + (str[i] - '0');
+  return value;
+}
+
+typedef struct
+{
+  const gchar *name;
+  gsize name_len;
+  const gchar *version;
+  gsize version_len;
+  const gchar *description;
+  gsize description_len;
+  const gchar *license;
+  gsize license_len;
+  const gchar *url;
+  gsize url_len;
+  const gchar *origin;
+  gsize origin_len;
+  const gchar *provides;
+  gsize provides_len;
+  const gchar *depends;
+  gsize depends_len;
+  const gchar *install_if;
+  gsize install_if_len;
+  guint64 size;
+  guint64 installed_size;
+} IndexRecord;
+
+/**
+ * parse_depends:
+ * @apk_index: The index
+ * @depends: A `D:` field, e.g. "so:libc.musl-x86_64.so.1 foo>=1.2 !bar",
+ *   an `i:` field or the world file
+ * @len: The length of @depends
+ *
+ * Returns: (transfer full): the %NULL-terminated names @depends requires,
+ * without versions or repository tags. Conflicts are left out.
+ **/
+static const gchar **
+parse_depends (GsApkIndex *apk_index, const gchar *depends, gsize len)
+{
+  g_autoptr (GPtrArray) names = g_ptr_array_new ();
+  const gchar *p = depends;
+  const gchar *end = depends + len;
+
+  while (p < end)
+    {
+      const gchar *token_end;
+      const gchar *name_end;
+      g_autofree gchar *name_tmp = NULL;
+
+      for (token_end = p; token_end < end && !g_ascii_isspace (*token_end); token_end++)
+        ;
+      for (name_end = p; name_end < token_end && strchr ("<>=~@", *name_end) == NULL; name_end++)
+        ;
+      if (name_end > p && *p != '!')
+        {
+          name_tmp = g_strndup (p, name_end - p);
+          g_ptr_array_add (names, (gpointer) g_string_chunk_insert_const (apk_index->strings, name_tmp));
+        }
+      p = token_end + 1;
+    }
+  g_ptr_array_add (names, NULL);
+
+  return (const gchar **) g_ptr_array_free (g_steal_pointer (&names), FALSE);
+}
+
+static void
+index_record_commit (GsApkIndex *apk_index, IndexRecord *record, gboolean installed)
+{
+  g_autofree gchar *name_tmp = NULL;
+  GsApkIndexPackage *package;
+  const gchar *p;
+  const gchar *end;
+
+  if (record->name == NULL || record->version == NULL)
+    return;
+
+  /* The first repository listing a package wins, in the order of
+   * etc/apk/repositories, unless the package is installed. apk itself
+   * prefers the newest version, which the repositories of a release
+   * normally agree on */
+  name_tmp = g_strndup (record->name, record->name_len);
+  package = g_hash_table_lookup (apk_index->packages, name_tmp);
+  if (package == NULL || (installed && !package->installed))
+    {
+      if (package == NULL)
+        {
+          package = g_new0 (GsApkIndexPackage, 1);
+          package->name = g_string_chunk_insert_const (apk_index->strings, name_tmp);
+          g_hash_table_insert (apk_index->packages, (gpointer) package->name, package);
+          g_ptr_array_add (apk_index->by_name, package);
+        }
+      if (installed)
+        g_ptr_array_add (apk_index->installed, package);
+      package->version = intern (apk_index, record->version, record->version_len);
+      package->description = record->description != NULL ? intern (apk_index, record->description, record->description_len) : NULL;
+      package->license = record->license != NULL ? intern (apk_index, record->license, record->license_len) : NULL;
+      package->url = record->url != NULL ? intern (apk_index, record->url, record->url_len) : NULL;
+      package->origin = record->origin != NULL ? intern (apk_index, record->origin, record->origin_len) : NULL;
+      package->size = record->size;
+      package->installed_size = record->installed_size;
+      package->installed = installed;
+      g_free (package->depends);
+      package->depends = record->depends != NULL ? parse_depends (apk_index, record->depends, record->depends_len) : NULL;
+      g_free (package->install_if);
+      package->install_if = record->install_if != NULL ? parse_depends (apk_index, record->install_if, record->install_if_len) : NULL;
+      package->has_commands = record->provides != NULL &&
+                              g_strstr_len (record->provides, record->provides_len, "cmd:") != NULL;
+    }
+
+  add_provider (apk_index, package->name, strlen (package->name), package);
+  if (record->provides == NULL)
+    return;
+
+  /* "p:cmd:foo=1.0-r0 so:libfoo.so.1=1.2.3 pc:foo" */
+  p = record->provides;
+  end = p + record->provides_len;
+  while (p < end)
+    {
+      const gchar *token_end = memchr (p, ' ', end - p);
+      const gchar *version;
+
+      if (token_end == NULL)
+        token_end = end;
+      version = memchr (p, '=', token_end - p);
+      if (version == NULL)
+        version = token_end;
+      if (version > p)
+        add_provider (apk_index, p, version - p, package);
+      p = token_end + 1;
+    }
+}
+
+/**
+ * gs_apk_index_add_text:
+ * @apk_index: The index
+ * @text: The contents of an APKINDEX or of the installed database
+ * @len: The length of @text
+ * @installed: Whether @text describes installed packages
+ *
+ * Adds the packages of @text to the index. Both formats are a list of
+ * records separated by empty lines, with one `X:value` field per line.
+ **/
+void
+gs_apk_index_add_text (GsApkIndex *apk_index,
+                       const gchar *text,
+                       gsize len,
+                       gboolean installed)
+{
+  const gchar *end = text + len;
+  const gchar *line = text;
+  IndexRecord record = { NULL };
+
+  while (line < end)
+    {
+      const gchar *line_end = memchr (line, '\n', end - line);
+      const gchar *value = line + 2;
+      gsize value_len;
+
+      if (line_end == NULL)
+        line_end = end;
+
+      if (line_end == line)
+        {
+          index_record_commit (apk_index, &record, installed);
+          memset (&record, 0, sizeof (record));
+          line = line_end + 1;
+          continue;
+        }
+
+      if (line_end - line < 2 || line[1] != ':')
+        {
+          line = line_end + 1;
+          continue;
+        }
+
+      value_len = line_end - value;
+      switch (line[0])
+        {
+        case 'P':
+          record.name = value;
+          record.name_len = value_len;
+          break;
+        case 'V':
+          record.version = value;
+          record.version_len = value_len;
+          break;
+        case 'T':
+          record.description = value;
+          record.description_len = value_len;
+          break;
+        case 'L':
+          record.license = value;
+          record.license_len = value_len;
+          break;
+        case 'U':
+          record.url = value;
+          record.url_len = value_len;
+          break;
+        case 'o':
+          record.origin = value;
+          record.origin_len = value_len;
+          break;
+        case 'p':
+          record.provides = value;
+          record.provides_len = value_len;
+          break;
+        case 'D':
+          record.depends = value;
+          record.depends_len = value_len;
+          break;
+        case 'i':
+          record.install_if = value;
+          record.install_if_len = value_len;
+          break;
+        case 'S':
+          record.size = parse_uint (value, value_len);
+          break;
+        case 'I':
+          record.installed_size = parse_uint (value, value_len);
+          break;
+        default:
+          break;
+        }
+      line = line_end + 1;
+    }
+  index_record_commit (apk_index, &record, installed);
+}
+
+/**
+ * gunzip_members:
+ * @data: gzip data
+ * @len: The length of @data
+ * @error: Return location for a #GError
+ *
+ * Decompresses all gzip members of @data. Signed apk indexes are made of
+ * one member for the signature and one for the index itself.
+ *
+ * Returns: (transfer full): the decompressed data, or %NULL on error.
+ **/
+static GByteArray *
+gunzip_members (const guint8 *data, gsize len, GError **error)
+{
+  g_autoptr (GZlibDecompressor) decompressor = g_zlib_decompressor_new (G_ZLIB_COMPRESSOR_FORMAT_GZIP);
+  g_autoptr (GByteArray) out = g_byte_array_new ();
+  guint8 buf[64 * 1024];
+
+  while (len > 0)
+    {
+      GConverterResult result;
+      gsize bytes_read;
+      gsize bytes_written;
+
+      result = g_converter_convert (G_CONVERTER (decompressor), data, len,
+                                    buf, sizeof (buf), G_CONVERTER_INPUT_AT_END,
+                                    &bytes_read, &bytes_written, error);
+      if (result == G_CONVERTER_ERROR)
+        return NULL;
+
+      g_byte_array_append (out, buf, bytes_written);
+      data += bytes_read;
+      len -= bytes_read;
+      if (result == G_CONVERTER_FINISHED)
+        g_converter_reset (G_CONVERTER (decompressor));
+    }
+
+  return g_steal_pointer (&out);
+}
+
+/**
+ * tar_find_member:
+ * @tar: A tar archive, or several concatenated ones
+ * @len: The length of @tar
+ * @name: The member to look for
+ * @out_len: (out): The length of the member
+ *
+ * Returns: (transfer none) (nullable): the contents of @name in @tar
+ **/
+static const guint8 *
+tar_find_member (const guint8 *tar, gsize len, const gchar *name, gsize *out_len)
+{
+  gsize offset = 0;
+
+  while (len - offset >= TAR_BLOCK_SIZE)
+    {
+      const gchar *header = (const gchar *) tar + offset;
+      gchar size_field[13];
+      guint64 size;
+
+      offset += TAR_BLOCK_SIZE;
+      /* End of archive marker, another archive may follow */
+      if (header[0] == '\0')
+        continue;
+
+      memcpy (size_field, header + 124, 12);
+      size_field[12] = '\0';
+      size = g_ascii_strtoull (size_field, NULL, 8);
+      if (size > len - offset)
+        return NULL;
+
+      if (strncmp (header, name, 100) == 0)
+        {
+          *out_len = size;
+          return tar + offset;
+        }
+      offset += MIN ((size + TAR_BLOCK_SIZE - 1) & ~(guint64) (TAR_BLOCK_SIZE - 1), len - offset);
+    }
+
+  return NULL;
+}
+
+/**
+ * gs_apk_index_add_file:
+ * @apk_index: The index
+ * @path: An APKINDEX.tar.gz, or a plain text database
+ * @installed: Whether @path describes installed packages
+ * @error: Return location for a #GError
+ *
+ * Returns: %TRUE if the packages of @path were added
+ **/
+gboolean
+gs_apk_index_add_file (GsApkIndex *apk_index,
+                       const gchar *path,
+                       gboolean installed,
+                       GError **error)
+{
+  g_autoptr (GMappedFile) file = NULL;
+  g_autoptr (GByteArray) tar = NULL;
+  const guint8 *data;
+  const guint8 *member;
+  gsize len;
+  gsize member_len;
+
+  file = g_mapped_file_new (path, FALSE, error);
+  if (file == NULL)
+    return FALSE;
+  data = (const guint8 *) g_mapped_file_get_contents (file);
+  len = g_mapped_file_get_length (file);
+
+  /* Not gzip, so the plain text installed database */
+  if (len < 2 || data[0] != 0x1f || data[1] != 0x8b)
+    {
+      gs_apk_index_add_text (apk_index, (const gchar *) data, len, installed);
+      return TRUE;
+    }
+
+  tar = gunzip_members (data, len, error);
+  if (tar == NULL)
+    {
+      g_prefix_error (error, "Failed to decompress %s: ", path);
+      return FALSE;
+    }
+
+  member = tar_find_member (tar->data, tar->len, "APKINDEX", &member_len);
+  if (member == NULL)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                   "No APKINDEX in %s", path);
+      return FALSE;
+    }
+
+  gs_apk_index_add_text (apk_index, (const gchar *) member, member_len, installed);
+  return TRUE;
+}
+
+static gint
+compare_paths (gconstpointer a, gconstpointer b)
+{
+  return strcmp (*(const gchar **) a, *(const gchar **) b);
+}
+
+/**
+ * read_repositories:
+ * @root: The root of the apk database
+ * @repositories: The array to add the repository URLs to
+ *
+ * Reads the configured repositories in the order apk uses them:
+ * etc/apk/repositories first, then etc/apk/repositories.d/\*.list in
+ * alphabetical order. Tags such as `@edge` are stripped.
+ **/
+static void
+read_repositories (const gchar *root, GPtrArray *repositories)
+{
+  g_autoptr (GPtrArray) files = g_ptr_array_new_with_free_func (g_free);
+  g_autofree gchar *list_dir_path = g_build_filename (root, "etc/apk/repositories.d", NULL);
+  g_autoptr (GDir) list_dir = g_dir_open (list_dir_path, 0, NULL);
+  g_autoptr (GPtrArray) list_files = g_ptr_array_new_with_free_func (g_free);
+  const gchar *name;
+
+  g_ptr_array_add (files, g_build_filename (root, "etc/apk/repositories", NULL));
+  while (list_dir != NULL && (name = g_dir_read_name (list_dir)) != NULL)
+    {
+      if (g_str_has_suffix (name, ".list"))
+        g_ptr_array_add (list_files, g_build_filename (list_dir_path, name, NULL));
+    }
+  g_ptr_array_sort (list_files, compare_paths);
+  g_ptr_array_extend_and_steal (files, g_steal_pointer (&list_files));
+
+  for (guint i = 0; i < files->len; i++)
+    {
+      g_autofree gchar *contents = NULL;
+      g_auto (GStrv) lines = NULL;
+
+      if (!g_file_get_contents (g_ptr_array_index (files, i), &contents, NULL, NULL))
+        continue;
+      lines = g_strsplit (contents, "\n", -1);
+      for (guint j = 0; lines[j] != NULL; j++)
+        {
+          gchar *url = g_strstrip (lines[j]);
+
+          if (url[0] == '#' || url[0] == '\0')
+            continue;
+          if (url[0] == '@')
+            {
+              url = strpbrk (url, " \t");
+              if (url == NULL)
+                continue;
+              url = g_strchug (url);
+            }
+          g_ptr_array_add (repositories, g_strdup (url));
+        }
+    }
+}
+
+/**
+ * repository_index_path:
+ * @root: The root of the apk database
+ * @url: A repository as configured
+ * @arch: (nullable): The architecture of the system
+ *
+ * Local repositories are read in place. apk caches the index of a remote
+ * one as `APKINDEX.<hash>.tar.gz`, with the first four bytes of the SHA-1
+ * of the repository URL as the hash.
+ *
+ * Returns: (transfer full) (nullable): the path of the index of @url
+ **/
+static gchar *
+repository_index_path (const gchar *root, const gchar *url, const gchar *arch)
+{
+  const gchar *cache_dirs[] = { "etc/apk/cache", "var/cache/apk", NULL };
+  g_autofree gchar *checksum = NULL;
+  g_autofree gchar *file_name = NULL;
+
+  if (g_str_has_prefix (url, "file://"))
+    url += strlen ("file://");
+  if (url[0] == '/')
+    return arch != NULL ? g_build_filename (root, url, arch, "APKINDEX.tar.gz", NULL) : NULL;
+
+  checksum = g_compute_checksum_for_string (G_CHECKSUM_SHA1, url, -1);
+  file_name = g_strdup_printf ("APKINDEX.%.8s.tar.gz", checksum);
+  for (guint i = 0; cache_dirs[i] != NULL; i++)
+    {
+      g_autofree gchar *path = g_build_filename (root, cache_dirs[i], file_name, NULL);
+
+      if (g_file_test (path, G_FILE_TEST_EXISTS))
+        return g_steal_pointer (&path);
+    }
+
+  return NULL;
+}
+
+/**
+ * gs_apk_index_load:
+ * @root: The root of the apk database
+ * @error: Return location for a #GError
+ *
+ * Builds the index from the installed database and the indexes of the
+ * repositories configured under @root, in their configured order. Indexes
+ * of repositories which were removed are ignored, even if they are still
+ * cached. Repository indexes that can't be read are skipped.
+ *
+ * Returns: (transfer full): the index, or %NULL if there is no installed
+ * database.
+ **/
+GsApkIndex *
+gs_apk_index_load (const gchar *root, GError **error)
+{
+  g_autoptr (GsApkIndex) apk_index = gs_apk_index_new ();
+  g_autoptr (GPtrArray) repositories = g_ptr_array_new_with_free_func (g_free);
+  g_autofree gchar *installed_path = g_build_filename (root, "lib/apk/db/installed", NULL);
+  g_autofree gchar *world_path = g_build_filename (root, "etc/apk/world", NULL);
+  g_autofree gchar *arch_path = g_build_filename (root, "etc/apk/arch", NULL);
+  g_autofree gchar *world = NULL;
+  g_autofree gchar *arch = NULL;
+  gsize world_len;
+
+  if (!gs_apk_index_add_file (apk_index, installed_path, TRUE, error))
+    return NULL;
+  if (g_file_get_contents (world_path, &world, &world_len, NULL))
+    gs_apk_index_set_world (apk_index, world, world_len);
+
+  if (g_file_get_contents (arch_path, &arch, NULL, NULL))
+    g_strstrip (arch);
+  read_repositories (root, repositories);
+  for (guint i = 0; i < repositories->len; i++)
+    {
+      const gchar *url = g_ptr_array_index (repositories, i);
+      g_autofree gchar *path = repository_index_path (root, url, arch);
+      g_autoptr (GError) local_error = NULL;
+
+      if (path == NULL)
+        {
+          g_debug ("No index of repository %s, it was not refreshed yet", url);
+          continue;
+        }
+      if (!gs_apk_index_add_file (apk_index, path, FALSE, &local_error))
+        g_debug ("Skipping repository index: %s", local_error->message);
+    }
+
+  gs_apk_index_link_subpackages (apk_index);
+  /* Refine only looks them up, so compute them while still in a thread */
+  if (apk_index->world != NULL)
+    compute_exclusive_sizes (apk_index);
+  return g_steal_pointer (&apk_index);
+}
+
+/**
+ * gs_apk_index_link_subpackages:
+ * @apk_index: The index
+ *
+ * Links subpackages to their main package in one pass over all packages:
+ * `foo-doc` belongs to `foo` if both were built from the same origin. Must
+ * be called once all packages were added.
+ **/
+void
+gs_apk_index_link_subpackages (GsApkIndex *apk_index)
+{
+  g_hash_table_remove_all (apk_index->subpackages);
+
+  for (guint i = 0; i < apk_index->by_name->len; i++)
+    {
+      GsApkIndexPackage *package = g_ptr_array_index (apk_index->by_name, i);
+      gsize name_len;
+
+      if (package->origin == NULL)
+        continue;
+
+      name_len = strlen (package->name);
+      for (guint j = 0; addon_suffixes[j] != NULL; j++)
+        {
+          gsize suffix_len = strlen (addon_suffixes[j]);
+          g_autofree gchar *main_name = NULL;
+          GsApkIndexPackage *main_package;
+          GPtrArray *subpackages;
+
+          if (name_len <= suffix_len ||
+              memcmp (package->name + name_len - suffix_len, addon_suffixes[j], suffix_len) != 0)
+            continue;
+
+          main_name = g_strndup (package->name, name_len - suffix_len);
+          main_package = g_hash_table_lookup (apk_index->packages, main_name);
+          if (main_package == NULL || g_strcmp0 (main_package->origin, package->origin) != 0)
+            break;
+
+          subpackages = g_hash_table_lookup (apk_index->subpackages, main_package->name);
+          if (subpackages == NULL)
+            {
+              subpackages = g_ptr_array_new ();
+              g_hash_table_insert (apk_index->subpackages, (gpointer) main_package->name, subpackages);
+            }
+          g_ptr_array_add (subpackages, package);
+          break;
+        }
+    }
+}
+
+/**
+ * gs_apk_index_get_subpackages:
+ * @apk_index: The index
+ * @name: The name of a package
+ *
+ * Returns: (transfer none) (nullable) (element-type GsApkIndexPackage): the
+ * documentation, translation, service and completion subpackages of @name.
+ **/
+GPtrArray *
+gs_apk_index_get_subpackages (GsApkIndex *apk_index, const gchar *name)
+{
+  return g_hash_table_lookup (apk_index->subpackages, name);
+}
+
+/**
+ * gs_apk_index_lookup:
+ * @apk_index: The index
+ * @provides: What to look for, e.g. `cmd:foo`, `so:libfoo.so.1`, `pc:foo`
+ *   or a package name, without version
+ *
+ * Returns: (transfer none) (nullable) (element-type GsApkIndexPackage): the
+ * packages providing @provides, or %NULL if there are none.
+ **/
+GPtrArray *
+gs_apk_index_lookup (GsApkIndex *apk_index, const gchar *provides)
+{
+  return g_hash_table_lookup (apk_index->provides, provides);
+}
+
+/**
+ * gs_apk_index_get_packages:
+ * @apk_index: The index
+ *
+ * Returns: (transfer none) (element-type GsApkIndexPackage): all packages,
+ * in no particular order
+ **/
+GPtrArray *
+gs_apk_index_get_packages (GsApkIndex *apk_index)
+{
+  return apk_index->by_name;
+}
+
+/**
+ * gs_apk_index_get_package:
+ * @apk_index: The index
+ * @name: The name of a package
+ *
+ * Returns: (transfer none) (nullable): the package called @name
+ **/
+GsApkIndexPackage *
+gs_apk_index_get_package (GsApkIndex *apk_index, const gchar *name)
+{
+  return g_hash_table_lookup (apk_index->packages, name);
+}
+
+static gboolean
+is_installed_provider (GsApkIndexPackage *package, GHashTable *removed)
+{
+  return package->installed && !g_hash_table_contains (removed, package);
+}
+
+/* Builds apk_index->rdepends, linking each installed package to the
+ * installed packages with a dependency it provides */
+static void
+index_link_reverse_dependencies (GsApkIndex *apk_index)
+{
+  apk_index->rdepends = g_hash_table_new_full (NULL, NULL, NULL,
+                                               (GDestroyNotify) g_ptr_array_unref);
+
+  for (guint i = 0; i < apk_index->installed->len; i++)
+    {
+      GsApkIndexPackage *package = g_ptr_array_index (apk_index->installed, i);
+
+      if (package->depends == NULL)
+        continue;
+
+      for (guint j = 0; package->depends[j] != NULL; j++)
+        {
+          GPtrArray *providers = g_hash_table_lookup (apk_index->provides, package->depends[j]);
+
+          for (guint k = 0; providers != NULL && k < providers->len; k++)
+            {
+              GsApkIndexPackage *provider = g_ptr_array_index (providers, k);
+              GPtrArray *dependents;
+
+              if (!provider->installed || provider == package)
+                continue;
+              dependents = g_hash_table_lookup (apk_index->rdepends, provider);
+              if (dependents == NULL)
+                {
+                  dependents = g_ptr_array_new ();
+                  g_hash_table_insert (apk_index->rdepends, provider, dependents);
+                }
+              if (!g_ptr_array_find (dependents, package, NULL))
+                g_ptr_array_add (dependents, package);
+            }
+        }
+    }
+}
+
+/* Whether @package has a dependency that was satisfied, but no longer
+ * is once the packages in @removed are gone */
+static gboolean
+is_broken_by_removal (GsApkIndex *apk_index,
+                      GsApkIndexPackage *package,
+                      GHashTable *removed)
+{
+  for (guint i = 0; package->depends[i] != NULL; i++)
+    {
+      GPtrArray *providers = g_hash_table_lookup (apk_index->provides, package->depends[i]);
+      gboolean was_satisfied = FALSE;
+      gboolean is_satisfied = FALSE;
+
+      for (guint j = 0; providers != NULL && j < providers->len; j++)
+        {
+          GsApkIndexPackage *provider = g_ptr_array_index (providers, j);
+
+          was_satisfied |= provider->installed;
+          is_satisfied |= is_installed_provider (provider, removed);
+        }
+      if (was_satisfied && !is_satisfied)
+        return TRUE;
+    }
+
+  return FALSE;
+}
+
+/**
+ * gs_apk_index_get_removal_impact:
+ * @apk_index: The index
+ * @names: The names of the installed packages to remove
+ *
+ * Follows the reverse dependencies of @names through the installed
+ * packages. apk refuses to remove a package while another installed
+ * package still needs it, so these are the packages which have to be
+ * removed along with @names, or which block their removal. A dependency
+ * only counts as broken once every installed provider of it is gone.
+ *
+ * Returns: (transfer container) (element-type GsApkIndexPackage): the
+ * installed packages depending on @names, directly or indirectly,
+ * excluding @names themselves.
+ **/
+GPtrArray *
+gs_apk_index_get_removal_impact (GsApkIndex *apk_index, const gchar *const *names)
+{
+  g_autoptr (GHashTable) removed = g_hash_table_new (NULL, NULL);
+  g_autoptr (GPtrArray) queue = g_ptr_array_new ();
+  GPtrArray *impact = g_ptr_array_new ();
+
+  if (apk_index->rdepends == NULL)
+    index_link_reverse_dependencies (apk_index);
+
+  for (guint i = 0; names[i] != NULL; i++)
+    {
+      GsApkIndexPackage *package = g_hash_table_lookup (apk_index->packages, names[i]);
+
+      if (package != NULL && package->installed && g_hash_table_add (removed, package))
+        g_ptr_array_add (queue, package);
+    }
+
+  for (guint i = 0; i < queue->len; i++)
+    {
+      GPtrArray *dependents = g_hash_table_lookup (apk_index->rdepends,
+                                                   g_ptr_array_index (queue, i));
+
+      for (guint j = 0; dependents != NULL && j < dependents->len; j++)
+        {
+          GsApkIndexPackage *dependent = g_ptr_array_index (dependents, j);
+
+          if (g_hash_table_contains (removed, dependent) ||
+              !is_broken_by_removal (apk_index, dependent, removed))
+            continue;
+          g_hash_table_add (removed, dependent);
+          g_ptr_array_add (queue, dependent);
+          g_ptr_array_add (impact, dependent);
+        }
+    }
+
+  return impact;
+}
+
+/**
+ * gs_apk_index_set_world:
+ * @apk_index: The index
+ * @world: The contents of /etc/apk/world
+ * @len: The length of @world
+ *
+ * Sets the packages the user asked for, which gs_apk_index_get_orphans()
+ * starts from.
+ **/
+void
+gs_apk_index_set_world (GsApkIndex *apk_index, const gchar *world, gsize len)
+{
+  g_free (apk_index->world);
+  apk_index->world = parse_depends (apk_index, world, len);
+  g_clear_pointer (&apk_index->reachable, g_hash_table_unref);
+  g_clear_pointer (&apk_index->exclusive_sizes, g_hash_table_unref);
+}
+
+/* Marks the installed providers of @name as reachable, queueing the ones
+ * which weren't yet. @removed is never reachable. */
+static void
+mark_reachable (GsApkIndex *apk_index,
+                const gchar *name,
+                GsApkIndexPackage *removed,
+                GHashTable *reachable,
+                GPtrArray *queue)
+{
+  GPtrArray *providers = g_hash_table_lookup (apk_index->provides, name);
+
+  for (guint i = 0; providers != NULL && i < providers->len; i++)
+    {
+      GsApkIndexPackage *provider = g_ptr_array_index (providers, i);
+
+      if (provider->installed && provider != removed && g_hash_table_add (reachable, provider))
+        g_ptr_array_add (queue, provider);
+    }
+}
+
+static gboolean
+is_install_if_satisfied (GsApkIndex *apk_index,
+                         GsApkIndexPackage *package,
+                         GHashTable *reachable)
+{
+  for (guint i = 0; package->install_if[i] != NULL; i++)
+    {
+      GPtrArray *providers = g_hash_table_lookup (apk_index->provides, package->install_if[i]);
+      gboolean satisfied = FALSE;
+
+      for (guint j = 0; providers != NULL && j < providers->len && !satisfied; j++)
+        satisfied = g_hash_table_contains (reachable, g_ptr_array_index (providers, j));
+      if (!satisfied)
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
+/**
+ * compute_reachable:
+ * @apk_index: The index, with a world
+ * @removed: (nullable): A package to leave out
+ *
+ * Walks the dependencies of the installed packages, starting from the
+ * world. Packages pulled in by `i:` (install_if) rules are reachable
+ * as long as all their conditions are.
+ *
+ * Returns: (transfer full): the set of installed packages the world
+ * needs, assuming @removed was removed.
+ **/
+static GHashTable *
+compute_reachable (GsApkIndex *apk_index, GsApkIndexPackage *removed)
+{
+  GHashTable *reachable = g_hash_table_new (NULL, NULL);
+  g_autoptr (GPtrArray) queue = g_ptr_array_new ();
+  gboolean changed = TRUE;
+  guint i = 0;
+
+  for (guint j = 0; apk_index->world[j] != NULL; j++)
+    mark_reachable (apk_index, apk_index->world[j], removed, reachable, queue);
+
+  while (changed)
+    {
+      for (; i < queue->len; i++)
+        {
+          GsApkIndexPackage *package = g_ptr_array_index (queue, i);
+
+          for (guint j = 0; package->depends != NULL && package->depends[j] != NULL; j++)
+            mark_reachable (apk_index, package->depends[j], removed, reachable, queue);
+        }
+
+      /* install_if rules can only add packages, repeat until none fire */
+      changed = FALSE;
+      for (guint j = 0; j < apk_index->installed->len; j++)
+        {
+          GsApkIndexPackage *package = g_ptr_array_index (apk_index->installed, j);
+
+          if (package->install_if != NULL && package != removed &&
+              !g_hash_table_contains (reachable, package) &&
+              is_install_if_satisfied (apk_index, package, reachable))
+            {
+              g_hash_table_add (reachable, package);
+              g_ptr_array_add (queue, package);
+              changed = TRUE;
+            }
+        }
+    }
+
+  return reachable;
+}
+
+static GHashTable *
+get_reachable (GsApkIndex *apk_index)
+{
+  if (apk_index->reachable == NULL)
+    apk_index->reachable = compute_reachable (apk_index, NULL);
+  return apk_index->reachable;
+}
+
+/**
+ * gs_apk_index_get_orphans:
+ * @apk_index: The index
+ *
+ * The walk of compute_reachable() does not know the rules of the apk
+ * solver, such as provider priorities or conflicts, so it may miss how a
+ * dependency is really satisfied. Hence a package only counts as an orphan
+ * if, on top of that, no installed package depends on it through any of
+ * its provides. The dependencies of orphans show up once those are gone.
+ *
+ * Returns: (transfer container) (element-type GsApkIndexPackage): the
+ * installed packages nothing in the world needs anymore. Empty if the
+ * world is unknown.
+ **/
+GPtrArray *
+gs_apk_index_get_orphans (GsApkIndex *apk_index)
+{
+  GPtrArray *orphans = g_ptr_array_new ();
+  GHashTable *reachable;
+
+  if (apk_index->world == NULL)
+    return orphans;
+
+  if (apk_index->rdepends == NULL)
+    index_link_reverse_dependencies (apk_index);
+  reachable = get_reachable (apk_index);
+  for (guint i = 0; i < apk_index->installed->len; i++)
+    {
+      GsApkIndexPackage *package = g_ptr_array_index (apk_index->installed, i);
+
+      if (!g_hash_table_contains (reachable, package) &&
+          !g_hash_table_contains (apk_index->rdepends, package))
+        g_ptr_array_add (orphans, package);
+    }
+
+  return orphans;
+}
+
+/* Adds edges from @from to the providers of @name the world reaches */
+static void
+add_dependency_edges (GsApkIndex *apk_index,
+                      GHashTable *node_ids,
+                      GPtrArray *successors,
+                      guint from,
+                      const gchar *name)
+{
+  GPtrArray *providers = g_hash_table_lookup (apk_index->provides, name);
+
+  for (guint i = 0; providers != NULL && i < providers->len; i++)
+    {
+      guint to = GPOINTER_TO_UINT (g_hash_table_lookup (node_ids, g_ptr_array_index (providers, i)));
+
+      if (to != 0)
+        g_array_append_val (g_ptr_array_index (successors, from), to);
+    }
+}
+
+static guint
+intersect_dominators (const gint *idom, const guint *postorder, guint a, guint b)
+{
+  while (a != b)
+    {
+      while (postorder[a] < postorder[b])
+        a = idom[a];
+      while (postorder[b] < postorder[a])
+        b = idom[b];
+    }
+  return a;
+}
+
+/**
+ * compute_exclusive_sizes:
+ * @apk_index: The index, with a world
+ *
+ * Removing a package frees the packages the world only reaches through
+ * it, which are the ones it dominates in the dependency graph rooted at
+ * the world. So this builds the dominator tree of that graph with the
+ * iterative algorithm of Cooper, Harvey and Kennedy, and sums up the
+ * installed sizes of each subtree, for all packages in one pass.
+ *
+ * A package pulled in by `i:` (install_if) rules hangs off each of its
+ * conditions, so it only counts for a package every condition depends
+ * on, while removing any single condition would remove it as well.
+ **/
+static void
+compute_exclusive_sizes (GsApkIndex *apk_index)
+{
+  GHashTable *reachable = get_reachable (apk_index);
+  guint n_nodes = g_hash_table_size (reachable) + 1;
+  g_autoptr (GHashTable) node_ids = g_hash_table_new (NULL, NULL);
+  g_autoptr (GPtrArray) successors = g_ptr_array_new_with_free_func ((GDestroyNotify) g_array_unref);
+  g_autoptr (GPtrArray) predecessors = g_ptr_array_new_with_free_func ((GDestroyNotify) g_array_unref);
+  g_autofree GsApkIndexPackage **packages = g_new0 (GsApkIndexPackage *, n_nodes);
+  g_autofree guint *postorder = g_new0 (guint, n_nodes);
+  g_autofree guint *by_postorder = g_new0 (guint, n_nodes);
+  g_autofree gint *idom = g_new (gint, n_nodes);
+  g_autofree guint64 *sizes = g_new0 (guint64, n_nodes);
+  g_autofree gboolean *visited = g_new0 (gboolean, n_nodes);
+  g_autoptr (GArray) stack = g_array_new (FALSE, FALSE, sizeof (guint) * 2);
+  guint n_visited = 0;
+  gboolean changed = TRUE;
+
+  /* Node 0 is the world, the packages it reaches follow */
+  for (guint i = 0, id = 1; i < apk_index->installed->len; i++)
+    {
+      GsApkIndexPackage *package = g_ptr_array_index (apk_index->installed, i);
+
+      if (!g_hash_table_contains (reachable, package))
+        continue;
+      packages[id] = package;
+      g_hash_table_insert (node_ids, package, GUINT_TO_POINTER (id));
+      id++;
+    }
+  for (guint i = 0; i < n_nodes; i++)
+    {
+      g_ptr_array_add (successors, g_array_new (FALSE, FALSE, sizeof (guint)));
+      g_ptr_array_add (predecessors, g_array_new (FALSE, FALSE, sizeof (guint)));
+    }
+
+  for (guint j = 0; apk_index->world[j] != NULL; j++)
+    add_dependency_edges (apk_index, node_ids, successors, 0, apk_index->world[j]);
+  for (guint i = 1; i < n_nodes; i++)
+    {
+      GsApkIndexPackage *package = packages[i];
+
+      for (guint j = 0; package->depends != NULL && package->depends[j] != NULL; j++)
+        add_dependency_edges (apk_index, node_ids, successors, i, package->depends[j]);
+
+      /* From each condition to the package it installs */
+      for (guint j = 0; package->install_if != NULL && package->install_if[j] != NULL; j++)
+        {
+          GPtrArray *providers = g_hash_table_lookup (apk_index->provides, package->install_if[j]);
+
+          for (guint k = 0; providers != NULL && k < providers->len; k++)
+            {
+              guint from = GPOINTER_TO_UINT (g_hash_table_lookup (node_ids, g_ptr_array_index (providers, k)));
+
+              if (from != 0)
+                g_array_append_val (g_ptr_array_index (successors, from), i);
+            }
+        }
+    }
+  for (guint i = 0; i < n_nodes; i++)
+    {
+      GArray *edges = g_ptr_array_index (successors, i);
+
+      for (guint j = 0; j < edges->len; j++)
+        g_array_append_val (g_ptr_array_index (predecessors, g_array_index (edges, guint, j)), i);
+    }
+
+  /* Depth-first postorder from the world, without recursion as the
+   * dependency chains can be long */
+  {
+    guint frame[2] = { 0, 0 };
+
+    visited[0] = TRUE;
+    g_array_append_val (stack, frame);
+  }
+  while (stack->len > 0)
+    {
+      guint *frame = &g_array_index (stack, guint, (stack->len - 1) * 2);
+      GArray *edges = g_ptr_array_index (successors, frame[0]);
+
+      if (frame[1] < edges->len)
+        {
+          guint next[2] = { g_array_index (edges, guint, frame[1]), 0 };
+
+          frame[1]++;
+          if (!visited[next[0]])
+            {
+              visited[next[0]] = TRUE;
+              g_array_append_val (stack, next);
+            }
+          continue;
+        }
+
+      postorder[frame[0]] = n_visited;
+      by_postorder[n_visited++] = frame[0];
+      g_array_set_size (stack, stack->len - 1);
+    }
+
+  for (guint i = 0; i < n_nodes; i++)
+    idom[i] = -1;
+  idom[0] = 0;
+  while (changed)
+    {
+      changed = FALSE;
+      /* Reverse postorder, skipping the world, which comes first */
+      for (gint k = (gint) n_visited - 2; k >= 0; k--)
+        {
+          guint node = by_postorder[k];
+          GArray *preds = g_ptr_array_index (predecessors, node);
+          gint new_idom = -1;
+
+          for (guint j = 0; j < preds->len; j++)
+            {
+              guint pred = g_array_index (preds, guint, j);
+
+              if (idom[pred] == -1)
+                continue;
+              new_idom = new_idom == -1 ? (gint) pred : (gint) intersect_dominators (idom, postorder, pred, new_idom);
+            }
+          if (idom[node] != new_idom)
+            {
+              idom[node] = new_idom;
+              changed = TRUE;
+            }
+        }
+    }
+
+  /* Dominators come later in postorder, so every subtree is complete
+   * before it is added to its parent */
+  apk_index->exclusive_sizes = g_hash_table_new_full (NULL, NULL, NULL, g_free);
+  for (guint k = 0; k + 1 < n_visited; k++)
+    {
+      guint node = by_postorder[k];
+      guint64 *size = g_new (guint64, 1);
+
+      *size = sizes[node] + packages[node]->installed_size;
+      sizes[idom[node]] += *size;
+      g_hash_table_insert (apk_index->exclusive_sizes, packages[node], size);
+    }
+}
+
+/**
+ * gs_apk_index_get_exclusive_size:
+ * @apk_index: The index
+ * @name: The name of an installed package
+ *
+ * Looks up how much space removing @name would free: its own installed
+ * size plus that of the installed packages only it needs, i.e. those the
+ * world still reaches with it, but not without it. The sizes of all
+ * packages are computed at once on first use, see
+ * compute_exclusive_sizes(). gs_apk_index_load() does so already.
+ *
+ * Returns: the size in bytes, 0 if @name is not installed
+ **/
+guint64
+gs_apk_index_get_exclusive_size (GsApkIndex *apk_index, const gchar *name)
+{
+  GsApkIndexPackage *package = g_hash_table_lookup (apk_index->packages, name);
+  guint64 *size;
+
+  if (package == NULL || !package->installed)
+    return 0;
+  if (apk_index->world == NULL)
+    return package->installed_size;
+
+  if (apk_index->exclusive_sizes == NULL)
+    compute_exclusive_sizes (apk_index);
+
+  /* Nothing in the world needs it, so nothing else goes with it */
+  size = g_hash_table_lookup (apk_index->exclusive_sizes, package);
+  return size != NULL ? *size : package->installed_size;
+}
+
+guint
+gs_apk_index_get_n_packages (GsApkIndex *apk_index)
+{
+  return g_hash_table_size (apk_index->packages);
+}
+
+guint
+gs_apk_index_get_n_provides (GsApkIndex *apk_index)
+{
+  return g_hash_table_size (apk_index->provides);
+}
+
+typedef struct
+{
+  guint64 peq[256]; /* positions of each byte in the pattern */
+  guint64 last;     /* bit of the last pattern position */
+  guint len;
+} EditPattern;
+
+static void
+edit_pattern_init (EditPattern *pattern, const gchar *str, guint len)
+{
+  memset (pattern->peq, 0, sizeof (pattern->peq));
+  for (guint i = 0; i < len; i++)
+    pattern->peq[(guchar) str[i]] |= G_GUINT64_CONSTANT (1) << i;
+  pattern->last = G_GUINT64_CONSTANT (1) << (len - 1);
+  pattern->len = len;
+}
+
+/**
+ * edit_distance:
+ * @pattern: The pattern, at most 64 bytes long
+ * @text: The text to compare it with
+ * @max_distance: The largest distance of interest
+ *
+ * Levenshtein distance between @pattern and @text, with Myers' bit-parallel
+ * algorithm in Hyyrö's formulation: one column of the dynamic programming
+ * matrix is updated per byte of @text with a handful of word operations.
+ * The scan stops as soon as the distance can't get back to @max_distance.
+ *
+ * Returns: the distance, or a value larger than @max_distance
+ **/
+static guint
+edit_distance (const EditPattern *pattern, const gchar *text, guint max_distance)
+{
+  guint64 pv = G_MAXUINT64;
+  guint64 mv = 0;
+  guint score = pattern->len;
+  gsize text_len = strlen (text);
+
+  if ((text_len > pattern->len ? text_len - pattern->len : pattern->len - text_len) > max_distance)
+    return max_distance + 1;
+
+  for (gsize j = 0; j < text_len; j++)
+    {
+      guint64 eq = pattern->peq[(guchar) text[j]];
+      guint64 xv = eq | mv;
+      guint64 xh = (((eq & pv) + pv) ^ pv) | eq;
+      guint64 ph = mv | ~(xh | pv);
+      guint64 mh = pv & xh;
+
+      if (ph & pattern->last)
+        score++;
+      else if (mh & pattern->last)
+        score--;
+
+      /* Every remaining byte can lower the distance by one at most */
+      if (score > max_distance + (text_len - j - 1))
+        return max_distance + 1;
+
+      ph = (ph << 1) | 1;
+      mh <<= 1;
+      pv = mh | ~(xv | ph);
+      mv = ph & xv;
+    }
+
+  return score;
+}
+
+static gint
+index_match_compare (gconstpointer a, gconstpointer b)
+{
+  const GsApkIndexMatch *match_a = a;
+  const GsApkIndexMatch *match_b = b;
+
+  if (match_a->distance != match_b->distance)
+    return match_a->distance < match_b->distance ? -1 : 1;
+  return strcmp (match_a->package->name, match_b->package->name);
+}
+
+/**
+ * gs_apk_index_suggest:
+ * @apk_index: The index
+ * @keyword: A search term that is likely a mistyped package name
+ * @max_distance: The largest edit distance to suggest
+ * @max_results: The maximum number of suggestions
+ * @budget_usec: Time after which the scan gives up
+ *
+ * Scans all package names for near misses of @keyword. If any name contains
+ * @keyword, the search isn't a typo and nothing is suggested. Keywords longer
+ * than 64 bytes are never suggested for.
+ *
+ * Returns: (transfer full) (element-type GsApkIndexMatch): the suggestions,
+ * closest first.
+ **/
+GArray *
+gs_apk_index_suggest (GsApkIndex *apk_index,
+                      const gchar *keyword,
+                      guint max_distance,
+                      guint max_results,
+                      gint64 budget_usec)
+{
+  g_autoptr (GArray) matches = g_array_new (FALSE, FALSE, sizeof (GsApkIndexMatch));
+  gsize keyword_len = strlen (keyword);
+  gint64 deadline = g_get_monotonic_time () + budget_usec;
+  EditPattern pattern;
+
+  if (keyword_len == 0 || keyword_len > 64)
+    return g_steal_pointer (&matches);
+
+  edit_pattern_init (&pattern, keyword, keyword_len);
+  for (guint i = 0; i < apk_index->by_name->len; i++)
+    {
+      GsApkIndexPackage *package = g_ptr_array_index (apk_index->by_name, i);
+      GsApkIndexMatch match;
+
+      if ((i & 1023) == 1023 && g_get_monotonic_time () > deadline)
+        {
+          g_debug ("Suggestions for '%s' ran out of time after %u of %u names",
+                   keyword, i, apk_index->by_name->len);
+          break;
+        }
+
+      if (strstr (package->name, keyword) != NULL)
+        {
+          g_array_set_size (matches, 0);
+          return g_steal_pointer (&matches);
+        }
+
+      match.distance = edit_distance (&pattern, package->name, max_distance);
+      if (match.distance > max_distance)
+        continue;
+      match.package = package;
+      g_array_append_val (matches, match);
+    }
+
+  g_array_sort (matches, index_match_compare);
+  if (matches->len > max_results)
+    g_array_set_size (matches, max_results);
+  return g_steal_pointer (&matches);
+}
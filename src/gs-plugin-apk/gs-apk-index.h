@@ -0,0 +1,90 @@
+/*
+ * Copyright (C) 2024 The gnome-software-plugin-apk contributors
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#pragma once
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/*
+ * An in-memory index over the `p:` (provides) fields of the apk database,
+ * answering "which packages provide cmd:foo, so:libfoo.so.1 or pc:foo?".
+ * It is built from the installed database and the cached repository
+ * indexes, and every package also provides its own name. It also offers
+ * typo-tolerant suggestions over all package names, links subpackages
+ * such as `foo-doc` to their main package and follows the `D:`
+ * (dependencies) fields of installed packages, in reverse or from the
+ * world to find orphans. All strings live as long as the index.
+ */
+
+typedef struct _GsApkIndex GsApkIndex;
+
+typedef struct
+{
+  const gchar *name;
+  const gchar *version;
+  const gchar *description; /* (nullable) */
+  const gchar *license;     /* (nullable) */
+  const gchar *url;         /* (nullable) */
+  const gchar *origin;      /* (nullable) the source package it was built from */
+  guint64 size;
+  guint64 installed_size;
+  gboolean installed;
+  gboolean has_commands;    /* whether it provides any cmd: */
+  const gchar **depends;    /* (nullable) the names of its dependencies */
+  const gchar **install_if; /* (nullable) installed automatically with these */
+} GsApkIndexPackage;
+
+typedef struct
+{
+  GsApkIndexPackage *package;
+  guint distance;
+} GsApkIndexMatch;
+
+GsApkIndex *gs_apk_index_new (void);
+GsApkIndex *gs_apk_index_ref (GsApkIndex *apk_index);
+void gs_apk_index_unref (GsApkIndex *apk_index);
+
+void gs_apk_index_add_text (GsApkIndex *apk_index,
+                            const gchar *text,
+                            gsize len,
+                            gboolean installed);
+gboolean gs_apk_index_add_file (GsApkIndex *apk_index,
+                                const gchar *path,
+                                gboolean installed,
+                                GError **error);
+GsApkIndex *gs_apk_index_load (const gchar *root,
+                               GError **error);
+
+void gs_apk_index_set_world (GsApkIndex *apk_index,
+                             const gchar *world,
+                             gsize len);
+void gs_apk_index_link_subpackages (GsApkIndex *apk_index);
+
+GPtrArray *gs_apk_index_get_packages (GsApkIndex *apk_index);
+GsApkIndexPackage *gs_apk_index_get_package (GsApkIndex *apk_index,
+                                             const gchar *name);
+GPtrArray *gs_apk_index_lookup (GsApkIndex *apk_index,
+                                const gchar *provides);
+GPtrArray *gs_apk_index_get_subpackages (GsApkIndex *apk_index,
+                                         const gchar *name);
+GPtrArray *gs_apk_index_get_removal_impact (GsApkIndex *apk_index,
+                                            const gchar *const *names);
+GPtrArray *gs_apk_index_get_orphans (GsApkIndex *apk_index);
+guint64 gs_apk_index_get_exclusive_size (GsApkIndex *apk_index,
+                                         const gchar *name);
+GArray *gs_apk_index_suggest (GsApkIndex *apk_index,
+                              const gchar *keyword,
+                              guint max_distance,
+                              guint max_results,
+                              gint64 budget_usec);
+guint gs_apk_index_get_n_packages (GsApkIndex *apk_index);
+guint gs_apk_index_get_n_provides (GsApkIndex *apk_index);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (GsApkIndex, gs_apk_index_unref)
+
+G_END_DECLS
@@ -0,0 +1,382 @@
+/*
+ * Copyright (C) 2024 The gnome-software-plugin-apk contributors
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#include "gs-apk-metrics.h"
+#include <gio/gio.h>
+
+/*
+ * Counters for the daemon calls and the plugin's caches. Calls are counted
+ * from the GDBus worker thread, so everything is behind one mutex; the
+ * counters are only touched once per call or per batch of lookups.
+ */
+
+/* Upper bounds of the latency histogram buckets, in µs */
+static const gint64 bucket_bounds[] = {
+  1000, 5000, 10000, 25000, 50000, 100000, 250000, 500000,
+  1000000, 2500000, 5000000, 10000000, 30000000, 60000000
+};
+
+typedef struct
+{
+  guint64 buckets[G_N_ELEMENTS (bucket_bounds) + 1];
+  guint64 n_calls;
+  guint64 n_errors;
+  guint64 sum_usec;
+  guint64 items_sent;
+  guint64 items_received;
+  guint64 bytes_sent;
+  guint64 bytes_received;
+  guint in_flight;
+} MethodStats;
+
+typedef struct
+{
+  guint64 hits;
+  guint64 misses;
+} CacheStats;
+
+struct _GsApkMetrics
+{
+  GMutex mutex;
+  GHashTable *methods; /* (element-type utf8 MethodStats) */
+  GHashTable *caches;  /* (element-type utf8 CacheStats) */
+};
+
+static void
+metrics_clear (gpointer data)
+{
+  GsApkMetrics *metrics = data;
+
+  g_hash_table_unref (metrics->methods);
+  g_hash_table_unref (metrics->caches);
+  g_mutex_clear (&metrics->mutex);
+}
+
+GsApkMetrics *
+gs_apk_metrics_new (void)
+{
+  GsApkMetrics *metrics = g_atomic_rc_box_new0 (GsApkMetrics);
+
+  g_mutex_init (&metrics->mutex);
+  metrics->methods = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+  metrics->caches = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+
+  return metrics;
+}
+
+GsApkMetrics *
+gs_apk_metrics_ref (GsApkMetrics *metrics)
+{
+  return g_atomic_rc_box_acquire (metrics);
+}
+
+void
+gs_apk_metrics_unref (GsApkMetrics *metrics)
+{
+  g_atomic_rc_box_release_full (metrics, metrics_clear);
+}
+
+/* Called with the mutex held */
+static MethodStats *
+metrics_get_method (GsApkMetrics *metrics, const gchar *method)
+{
+  MethodStats *stats = g_hash_table_lookup (metrics->methods, method);
+
+  if (stats == NULL)
+    {
+      stats = g_new0 (MethodStats, 1);
+      g_hash_table_insert (metrics->methods, g_strdup (method), stats);
+    }
+  return stats;
+}
+
+/**
+ * gs_apk_metrics_call_started:
+ * @metrics: The metrics
+ * @method: The daemon method called
+ * @n_items: Number of packages or paths sent along
+ * @n_bytes: Size of the serialized arguments
+ **/
+void
+gs_apk_metrics_call_started (GsApkMetrics *metrics,
+                             const gchar *method,
+                             guint n_items,
+                             gsize n_bytes)
+{
+  MethodStats *stats;
+
+  g_mutex_lock (&metrics->mutex);
+  stats = metrics_get_method (metrics, method);
+  stats->in_flight++;
+  stats->items_sent += n_items;
+  stats->bytes_sent += n_bytes;
+  g_mutex_unlock (&metrics->mutex);
+}
+
+/**
+ * gs_apk_metrics_call_finished:
+ * @metrics: The metrics
+ * @method: The daemon method called
+ * @duration_usec: Time from sending the call to receiving the reply
+ * @n_items: Number of packages received
+ * @n_bytes: Size of the serialized reply
+ * @failed: Whether the daemon replied with an error
+ **/
+void
+gs_apk_metrics_call_finished (GsApkMetrics *metrics,
+                              const gchar *method,
+                              gint64 duration_usec,
+                              guint n_items,
+                              gsize n_bytes,
+                              gboolean failed)
+{
+  MethodStats *stats;
+  guint bucket = 0;
+
+  while (bucket < G_N_ELEMENTS (bucket_bounds) && duration_usec > bucket_bounds[bucket])
+    bucket++;
+
+  g_mutex_lock (&metrics->mutex);
+  stats = metrics_get_method (metrics, method);
+  if (stats->in_flight > 0)
+    stats->in_flight--;
+  stats->buckets[bucket]++;
+  stats->n_calls++;
+  stats->sum_usec += MAX (duration_usec, 0);
+  stats->items_received += n_items;
+  stats->bytes_received += n_bytes;
+  if (failed)
+    stats->n_errors++;
+  g_mutex_unlock (&metrics->mutex);
+}
+
+/**
+ * gs_apk_metrics_cache_lookup:
+ * @metrics: The metrics
+ * @cache: Name of the cache
+ * @n_hits: Number of lookups answered by the cache
+ * @n_misses: Number of lookups that had to go elsewhere
+ **/
+void
+gs_apk_metrics_cache_lookup (GsApkMetrics *metrics,
+                             const gchar *cache,
+                             guint n_hits,
+                             guint n_misses)
+{
+  CacheStats *stats;
+
+  g_mutex_lock (&metrics->mutex);
+  stats = g_hash_table_lookup (metrics->caches, cache);
+  if (stats == NULL)
+    {
+      stats = g_new0 (CacheStats, 1);
+      g_hash_table_insert (metrics->caches, g_strdup (cache), stats);
+    }
+  stats->hits += n_hits;
+  stats->misses += n_misses;
+  g_mutex_unlock (&metrics->mutex);
+}
+
+static gint
+compare_keys (gconstpointer a, gconstpointer b)
+{
+  return g_strcmp0 (*(const gchar **) a, *(const gchar **) b);
+}
+
+/* Called with the mutex held; sorted, so consecutive dumps can be diffed */
+static GPtrArray *
+sorted_keys (GHashTable *table)
+{
+  GPtrArray *keys = g_ptr_array_new ();
+  GHashTableIter iter;
+  gpointer key;
+
+  g_hash_table_iter_init (&iter, table);
+  while (g_hash_table_iter_next (&iter, &key, NULL))
+    g_ptr_array_add (keys, key);
+  g_ptr_array_sort (keys, compare_keys);
+
+  return keys;
+}
+
+/**
+ * gs_apk_metrics_to_prometheus:
+ * @metrics: The metrics
+ *
+ * Formats all counters in the Prometheus text exposition format.
+ *
+ * Returns: (transfer full): the formatted metrics
+ **/
+gchar *
+gs_apk_metrics_to_prometheus (GsApkMetrics *metrics)
+{
+  GString *out = g_string_new (NULL);
+  g_autoptr (GPtrArray) methods = NULL;
+  g_autoptr (GPtrArray) caches = NULL;
+
+  g_mutex_lock (&metrics->mutex);
+  methods = sorted_keys (metrics->methods);
+  caches = sorted_keys (metrics->caches);
+
+  g_string_append (out,
+                   "# HELP gs_plugin_apk_call_duration_seconds Latency of apkPolkit2 calls.\n"
+                   "# TYPE gs_plugin_apk_call_duration_seconds histogram\n");
+  for (guint i = 0; i < methods->len; i++)
+    {
+      const gchar *method = g_ptr_array_index (methods, i);
+      MethodStats *stats = g_hash_table_lookup (metrics->methods, method);
+      guint64 cumulative = 0;
+
+      for (guint j = 0; j < G_N_ELEMENTS (bucket_bounds); j++)
+        {
+          cumulative += stats->buckets[j];
+          g_string_append_printf (out,
+                                  "gs_plugin_apk_call_duration_seconds_bucket{method=\"%s\",le=\"%g\"} %" G_GUINT64_FORMAT "\n",
+                                  method, bucket_bounds[j] / (gdouble) G_USEC_PER_SEC, cumulative);
+        }
+      g_string_append_printf (out,
+                              "gs_plugin_apk_call_duration_seconds_bucket{method=\"%s\",le=\"+Inf\"} %" G_GUINT64_FORMAT "\n"
+                              "gs_plugin_apk_call_duration_seconds_sum{method=\"%s\"} %g\n"
+                              "gs_plugin_apk_call_duration_seconds_count{method=\"%s\"} %" G_GUINT64_FORMAT "\n",
+                              method, stats->n_calls,
+                              method, stats->sum_usec / (gdouble) G_USEC_PER_SEC,
+                              method, stats->n_calls);
+    }
+
+  g_string_append (out,
+                   "# HELP gs_plugin_apk_call_errors_total apkPolkit2 calls that returned an error.\n"
+                   "# TYPE gs_plugin_apk_call_errors_total counter\n");
+  for (guint i = 0; i < methods->len; i++)
+    {
+      const gchar *method = g_ptr_array_index (methods, i);
+      MethodStats *stats = g_hash_table_lookup (metrics->methods, method);
+
+      g_string_append_printf (out, "gs_plugin_apk_call_errors_total{method=\"%s\"} %" G_GUINT64_FORMAT "\n",
+                              method, stats->n_errors);
+    }
+
+  g_string_append (out,
+                   "# HELP gs_plugin_apk_call_items_total Packages or paths carried by apkPolkit2 calls.\n"
+                   "# TYPE gs_plugin_apk_call_items_total counter\n");
+  for (guint i = 0; i < methods->len; i++)
+    {
+      const gchar *method = g_ptr_array_index (methods, i);
+      MethodStats *stats = g_hash_table_lookup (metrics->methods, method);
+
+      g_string_append_printf (out,
+                              "gs_plugin_apk_call_items_total{method=\"%s\",direction=\"sent\"} %" G_GUINT64_FORMAT "\n"
+                              "gs_plugin_apk_call_items_total{method=\"%s\",direction=\"received\"} %" G_GUINT64_FORMAT "\n",
+                              method, stats->items_sent, method, stats->items_received);
+    }
+
+  g_string_append (out,
+                   "# HELP gs_plugin_apk_call_bytes_total Serialized size of apkPolkit2 calls.\n"
+                   "# TYPE gs_plugin_apk_call_bytes_total counter\n");
+  for (guint i = 0; i < methods->len; i++)
+    {
+      const gchar *method = g_ptr_array_index (methods, i);
+      MethodStats *stats = g_hash_table_lookup (metrics->methods, method);
+
+      g_string_append_printf (out,
+                              "gs_plugin_apk_call_bytes_total{method=\"%s\",direction=\"sent\"} %" G_GUINT64_FORMAT "\n"
+                              "gs_plugin_apk_call_bytes_total{method=\"%s\",direction=\"received\"} %" G_GUINT64_FORMAT "\n",
+                              method, stats->bytes_sent, method, stats->bytes_received);
+    }
+
+  g_string_append (out,
+                   "# HELP gs_plugin_apk_calls_in_flight apkPolkit2 calls waiting for a reply.\n"
+                   "# TYPE gs_plugin_apk_calls_in_flight gauge\n");
+  for (guint i = 0; i < methods->len; i++)
+    {
+      const gchar *method = g_ptr_array_index (methods, i);
+      MethodStats *stats = g_hash_table_lookup (metrics->methods, method);
+
+      g_string_append_printf (out, "gs_plugin_apk_calls_in_flight{method=\"%s\"} %u\n",
+                              method, stats->in_flight);
+    }
+
+  g_string_append (out,
+                   "# HELP gs_plugin_apk_cache_lookups_total Lookups in the plugin's caches.\n"
+                   "# TYPE gs_plugin_apk_cache_lookups_total counter\n");
+  for (guint i = 0; i < caches->len; i++)
+    {
+      const gchar *cache = g_ptr_array_index (caches, i);
+      CacheStats *stats = g_hash_table_lookup (metrics->caches, cache);
+
+      g_string_append_printf (out,
+                              "gs_plugin_apk_cache_lookups_total{cache=\"%s\",result=\"hit\"} %" G_GUINT64_FORMAT "\n"
+                              "gs_plugin_apk_cache_lookups_total{cache=\"%s\",result=\"miss\"} %" G_GUINT64_FORMAT "\n",
+                              cache, stats->hits, cache, stats->misses);
+    }
+  g_mutex_unlock (&metrics->mutex);
+
+  return g_string_free (out, FALSE);
+}
+
+/**
+ * gs_apk_metrics_log:
+ * @metrics: The metrics
+ *
+ * Logs a one-line summary per method and cache, visible with
+ * `G_MESSAGES_DEBUG=GsPluginApk`.
+ **/
+void
+gs_apk_metrics_log (GsApkMetrics *metrics)
+{
+  g_autoptr (GPtrArray) methods = NULL;
+  g_autoptr (GPtrArray) caches = NULL;
+
+  g_mutex_lock (&metrics->mutex);
+  methods = sorted_keys (metrics->methods);
+  caches = sorted_keys (metrics->caches);
+
+  for (guint i = 0; i < methods->len; i++)
+    {
+      const gchar *method = g_ptr_array_index (methods, i);
+      MethodStats *stats = g_hash_table_lookup (metrics->methods, method);
+
+      g_debug ("%s: %" G_GUINT64_FORMAT " calls (%" G_GUINT64_FORMAT " failed, %u in flight), "
+               "mean %.1f ms, %" G_GUINT64_FORMAT "/%" G_GUINT64_FORMAT " items sent/received, "
+               "%" G_GUINT64_FORMAT "/%" G_GUINT64_FORMAT " bytes sent/received",
+               method, stats->n_calls, stats->n_errors, stats->in_flight,
+               stats->n_calls > 0 ? stats->sum_usec / 1000.0 / stats->n_calls : 0.0,
+               stats->items_sent, stats->items_received,
+               stats->bytes_sent, stats->bytes_received);
+    }
+
+  for (guint i = 0; i < caches->len; i++)
+    {
+      const gchar *cache = g_ptr_array_index (caches, i);
+      CacheStats *stats = g_hash_table_lookup (metrics->caches, cache);
+      guint64 total = stats->hits + stats->misses;
+
+      g_debug ("%s cache: %" G_GUINT64_FORMAT " hits, %" G_GUINT64_FORMAT " misses (%.1f%% hit ratio)",
+               cache, stats->hits, stats->misses,
+               total > 0 ? 100.0 * stats->hits / total : 0.0);
+    }
+  g_mutex_unlock (&metrics->mutex);
+}
+
+/**
+ * gs_apk_metrics_write_textfile:
+ * @metrics: The metrics
+ * @path: Destination, e.g. in node_exporter's textfile collector directory
+ * @error: Return location for a #GError
+ *
+ * Atomically replaces @path with the output of
+ * gs_apk_metrics_to_prometheus(), so a collector never reads a partial file.
+ *
+ * Returns: %TRUE on success
+ **/
+gboolean
+gs_apk_metrics_write_textfile (GsApkMetrics *metrics,
+                               const gchar *path,
+                               GError **error)
+{
+  g_autofree gchar *contents = gs_apk_metrics_to_prometheus (metrics);
+
+  return g_file_set_contents (path, contents, -1, error);
+}
@@ -0,0 +1,42 @@
+/*
+ * Copyright (C) 2024 The gnome-software-plugin-apk contributors
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#pragma once
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+typedef struct _GsApkMetrics GsApkMetrics;
+
+GsApkMetrics *gs_apk_metrics_new (void);
+GsApkMetrics *gs_apk_metrics_ref (GsApkMetrics *metrics);
+void gs_apk_metrics_unref (GsApkMetrics *metrics);
+
+void gs_apk_metrics_call_started (GsApkMetrics *metrics,
+                                  const gchar *method,
+                                  guint n_items,
+                                  gsize n_bytes);
+void gs_apk_metrics_call_finished (GsApkMetrics *metrics,
+                                   const gchar *method,
+                                   gint64 duration_usec,
+                                   guint n_items,
+                                   gsize n_bytes,
+                                   gboolean failed);
+void gs_apk_metrics_cache_lookup (GsApkMetrics *metrics,
+                                  const gchar *cache,
+                                  guint n_hits,
+                                  guint n_misses);
+
+gchar *gs_apk_metrics_to_prometheus (GsApkMetrics *metrics);
+void gs_apk_metrics_log (GsApkMetrics *metrics);
+gboolean gs_apk_metrics_write_textfile (GsApkMetrics *metrics,
+                                        const gchar *path,
+                                        GError **error);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (GsApkMetrics, gs_apk_metrics_unref)
+
+G_END_DECLS
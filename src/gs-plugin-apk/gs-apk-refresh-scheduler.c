@@ -0,0 +1,233 @@
+/*
+ * Copyright (C) 2024 The gnome-software-plugin-apk contributors
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#include "gs-apk-refresh-scheduler.h"
+#include <gio/gio.h>
+#include <glib/gstdio.h>
+
+/* Upper bound for the jitter added to the refresh interval */
+#define MAX_JITTER_SECS (4 * 60 * 60)
+
+/* Backoff after failed refreshes: 15 minutes, doubling up to a day */
+#define BACKOFF_BASE_SECS (15 * 60)
+#define BACKOFF_MAX_SECS (24 * 60 * 60)
+
+/* 1-minute load average per CPU above which the device counts as busy */
+#define MAX_LOAD_PER_CPU 1.0
+
+struct _GsApkRefreshScheduler
+{
+  gchar *root; /* (owned) */
+  guint32 seed; /* per device, for the jitter */
+  GPowerProfileMonitor *power_profile_monitor; /* (owned) */
+  guint n_failures;
+  gint64 retry_after; /* monotonic time, µs */
+};
+
+/* FNV-1a over the machine id, or a random seed without one */
+static guint32
+scheduler_seed (void)
+{
+  g_autofree gchar *machine_id = NULL;
+  guint32 hash = 2166136261U;
+
+  if (!g_file_get_contents ("/etc/machine-id", &machine_id, NULL, NULL))
+    return g_random_int ();
+
+  for (const gchar *p = machine_id; *p != '\0'; p++)
+    {
+      hash ^= (guchar) *p;
+      hash *= 16777619U;
+    }
+  return hash;
+}
+
+GsApkRefreshScheduler *
+gs_apk_refresh_scheduler_new (const gchar *root)
+{
+  GsApkRefreshScheduler *scheduler = g_new0 (GsApkRefreshScheduler, 1);
+
+  scheduler->root = g_strdup (root);
+  scheduler->seed = scheduler_seed ();
+  scheduler->power_profile_monitor = g_power_profile_monitor_dup_default ();
+  return scheduler;
+}
+
+void
+gs_apk_refresh_scheduler_free (GsApkRefreshScheduler *scheduler)
+{
+  g_clear_object (&scheduler->power_profile_monitor);
+  g_free (scheduler->root);
+  g_free (scheduler);
+}
+
+/**
+ * get_index_age:
+ * @scheduler: The scheduler
+ *
+ * apk rewrites the cached repository indexes on every refresh, so the
+ * newest of them tells when the last one happened, across restarts.
+ *
+ * Returns: the seconds since the last refresh, or %G_MAXUINT64 if there
+ * was none.
+ **/
+static guint64
+get_index_age (GsApkRefreshScheduler *scheduler)
+{
+  const gchar *cache_dirs[] = { "etc/apk/cache", "var/cache/apk", NULL };
+  gint64 newest = -1;
+  gint64 now = g_get_real_time () / G_USEC_PER_SEC;
+
+  for (guint i = 0; cache_dirs[i] != NULL; i++)
+    {
+      g_autofree gchar *dir_path = g_build_filename (scheduler->root, cache_dirs[i], NULL);
+      g_autoptr (GDir) dir = g_dir_open (dir_path, 0, NULL);
+      const gchar *name;
+
+      if (dir == NULL)
+        continue;
+
+      while ((name = g_dir_read_name (dir)) != NULL)
+        {
+          g_autofree gchar *path = NULL;
+          GStatBuf st;
+
+          if (!g_str_has_prefix (name, "APKINDEX."))
+            continue;
+          path = g_build_filename (dir_path, name, NULL);
+          if (g_stat (path, &st) == 0 && st.st_mtime > newest)
+            newest = st.st_mtime;
+        }
+    }
+
+  if (newest < 0)
+    return G_MAXUINT64;
+  return now > newest ? (guint64) (now - newest) : 0;
+}
+
+/* Whether a battery is discharging, according to the kernel */
+static gboolean
+is_on_battery (void)
+{
+  const gchar *supplies_path = "/sys/class/power_supply";
+  g_autoptr (GDir) dir = g_dir_open (supplies_path, 0, NULL);
+  const gchar *name;
+
+  if (dir == NULL)
+    return FALSE;
+
+  while ((name = g_dir_read_name (dir)) != NULL)
+    {
+      g_autofree gchar *status_path = g_build_filename (supplies_path, name, "status", NULL);
+      g_autofree gchar *status = NULL;
+
+      if (g_file_get_contents (status_path, &status, NULL, NULL) &&
+          g_str_has_prefix (status, "Discharging"))
+        return TRUE;
+    }
+
+  return FALSE;
+}
+
+static gboolean
+is_busy (void)
+{
+  g_autofree gchar *loadavg = NULL;
+  gdouble load;
+
+  if (!g_file_get_contents ("/proc/loadavg", &loadavg, NULL, NULL))
+    return FALSE;
+
+  load = g_ascii_strtod (loadavg, NULL);
+  return load > MAX_LOAD_PER_CPU * g_get_num_processors ();
+}
+
+/**
+ * gs_apk_refresh_scheduler_should_refresh:
+ * @scheduler: The scheduler
+ * @cache_age_secs: How old the indexes may get, as asked by gnome-software
+ * @interactive: Whether the user asked for the refresh
+ * @out_reason: (out) (optional): Why the refresh should not run
+ *
+ * Background refreshes are due once the indexes are older than
+ * @cache_age_secs plus this device's jitter, which is a fixed fraction of
+ * a quarter of @cache_age_secs, at most MAX_JITTER_SECS. Without any
+ * indexes the device cannot show anything, so a refresh is due right away,
+ * unless it just failed.
+ *
+ * Returns: %TRUE if the refresh should run now
+ **/
+gboolean
+gs_apk_refresh_scheduler_should_refresh (GsApkRefreshScheduler *scheduler,
+                                         guint64 cache_age_secs,
+                                         gboolean interactive,
+                                         const gchar **out_reason)
+{
+  guint64 age;
+  guint64 jitter;
+  const gchar *reason = NULL;
+
+  if (interactive)
+    return TRUE;
+
+  /* gnome-software asks for a cache age of G_MAXUINT64 when it only wants
+   * some metadata to exist, there is nothing to spread out then */
+  age = get_index_age (scheduler);
+  jitter = 0;
+  if (cache_age_secs != G_MAXUINT64)
+    jitter = MIN (cache_age_secs / 4, MAX_JITTER_SECS) * (scheduler->seed % 1000) / 1000;
+  if (age != G_MAXUINT64 && (age < cache_age_secs || age - cache_age_secs < jitter))
+    reason = "the indexes are recent enough";
+  else if (g_get_monotonic_time () < scheduler->retry_after)
+    reason = "backing off after failures";
+  else if (age == G_MAXUINT64)
+    reason = NULL; /* never refreshed, better conditions may never come */
+  else if (is_on_battery ())
+    reason = "running on battery";
+  else if (scheduler->power_profile_monitor != NULL &&
+           g_power_profile_monitor_get_power_saver_enabled (scheduler->power_profile_monitor))
+    reason = "power saver is enabled";
+  else if (g_network_monitor_get_network_metered (g_network_monitor_get_default ()))
+    reason = "the network is metered";
+  else if (is_busy ())
+    reason = "the system is busy";
+
+  if (out_reason != NULL)
+    *out_reason = reason;
+  return reason == NULL;
+}
+
+/**
+ * gs_apk_refresh_scheduler_report:
+ * @scheduler: The scheduler
+ * @success: Whether the refresh succeeded
+ *
+ * Records the outcome of a refresh. Failures defer the next background
+ * refresh by BACKOFF_BASE_SECS, doubled for each further failure.
+ *
+ * Returns: the seconds until the next background refresh may run
+ **/
+guint64
+gs_apk_refresh_scheduler_report (GsApkRefreshScheduler *scheduler, gboolean success)
+{
+  guint64 backoff_secs;
+
+  if (success)
+    {
+      scheduler->n_failures = 0;
+      scheduler->retry_after = 0;
+      return 0;
+    }
+
+  scheduler->n_failures++;
+  backoff_secs = BACKOFF_MAX_SECS;
+  if (scheduler->n_failures <= 16)
+    backoff_secs = MIN ((guint64) BACKOFF_BASE_SECS << (scheduler->n_failures - 1), BACKOFF_MAX_SECS);
+  scheduler->retry_after = g_get_monotonic_time () + backoff_secs * G_USEC_PER_SEC;
+  g_debug ("Refresh failed %u times, retrying in the background after %" G_GUINT64_FORMAT " s",
+           scheduler->n_failures, backoff_secs);
+  return backoff_secs;
+}
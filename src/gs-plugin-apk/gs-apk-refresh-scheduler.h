@@ -0,0 +1,37 @@
+/*
+ * Copyright (C) 2024 The gnome-software-plugin-apk contributors
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#pragma once
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/*
+ * Decides whether a background refresh of the repository indexes should
+ * run now. Refreshes the user asked for always run. Background ones are
+ * deferred while the device runs on battery or in power saver mode, is on
+ * a metered network or is busy, and after failures with an exponential
+ * backoff. Without any indexes a refresh is always due, only the backoff
+ * applies. A per-device jitter, derived from the machine id, keeps a fleet
+ * of devices from all hitting the mirror at the same time.
+ */
+
+typedef struct _GsApkRefreshScheduler GsApkRefreshScheduler;
+
+GsApkRefreshScheduler *gs_apk_refresh_scheduler_new (const gchar *root);
+void gs_apk_refresh_scheduler_free (GsApkRefreshScheduler *scheduler);
+
+gboolean gs_apk_refresh_scheduler_should_refresh (GsApkRefreshScheduler *scheduler,
+                                                  guint64 cache_age_secs,
+                                                  gboolean interactive,
+                                                  const gchar **out_reason);
+guint64 gs_apk_refresh_scheduler_report (GsApkRefreshScheduler *scheduler,
+                                         gboolean success);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (GsApkRefreshScheduler, gs_apk_refresh_scheduler_free)
+
+G_END_DECLS
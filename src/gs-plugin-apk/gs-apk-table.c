@@ -0,0 +1,189 @@
+/*
+ * Copyright (C) 2024 The gnome-software-plugin-apk contributors
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#define _GNU_SOURCE
+
+#include "gs-apk-table.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <gio/gio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+typedef struct
+{
+  gpointer addr;
+  gsize len;
+} TableMapping;
+
+static void
+table_mapping_free (gpointer user_data)
+{
+  TableMapping *mapping = user_data;
+
+  munmap (mapping->addr, mapping->len);
+  g_free (mapping);
+}
+
+/**
+ * gs_apk_table_map_fd:
+ * @fd: A memfd holding a package table
+ * @error: Return location for a #GError
+ *
+ * Maps a package table read-only. The memfd must be sealed against writes
+ * and shrinking, otherwise the sender could change or truncate it while we
+ * read it in place. The fd can be closed once this returns.
+ *
+ * Returns: (transfer full): the validated table, or %NULL on error.
+ **/
+GBytes *
+gs_apk_table_map_fd (gint fd, GError **error)
+{
+  g_autoptr (GBytes) table = NULL;
+  TableMapping *mapping;
+  struct stat st;
+  gpointer addr;
+  gint seals;
+
+  seals = fcntl (fd, F_GET_SEALS);
+  if (seals < 0 || (seals & (F_SEAL_WRITE | F_SEAL_SHRINK)) != (F_SEAL_WRITE | F_SEAL_SHRINK))
+    {
+      g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_PERMISSION_DENIED,
+                           "Package table is not sealed");
+      return NULL;
+    }
+
+  if (fstat (fd, &st) != 0)
+    {
+      g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errno),
+                   "Failed to stat package table: %s", g_strerror (errno));
+      return NULL;
+    }
+
+  if (st.st_size < (goffset) sizeof (GsApkTableHeader))
+    {
+      g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                           "Package table is truncated");
+      return NULL;
+    }
+
+  addr = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (addr == MAP_FAILED)
+    {
+      g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errno),
+                   "Failed to map package table: %s", g_strerror (errno));
+      return NULL;
+    }
+
+  mapping = g_new (TableMapping, 1);
+  mapping->addr = addr;
+  mapping->len = st.st_size;
+  table = g_bytes_new_with_free_func (addr, st.st_size, table_mapping_free, mapping);
+
+  if (!gs_apk_table_validate (table, error))
+    return NULL;
+
+  return g_steal_pointer (&table);
+}
+
+/**
+ * gs_apk_table_validate:
+ * @table: The package table
+ * @error: Return location for a #GError
+ *
+ * Checks that every record and every string offset lies within @table, so
+ * the accessors below never read out of bounds.
+ *
+ * Returns: %TRUE if the table is well-formed
+ **/
+gboolean
+gs_apk_table_validate (GBytes *table, GError **error)
+{
+  gsize len;
+  const guint8 *data = g_bytes_get_data (table, &len);
+  const GsApkTableHeader *header = (const GsApkTableHeader *) data;
+  const gchar *strings;
+  guint64 records_end;
+
+  if (len < sizeof (GsApkTableHeader) ||
+      memcmp (header->magic, GS_APK_TABLE_MAGIC, sizeof (header->magic)) != 0)
+    goto invalid;
+
+  if (header->record_size != sizeof (GsApkTableRecord))
+    goto invalid;
+
+  records_end = sizeof (GsApkTableHeader) + (guint64) header->n_packages * sizeof (GsApkTableRecord);
+  if (records_end > len ||
+      header->strings_offset < records_end ||
+      header->strings_offset > len ||
+      header->strings_size > len - header->strings_offset ||
+      header->strings_size > G_MAXUINT32)
+    goto invalid;
+
+  /* A trailing NUL guarantees that any in-bounds offset is terminated */
+  strings = (const gchar *) data + header->strings_offset;
+  if (header->strings_size == 0 || strings[header->strings_size - 1] != '\0')
+    goto invalid;
+
+  for (guint32 i = 0; i < header->n_packages; i++)
+    {
+      const GsApkTableRecord *record = gs_apk_table_get_record (table, i);
+      const guint32 offsets[] = { record->name, record->version,
+                                  record->description, record->license,
+                                  record->url, record->staging_version };
+
+      if (record->name == GS_APK_TABLE_NO_STRING)
+        goto invalid;
+      for (guint j = 0; j < G_N_ELEMENTS (offsets); j++)
+        {
+          if (offsets[j] != GS_APK_TABLE_NO_STRING && offsets[j] >= header->strings_size)
+            goto invalid;
+        }
+    }
+
+  return TRUE;
+
+invalid:
+  g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                       "Malformed package table");
+  return FALSE;
+}
+
+guint32
+gs_apk_table_get_n_packages (GBytes *table)
+{
+  const GsApkTableHeader *header = g_bytes_get_data (table, NULL);
+
+  return header->n_packages;
+}
+
+const GsApkTableRecord *
+gs_apk_table_get_record (GBytes *table, guint32 index)
+{
+  const guint8 *data = g_bytes_get_data (table, NULL);
+
+  return (const GsApkTableRecord *) (data + sizeof (GsApkTableHeader)) + index;
+}
+
+/**
+ * gs_apk_table_get_string:
+ * @table: The package table
+ * @offset: An offset into the string pool
+ *
+ * Returns: (nullable): the string in place, or %NULL for
+ * %GS_APK_TABLE_NO_STRING. Valid as long as @table is alive.
+ **/
+const gchar *
+gs_apk_table_get_string (GBytes *table, guint32 offset)
+{
+  const guint8 *data = g_bytes_get_data (table, NULL);
+  const GsApkTableHeader *header = (const GsApkTableHeader *) data;
+
+  if (offset == GS_APK_TABLE_NO_STRING)
+    return NULL;
+  return (const gchar *) data + header->strings_offset + offset;
+}
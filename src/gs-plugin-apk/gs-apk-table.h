@@ -0,0 +1,63 @@
+/*
+ * Copyright (C) 2024 The gnome-software-plugin-apk contributors
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#pragma once
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/*
+ * A package table is a compact, read-only description of many packages
+ * which the daemon can hand over as a sealed memfd instead of marshalling
+ * one `a{sv}` per package. All integers are in host byte order, as the
+ * table never leaves the machine. Layout:
+ *
+ *   GsApkTableHeader
+ *   GsApkTableRecord[n_packages]
+ *   string pool: NUL-terminated strings, referenced by offset
+ */
+
+#define GS_APK_TABLE_MAGIC "APKTABL1"
+#define GS_APK_TABLE_NO_STRING G_MAXUINT32
+
+typedef struct
+{
+  gchar magic[8];
+  guint32 n_packages;
+  guint32 record_size;
+  guint64 strings_offset;
+  guint64 strings_size;
+} GsApkTableHeader;
+
+typedef struct
+{
+  guint32 name;
+  guint32 version;
+  guint32 description;
+  guint32 license;
+  guint32 url;
+  guint32 staging_version;
+  guint32 package_state;
+  guint32 reserved;
+  guint64 installed_size;
+  guint64 size;
+} GsApkTableRecord;
+
+G_STATIC_ASSERT (sizeof (GsApkTableHeader) == 32);
+G_STATIC_ASSERT (sizeof (GsApkTableRecord) == 48);
+
+GBytes *gs_apk_table_map_fd (gint fd,
+                             GError **error);
+gboolean gs_apk_table_validate (GBytes *table,
+                                GError **error);
+guint32 gs_apk_table_get_n_packages (GBytes *table);
+const GsApkTableRecord *gs_apk_table_get_record (GBytes *table,
+                                                 guint32 index);
+const gchar *gs_apk_table_get_string (GBytes *table,
+                                      guint32 offset);
+
+G_END_DECLS
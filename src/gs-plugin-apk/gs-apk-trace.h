@@ -0,0 +1,70 @@
+/*
+ * Copyright (C) 2024 The gnome-software-plugin-apk contributors
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#pragma once
+
+#include <glib.h>
+
+/*
+ * Trace points at the phase boundaries of the plugin's operations. Built
+ * with -Dtracing=sysprof they become sysprof marks in the "gs-plugin-apk"
+ * group; with -Dtracing=usdt they become USDT probes in the gs_plugin_apk
+ * provider, usable with perf, bpftrace or systemtap. Otherwise they compile
+ * to nothing.
+ *
+ * Times are CLOCK_MONOTONIC nanoseconds. Every probe carries the start of
+ * the phase, its duration and the number of apps or packages it handled:
+ *
+ *   GS_APK_TRACE_MARK (phase, begin, n_items)
+ *     @phase ran from @begin (a GS_APK_TRACE_NOW() value) until now.
+ *   GS_APK_TRACE_MARK_DURATION (phase, begin, duration, n_items)
+ *     @phase started at @begin and took @duration in total, for phases
+ *     interleaved with others in one loop.
+ *   GS_APK_TRACE_CALL (method, begin, duration, n_items)
+ *     A daemon call, with @method as a string.
+ */
+
+#if defined(HAVE_SYSPROF)
+
+#include <sysprof-capture.h>
+
+#define GS_APK_TRACE_NOW() SYSPROF_CAPTURE_CURRENT_TIME
+#define GS_APK_TRACE_MARK_DURATION(phase, begin, duration, n_items) \
+  sysprof_collector_mark_printf ((begin), (duration), "gs-plugin-apk", #phase, \
+                                 "%u items", (guint) (n_items))
+#define GS_APK_TRACE_CALL(method, begin, duration, n_items) \
+  sysprof_collector_mark_printf ((begin), (duration), "gs-plugin-apk", "daemon-call", \
+                                 "%s: %u items", (method), (guint) (n_items))
+
+#elif defined(HAVE_USDT)
+
+#include <sys/sdt.h>
+
+#define GS_APK_TRACE_NOW() (g_get_monotonic_time () * 1000)
+#define GS_APK_TRACE_MARK_DURATION(phase, begin, duration, n_items) \
+  DTRACE_PROBE3 (gs_plugin_apk, phase, (gint64) (begin), (gint64) (duration), (guint) (n_items))
+#define GS_APK_TRACE_CALL(method, begin, duration, n_items) \
+  DTRACE_PROBE4 (gs_plugin_apk, daemon_call, (method), (gint64) (begin), \
+                 (gint64) (duration), (guint) (n_items))
+
+#else
+
+#define GS_APK_TRACE_NOW() G_GINT64_CONSTANT (0)
+#define GS_APK_TRACE_MARK_DURATION(phase, begin, duration, n_items) \
+  G_STMT_START { (void) (begin); (void) (duration); } G_STMT_END
+#define GS_APK_TRACE_CALL(method, begin, duration, n_items) \
+  G_STMT_START { (void) (begin); (void) (duration); } G_STMT_END
+
+#endif
+
+#define GS_APK_TRACE_MARK(phase, begin, n_items) \
+  G_STMT_START \
+  { \
+    gint64 _gs_apk_trace_begin = (begin); \
+    GS_APK_TRACE_MARK_DURATION (phase, _gs_apk_trace_begin, \
+                                GS_APK_TRACE_NOW () - _gs_apk_trace_begin, n_items); \
+  } \
+  G_STMT_END
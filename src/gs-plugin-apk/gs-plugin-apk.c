@@ -6,9 +6,18 @@
  */
 
 #include "gs-plugin-apk.h"
+#include "gs-apk-appstream.h"
+#include "gs-apk-call-monitor.h"
+#include "gs-apk-index.h"
+#include "gs-apk-metrics.h"
+#include "gs-apk-refresh-scheduler.h"
+#include "gs-apk-table.h"
+#include "gs-apk-trace.h"
 #include <apk-polkit-client-bitflags.h>
 #include <apk-polkit-client.h>
 #include <appstream.h>
+#include <gio/gunixfdlist.h>
+#include <glib/gstdio.h>
 #include <gnome-software.h>
 #include <libintl.h>
 #include <locale.h>
@@ -16,11 +25,85 @@
 
 #define APK_POLKIT_CLIENT_DETAILS_FLAGS_ALL 0xFF
 
+/* Fits "name-version" of all but pathological packages */
+#define APK_CACHE_KEY_MAX 256
+
+/* Seconds between two exports to GS_PLUGIN_APK_METRICS_FILE */
+#define GS_PLUGIN_APK_METRICS_INTERVAL 30
+
+/* Default watchdog budgets, see gs_plugin_apk_setup_watchdog() */
+#define GS_PLUGIN_APK_READ_BUDGET_MS 30000
+#define GS_PLUGIN_APK_TRANSACTION_BUDGET_MS (30 * 60 * 1000)
+
+/* Quiet period before updates-changed is considered, so that bursts of
+ * refreshes and upgrades result in a single notification */
+#define GS_PLUGIN_APK_UPDATES_CHANGED_DELAY_MS 500
+
+/* Package name suggestions for keyword searches, see
+ * gs_plugin_apk_suggestions_to_list() */
+#define GS_PLUGIN_APK_SUGGESTIONS_MAX 5
+#define GS_PLUGIN_APK_SUGGESTIONS_BUDGET_USEC 20000
+
+/* How often a read is sent again when the daemon goes away before replying */
+#define GS_PLUGIN_APK_READ_RETRIES 2
+
+/* Bump whenever the layout of the upgradable snapshot changes */
+#define GS_PLUGIN_APK_SNAPSHOT_VERSION 1
+#define GS_PLUGIN_APK_SNAPSHOT_TYPE "(utaa{sv})"
+
 struct _GsPluginApk
 {
   GsPlugin parent;
 
   ApkPolkit2 *proxy;
+  guint64 daemon_fingerprint; /* of the database our caches last matched */
+  GsApkCallMonitor *call_monitor; /* (owned) (nullable) */
+  GsApkMetrics *metrics;          /* (owned) */
+  gchar *metrics_path;            /* (owned) (nullable) */
+  guint metrics_timeout_id;
+  gchar *root; /* (owned) */
+
+  /* Last known set of upgradable packages, as returned by the daemon */
+  GVariant *upgradable; /* (owned) (nullable) */
+  guint64 upgradable_fingerprint;
+  gchar *snapshot_path; /* (owned) (nullable) */
+  gboolean upgradable_stale; /* kept only to diff against the next set */
+  gboolean reconcile_in_flight;
+  gboolean reconcile_queued;
+  guint updates_changed_id;
+
+  /* Whether the daemon lacks ListPackagesTable */
+  gboolean table_unsupported;
+
+  /* Update details keyed by "name\nold-version\nnew-version" */
+  GHashTable *update_details; /* (owned) (element-type utf8 ApkUpdateDetails) */
+
+  /* Priority lanes for GetPackagesDetails, see gs_plugin_apk_get_details_async() */
+  GQueue bulk_queue; /* (element-type DetailsChunk) */
+  gboolean bulk_in_flight;
+  guint n_interactive_in_flight;
+
+  /* Names the daemon could not resolve with the current repositories */
+  GHashTable *not_found; /* (owned) (element-type utf8) */
+  guint64 not_found_skipped;
+
+  /* What-provides index over the apk database, built on first use */
+  GsApkIndex *provides_index; /* (owned) (nullable) */
+  guint64 provides_index_fingerprint;
+  guint64 index_load_fingerprint; /* of the load in flight, 0 if there is none */
+  GPtrArray *index_waiters;       /* (owned) (element-type GTask) for the load in flight */
+  GPtrArray *index_next_waiters;  /* (owned) (element-type GTask) for the load after it */
+  gboolean index_prefetch_suppressed; /* since a memory warning dropped it */
+  gboolean orphans_reload_pending; /* the orphans were listed without an index */
+
+  /* AppStream for packages without any, regenerated after refreshes */
+  GsApkAppstream *appstream; /* (owned) only used by the update while in flight */
+  gboolean appstream_in_flight;
+  gboolean appstream_shed_pending;
+
+  GsApkRefreshScheduler *refresh_scheduler; /* (owned) */
+
+  GMemoryMonitor *memory_monitor; /* (owned) (nullable) */
 };
 
 G_DEFINE_TYPE (GsPluginApk, gs_plugin_apk, GS_TYPE_PLUGIN);
@@ -49,6 +132,23 @@ typedef struct
   ApkPackageState packageState;
 } ApkdPackage;
 
+/* Upper bound for the update details cache before it is flushed */
+#define UPDATE_DETAILS_CACHE_MAX 2048
+
+typedef struct
+{
+  gchar *text;
+  guint64 download_size;
+  AsUrgencyKind urgency;
+} ApkUpdateDetails;
+
+static void
+apk_update_details_free (ApkUpdateDetails *details)
+{
+  g_free (details->text);
+  g_free (details);
+}
+
 /**
  * gs_plugin_apk_variant_to_apkd:
  * @dict: a `a{sv}` GVariant representing a package
@@ -82,6 +182,36 @@ gs_plugin_apk_variant_to_apkd (GVariant *dict, ApkdPackage *pkg)
   return TRUE;
 }
 
+/* apk-polkit-rs' error for a package no repository has, filled in with
+ * its name. The other per-package errors may be gone on the next attempt */
+#define APK_POLKIT_PACKAGE_NOT_FOUND_FORMAT "Package %s not found"
+
+/**
+ * gs_plugin_apk_variant_is_not_found:
+ * @dict: a `a{sv}` GVariant representing a package
+ *
+ * The daemon reports per-package failures as a free-form `error` field.
+ * Only a package missing from the repositories is worth remembering, so
+ * the error must be exactly APK_POLKIT_PACKAGE_NOT_FOUND_FORMAT for the
+ * package of @dict. Anything else, e.g. a locked database that merely
+ * mentions some file was not found, is not.
+ *
+ * Returns: %TRUE if the error of @dict says the package does not exist
+ **/
+static gboolean
+gs_plugin_apk_variant_is_not_found (GVariant *dict)
+{
+  const gchar *error_str;
+  const gchar *name;
+  g_autofree gchar *not_found = NULL;
+
+  if (!g_variant_lookup (dict, "error", "&s", &error_str) ||
+      !g_variant_lookup (dict, "name", "&s", &name))
+    return FALSE;
+  not_found = g_strdup_printf (APK_POLKIT_PACKAGE_NOT_FOUND_FORMAT, name);
+  return g_str_equal (error_str, not_found);
+}
+
 /**
  * apk_to_app_state:
  * @state: A ApkPackageState
@@ -110,21 +240,16 @@ apk_to_app_state (ApkPackageState state)
 }
 
 /**
- * apk_package_to_app:
+ * apk_package_new_app:
  * @pkg: A ApkPackage
  *
- * Convenience function which converts a ApkdPackage to a GsApp.
+ * Returns: (transfer full): a new GsApp for @pkg, which is not shared with
+ * other results, see apk_package_to_app()
  **/
 static GsApp *
-apk_package_to_app (GsPlugin *plugin, ApkdPackage *pkg)
+apk_package_new_app (GsPlugin *plugin, ApkdPackage *pkg)
 {
-  g_autofree gchar *cache_name = NULL;
-  cache_name = g_strdup_printf ("%s-%s", pkg->name, pkg->version);
-  GsApp *app = gs_plugin_cache_lookup (plugin, cache_name);
-  if (app != NULL)
-    return app;
-
-  app = gs_app_new (pkg->name);
+  GsApp *app = gs_app_new (pkg->name);
 
   gs_app_set_kind (app, AS_COMPONENT_KIND_GENERIC);
   gs_app_set_bundle_kind (app, AS_BUNDLE_KIND_PACKAGE);
@@ -146,11 +271,107 @@ apk_package_to_app (GsPlugin *plugin, ApkdPackage *pkg)
   gs_app_set_version (app, pkg->version);
   if (gs_app_get_state (app) == GS_APP_STATE_UPDATABLE_LIVE)
     gs_app_set_update_version (app, pkg->stagingVersion);
+
+  return app;
+}
+
+/**
+ * apk_package_to_app:
+ * @pkg: A ApkPackage
+ *
+ * Convenience function which converts a ApkdPackage to a GsApp. The app
+ * is cached, so the same package always maps to the same GsApp.
+ **/
+static GsApp *
+apk_package_to_app (GsPlugin *plugin, ApkdPackage *pkg)
+{
+  GsPluginApk *self = GS_PLUGIN_APK (plugin);
+  gchar cache_buf[APK_CACHE_KEY_MAX];
+  g_autofree gchar *cache_heap = NULL;
+  const gchar *cache_name = cache_buf;
+  GsApp *app;
+
+  /* This runs for every package listed, avoid allocating on cache hits */
+  if ((gsize) g_snprintf (cache_buf, sizeof (cache_buf), "%s-%s", pkg->name, pkg->version) >= sizeof (cache_buf))
+    cache_name = cache_heap = g_strdup_printf ("%s-%s", pkg->name, pkg->version);
+  app = gs_plugin_cache_lookup (plugin, cache_name);
+  gs_apk_metrics_cache_lookup (self->metrics, "packages", app != NULL, app == NULL);
+  if (app != NULL)
+    return app;
+
+  app = apk_package_new_app (plugin, pkg);
   gs_plugin_cache_add (plugin, cache_name, app);
 
   return app;
 }
 
+/**
+ * index_package_to_app:
+ * @plugin: The apk GsPlugin.
+ * @package: A package of the provides index
+ * @shared: Whether the cached GsApp will do, see apk_package_to_app()
+ *
+ * Returns: (transfer full): the GsApp for @package
+ **/
+static GsApp *
+index_package_to_app (GsPlugin *plugin, GsApkIndexPackage *package, gboolean shared)
+{
+  ApkdPackage pkg = {
+    package->name, package->version, package->description,
+    package->license, NULL, package->url,
+    package->installed_size, package->size,
+    package->installed ? Installed : Available
+  };
+
+  if (!shared)
+    return apk_package_new_app (plugin, &pkg);
+  return apk_package_to_app (plugin, &pkg);
+}
+
+/**
+ * gs_plugin_apk_set_removal_impact:
+ * @self: The apk plugin
+ * @app: The app to annotate
+ * @names: The packages that would be removed
+ *
+ * Sets the `apk::removal-impact` metadata of @app to the space separated
+ * names of the installed packages which depend on @names, and hence block
+ * their removal unless they are removed as well. Unsets it if there are
+ * none. self->provides_index must be up to date.
+ *
+ * gnome-software itself doesn't show this yet: none of its GsApp
+ * properties describes the apps an uninstall takes along, and the related
+ * apps are reserved for what a proxy app stands for. The metadata is for
+ * frontends and logs until there is one.
+ **/
+static void
+gs_plugin_apk_set_removal_impact (GsPluginApk *self,
+                                  GsApp *app,
+                                  const gchar *const *names)
+{
+  g_autoptr (GPtrArray) impact = NULL;
+  g_autoptr (GString) impact_str = g_string_new (NULL);
+
+  impact = gs_apk_index_get_removal_impact (self->provides_index, names);
+  for (guint i = 0; i < impact->len; i++)
+    {
+      GsApkIndexPackage *package = g_ptr_array_index (impact, i);
+
+      if (i > 0)
+        g_string_append_c (impact_str, ' ');
+      g_string_append (impact_str, package->name);
+    }
+
+  /* GsApp refuses to overwrite metadata */
+  gs_app_set_metadata (app, "apk::removal-impact", NULL);
+  if (impact->len > 0)
+    {
+      g_debug ("Removing %s also needs removing %s",
+               gs_app_get_unique_id (app), impact_str->str);
+      gs_app_set_metadata (app, "apk::removal-impact", impact_str->str);
+    }
+}
+
 /**
  * gs_plugin_apk_get_source:
  * @app: The GsApp
@@ -158,7 +379,7 @@ apk_package_to_app (GsPlugin *plugin, ApkdPackage *pkg)
  * Convenience function that verifies that the app only has a single source.
  * Returns the corresponding source if successful or NULL if failed.
  */
-static gchar *
+static const gchar *
 gs_plugin_apk_get_source (GsApp *app, GError **error)
 {
   GPtrArray *sources = gs_app_get_sources (app);
@@ -169,7 +390,289 @@ gs_plugin_apk_get_source (GsApp *app, GError **error)
                    gs_app_get_unique_id (app), sources->len);
       return NULL;
     }
-  return g_strdup (g_ptr_array_index (sources, 0));
+  return g_ptr_array_index (sources, 0);
+}
+
+static guint64
+fnv1a_update (guint64 hash, gconstpointer data, gsize len)
+{
+  const guchar *p = data;
+
+  for (gsize i = 0; i < len; i++)
+    {
+      hash ^= p[i];
+      hash *= 1099511628211ULL;
+    }
+  return hash;
+}
+
+/**
+ * fingerprint_file:
+ * @path: The file to stat
+ *
+ * Hashes the identity of a file (path, inode, size and modification time)
+ * without reading its contents.
+ *
+ * Returns: the hash, or 0 if the file does not exist.
+ **/
+static guint64
+fingerprint_file (const gchar *path)
+{
+  GStatBuf st;
+  guint64 hash = 14695981039346656037ULL;
+  guint64 fields[3];
+
+  if (g_stat (path, &st) != 0)
+    return 0;
+
+  fields[0] = st.st_ino;
+  fields[1] = st.st_size;
+  fields[2] = st.st_mtime;
+  hash = fnv1a_update (hash, path, strlen (path));
+  return fnv1a_update (hash, fields, sizeof (fields));
+}
+
+/**
+ * gs_plugin_apk_get_fingerprint:
+ * @self: The apk plugin
+ *
+ * Computes a cheap fingerprint of the apk database: the installed database,
+ * the world file, the repositories file and all cached repository indexes.
+ * Any transaction or repository refresh changes at least one of them, so
+ * data derived from the daemon stays valid as long as the fingerprint does.
+ *
+ * Returns: the fingerprint, or 0 if there is no apk database at all.
+ **/
+static guint64
+gs_plugin_apk_get_fingerprint (GsPluginApk *self)
+{
+  const gchar *files[] = { "lib/apk/db/installed", "etc/apk/world", "etc/apk/repositories", NULL };
+  const gchar *cache_dirs[] = { "etc/apk/cache", "var/cache/apk", NULL };
+  guint64 fingerprint = 0;
+
+  for (guint i = 0; files[i] != NULL; i++)
+    {
+      g_autofree gchar *path = g_build_filename (self->root, files[i], NULL);
+      guint64 file_fingerprint = fingerprint_file (path);
+
+      /* Only the installed database is mandatory */
+      if (i == 0 && file_fingerprint == 0)
+        return 0;
+      fingerprint = fingerprint * 31 + file_fingerprint;
+    }
+
+  for (guint i = 0; cache_dirs[i] != NULL; i++)
+    {
+      g_autofree gchar *dir_path = g_build_filename (self->root, cache_dirs[i], NULL);
+      g_autoptr (GDir) dir = g_dir_open (dir_path, 0, NULL);
+      const gchar *name;
+
+      if (dir == NULL)
+        continue;
+
+      /* XOR keeps the result independent of the directory order */
+      while ((name = g_dir_read_name (dir)) != NULL)
+        {
+          g_autofree gchar *path = NULL;
+          if (!g_str_has_prefix (name, "APKINDEX."))
+            continue;
+          path = g_build_filename (dir_path, name, NULL);
+          fingerprint ^= fingerprint_file (path);
+        }
+    }
+
+  return fingerprint != 0 ? fingerprint : 1;
+}
+
+/**
+ * gs_plugin_apk_track_database:
+ * @self: The apk plugin
+ *
+ * Records the state of the database after a change of our own, which our
+ * caches already account for, so that a later daemon restart doesn't
+ * mistake it for a change behind our back and flush them.
+ **/
+static void
+gs_plugin_apk_track_database (GsPluginApk *self)
+{
+  self->daemon_fingerprint = gs_plugin_apk_get_fingerprint (self);
+}
+
+/**
+ * gs_plugin_apk_load_snapshot:
+ * @self: The apk plugin
+ *
+ * Loads the upgradable set persisted by a previous session, so the updates
+ * list can be served before the daemon has answered.
+ **/
+static void
+gs_plugin_apk_load_snapshot (GsPluginApk *self)
+{
+  g_autoptr (GMappedFile) file = NULL;
+  g_autoptr (GBytes) bytes = NULL;
+  g_autoptr (GVariant) snapshot = NULL;
+  g_autoptr (GVariant) upgradable = NULL;
+  guint32 version;
+  guint64 fingerprint;
+
+  if (self->snapshot_path == NULL)
+    return;
+
+  file = g_mapped_file_new (self->snapshot_path, FALSE, NULL);
+  if (file == NULL)
+    return;
+
+  bytes = g_mapped_file_get_bytes (file);
+  snapshot = g_variant_ref_sink (g_variant_new_from_bytes (G_VARIANT_TYPE (GS_PLUGIN_APK_SNAPSHOT_TYPE),
+                                                           bytes, FALSE));
+  g_variant_get (snapshot, "(ut@aa{sv})", &version, &fingerprint, &upgradable);
+  if (version != GS_PLUGIN_APK_SNAPSHOT_VERSION)
+    {
+      g_debug ("Ignoring upgradable snapshot with version %u", version);
+      return;
+    }
+
+  g_debug ("Loaded snapshot with %" G_GSIZE_FORMAT " upgradable packages",
+           g_variant_n_children (upgradable));
+  g_clear_pointer (&self->upgradable, g_variant_unref);
+  self->upgradable = g_steal_pointer (&upgradable);
+  self->upgradable_fingerprint = fingerprint;
+}
+
+/**
+ * gs_plugin_apk_save_snapshot:
+ * @self: The apk plugin
+ *
+ * Persists the current upgradable set together with its fingerprint.
+ **/
+static void
+gs_plugin_apk_save_snapshot (GsPluginApk *self)
+{
+  g_autoptr (GVariant) snapshot = NULL;
+  g_autoptr (GError) local_error = NULL;
+
+  if (self->snapshot_path == NULL || self->upgradable == NULL)
+    return;
+
+  snapshot = g_variant_ref_sink (g_variant_new ("(ut@aa{sv})",
+                                                GS_PLUGIN_APK_SNAPSHOT_VERSION,
+                                                self->upgradable_fingerprint,
+                                                self->upgradable));
+  if (!g_file_set_contents (self->snapshot_path,
+                            g_variant_get_data (snapshot),
+                            g_variant_get_size (snapshot),
+                            &local_error))
+    g_warning ("Failed to save upgradable snapshot: %s", local_error->message);
+}
+
+/**
+ * gs_plugin_apk_set_upgradable:
+ * @self: The apk plugin
+ * @packages: The `aa{sv}` returned by ListUpgradablePackages
+ * @fingerprint: The fingerprint of the database @packages was computed from
+ *
+ * Keeps only the packages that can actually be updated and stores them as
+ * the current upgradable set, persisting it for the next session.
+ *
+ * Returns: %TRUE if the set differs from the previous one
+ **/
+static gboolean
+gs_plugin_apk_set_upgradable (GsPluginApk *self,
+                              GVariant *packages,
+                              guint64 fingerprint)
+{
+  g_autoptr (GVariant) upgradable = NULL;
+  GVariantBuilder builder;
+  gboolean changed;
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("aa{sv}"));
+  for (gsize i = 0; i < g_variant_n_children (packages); i++)
+    {
+      g_autoptr (GVariant) dict = g_variant_get_child_value (packages, i);
+      guint32 state = Available;
+
+      g_variant_lookup (dict, "package_state", "u", &state);
+      if (state == Upgradable || state == Downgradable)
+        g_variant_builder_add_value (&builder, dict);
+    }
+  upgradable = g_variant_ref_sink (g_variant_builder_end (&builder));
+
+  changed = self->upgradable == NULL || !g_variant_equal (self->upgradable, upgradable);
+  g_clear_pointer (&self->upgradable, g_variant_unref);
+  self->upgradable = g_steal_pointer (&upgradable);
+  self->upgradable_fingerprint = fingerprint;
+  self->upgradable_stale = FALSE;
+  gs_plugin_apk_save_snapshot (self);
+  /* The daemon answered for this database, there is nothing to flush if
+   * it restarts without it changing */
+  if (fingerprint != 0)
+    self->daemon_fingerprint = fingerprint;
+
+  return changed;
+}
+
+/**
+ * gs_plugin_apk_invalidate_not_found:
+ * @self: The apk plugin
+ *
+ * Forgets which packages could not be found. Must be called whenever the
+ * set of available packages changes, i.e. when repositories change.
+ **/
+static void
+gs_plugin_apk_invalidate_not_found (GsPluginApk *self)
+{
+  g_debug ("Invalidating %u not found packages, %" G_GUINT64_FORMAT " lookups were saved",
+           g_hash_table_size (self->not_found), self->not_found_skipped);
+  g_hash_table_remove_all (self->not_found);
+}
+
+/**
+ * gs_plugin_apk_invalidate_upgradable:
+ * @self: The apk plugin
+ *
+ * Marks the upgradable set as stale after an operation that may change it,
+ * so that the next query is answered by the daemon. The set itself is kept
+ * to tell whether the new one actually differs.
+ **/
+static void
+gs_plugin_apk_invalidate_upgradable (GsPluginApk *self)
+{
+  self->upgradable_stale = TRUE;
+  self->upgradable_fingerprint = 0;
+}
+
+static void gs_plugin_apk_reconcile_upgradable (GsPluginApk *self,
+                                                guint64 fingerprint);
+
+static gboolean
+gs_plugin_apk_updates_changed_cb (gpointer user_data)
+{
+  GsPluginApk *self = GS_PLUGIN_APK (user_data);
+
+  self->updates_changed_id = 0;
+  gs_plugin_apk_reconcile_upgradable (self, gs_plugin_apk_get_fingerprint (self));
+
+  return G_SOURCE_REMOVE;
+}
+
+/**
+ * gs_plugin_apk_queue_updates_changed:
+ * @self: The apk plugin
+ *
+ * To be called instead of gs_plugin_updates_changed() after an operation
+ * that may have changed the upgradable set. Once no further operation came
+ * in for GS_PLUGIN_APK_UPDATES_CHANGED_DELAY_MS, the set is fetched again
+ * and updates-changed is only emitted if it differs from the last one, which
+ * spares gnome-software a full reload of the updates when nothing changed.
+ **/
+static void
+gs_plugin_apk_queue_updates_changed (GsPluginApk *self)
+{
+  gs_plugin_apk_invalidate_upgradable (self);
+  g_clear_handle_id (&self->updates_changed_id, g_source_remove);
+  self->updates_changed_id = g_timeout_add (GS_PLUGIN_APK_UPDATES_CHANGED_DELAY_MS,
+                                            gs_plugin_apk_updates_changed_cb,
+                                            self);
 }
 
 static void
@@ -182,6 +685,33 @@ gs_plugin_apk_init (GsPluginApk *self)
   /* We want to get packages from appstream and refine them */
   gs_plugin_add_rule (plugin, GS_PLUGIN_RULE_RUN_AFTER, "appstream");
   self->proxy = NULL;
+  self->metrics = gs_apk_metrics_new ();
+  g_queue_init (&self->bulk_queue);
+  self->not_found = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  self->update_details = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                                (GDestroyNotify) apk_update_details_free);
+  self->appstream = gs_apk_appstream_new ();
+  self->index_waiters = g_ptr_array_new_with_free_func (g_object_unref);
+  self->index_next_waiters = g_ptr_array_new_with_free_func (g_object_unref);
+
+  /* Allow tests to point us to a fake apk database */
+  if (g_getenv ("GS_SELF_TEST_APK_ROOT") != NULL)
+    self->root = g_strdup (g_getenv ("GS_SELF_TEST_APK_ROOT"));
+  else
+    self->root = g_strdup ("/");
+  self->refresh_scheduler = gs_apk_refresh_scheduler_new (self->root);
+}
+
+static gboolean
+gs_plugin_apk_export_metrics_cb (gpointer user_data)
+{
+  GsPluginApk *self = user_data;
+  g_autoptr (GError) local_error = NULL;
+
+  if (!gs_apk_metrics_write_textfile (self->metrics, self->metrics_path, &local_error))
+    g_debug ("Failed to export metrics: %s", local_error->message);
+
+  return G_SOURCE_CONTINUE;
 }
 
 static void
@@ -189,11 +719,166 @@ gs_plugin_apk_dispose (GObject *object)
 {
   GsPluginApk *self = GS_PLUGIN_APK (object);
 
+  if (self->metrics != NULL)
+    {
+      g_clear_handle_id (&self->metrics_timeout_id, g_source_remove);
+      if (self->metrics_path != NULL)
+        gs_plugin_apk_export_metrics_cb (self);
+      gs_apk_metrics_log (self->metrics);
+    }
+  g_clear_handle_id (&self->updates_changed_id, g_source_remove);
+  if (self->memory_monitor != NULL)
+    g_signal_handlers_disconnect_by_data (self->memory_monitor, self);
+  g_clear_object (&self->memory_monitor);
+  g_clear_pointer (&self->call_monitor, gs_apk_call_monitor_free);
+  g_clear_pointer (&self->metrics, gs_apk_metrics_unref);
+  g_clear_pointer (&self->metrics_path, g_free);
+  if (self->proxy != NULL)
+    g_signal_handlers_disconnect_by_data (self->proxy, self);
   g_clear_object (&self->proxy);
+  g_clear_pointer (&self->upgradable, g_variant_unref);
+  g_clear_pointer (&self->update_details, g_hash_table_unref);
+  g_clear_pointer (&self->not_found, g_hash_table_unref);
+  g_clear_pointer (&self->provides_index, gs_apk_index_unref);
+  g_clear_pointer (&self->index_waiters, g_ptr_array_unref);
+  g_clear_pointer (&self->index_next_waiters, g_ptr_array_unref);
+  g_clear_pointer (&self->appstream, gs_apk_appstream_free);
+  g_clear_pointer (&self->refresh_scheduler, gs_apk_refresh_scheduler_free);
+  g_clear_pointer (&self->snapshot_path, g_free);
+  g_clear_pointer (&self->root, g_free);
 
   G_OBJECT_CLASS (gs_plugin_apk_parent_class)->dispose (object);
 }
 
+static guint
+budget_from_env (const gchar *name, guint default_ms)
+{
+  const gchar *value = g_getenv (name);
+  guint64 budget_ms;
+
+  if (value == NULL || !g_ascii_string_to_unsigned (value, 10, 0, G_MAXUINT, &budget_ms, NULL))
+    return default_ms;
+  return budget_ms;
+}
+
+static void
+gs_plugin_apk_log_state (gpointer user_data)
+{
+  GsPluginApk *self = user_data;
+
+  g_message ("Plugin state: %u interactive and %u bulk details requests in flight, "
+             "%u bulk chunks queued, reconcile %s, %u cached update details, "
+             "%u packages known missing",
+             self->n_interactive_in_flight, self->bulk_in_flight ? 1 : 0,
+             g_queue_get_length (&self->bulk_queue),
+             self->reconcile_in_flight ? "running" : "idle",
+             g_hash_table_size (self->update_details),
+             g_hash_table_size (self->not_found));
+}
+
+/**
+ * gs_plugin_apk_setup_watchdog:
+ * @self: The apk plugin
+ *
+ * The proxy never times out, as transactions can legitimately take very
+ * long, so a hung daemon would go unnoticed. Warn about reads pending for
+ * longer than GS_PLUGIN_APK_WATCHDOG_READ_MS and transactions pending for
+ * longer than GS_PLUGIN_APK_WATCHDOG_TRANSACTION_MS (0 disables either).
+ * With GS_PLUGIN_APK_WATCHDOG_SNAPSHOT set, the pending calls and our own
+ * queues are logged along with the warning.
+ **/
+static void
+gs_plugin_apk_setup_watchdog (GsPluginApk *self)
+{
+  gs_apk_call_monitor_set_watchdog (self->call_monitor,
+                                    budget_from_env ("GS_PLUGIN_APK_WATCHDOG_READ_MS",
+                                                     GS_PLUGIN_APK_READ_BUDGET_MS),
+                                    budget_from_env ("GS_PLUGIN_APK_WATCHDOG_TRANSACTION_MS",
+                                                     GS_PLUGIN_APK_TRANSACTION_BUDGET_MS),
+                                    g_getenv ("GS_PLUGIN_APK_WATCHDOG_SNAPSHOT") != NULL ? gs_plugin_apk_log_state : NULL,
+                                    self);
+}
+
+/**
+ * gs_plugin_apk_name_owner_cb:
+ *
+ * apk-polkit-rs is bus activated and exits when idle, and it might crash.
+ * The proxy follows the name to the next instance on its own, and reads
+ * that were in flight are sent again by gs_plugin_apk_call_read_async().
+ * Our cached data only has to go if the apk database changed in the
+ * meantime, e.g. because a transaction was cut short or apk was run by
+ * hand, so a plain restart does not cost a full refine.
+ **/
+static void
+gs_plugin_apk_name_owner_cb (GObject *object,
+                             GParamSpec *pspec,
+                             gpointer user_data)
+{
+  GsPluginApk *self = GS_PLUGIN_APK (user_data);
+  g_autofree gchar *name_owner = g_dbus_proxy_get_name_owner (G_DBUS_PROXY (self->proxy));
+  guint64 fingerprint;
+
+  if (name_owner == NULL)
+    {
+      g_debug ("Daemon exited");
+      return;
+    }
+
+  fingerprint = gs_plugin_apk_get_fingerprint (self);
+  if (fingerprint != 0 && fingerprint == self->daemon_fingerprint)
+    {
+      g_debug ("Daemon started as %s, database unchanged", name_owner);
+      return;
+    }
+
+  g_debug ("Daemon started as %s, database changed, flushing caches", name_owner);
+  self->daemon_fingerprint = fingerprint;
+  gs_plugin_cache_invalidate (GS_PLUGIN (self));
+  gs_plugin_apk_invalidate_not_found (self);
+  gs_plugin_apk_queue_updates_changed (self);
+}
+
+/**
+ * gs_plugin_apk_low_memory_warning_cb:
+ *
+ * Sheds the caches that can be rebuilt, more of them the more pressing the
+ * warning is. Each of them is rebuilt on next use, the what-provides index
+ * only once it is queried or the metadata is refreshed:
+ *  - low: the update details and the XML of the generated AppStream
+ *    components
+ *  - medium: also the what-provides index, the largest of them
+ *  - critical: also the GsApps gnome-software cached for us
+ * Names known to be missing and the upgradable set are kept, they are
+ * small and dropping them costs daemon calls.
+ **/
+static void
+gs_plugin_apk_low_memory_warning_cb (GMemoryMonitor *monitor,
+                                     GMemoryMonitorWarningLevel level,
+                                     gpointer user_data)
+{
+  GsPluginApk *self = GS_PLUGIN_APK (user_data);
+
+  g_debug ("Low memory warning at level %u, shedding caches", (guint) level);
+
+  g_hash_table_remove_all (self->update_details);
+  /* The versions are kept, so an unchanged collection is not rewritten */
+  if (self->appstream_in_flight)
+    self->appstream_shed_pending = TRUE;
+  else
+    gs_apk_appstream_shed (self->appstream);
+
+  if (level >= G_MEMORY_MONITOR_WARNING_LEVEL_MEDIUM)
+    {
+      g_clear_pointer (&self->provides_index, gs_apk_index_unref);
+      self->provides_index_fingerprint = 0;
+      /* Rebuilding it right away would only bring the pressure back */
+      self->index_prefetch_suppressed = TRUE;
+    }
+
+  if (level >= G_MEMORY_MONITOR_WARNING_LEVEL_CRITICAL)
+    gs_plugin_cache_invalidate (GS_PLUGIN (self));
+}
+
 static gboolean
 gs_plugin_apk_setup_finish (GsPlugin *plugin,
                             GAsyncResult *result,
@@ -213,13 +898,28 @@ gs_plugin_apk_setup_async (GsPlugin *plugin,
                            GAsyncReadyCallback callback,
                            gpointer user_data)
 {
+  GsPluginApk *self = GS_PLUGIN_APK (plugin);
   g_autoptr (GTask) task = NULL;
+  g_autoptr (GError) local_error = NULL;
 
   task = g_task_new (plugin, cancellable, callback, user_data);
   g_task_set_source_tag (task, gs_plugin_apk_setup_async);
 
   g_debug ("APK plugin version: %s", GS_PLUGIN_APK_VERSION);
 
+  self->snapshot_path = gs_utils_get_cache_filename ("apk", "upgradable.gvariant",
+                                                     GS_UTILS_CACHE_FLAG_WRITEABLE |
+                                                         GS_UTILS_CACHE_FLAG_CREATE_DIRECTORY,
+                                                     &local_error);
+  if (self->snapshot_path == NULL)
+    g_warning ("Upgradable snapshot disabled: %s", local_error->message);
+  gs_plugin_apk_load_snapshot (self);
+
+  self->memory_monitor = g_memory_monitor_dup_default ();
+  if (self->memory_monitor != NULL)
+    g_signal_connect (self->memory_monitor, "low-memory-warning",
+                      G_CALLBACK (gs_plugin_apk_low_memory_warning_cb), self);
+
   apk_polkit2_proxy_new (gs_plugin_get_system_bus_connection (plugin),
                          G_DBUS_PROXY_FLAGS_NONE,
                          "dev.Cogitri.apkPolkit2",
@@ -237,6 +937,7 @@ apk_polkit_proxy_setup_cb (GObject *source_object,
   g_autoptr (GTask) task = g_steal_pointer (&user_data);
   GsPluginApk *self = g_task_get_source_object (task);
   g_autoptr (GError) local_error = NULL;
+  const gchar *record_path;
 
   self->proxy = apk_polkit2_proxy_new_for_bus_finish (result, &local_error);
   if (local_error != NULL)
@@ -249,6 +950,39 @@ apk_polkit_proxy_setup_cb (GObject *source_object,
   /* Live update operations can take very, very long */
   g_dbus_proxy_set_default_timeout (G_DBUS_PROXY (self->proxy), G_MAXINT);
 
+  gs_plugin_apk_track_database (self);
+  g_signal_connect (self->proxy, "notify::g-name-owner",
+                    G_CALLBACK (gs_plugin_apk_name_owner_cb), self);
+
+  self->call_monitor = gs_apk_call_monitor_new (g_dbus_proxy_get_connection (G_DBUS_PROXY (self->proxy)),
+                                                "dev.Cogitri.apkPolkit2");
+  gs_apk_call_monitor_set_metrics (self->call_monitor, self->metrics);
+  gs_plugin_apk_setup_watchdog (self);
+
+  /* Periodically export the metrics for a Prometheus textfile collector */
+  self->metrics_path = g_strdup (g_getenv ("GS_PLUGIN_APK_METRICS_FILE"));
+  if (self->metrics_path != NULL)
+    self->metrics_timeout_id = g_timeout_add_seconds (GS_PLUGIN_APK_METRICS_INTERVAL,
+                                                      gs_plugin_apk_export_metrics_cb,
+                                                      self);
+  /* Capture the daemon traffic of this device, for replaying it with
+   * tests/apk-mock-daemon --replay */
+  record_path = g_getenv ("GS_PLUGIN_APK_RECORD");
+  if (record_path != NULL)
+    {
+      if (gs_apk_call_monitor_start_recording (self->call_monitor, record_path, &local_error))
+        {
+          /* The package table memfd can't be recorded, stick to variants */
+          self->table_unsupported = TRUE;
+          g_debug ("Recording daemon calls to %s", record_path);
+        }
+      else
+        {
+          g_warning ("%s", local_error->message);
+          g_clear_error (&local_error);
+        }
+    }
+
   g_task_return_boolean (task, TRUE);
 }
 
@@ -264,6 +998,8 @@ static void apk_polkit_update_repositories_cb (GObject *source_object,
                                                GAsyncResult *res,
                                                gpointer user_data);
 
+static void gs_plugin_apk_update_appstream (GsPluginApk *self);
+
 static void
 gs_plugin_apk_refresh_metadata_async (GsPlugin *plugin,
                                       guint64 cache_age_secs,
@@ -275,10 +1011,21 @@ gs_plugin_apk_refresh_metadata_async (GsPlugin *plugin,
   GsPluginApk *self = GS_PLUGIN_APK (plugin);
   g_autoptr (GTask) task = NULL;
   g_autoptr (GError) local_error = NULL;
+  gboolean interactive = (flags & GS_PLUGIN_REFRESH_METADATA_FLAGS_INTERACTIVE) != 0;
+  const gchar *reason;
 
   task = g_task_new (plugin, cancellable, callback, user_data);
   g_task_set_source_tag (task, gs_plugin_apk_refresh_metadata_async);
 
+  /* Not refreshing is not an error, gnome-software asks again later */
+  if (!gs_apk_refresh_scheduler_should_refresh (self->refresh_scheduler, cache_age_secs,
+                                                interactive, &reason))
+    {
+      g_debug ("Not refreshing repositories: %s", reason);
+      g_task_return_boolean (task, TRUE);
+      return;
+    }
+
   g_debug ("Refreshing repositories");
 
   gs_plugin_status_update (plugin, NULL, GS_PLUGIN_STATUS_DOWNLOADING);
@@ -298,14 +1045,30 @@ apk_polkit_update_repositories_cb (GObject *source_object,
 
   if (!apk_polkit2_call_update_repositories_finish (self->proxy, res, &local_error))
     {
+      gs_apk_refresh_scheduler_report (self->refresh_scheduler, FALSE);
       g_task_return_error (task, g_steal_pointer (&local_error));
       return;
     }
 
-  gs_plugin_updates_changed (GS_PLUGIN (self));
+  gs_apk_refresh_scheduler_report (self->refresh_scheduler, TRUE);
+  gs_plugin_apk_track_database (self);
+  gs_plugin_apk_invalidate_not_found (self);
+  gs_plugin_apk_queue_updates_changed (self);
+  self->index_prefetch_suppressed = FALSE;
+  gs_plugin_apk_update_appstream (self);
   g_task_return_boolean (task, TRUE);
 }
 
+static void gs_plugin_apk_ensure_index_async (GsPluginApk *self,
+                                              GCancellable *cancellable,
+                                              GAsyncReadyCallback callback,
+                                              gpointer user_data);
+static GsApkIndex *gs_plugin_apk_ensure_index_finish (GsPluginApk *self,
+                                                      GAsyncResult *res,
+                                                      GError **error);
+static GsApkIndex *gs_plugin_apk_peek_index (GsPluginApk *self,
+                                             gboolean allow_stale);
+
 static gboolean
 gs_plugin_apk_install_apps_finish (GsPlugin *plugin,
                                    GAsyncResult *result,
@@ -319,15 +1082,94 @@ apk_polkit_add_packages_cb (GObject *object_source,
                             GAsyncResult *res,
                             gpointer user_data);
 
-static void
-gs_plugin_apk_install_apps_async (GsPlugin *plugin,
-                                  GsAppList *list,
-                                  GsPluginInstallAppsFlags flags,
-                                  GsPluginProgressCallback progress_callback,
-                                  gpointer progress_user_data,
-                                  GsPluginAppNeedsUserActionCallback app_needs_user_action_callback,
-                                  gpointer app_needs_user_action_data,
-                                  GCancellable *cancellable,
+/**
+ * gs_plugin_apk_get_lang_suffixes:
+ *
+ * Alpine ships the translations of a package in `foo-lang`, and a few
+ * large packages split them further into `foo-lang-de` or `foo-lang-pt_br`.
+ *
+ * Returns: (transfer full): the suffixes of the translation subpackages
+ * matching the session's locales, empty if it only uses the C locale.
+ **/
+static GPtrArray *
+gs_plugin_apk_get_lang_suffixes (void)
+{
+  const gchar *const *language_names = g_get_language_names ();
+  GPtrArray *suffixes = g_ptr_array_new_with_free_func (g_free);
+
+  for (guint i = 0; language_names[i] != NULL; i++)
+    {
+      g_autofree gchar *locale = NULL;
+      g_autofree gchar *suffix = NULL;
+
+      /* Skip variants with a codeset or modifier, the plain ones follow */
+      if (strpbrk (language_names[i], ".@") != NULL ||
+          g_str_equal (language_names[i], "C") ||
+          g_str_equal (language_names[i], "POSIX"))
+        continue;
+
+      locale = g_ascii_strdown (language_names[i], -1);
+      suffix = g_strconcat ("-lang-", locale, NULL);
+      if (!g_ptr_array_find_with_equal_func (suffixes, suffix, g_str_equal, NULL))
+        g_ptr_array_add (suffixes, g_steal_pointer (&suffix));
+    }
+  if (suffixes->len > 0)
+    g_ptr_array_insert (suffixes, 0, g_strdup ("-lang"));
+
+  return suffixes;
+}
+
+/**
+ * gs_plugin_apk_add_lang_packages:
+ * @self: The apk plugin
+ * @apk_index: The index to look the subpackages up in
+ * @add_list: The apps to install
+ *
+ * Adds the translation subpackages of the apps in @add_list for the
+ * session's locales, so they are installed in the same transaction.
+ **/
+static void
+gs_plugin_apk_add_lang_packages (GsPluginApk *self, GsApkIndex *apk_index, GsAppList *add_list)
+{
+  g_autoptr (GPtrArray) suffixes = gs_plugin_apk_get_lang_suffixes ();
+  guint n_apps = gs_app_list_length (add_list);
+
+  for (guint i = 0; i < n_apps; i++)
+    {
+      GsApp *app = gs_app_list_index (add_list, i);
+      const gchar *source = gs_app_get_source_default (app);
+      GsApkIndexPackage *main_package = gs_apk_index_get_package (apk_index, source);
+
+      if (main_package == NULL)
+        continue;
+
+      for (guint j = 0; j < suffixes->len; j++)
+        {
+          g_autofree gchar *name = g_strconcat (source, g_ptr_array_index (suffixes, j), NULL);
+          GsApkIndexPackage *package = gs_apk_index_get_package (apk_index, name);
+          g_autoptr (GsApp) lang_app = NULL;
+
+          if (package == NULL || package->installed ||
+              g_strcmp0 (package->origin, main_package->origin) != 0)
+            continue;
+
+          g_debug ("Adding %s to the installation of %s", name, source);
+          lang_app = index_package_to_app (GS_PLUGIN (self), package, TRUE);
+          gs_app_set_state (lang_app, GS_APP_STATE_INSTALLING);
+          gs_app_list_add (add_list, lang_app);
+        }
+    }
+}
+
+static void
+gs_plugin_apk_install_apps_async (GsPlugin *plugin,
+                                  GsAppList *list,
+                                  GsPluginInstallAppsFlags flags,
+                                  GsPluginProgressCallback progress_callback,
+                                  gpointer progress_user_data,
+                                  GsPluginAppNeedsUserActionCallback app_needs_user_action_callback,
+                                  gpointer app_needs_user_action_data,
+                                  GCancellable *cancellable,
                                   GAsyncReadyCallback callback,
                                   gpointer user_data)
 {
@@ -337,6 +1179,8 @@ gs_plugin_apk_install_apps_async (GsPlugin *plugin,
   g_autoptr (GError) local_error = NULL;
   g_autoptr (GsAppList) add_list = gs_app_list_new ();
   g_autofree const gchar **source_array = NULL;
+  GsApkIndex *apk_index;
+  gint64 trace_begin = GS_APK_TRACE_NOW ();
 
   task = g_task_new (plugin, cancellable, callback, user_data);
   g_task_set_source_tag (task, gs_plugin_apk_install_apps_async);
@@ -371,21 +1215,34 @@ gs_plugin_apk_install_apps_async (GsPlugin *plugin,
       gs_app_set_state (app, GS_APP_STATE_INSTALLING);
     }
 
-  source_array = g_new0 (const gchar *, gs_app_list_length (add_list) + 1);
   for (int i = 0; i < gs_app_list_length (add_list); i++)
     {
       GsApp *app = gs_app_list_index (add_list, i);
-      g_autofree gchar *source = gs_plugin_apk_get_source (app, &local_error);
-      if (source == NULL)
+      if (gs_plugin_apk_get_source (app, &local_error) == NULL)
         {
           g_task_return_error (task, g_steal_pointer (&local_error));
           return;
         }
-      source_array[i] = gs_app_get_source_default (app);
     }
 
+  /* Translations are nice to have, don't hold up the installation for an
+   * index rebuild. A stale index may offer subpackages of repositories no
+   * longer configured, which would fail the whole transaction, so they
+   * are skipped until the index is rebuilt */
+  apk_index = gs_plugin_apk_peek_index (self, FALSE);
+  if (apk_index != NULL)
+    gs_plugin_apk_add_lang_packages (self, apk_index, add_list);
+  else
+    g_debug ("Package index not up to date, not adding translations");
+  GS_APK_TRACE_MARK (install_prepare, trace_begin, gs_app_list_length (add_list));
+
+  source_array = g_new0 (const gchar *, gs_app_list_length (add_list) + 1);
+  for (int i = 0; i < gs_app_list_length (add_list); i++)
+    source_array[i] = gs_app_get_source_default (gs_app_list_index (add_list, i));
+
   g_task_set_task_data (task, g_steal_pointer (&add_list), g_object_unref);
-  apk_polkit2_call_add_packages (self->proxy, source_array, cancellable,
+  apk_polkit2_call_add_packages (self->proxy, source_array,
+                                 cancellable,
                                  apk_polkit_add_packages_cb,
                                  g_steal_pointer (&task));
 }
@@ -399,6 +1256,7 @@ apk_polkit_add_packages_cb (GObject *object_source,
   GsPluginApk *self = g_task_get_source_object (task);
   GsAppList *add_list = g_task_get_task_data (task);
   g_autoptr (GError) local_error = NULL;
+  gint64 trace_begin;
 
   if (!apk_polkit2_call_add_packages_finish (self->proxy, res, &local_error))
     {
@@ -413,11 +1271,15 @@ apk_polkit_add_packages_cb (GObject *object_source,
       return;
     }
 
+  trace_begin = GS_APK_TRACE_NOW ();
+  gs_plugin_apk_track_database (self);
+  gs_plugin_apk_invalidate_upgradable (self);
   for (int i = 0; i < gs_app_list_length (add_list); i++)
     {
       GsApp *app = gs_app_list_index (add_list, i);
       gs_app_set_state (app, GS_APP_STATE_INSTALLED);
     }
+  GS_APK_TRACE_MARK (install_apply, trace_begin, gs_app_list_length (add_list));
 
   g_task_return_boolean (task, TRUE);
 }
@@ -435,6 +1297,93 @@ apk_polkit_del_packages_cb (GObject *object_source,
                             GAsyncResult *res,
                             gpointer user_data);
 
+/**
+ * gs_plugin_apk_del_lang_packages:
+ * @self: The apk plugin
+ * @apk_index: The index to look the subpackages up in
+ * @del_list: The apps to uninstall
+ *
+ * Adds the installed translation subpackages of the apps in @del_list, see
+ * gs_plugin_apk_add_lang_packages(). Those are in the world as well, so
+ * apk would otherwise keep them after their app is gone.
+ **/
+static void
+gs_plugin_apk_del_lang_packages (GsPluginApk *self, GsApkIndex *apk_index, GsAppList *del_list)
+{
+  g_autoptr (GHashTable) removing = g_hash_table_new (g_str_hash, g_str_equal);
+  GPtrArray *packages = gs_apk_index_get_packages (apk_index);
+
+  for (guint i = 0; i < gs_app_list_length (del_list); i++)
+    {
+      GsApp *app = gs_app_list_index (del_list, i);
+
+      if (!gs_app_has_quirk (app, GS_APP_QUIRK_IS_PROXY))
+        g_hash_table_add (removing, (gpointer) gs_app_get_source_default (app));
+    }
+
+  /* foo-lang and foo-lang-de both belong to foo */
+  for (guint i = 0; i < packages->len; i++)
+    {
+      GsApkIndexPackage *package = g_ptr_array_index (packages, i);
+      const gchar *suffix;
+      g_autofree gchar *main_name = NULL;
+      GsApkIndexPackage *main_package;
+      g_autoptr (GsApp) lang_app = NULL;
+
+      if (!package->installed || g_hash_table_contains (removing, package->name))
+        continue;
+      suffix = g_strrstr (package->name, "-lang");
+      if (suffix == NULL || (suffix[5] != '\0' && (suffix[5] != '-' || strchr (suffix + 6, '-') != NULL)))
+        continue;
+      main_name = g_strndup (package->name, suffix - package->name);
+      main_package = gs_apk_index_get_package (apk_index, main_name);
+      if (main_package == NULL || !g_hash_table_contains (removing, main_package->name) ||
+          g_strcmp0 (package->origin, main_package->origin) != 0)
+        continue;
+
+      g_debug ("Adding %s to the removal of %s", package->name, main_name);
+      lang_app = index_package_to_app (GS_PLUGIN (self), package, TRUE);
+      gs_app_set_state (lang_app, GS_APP_STATE_REMOVING);
+      gs_app_list_add (del_list, lang_app);
+    }
+}
+
+static void
+gs_plugin_apk_uninstall_indexed_cb (GObject *source_object,
+                                    GAsyncResult *res,
+                                    gpointer user_data)
+{
+  g_autoptr (GTask) task = G_TASK (user_data);
+  GsPluginApk *self = g_task_get_source_object (task);
+  GsAppList *del_list = g_task_get_task_data (task);
+  g_autoptr (GsApkIndex) apk_index = NULL;
+  g_autoptr (GError) local_error = NULL;
+  g_autofree const gchar **source_array = NULL;
+  guint n_sources = 0;
+
+  apk_index = gs_plugin_apk_ensure_index_finish (self, res, &local_error);
+  if (apk_index != NULL)
+    gs_plugin_apk_del_lang_packages (self, apk_index, del_list);
+  else if (local_error != NULL)
+    g_debug ("Failed to index packages, not removing translations: %s", local_error->message);
+
+  /* Whether other packages still need these is up to apk, the
+   * apk::removal-impact metadata set on refine is only a preview */
+  source_array = g_new0 (const gchar *, gs_app_list_length (del_list) + 1);
+  for (guint i = 0; i < gs_app_list_length (del_list); i++)
+    {
+      GsApp *app = gs_app_list_index (del_list, i);
+
+      if (!gs_app_has_quirk (app, GS_APP_QUIRK_IS_PROXY))
+        source_array[n_sources++] = gs_app_get_source_default (app);
+    }
+
+  apk_polkit2_call_delete_packages (self->proxy, source_array,
+                                    g_task_get_cancellable (task),
+                                    apk_polkit_del_packages_cb,
+                                    g_steal_pointer (&task));
+}
+
 static void
 gs_plugin_apk_uninstall_apps_async (GsPlugin *plugin,
                                     GsAppList *list,
@@ -451,7 +1400,7 @@ gs_plugin_apk_uninstall_apps_async (GsPlugin *plugin,
   g_autoptr (GTask) task = NULL;
   g_autoptr (GError) local_error = NULL;
   g_autoptr (GsAppList) del_list = gs_app_list_new ();
-  g_autofree const gchar **source_array = NULL;
+  gint64 trace_begin = GS_APK_TRACE_NOW ();
 
   task = g_task_new (plugin, cancellable, callback, user_data);
   g_task_set_source_tag (task, gs_plugin_apk_uninstall_apps_async);
@@ -471,26 +1420,41 @@ gs_plugin_apk_uninstall_apps_async (GsPlugin *plugin,
           continue;
         }
 
+      /* The unused packages, removed in the same transaction */
+      if (gs_app_has_quirk (app, GS_APP_QUIRK_IS_PROXY))
+        {
+          GsAppList *related = gs_app_get_related (app);
+
+          for (guint j = 0; j < gs_app_list_length (related); j++)
+            {
+              GsApp *related_app = gs_app_list_index (related, j);
+              gs_app_list_add (del_list, related_app);
+              gs_app_set_state (related_app, GS_APP_STATE_REMOVING);
+            }
+        }
+
       gs_app_list_add (del_list, app);
       gs_app_set_state (app, GS_APP_STATE_REMOVING);
     }
 
-  source_array = g_new0 (const gchar *, gs_app_list_length (del_list) + 1);
   for (int i = 0; i < gs_app_list_length (del_list); i++)
     {
       GsApp *app = gs_app_list_index (del_list, i);
-      g_autofree gchar *source = gs_plugin_apk_get_source (app, &local_error);
-      if (source == NULL)
+
+      if (!gs_app_has_quirk (app, GS_APP_QUIRK_IS_PROXY) &&
+          gs_plugin_apk_get_source (app, &local_error) == NULL)
         {
           g_task_return_error (task, g_steal_pointer (&local_error));
           return;
         }
-      source_array[i] = gs_app_get_source_default (app);
     }
 
+  GS_APK_TRACE_MARK (uninstall_prepare, trace_begin, gs_app_list_length (del_list));
+  /* The translations installed along with the apps are removed with them,
+   * which needs an up to date index of the installed packages */
   g_task_set_task_data (task, g_steal_pointer (&del_list), g_object_unref);
-  apk_polkit2_call_delete_packages (self->proxy, source_array, cancellable,
-                                    apk_polkit_del_packages_cb,
+  gs_plugin_apk_ensure_index_async (self, cancellable,
+                                    gs_plugin_apk_uninstall_indexed_cb,
                                     g_steal_pointer (&task));
 }
 
@@ -503,6 +1467,7 @@ apk_polkit_del_packages_cb (GObject *object_source,
   GsPluginApk *self = g_task_get_source_object (task);
   GsAppList *del_list = g_task_get_task_data (task);
   g_autoptr (GError) local_error = NULL;
+  gint64 trace_begin;
 
   if (!apk_polkit2_call_add_packages_finish (self->proxy, res, &local_error))
     {
@@ -517,11 +1482,15 @@ apk_polkit_del_packages_cb (GObject *object_source,
       return;
     }
 
+  trace_begin = GS_APK_TRACE_NOW ();
+  gs_plugin_apk_track_database (self);
+  gs_plugin_apk_invalidate_upgradable (self);
   for (int i = 0; i < gs_app_list_length (del_list); i++)
     {
       GsApp *app = gs_app_list_index (del_list, i);
       gs_app_set_state (app, GS_APP_STATE_AVAILABLE);
     }
+  GS_APK_TRACE_MARK (uninstall_apply, trace_begin, gs_app_list_length (del_list));
 
   g_task_return_boolean (task, TRUE);
 }
@@ -602,6 +1571,7 @@ gs_plugin_apk_update_apps_async (GsPlugin *plugin,
   GsAppList *list_installing = gs_app_list_new ();
   unsigned int num_sources;
   g_autofree const gchar **source_array = NULL;
+  gint64 trace_begin = GS_APK_TRACE_NOW ();
 
   g_debug ("Updating apps");
 
@@ -641,6 +1611,7 @@ gs_plugin_apk_update_apps_async (GsPlugin *plugin,
         }
     }
 
+  GS_APK_TRACE_MARK (update_prepare, trace_begin, num_sources);
   g_task_set_task_data (task, g_steal_pointer (&list_installing), g_object_unref);
   apk_polkit2_call_upgrade_packages (self->proxy, source_array, cancellable,
                                      upgrade_apk_packages_cb, g_steal_pointer (&task));
@@ -655,6 +1626,7 @@ upgrade_apk_packages_cb (GObject *object_source,
   GsPluginApk *self = g_task_get_source_object (task);
   GsAppList *list_installing = g_task_get_task_data (task);
   g_autoptr (GError) local_error = NULL;
+  gint64 trace_begin;
 
   if (!apk_polkit2_call_upgrade_packages_finish (self->proxy, res, &local_error))
     {
@@ -679,15 +1651,19 @@ upgrade_apk_packages_cb (GObject *object_source,
       return;
     }
 
+  trace_begin = GS_APK_TRACE_NOW ();
+  gs_plugin_apk_track_database (self);
+  gs_plugin_apk_invalidate_upgradable (self);
   for (int i = 0; i < gs_app_list_length (list_installing); i++)
     {
       GsApp *app = gs_app_list_index (list_installing, i);
       gs_app_set_state (app, GS_APP_STATE_INSTALLED);
     }
+  GS_APK_TRACE_MARK (update_apply, trace_begin, gs_app_list_length (list_installing));
 
   g_debug ("All apps updated correctly");
 
-  gs_plugin_updates_changed (GS_PLUGIN (self));
+  gs_plugin_apk_queue_updates_changed (self);
   g_task_return_boolean (task, TRUE);
 }
 
@@ -734,7 +1710,8 @@ set_app_metadata (GsPlugin *plugin, GsApp *app, ApkdPackage *package)
   if (package->installedSize)
     gs_app_set_size_installed (app, GS_SIZE_TYPE_VALID, package->installedSize);
 
-  if (package->url)
+  /* Setting the URL always copies it, skip that when refining again */
+  if (package->url && g_strcmp0 (gs_app_get_url (app, AS_URL_KIND_HOMEPAGE), package->url) != 0)
     gs_app_set_url (app, AS_URL_KIND_HOMEPAGE, package->url);
 
   if (package->license)
@@ -775,556 +1752,2198 @@ set_app_metadata (GsPlugin *plugin, GsApp *app, ApkdPackage *package)
 
 typedef struct
 {
-  GsAppList *missing_pkgname_list; /* (owned) (nullable) */
-  GsAppList *refine_apps_list;     /* (owned) (not nullable) */
-  GsPluginRefineFlags flags;
-} RefineData;
+  gchar *method;          /* (owned) */
+  GVariant *parameters;   /* (owned) (nullable) */
+  GUnixFDList *fd_list;   /* (owned) (nullable) passed along the reply */
+  guint attempts;
+} ReadCall;
 
 static void
-refine_data_free (RefineData *data)
+read_call_free (ReadCall *call)
 {
-  g_clear_object (&data->missing_pkgname_list);
-  g_clear_object (&data->refine_apps_list);
+  g_free (call->method);
+  g_clear_pointer (&call->parameters, g_variant_unref);
+  g_clear_object (&call->fd_list);
 
-  g_free (data);
+  g_free (call);
 }
 
-G_DEFINE_AUTOPTR_CLEANUP_FUNC (RefineData, refine_data_free);
+/* Errors meaning the daemon went away before replying, the bus starts a
+ * new one for the next call */
+static gboolean
+gs_plugin_apk_daemon_vanished (const GError *error)
+{
+  return g_error_matches (error, G_DBUS_ERROR, G_DBUS_ERROR_NO_REPLY) ||
+         g_error_matches (error, G_DBUS_ERROR, G_DBUS_ERROR_SERVICE_UNKNOWN) ||
+         g_error_matches (error, G_DBUS_ERROR, G_DBUS_ERROR_NAME_HAS_NO_OWNER);
+}
 
 static void
-refine_apk_packages_cb (GObject *object_source,
-                        GAsyncResult *res,
-                        gpointer user_data);
+apk_polkit_read_cb (GObject *object_source,
+                    GAsyncResult *res,
+                    gpointer user_data);
 
 static void
-fix_app_missing_appstream_async (GsPlugin *plugin,
-                                 GsAppList *list,
-                                 GCancellable *cancellable,
-                                 GAsyncReadyCallback callback,
-                                 gpointer user_data);
-
-static gboolean
-gs_plugin_apk_refine_finish (GsPlugin *plugin,
-                             GAsyncResult *result,
-                             GError **error)
+gs_plugin_apk_send_read (GTask *task)
 {
-  return g_task_propagate_boolean (G_TASK (result), error);
+  GsPluginApk *self = g_task_get_source_object (task);
+  ReadCall *call = g_task_get_task_data (task);
+
+  g_dbus_proxy_call_with_unix_fd_list (G_DBUS_PROXY (self->proxy),
+                                       call->method,
+                                       call->parameters,
+                                       G_DBUS_CALL_FLAGS_NONE,
+                                       -1,
+                                       NULL,
+                                       g_task_get_cancellable (task),
+                                       apk_polkit_read_cb,
+                                       task);
 }
 
+/**
+ * gs_plugin_apk_call_read_async:
+ * @self: The apk plugin
+ * @method: The daemon method to call
+ * @parameters: (nullable): The parameters of @method, consumed if floating
+ * @cancellable: A GCancellable
+ * @callback: Function to call when done
+ * @user_data: Data for @callback
+ *
+ * Calls a daemon method that doesn't change anything. Such calls are safe
+ * to send again, which is done up to GS_PLUGIN_APK_READ_RETRIES times if
+ * the daemon exits or crashes before replying. Transactions must never go
+ * through here.
+ **/
 static void
-gs_plugin_apk_refine_async (GsPlugin *plugin,
-                            GsAppList *list,
-                            GsPluginRefineFlags flags,
-                            GCancellable *cancellable,
-                            GAsyncReadyCallback callback,
-                            gpointer user_data)
+gs_plugin_apk_call_read_async (GsPluginApk *self,
+                               const gchar *method,
+                               GVariant *parameters,
+                               GCancellable *cancellable,
+                               GAsyncReadyCallback callback,
+                               gpointer user_data)
 {
-  g_autoptr (GTask) task = NULL;
-  g_autoptr (GError) local_error = NULL;
-  g_autoptr (GsAppList) missing_pkgname_list = gs_app_list_new ();
-  g_autoptr (GsAppList) refine_apps_list = gs_app_list_new ();
-  RefineData *data = g_new0 (RefineData, 1);
+  GTask *task = g_task_new (self, cancellable, callback, user_data);
+  ReadCall *call = g_new0 (ReadCall, 1);
 
-  data->missing_pkgname_list = g_object_ref (missing_pkgname_list);
-  data->refine_apps_list = g_object_ref (refine_apps_list);
-  data->flags = flags;
+  g_task_set_source_tag (task, gs_plugin_apk_call_read_async);
+  call->method = g_strdup (method);
+  if (parameters != NULL)
+    call->parameters = g_variant_ref_sink (parameters);
+  g_task_set_task_data (task, call, (GDestroyNotify) read_call_free);
 
-  task = g_task_new (plugin, cancellable, callback, user_data);
-  g_task_set_source_tag (task, gs_plugin_apk_refine_async);
-  g_task_set_task_data (task, data, (GDestroyNotify) refine_data_free);
+  gs_plugin_apk_send_read (task);
+}
 
-  g_debug ("Starting refinining process");
+static void
+apk_polkit_read_cb (GObject *object_source,
+                    GAsyncResult *res,
+                    gpointer user_data)
+{
+  g_autoptr (GTask) task = G_TASK (user_data);
+  GsPluginApk *self = g_task_get_source_object (task);
+  ReadCall *call = g_task_get_task_data (task);
+  g_autoptr (GVariant) reply = NULL;
+  g_autoptr (GError) local_error = NULL;
 
-  for (guint i = 0; i < gs_app_list_length (list); i++)
+  reply = g_dbus_proxy_call_with_unix_fd_list_finish (G_DBUS_PROXY (self->proxy),
+                                                      &call->fd_list, res, &local_error);
+  if (reply == NULL)
     {
-      GsApp *app = gs_app_list_index (list, i);
-      GPtrArray *sources;
-      AsBundleKind bundle_kind = gs_app_get_bundle_kind (app);
-
-      if (gs_app_has_quirk (app, GS_APP_QUIRK_IS_WILDCARD) ||
-          gs_app_get_kind (app) == AS_COMPONENT_KIND_REPOSITORY)
+      if (gs_plugin_apk_daemon_vanished (local_error) &&
+          call->attempts < GS_PLUGIN_APK_READ_RETRIES &&
+          !g_cancellable_is_cancelled (g_task_get_cancellable (task)))
         {
-          g_debug ("App %s has quirk WILDCARD or is a repository; not refining!", gs_app_get_unique_id (app));
-          continue;
+          call->attempts++;
+          g_debug ("Daemon went away during %s, sending it again: %s",
+                   call->method, local_error->message);
+          gs_plugin_apk_send_read (g_steal_pointer (&task));
+          return;
         }
 
-      /* Only package and unknown (desktop or metainfo file with upstream AS)
-       * belog to us */
-      if (bundle_kind != AS_BUNDLE_KIND_UNKNOWN &&
-          bundle_kind != AS_BUNDLE_KIND_PACKAGE)
-        {
-          g_debug ("App %s has bundle kind %s; not refining!", gs_app_get_unique_id (app),
-                   as_bundle_kind_to_string (bundle_kind));
-          continue;
-        }
+      g_task_return_error (task, g_steal_pointer (&local_error));
+      return;
+    }
 
-      /* set management plugin for system apps just created by appstream */
-      if (gs_app_has_management_plugin (app, NULL) &&
-          gs_app_get_scope (app) == AS_COMPONENT_SCOPE_SYSTEM &&
-          g_strcmp0 (gs_app_get_metadata_item (app, "GnomeSoftware::Creator"), "appstream") == 0)
-        {
-          /* If appstream couldn't assign a source, it means the app does not
-           * have an entry in the distribution-generated metadata. That should
-           * be fixed in the app. We try to workaround it by finding the
-           * owner of the metainfo or desktop file */
-          if (gs_app_get_source_default (app) == NULL)
-            {
-              g_debug ("App %s missing pkgname. Will try to resolve via metainfo/desktop file",
-                       gs_app_get_unique_id (app));
-              gs_app_list_add (missing_pkgname_list, app);
-              continue;
-            }
+  g_task_return_pointer (task, g_steal_pointer (&reply), (GDestroyNotify) g_variant_unref);
+}
 
-          g_debug ("Setting ourselves as management plugin for app %s", gs_app_get_unique_id (app));
-          gs_app_set_management_plugin (app, plugin);
-        }
+/**
+ * gs_plugin_apk_call_read_finish:
+ * @self: The apk plugin
+ * @res: The GAsyncResult
+ * @out_fd_list: (out) (optional) (nullable): The fds passed along the reply
+ * @error: A GError
+ *
+ * Returns: (transfer full): the reply tuple, or %NULL on error
+ **/
+static GVariant *
+gs_plugin_apk_call_read_finish (GsPluginApk *self,
+                                GAsyncResult *res,
+                                GUnixFDList **out_fd_list,
+                                GError **error)
+{
+  ReadCall *call = g_task_get_task_data (G_TASK (res));
+  GVariant *reply = g_task_propagate_pointer (G_TASK (res), error);
 
-      if (!gs_app_has_management_plugin (app, plugin))
-        {
-          g_debug ("Ignoring app %s, not owned by apk", gs_app_get_unique_id (app));
-          continue;
-        }
+  if (reply != NULL && out_fd_list != NULL)
+    *out_fd_list = g_steal_pointer (&call->fd_list);
+  return reply;
+}
 
-      sources = gs_app_get_sources (app);
-      if (sources->len == 0)
-        {
-          g_warning ("app %s has missing sources; skipping", gs_app_get_unique_id (app));
-          continue;
-        }
-      if (sources->len >= 2)
-        {
-          g_warning ("app %s has %d > 1 sources; skipping", gs_app_get_unique_id (app), sources->len);
-          continue;
-        }
+/* Size of the pieces bulk requests are split into */
+#define DETAILS_CHUNK_SIZE 50
 
-      /* If we reached here, the app is valid and under our responsibility.
-         Therefore, we have to make sure that it stays valid. For that purpose,
-         if the state is unknown, force refining by setting the SETUP_ACTION
-         flag. This has the drawback that it forces a refine for all other apps.
-         The alternative would be to have yet another app list. But since this
-         is expected to happen very seldomly, it should be fine */
-      if (gs_app_get_state (app) == GS_APP_STATE_UNKNOWN)
-        data->flags |= GS_PLUGIN_REFINE_FLAGS_REQUIRE_SETUP_ACTION;
+typedef enum
+{
+  APK_LANE_INTERACTIVE,
+  APK_LANE_BULK,
+} ApkLane;
 
-      g_debug ("Selecting app %s for refine", gs_app_get_unique_id (app));
-      gs_app_list_add (refine_apps_list, app);
-    }
+typedef struct
+{
+  GVariant **results; /* (owned) (array length=n_chunks) */
+  guint n_chunks;
+  guint n_chunks_left;
+  gboolean failed;
+} DetailsRequest;
 
-  fix_app_missing_appstream_async (plugin, missing_pkgname_list,
-                                   cancellable, refine_apk_packages_cb,
-                                   g_steal_pointer (&task));
+static void
+details_request_free (DetailsRequest *request)
+{
+  for (guint i = 0; i < request->n_chunks; i++)
+    g_clear_pointer (&request->results[i], g_variant_unref);
+  g_free (request->results);
+
+  g_free (request);
 }
 
+typedef struct
+{
+  GTask *task;  /* (owned) the request this chunk belongs to */
+  gchar **names; /* (owned) */
+  guint flags;
+  guint index;
+  ApkLane lane;
+} DetailsChunk;
+
 static void
-apk_polkit_search_files_owners_cb (GObject *object_source,
-                                   GAsyncResult *res,
-                                   gpointer user_data);
+details_chunk_free (DetailsChunk *chunk)
+{
+  g_clear_object (&chunk->task);
+  g_strfreev (chunk->names);
+
+  g_free (chunk);
+}
+
+static void
+apk_polkit_details_chunk_cb (GObject *object_source,
+                             GAsyncResult *res,
+                             gpointer user_data);
+
+static void
+gs_plugin_apk_dispatch_chunk (GsPluginApk *self, DetailsChunk *chunk)
+{
+  if (chunk->lane == APK_LANE_BULK)
+    self->bulk_in_flight = TRUE;
+  else
+    self->n_interactive_in_flight++;
+
+  gs_plugin_apk_call_read_async (self, "GetPackagesDetails",
+                                 g_variant_new ("(^asu)", chunk->names, chunk->flags),
+                                 g_task_get_cancellable (chunk->task),
+                                 apk_polkit_details_chunk_cb,
+                                 chunk);
+}
 
 /**
- * fix_app_missing_appstream:
- * @plugin: The apk GsPlugin.
- * @list: The GsAppList to resolve the metainfo/desktop files for.
- * @cancellable: GCancellable to cancel synchronous dbus call.
- * @task: FIXME!
+ * gs_plugin_apk_pump_bulk_lane:
+ * @self: The apk plugin
  *
- * If the appstream plugin could not find the apps in the distribution metadata,
- * it might have created the application from the metainfo or desktop files
- * installed. It will contain some basic information, but the apk package to
- * which it belongs (the source) needs to completed by us.
+ * Sends the next queued bulk chunk to the daemon, but only while no other
+ * bulk chunk or interactive request is in flight.
  **/
 static void
-fix_app_missing_appstream_async (GsPlugin *plugin,
-                                 GsAppList *list,
-                                 GCancellable *cancellable,
-                                 GAsyncReadyCallback callback,
-                                 gpointer user_data)
+gs_plugin_apk_pump_bulk_lane (GsPluginApk *self)
 {
-  GsPluginApk *self = GS_PLUGIN_APK (plugin);
-  g_autofree const gchar **fn_array = NULL;
-  g_autoptr (GsAppList) search_list = gs_app_list_new ();
-  g_autoptr (GTask) task = NULL;
+  while (!self->bulk_in_flight &&
+         self->n_interactive_in_flight == 0 &&
+         !g_queue_is_empty (&self->bulk_queue))
+    {
+      DetailsChunk *chunk = g_queue_pop_head (&self->bulk_queue);
+      DetailsRequest *request = g_task_get_task_data (chunk->task);
 
-  task = g_task_new (plugin, cancellable, callback, user_data);
+      /* A previous chunk of the same request failed, nothing to do */
+      if (request->failed)
+        {
+          details_chunk_free (chunk);
+          continue;
+        }
+
+      gs_plugin_apk_dispatch_chunk (self, chunk);
+    }
+}
+
+/**
+ * gs_plugin_apk_get_details_async:
+ * @self: The apk plugin
+ * @names: NULL-terminated array of package names
+ * @flags: The ApkPolkitClientDetailsFlags to request
+ * @lane: The priority lane of the request
+ * @cancellable: A GCancellable
+ * @callback: Function to call when done
+ * @user_data: Data for @callback
+ *
+ * Wrapper around GetPackagesDetails that keeps background work from
+ * delaying what the user is looking at. Interactive requests are sent
+ * right away. Bulk requests are split in chunks which are queued and sent
+ * one at a time, only while no interactive request is in flight.
+ **/
+static void
+gs_plugin_apk_get_details_async (GsPluginApk *self,
+                                 const gchar *const *names,
+                                 guint flags,
+                                 ApkLane lane,
+                                 GCancellable *cancellable,
+                                 GAsyncReadyCallback callback,
+                                 gpointer user_data)
+{
+  g_autoptr (GTask) task = NULL;
+  DetailsRequest *request = g_new0 (DetailsRequest, 1);
+  guint n_names = g_strv_length ((gchar **) names);
+  guint chunk_size = lane == APK_LANE_BULK ? DETAILS_CHUNK_SIZE : MAX (n_names, 1);
+
+  task = g_task_new (self, cancellable, callback, user_data);
+  g_task_set_source_tag (task, gs_plugin_apk_get_details_async);
+  g_task_set_task_data (task, request, (GDestroyNotify) details_request_free);
+
+  request->n_chunks = MAX ((n_names + chunk_size - 1) / chunk_size, 1);
+  request->n_chunks_left = request->n_chunks;
+  request->results = g_new0 (GVariant *, request->n_chunks);
+
+  for (guint i = 0; i < request->n_chunks; i++)
+    {
+      DetailsChunk *chunk = g_new0 (DetailsChunk, 1);
+      guint start = i * chunk_size;
+      guint len = MIN (chunk_size, n_names - start);
+
+      chunk->task = g_object_ref (task);
+      chunk->names = g_new0 (gchar *, len + 1);
+      for (guint j = 0; j < len; j++)
+        chunk->names[j] = g_strdup (names[start + j]);
+      chunk->flags = flags;
+      chunk->index = i;
+      chunk->lane = lane;
+
+      if (lane == APK_LANE_INTERACTIVE)
+        gs_plugin_apk_dispatch_chunk (self, chunk);
+      else
+        g_queue_push_tail (&self->bulk_queue, chunk);
+    }
+
+  if (lane == APK_LANE_BULK)
+    g_debug ("Queued %u bulk chunks, %u chunks waiting",
+             request->n_chunks, g_queue_get_length (&self->bulk_queue));
+  gs_plugin_apk_pump_bulk_lane (self);
+}
+
+static void
+apk_polkit_details_chunk_cb (GObject *object_source,
+                             GAsyncResult *res,
+                             gpointer user_data)
+{
+  DetailsChunk *chunk = user_data;
+  GsPluginApk *self = g_task_get_source_object (chunk->task);
+  DetailsRequest *request = g_task_get_task_data (chunk->task);
+  g_autoptr (GVariant) reply = NULL;
+  g_autoptr (GError) local_error = NULL;
+
+  if (chunk->lane == APK_LANE_BULK)
+    self->bulk_in_flight = FALSE;
+  else
+    self->n_interactive_in_flight--;
+
+  reply = gs_plugin_apk_call_read_finish (self, res, NULL, &local_error);
+  if (reply == NULL)
+    {
+      if (!request->failed)
+        {
+          request->failed = TRUE;
+          g_dbus_error_strip_remote_error (local_error);
+          g_task_return_error (chunk->task, g_steal_pointer (&local_error));
+        }
+    }
+  else if (!request->failed)
+    {
+      request->results[chunk->index] = g_variant_get_child_value (reply, 0);
+      if (--request->n_chunks_left == 0)
+        {
+          GVariantBuilder builder;
+
+          g_variant_builder_init (&builder, G_VARIANT_TYPE ("aa{sv}"));
+          for (guint i = 0; i < request->n_chunks; i++)
+            {
+              GVariantIter iter;
+              GVariant *child;
+
+              g_variant_iter_init (&iter, request->results[i]);
+              while ((child = g_variant_iter_next_value (&iter)) != NULL)
+                {
+                  g_variant_builder_add_value (&builder, child);
+                  g_variant_unref (child);
+                }
+            }
+          g_task_return_pointer (chunk->task,
+                                 g_variant_ref_sink (g_variant_builder_end (&builder)),
+                                 (GDestroyNotify) g_variant_unref);
+        }
+    }
+
+  gs_plugin_apk_pump_bulk_lane (self);
+  details_chunk_free (chunk);
+}
+
+static GVariant *
+gs_plugin_apk_get_details_finish (GsPluginApk *self,
+                                  GAsyncResult *res,
+                                  GError **error)
+{
+  return g_task_propagate_pointer (G_TASK (res), error);
+}
+
+typedef struct
+{
+  GsAppList *missing_pkgname_list; /* (owned) (not nullable) */
+  GsPluginRefineFlags flags;
+  gboolean interactive; /* whether the job refining is user-facing */
+  guint n_pending;  /* operations left before the refine is done */
+  GError *error;    /* (owned) (nullable) first error of any operation */
+} RefineData;
+
+static void
+refine_data_free (RefineData *data)
+{
+  g_clear_object (&data->missing_pkgname_list);
+  g_clear_error (&data->error);
+
+  g_free (data);
+}
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (RefineData, refine_data_free);
+
+/**
+ * refine_task_complete_op:
+ * @task: The refine task
+ * @error: (transfer full) (nullable): The error of the operation, if any
+ *
+ * Marks one of the concurrent refine operations as done and returns the
+ * task once all of them are, with the first error encountered.
+ **/
+static void
+refine_task_complete_op (GTask *task, GError *error)
+{
+  RefineData *data = g_task_get_task_data (task);
+
+  if (error != NULL && data->error == NULL)
+    data->error = error;
+  else if (error != NULL)
+    g_error_free (error);
+
+  g_assert (data->n_pending > 0);
+  if (--data->n_pending > 0)
+    return;
+
+  if (data->error != NULL)
+    g_task_return_error (task, g_steal_pointer (&data->error));
+  else
+    g_task_return_boolean (task, TRUE);
+}
+
+static gchar *
+update_details_key (const gchar *name,
+                    const gchar *old_version,
+                    const gchar *new_version)
+{
+  return g_strdup_printf ("%s\n%s\n%s", name, old_version, new_version);
+}
+
+/**
+ * apk_version_is_rebuild:
+ * @old_version: The installed version
+ * @new_version: The version available
+ *
+ * Returns: %TRUE if the versions only differ in their `-rN` suffix, i.e. the
+ * update is a rebuild of the same upstream release.
+ **/
+static gboolean
+apk_version_is_rebuild (const gchar *old_version, const gchar *new_version)
+{
+  const gchar *old_rel = g_strrstr (old_version, "-r");
+  const gchar *new_rel = g_strrstr (new_version, "-r");
+
+  if (old_rel == NULL || new_rel == NULL)
+    return FALSE;
+
+  return (old_rel - old_version) == (new_rel - new_version) &&
+         strncmp (old_version, new_version, old_rel - old_version) == 0;
+}
+
+/**
+ * apk_update_details_new:
+ * @name: The package name
+ * @old_version: The installed version
+ * @new_version: The version available
+ * @dict: The `a{sv}` the daemon returned for the package
+ *
+ * Builds the update details shown to the user. Pure rebuilds are flagged
+ * as low priority so they don't get in the way. The daemon doesn't tell
+ * which updates fix security issues, so the others are of medium priority.
+ **/
+static ApkUpdateDetails *
+apk_update_details_new (const gchar *name,
+                        const gchar *old_version,
+                        const gchar *new_version,
+                        GVariant *dict)
+{
+  ApkUpdateDetails *details = g_new0 (ApkUpdateDetails, 1);
+  g_autoptr (GString) text = g_string_new (NULL);
+
+  /* apk has no delta packages, an update downloads the whole new package */
+  g_variant_lookup (dict, "size", "t", &details->download_size);
+
+  g_string_append_printf (text, _ ("%s %s → %s"), name, old_version, new_version);
+  if (apk_version_is_rebuild (old_version, new_version))
+    {
+      g_string_append_c (text, '\n');
+      g_string_append (text, _ ("Rebuild without upstream changes"));
+      details->urgency = AS_URGENCY_KIND_LOW;
+    }
+  else
+    {
+      details->urgency = AS_URGENCY_KIND_MEDIUM;
+    }
+
+  details->text = g_string_free (g_steal_pointer (&text), FALSE);
+  return details;
+}
+
+static void
+apk_update_details_apply (GsApp *app, ApkUpdateDetails *details)
+{
+  gs_app_set_update_details_text (app, details->text);
+  gs_app_set_update_urgency (app, details->urgency);
+  if (details->download_size)
+    gs_app_set_size_download (app, GS_SIZE_TYPE_VALID, details->download_size);
+}
+
+/* One of the concurrent daemon calls of a refine, and the apps it is for */
+typedef struct
+{
+  GTask *refine_task; /* (owned) */
+  GsAppList *list;    /* (owned) */
+  gboolean update_details; /* whether to fill in uncached update details */
+} RefineListData;
+
+static void
+refine_list_data_free (RefineListData *data)
+{
+  g_clear_object (&data->refine_task);
+  g_clear_object (&data->list);
+
+  g_free (data);
+}
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (RefineListData, refine_list_data_free);
+
+/**
+ * gs_plugin_apk_refine_update_details:
+ * @self: The apk plugin
+ * @list: The apps to refine
+ *
+ * Fills in the cached update details of the updatable apps in @list.
+ * Details are cached per (name, old version, new version), the missing
+ * ones are built from the details reply of the same refine, see
+ * gs_plugin_apk_set_update_details().
+ *
+ * Returns: %TRUE if some updatable app missed the cache
+ **/
+static gboolean
+gs_plugin_apk_refine_update_details (GsPluginApk *self, GsAppList *list)
+{
+  guint n_hits = 0;
+  guint n_misses = 0;
+
+  for (guint i = 0; i < gs_app_list_length (list); i++)
+    {
+      GsApp *app = gs_app_list_index (list, i);
+      const gchar *old_version = gs_app_get_version (app);
+      const gchar *new_version = gs_app_get_update_version (app);
+      g_autofree gchar *key = NULL;
+      ApkUpdateDetails *details;
+
+      if (!gs_app_is_updatable (app) || old_version == NULL || new_version == NULL)
+        continue;
+
+      key = update_details_key (gs_app_get_source_default (app), old_version, new_version);
+      details = g_hash_table_lookup (self->update_details, key);
+      if (details != NULL)
+        {
+          apk_update_details_apply (app, details);
+          n_hits++;
+        }
+      else
+        {
+          n_misses++;
+        }
+    }
+  gs_apk_metrics_cache_lookup (self->metrics, "update-details", n_hits, n_misses);
+
+  return n_misses > 0;
+}
+
+/**
+ * gs_plugin_apk_set_update_details:
+ * @self: The apk plugin
+ * @app: A refined app
+ * @dict: The `a{sv}` the daemon returned for @app
+ *
+ * Fills in and caches the update details of @app, if it is updatable.
+ **/
+static void
+gs_plugin_apk_set_update_details (GsPluginApk *self, GsApp *app, GVariant *dict)
+{
+  const gchar *source = gs_app_get_source_default (app);
+  const gchar *old_version = gs_app_get_version (app);
+  const gchar *new_version = gs_app_get_update_version (app);
+  g_autofree gchar *key = NULL;
+  ApkUpdateDetails *details;
+
+  if (!gs_app_is_updatable (app) || old_version == NULL || new_version == NULL)
+    return;
+
+  key = update_details_key (source, old_version, new_version);
+  details = g_hash_table_lookup (self->update_details, key);
+  if (details == NULL)
+    {
+      if (g_hash_table_size (self->update_details) > UPDATE_DETAILS_CACHE_MAX)
+        g_hash_table_remove_all (self->update_details);
+      details = apk_update_details_new (source, old_version, new_version, dict);
+      g_hash_table_insert (self->update_details, g_steal_pointer (&key), details);
+    }
+  apk_update_details_apply (app, details);
+}
+
+/**
+ * gs_plugin_apk_refine_from_index:
+ * @self: The apk plugin
+ * @task: The refine task
+ * @list: The apps to refine
+ *
+ * Fills in what the provides index knows about the apps in @list, rather
+ * than asking the daemon once per app:
+ *
+ * - Alpine splits documentation, translations, OpenRC services and shell
+ *   completions into subpackages, these become addons of the app.
+ * - For installed apps, the packages that would have to be removed along
+ *   with them, see gs_plugin_apk_set_removal_impact().
+ * - For installed apps, the size of the dependencies nothing else needs,
+ *   which removing them would free as well.
+ *
+ * Refines don't wait for the index. If it is out of date, these are left
+ * out while it is rebuilt in the background.
+ **/
+static void
+gs_plugin_apk_refine_from_index (GsPluginApk *self, GTask *task, GsAppList *list)
+{
+  RefineData *refine_data = g_task_get_task_data (task);
+  GsApkIndex *apk_index = gs_plugin_apk_peek_index (self, FALSE);
+  guint n_addons = 0;
+
+  if (apk_index == NULL)
+    {
+      g_debug ("Package index not ready, skipping addons, related and sizes");
+      return;
+    }
+
+  for (guint i = 0; i < gs_app_list_length (list); i++)
+    {
+      GsApp *app = gs_app_list_index (list, i);
+      GsApkIndexPackage *package;
+      GPtrArray *subpackages;
+
+      /* The app's state may not be known yet, as the details of the same
+       * refine may still be on their way, so ask the index instead */
+      package = gs_apk_index_get_package (apk_index, gs_app_get_source_default (app));
+
+      if ((refine_data->flags & GS_PLUGIN_REFINE_FLAGS_REQUIRE_RELATED) &&
+          package != NULL && package->installed)
+        {
+          const gchar *names[] = { package->name, NULL };
+          gs_plugin_apk_set_removal_impact (self, app, names);
+        }
+
+      if ((refine_data->flags & GS_PLUGIN_REFINE_FLAGS_REQUIRE_SIZE) &&
+          package != NULL && package->installed)
+        {
+          guint64 exclusive_size = gs_apk_index_get_exclusive_size (apk_index, package->name);
+          gs_app_set_size_installed_dependencies (app, GS_SIZE_TYPE_VALID,
+                                                  exclusive_size - package->installed_size);
+        }
+
+      if (!(refine_data->flags & GS_PLUGIN_REFINE_FLAGS_REQUIRE_ADDONS))
+        continue;
+
+      subpackages = gs_apk_index_get_subpackages (apk_index,
+                                                  gs_app_get_source_default (app));
+      for (guint j = 0; subpackages != NULL && j < subpackages->len; j++)
+        {
+          g_autoptr (GsApp) addon = NULL;
+
+          addon = index_package_to_app (GS_PLUGIN (self), g_ptr_array_index (subpackages, j), TRUE);
+          gs_app_add_addon (app, addon);
+          n_addons++;
+        }
+    }
+  g_debug ("Attached %u subpackages as addons", n_addons);
+}
+
+static void
+refine_missing_pkgname_cb (GObject *object_source,
+                           GAsyncResult *res,
+                           gpointer user_data);
+
+static void
+gs_plugin_apk_refine_details (GsPluginApk *self, GTask *task, GsAppList *list);
+
+static void
+fix_app_missing_appstream_async (GsPlugin *plugin,
+                                 GsAppList *list,
+                                 GCancellable *cancellable,
+                                 GAsyncReadyCallback callback,
+                                 gpointer user_data);
+
+static gboolean
+gs_plugin_apk_refine_finish (GsPlugin *plugin,
+                             GAsyncResult *result,
+                             GError **error)
+{
+  return g_task_propagate_boolean (G_TASK (result), error);
+}
+
+static void
+gs_plugin_apk_refine_async (GsPlugin *plugin,
+                            GsAppList *list,
+                            GsPluginRefineFlags flags,
+                            GCancellable *cancellable,
+                            GAsyncReadyCallback callback,
+                            gpointer user_data)
+{
+  GsPluginApk *self = GS_PLUGIN_APK (plugin);
+  g_autoptr (GTask) task = NULL;
+  g_autoptr (GsAppList) missing_pkgname_list = gs_app_list_new ();
+  g_autoptr (GsAppList) refine_apps_list = gs_app_list_new ();
+  RefineData *data = g_new0 (RefineData, 1);
+  gint64 trace_begin = GS_APK_TRACE_NOW ();
+
+  data->missing_pkgname_list = g_object_ref (missing_pkgname_list);
+  data->flags = flags;
+  /* The loader only sets this flag for the duration of this call */
+  data->interactive = gs_plugin_has_flags (plugin, GS_PLUGIN_FLAGS_INTERACTIVE);
+
+  task = g_task_new (plugin, cancellable, callback, user_data);
+  g_task_set_source_tag (task, gs_plugin_apk_refine_async);
+  g_task_set_task_data (task, data, (GDestroyNotify) refine_data_free);
+
+  g_debug ("Starting refinining process");
+
+  for (guint i = 0; i < gs_app_list_length (list); i++)
+    {
+      GsApp *app = gs_app_list_index (list, i);
+      GPtrArray *sources;
+      AsBundleKind bundle_kind = gs_app_get_bundle_kind (app);
+
+      if (gs_app_has_quirk (app, GS_APP_QUIRK_IS_WILDCARD) ||
+          gs_app_has_quirk (app, GS_APP_QUIRK_IS_PROXY) ||
+          gs_app_get_kind (app) == AS_COMPONENT_KIND_REPOSITORY)
+        {
+          g_debug ("App %s has quirk WILDCARD or PROXY, or is a repository; not refining!", gs_app_get_unique_id (app));
+          continue;
+        }
+
+      /* Only package and unknown (desktop or metainfo file with upstream AS)
+       * belog to us */
+      if (bundle_kind != AS_BUNDLE_KIND_UNKNOWN &&
+          bundle_kind != AS_BUNDLE_KIND_PACKAGE)
+        {
+          g_debug ("App %s has bundle kind %s; not refining!", gs_app_get_unique_id (app),
+                   as_bundle_kind_to_string (bundle_kind));
+          continue;
+        }
+
+      /* set management plugin for system apps just created by appstream */
+      if (gs_app_has_management_plugin (app, NULL) &&
+          gs_app_get_scope (app) == AS_COMPONENT_SCOPE_SYSTEM &&
+          g_strcmp0 (gs_app_get_metadata_item (app, "GnomeSoftware::Creator"), "appstream") == 0)
+        {
+          /* If appstream couldn't assign a source, it means the app does not
+           * have an entry in the distribution-generated metadata. That should
+           * be fixed in the app. We try to workaround it by finding the
+           * owner of the metainfo or desktop file */
+          if (gs_app_get_source_default (app) == NULL)
+            {
+              g_debug ("App %s missing pkgname. Will try to resolve via metainfo/desktop file",
+                       gs_app_get_unique_id (app));
+              gs_app_list_add (missing_pkgname_list, app);
+              continue;
+            }
+
+          g_debug ("Setting ourselves as management plugin for app %s", gs_app_get_unique_id (app));
+          gs_app_set_management_plugin (app, plugin);
+        }
+
+      if (!gs_app_has_management_plugin (app, plugin))
+        {
+          g_debug ("Ignoring app %s, not owned by apk", gs_app_get_unique_id (app));
+          continue;
+        }
+
+      sources = gs_app_get_sources (app);
+      if (sources->len == 0)
+        {
+          g_warning ("app %s has missing sources; skipping", gs_app_get_unique_id (app));
+          continue;
+        }
+      if (sources->len >= 2)
+        {
+          g_warning ("app %s has %d > 1 sources; skipping", gs_app_get_unique_id (app), sources->len);
+          continue;
+        }
+
+      /* If we reached here, the app is valid and under our responsibility.
+         Therefore, we have to make sure that it stays valid. For that purpose,
+         if the state is unknown, force refining by setting the SETUP_ACTION
+         flag. This has the drawback that it forces a refine for all other apps.
+         The alternative would be to have yet another app list. But since this
+         is expected to happen very seldomly, it should be fine */
+      if (gs_app_get_state (app) == GS_APP_STATE_UNKNOWN)
+        data->flags |= GS_PLUGIN_REFINE_FLAGS_REQUIRE_SETUP_ACTION;
+
+      g_debug ("Selecting app %s for refine", gs_app_get_unique_id (app));
+      gs_app_list_add (refine_apps_list, app);
+    }
+
+  GS_APK_TRACE_MARK (refine_select, trace_begin, gs_app_list_length (list));
+
+  /* The apps which already have a source don't need to wait for the
+   * missing ones to be looked up, so both run at the same time. The apps
+   * whose source gets found are refined by a second, small details call
+   * once the lookup is done. The refine itself holds one pending
+   * operation until everything has been started. */
+  data->n_pending = 1;
+  if (gs_app_list_length (missing_pkgname_list) > 0)
+    {
+      data->n_pending++;
+      fix_app_missing_appstream_async (plugin, missing_pkgname_list,
+                                       cancellable, refine_missing_pkgname_cb,
+                                       g_object_ref (task));
+    }
+  gs_plugin_apk_refine_details (self, task, refine_apps_list);
+  refine_task_complete_op (task, NULL);
+}
+
+static void
+apk_polkit_search_files_owners_cb (GObject *object_source,
+                                   GAsyncResult *res,
+                                   gpointer user_data);
+
+/**
+ * fix_app_missing_appstream:
+ * @plugin: The apk GsPlugin.
+ * @list: The GsAppList to resolve the metainfo/desktop files for.
+ * @cancellable: GCancellable to cancel synchronous dbus call.
+ * @task: FIXME!
+ *
+ * If the appstream plugin could not find the apps in the distribution metadata,
+ * it might have created the application from the metainfo or desktop files
+ * installed. It will contain some basic information, but the apk package to
+ * which it belongs (the source) needs to completed by us.
+ **/
+static void
+fix_app_missing_appstream_async (GsPlugin *plugin,
+                                 GsAppList *list,
+                                 GCancellable *cancellable,
+                                 GAsyncReadyCallback callback,
+                                 gpointer user_data)
+{
+  GsPluginApk *self = GS_PLUGIN_APK (plugin);
+  g_autofree const gchar **fn_array = NULL;
+  g_autoptr (GsAppList) search_list = gs_app_list_new ();
+  g_autoptr (GTask) task = NULL;
+
+  task = g_task_new (plugin, cancellable, callback, user_data);
   g_task_set_source_tag (task, fix_app_missing_appstream_async);
   g_task_set_task_data (task, g_object_ref (search_list), g_object_unref);
 
-  if (gs_app_list_length (list) == 0)
+  if (gs_app_list_length (list) == 0)
+    {
+      g_task_return_boolean (task, TRUE);
+      return;
+    }
+
+  g_debug ("Trying to find source packages for %d apps", gs_app_list_length (list));
+  /* The appstream plugin sets some metadata on apps that come from desktop
+   * and metainfo files. If metadata is missing, just give-up */
+  for (int i = 0; i < gs_app_list_length (list); i++)
+    {
+      GsApp *app = gs_app_list_index (list, i);
+      if (gs_app_get_metadata_item (app, "appstream::source-file"))
+        gs_app_list_add (search_list, app);
+      else
+        g_warning ("Couldn't find 'appstream::source-file' metadata for %s",
+                   gs_app_get_unique_id (app));
+    }
+
+  fn_array = g_new0 (const gchar *, gs_app_list_length (search_list) + 1);
+  for (int i = 0; i < gs_app_list_length (search_list); i++)
+    {
+      GsApp *app = gs_app_list_index (search_list, i);
+      fn_array[i] = gs_app_get_metadata_item (app, "appstream::source-file");
+      g_assert (fn_array[i]);
+    }
+
+  if (gs_app_list_length (search_list) == 0)
+    {
+      g_task_return_boolean (task, TRUE);
+      return;
+    }
+
+  gs_plugin_apk_call_read_async (self, "SearchFilesOwners",
+                                 g_variant_new ("(^asu)", fn_array,
+                                                APK_POLKIT_CLIENT_DETAILS_FLAGS_NONE),
+                                 cancellable, apk_polkit_search_files_owners_cb,
+                                 g_steal_pointer (&task));
+}
+
+static void
+apk_polkit_search_files_owners_cb (GObject *object_source,
+                                   GAsyncResult *res,
+                                   gpointer user_data)
+{
+  g_autoptr (GTask) task = g_steal_pointer (&user_data);
+  GsPluginApk *self = g_task_get_source_object (task);
+  g_autoptr (GError) local_error = NULL;
+  g_autoptr (GVariant) reply = NULL;
+  g_autoptr (GVariant) search_results = NULL;
+  GsAppList *search_list = g_task_get_task_data (task);
+
+  reply = gs_plugin_apk_call_read_finish (self, res, NULL, &local_error);
+  if (reply == NULL)
+    {
+      g_task_return_error (task, g_steal_pointer (&local_error));
+      return;
+    }
+  search_results = g_variant_get_child_value (reply, 0);
+
+  g_assert (g_variant_n_children (search_results) == gs_app_list_length (search_list));
+  for (int i = 0; i < gs_app_list_length (search_list); i++)
+    {
+      g_autoptr (GVariant) apk_pkg_variant = NULL;
+      GsApp *app = gs_app_list_index (search_list, i);
+      ApkdPackage apk_pkg = { NULL, NULL, NULL, NULL, NULL, NULL, 0, 0, Available };
+
+      apk_pkg_variant = g_variant_get_child_value (search_results, i);
+      if (!gs_plugin_apk_variant_to_apkd (apk_pkg_variant, &apk_pkg))
+        {
+          // TODO: We need fn_array if we want to print this info!
+          /* g_warning ("Couldn't find any package owning file '%s'", */
+          /*            fn_array[i]); */
+          continue;
+        }
+      g_debug ("Found pkgname '%s' for app %s: adding source and setting management plugin",
+               apk_pkg.name, gs_app_get_unique_id (app));
+      gs_app_add_source (app, apk_pkg.name);
+      gs_app_set_management_plugin (app, GS_PLUGIN (self));
+    }
+  g_task_return_boolean (task, TRUE);
+}
+
+static gboolean
+fix_app_missing_appstream_finish (GsPlugin *plugin,
+                                  GAsyncResult *res,
+                                  GError **error)
+{
+  return g_task_propagate_boolean (G_TASK (res), error);
+}
+
+static void
+refine_missing_pkgname_cb (GObject *object_source,
+                           GAsyncResult *res,
+                           gpointer user_data)
+{
+  g_autoptr (GTask) task = G_TASK (g_steal_pointer (&user_data));
+  GsPluginApk *self = g_task_get_source_object (task);
+  RefineData *data = g_task_get_task_data (task);
+  g_autoptr (GsAppList) found_list = gs_app_list_new ();
+  g_autoptr (GError) local_error = NULL;
+
+  if (!fix_app_missing_appstream_finish (GS_PLUGIN (self), res, &local_error))
+    {
+      // TODO: We should print a warning, but continue execution!
+      // There's no reason failing to find some package should stop
+      // the rest of the processing.
+      refine_task_complete_op (task, g_steal_pointer (&local_error));
+      return;
+    }
+
+  for (guint i = 0; i < gs_app_list_length (data->missing_pkgname_list); i++)
+    {
+      GsApp *app = gs_app_list_index (data->missing_pkgname_list, i);
+      if (gs_app_get_source_default (app) != NULL)
+        gs_app_list_add (found_list, app);
+    }
+
+  gs_plugin_apk_refine_details (self, task, found_list);
+  refine_task_complete_op (task, NULL);
+}
+
+static void
+apk_polkit_get_packages_details_cb (GObject *object_source,
+                                    GAsyncResult *res,
+                                    gpointer user_data);
+
+/**
+ * gs_plugin_apk_refine_details:
+ * @self: The apk plugin
+ * @task: The refine task
+ * @list: The apps to refine, all with a source
+ *
+ * Starts the daemon calls which fill in the data requested by the refine
+ * flags for @list, each as a pending operation of @task.
+ **/
+static void
+gs_plugin_apk_refine_details (GsPluginApk *self, GTask *task, GsAppList *list)
+{
+  RefineData *data = g_task_get_task_data (task);
+  GsPluginRefineFlags flags = data->flags;
+  g_autoptr (GsAppList) found_list = NULL;
+  g_autofree const gchar **source_array = NULL;
+  guint details_flags = APK_POLKIT_CLIENT_DETAILS_FLAGS_PACKAGE_STATE;
+  gboolean update_details = FALSE;
+  RefineListData *details_data;
+
+  if (gs_app_list_length (list) == 0)
+    return;
+
+  if (flags & GS_PLUGIN_REFINE_FLAGS_REQUIRE_UPDATE_DETAILS)
+    update_details = gs_plugin_apk_refine_update_details (self, list);
+
+  if (flags & (GS_PLUGIN_REFINE_FLAGS_REQUIRE_ADDONS |
+               GS_PLUGIN_REFINE_FLAGS_REQUIRE_RELATED |
+               GS_PLUGIN_REFINE_FLAGS_REQUIRE_SIZE))
+    gs_plugin_apk_refine_from_index (self, task, list);
+
+  if (!update_details &&
+      !(flags &
+        (GS_PLUGIN_REFINE_FLAGS_REQUIRE_VERSION |
+         GS_PLUGIN_REFINE_FLAGS_REQUIRE_ORIGIN |
+         GS_PLUGIN_REFINE_FLAGS_REQUIRE_DESCRIPTION |
+         GS_PLUGIN_REFINE_FLAGS_REQUIRE_SETUP_ACTION |
+         GS_PLUGIN_REFINE_FLAGS_REQUIRE_SIZE |
+         GS_PLUGIN_REFINE_FLAGS_REQUIRE_URL |
+         GS_PLUGIN_REFINE_FLAGS_REQUIRE_LICENSE)))
+    {
+      g_debug ("Ignoring refine");
+      return;
+    }
+
+  /* Don't ask again for packages the daemon already told us it can't find */
+  if (g_hash_table_size (self->not_found) > 0)
+    {
+      guint skipped;
+
+      found_list = gs_app_list_new ();
+      for (guint i = 0; i < gs_app_list_length (list); i++)
+        {
+          GsApp *app = gs_app_list_index (list, i);
+          if (!g_hash_table_contains (self->not_found, gs_app_get_source_default (app)))
+            gs_app_list_add (found_list, app);
+        }
+
+      skipped = gs_app_list_length (list) - gs_app_list_length (found_list);
+      gs_apk_metrics_cache_lookup (self->metrics, "not-found",
+                                   skipped, gs_app_list_length (found_list));
+      if (skipped > 0)
+        {
+          self->not_found_skipped += skipped;
+          g_debug ("Skipping %u packages known to be missing (%" G_GUINT64_FORMAT " in total)",
+                   skipped, self->not_found_skipped);
+          list = found_list;
+        }
+    }
+
+  if (gs_app_list_length (list) == 0)
+    return;
+
+  if (flags & GS_PLUGIN_REFINE_FLAGS_REQUIRE_SETUP_ACTION)
+    details_flags |= APK_POLKIT_CLIENT_DETAILS_FLAGS_ALL;
+  if (flags & GS_PLUGIN_REFINE_FLAGS_REQUIRE_VERSION)
+    details_flags |= APK_POLKIT_CLIENT_DETAILS_FLAGS_VERSION;
+  if (flags & GS_PLUGIN_REFINE_FLAGS_REQUIRE_DESCRIPTION)
+    details_flags |= APK_POLKIT_CLIENT_DETAILS_FLAGS_DESCRIPTION;
+  if (flags & GS_PLUGIN_REFINE_FLAGS_REQUIRE_SIZE)
+    details_flags |= (APK_POLKIT_CLIENT_DETAILS_FLAGS_SIZE |
+                      APK_POLKIT_CLIENT_DETAILS_FLAGS_INSTALLED_SIZE);
+  /* The download size of the update */
+  if (update_details)
+    details_flags |= APK_POLKIT_CLIENT_DETAILS_FLAGS_SIZE;
+  if (flags & GS_PLUGIN_REFINE_FLAGS_REQUIRE_URL)
+    details_flags |= APK_POLKIT_CLIENT_DETAILS_FLAGS_URL;
+  if (flags & GS_PLUGIN_REFINE_FLAGS_REQUIRE_LICENSE)
+    details_flags |= APK_POLKIT_CLIENT_DETAILS_FLAGS_LICENSE;
+
+  source_array = g_new0 (const gchar *, gs_app_list_length (list) + 1);
+  for (guint i = 0; i < gs_app_list_length (list); i++)
+    {
+      GsApp *app = gs_app_list_index (list, i);
+      g_debug ("Requesting details for %s", gs_app_get_unique_id (app));
+      source_array[i] = gs_app_get_source_default (app);
+    }
+
+  details_data = g_new0 (RefineListData, 1);
+  details_data->refine_task = g_object_ref (task);
+  details_data->list = g_object_ref (list);
+  details_data->update_details = update_details;
+  data->n_pending++;
+  gs_plugin_apk_get_details_async (self, source_array,
+                                   details_flags,
+                                   data->interactive ? APK_LANE_INTERACTIVE : APK_LANE_BULK,
+                                   g_task_get_cancellable (task),
+                                   apk_polkit_get_packages_details_cb,
+                                   details_data);
+}
+
+static void
+apk_polkit_get_packages_details_cb (GObject *object_source,
+                                    GAsyncResult *res,
+                                    gpointer user_data)
+{
+  g_autoptr (RefineListData) data = user_data;
+  GTask *task = data->refine_task;
+  GsPluginApk *self = g_task_get_source_object (task);
+  g_autoptr (GError) local_error = NULL;
+  g_autoptr (GVariant) apk_pkgs = NULL;
+  GsAppList *list = data->list;
+  gint64 trace_step;
+  gint64 decode_begin = 0;
+  gint64 decode_time = 0;
+  gint64 metadata_begin = 0;
+  gint64 metadata_time = 0;
+
+  apk_pkgs = gs_plugin_apk_get_details_finish (self, res, &local_error);
+  if (apk_pkgs == NULL)
+    {
+      refine_task_complete_op (task, g_steal_pointer (&local_error));
+      return;
+    }
+
+  g_assert (gs_app_list_length (list) == g_variant_n_children (apk_pkgs));
+  for (int i = 0; i < gs_app_list_length (list); i++)
+    {
+      g_autoptr (GVariant) apk_pkg_variant = NULL;
+      GsApp *app = gs_app_list_index (list, i);
+      const gchar *source = gs_app_get_source_default (app);
+      ApkdPackage apk_pkg = { NULL, NULL, NULL, NULL, NULL, NULL, 0, 0, Available };
+      gboolean decoded;
+
+      g_debug ("Refining %s", gs_app_get_unique_id (app));
+      trace_step = GS_APK_TRACE_NOW ();
+      if (i == 0)
+        decode_begin = trace_step;
+      apk_pkg_variant = g_variant_get_child_value (apk_pkgs, i);
+      decoded = gs_plugin_apk_variant_to_apkd (apk_pkg_variant, &apk_pkg);
+      /* Failed packages were decoded all the same */
+      decode_time += GS_APK_TRACE_NOW () - trace_step;
+      if (!decoded)
+        {
+          if (g_strcmp0 (source, apk_pkg.name) != 0)
+            g_warning ("source: '%s' and the pkg name: '%s' differ", source, apk_pkg.name);
+          else if (gs_plugin_apk_variant_is_not_found (apk_pkg_variant))
+            g_hash_table_add (self->not_found, g_strdup (source));
+          continue;
+        }
+
+      if (g_strcmp0 (source, apk_pkg.name) != 0)
+        {
+          g_warning ("source: '%s' and the pkg name: '%s' differ", source, apk_pkg.name);
+          continue;
+        }
+
+      trace_step = GS_APK_TRACE_NOW ();
+      if (metadata_begin == 0)
+        metadata_begin = trace_step;
+      set_app_metadata (GS_PLUGIN (self), app, &apk_pkg);
+      /* We should only set generic apps for OS updates */
+      if (gs_app_get_kind (app) == AS_COMPONENT_KIND_GENERIC)
+        gs_app_set_special_kind (app, GS_APP_SPECIAL_KIND_OS_UPDATE);
+      if (data->update_details)
+        gs_plugin_apk_set_update_details (self, app, apk_pkg_variant);
+      metadata_time += GS_APK_TRACE_NOW () - trace_step;
+    }
+  /* The phases interleave, so each mark starts when its phase first ran
+   * and only covers the time spent in it */
+  GS_APK_TRACE_MARK_DURATION (refine_decode, decode_begin, decode_time, gs_app_list_length (list));
+  GS_APK_TRACE_MARK_DURATION (refine_set_metadata, metadata_begin, metadata_time, gs_app_list_length (list));
+
+  refine_task_complete_op (task, NULL);
+}
+
+static gboolean
+gs_plugin_apk_launch_finish (GsPlugin *plugin,
+                             GAsyncResult *result,
+                             GError **error)
+{
+  return gs_plugin_app_launch_filtered_finish (plugin, result, error);
+}
+
+static gboolean
+gs_plugin_apk_filter_desktop_file_cb (GsPlugin *plugin,
+                                      GsApp *app,
+                                      const gchar *filename,
+                                      GKeyFile *key_file,
+                                      gpointer user_data)
+{
+  return strstr (filename, "/snapd/") == NULL &&
+         strstr (filename, "/snap/") == NULL &&
+         strstr (filename, "/flatpak/") == NULL &&
+         g_key_file_has_group (key_file, "Desktop Entry") &&
+         !g_key_file_has_key (key_file, "Desktop Entry", "X-Flatpak", NULL) &&
+         !g_key_file_has_key (key_file, "Desktop Entry", "X-SnapInstanceName", NULL);
+}
+
+static void
+gs_plugin_apk_launch_async (GsPlugin *plugin,
+                            GsApp *app,
+                            GsPluginLaunchFlags flags,
+                            GCancellable *cancellable,
+                            GAsyncReadyCallback callback,
+                            gpointer user_data)
+
+{
+  gs_plugin_app_launch_filtered_async (plugin, app, flags, gs_plugin_apk_filter_desktop_file_cb, NULL, cancellable, callback, user_data);
+}
+
+/**
+ * gs_plugin_apk_apkd_to_variant:
+ * @pkg: An ApkdPackage
+ *
+ * The inverse of gs_plugin_apk_variant_to_apkd().
+ *
+ * Returns: (transfer floating): an `a{sv}` GVariant representing @pkg
+ **/
+static GVariant *
+gs_plugin_apk_apkd_to_variant (ApkdPackage *pkg)
+{
+  GVariantDict dict;
+
+  g_variant_dict_init (&dict, NULL);
+  g_variant_dict_insert (&dict, "name", "s", pkg->name);
+  if (pkg->version)
+    g_variant_dict_insert (&dict, "version", "s", pkg->version);
+  if (pkg->description)
+    g_variant_dict_insert (&dict, "description", "s", pkg->description);
+  if (pkg->license)
+    g_variant_dict_insert (&dict, "license", "s", pkg->license);
+  if (pkg->url)
+    g_variant_dict_insert (&dict, "url", "s", pkg->url);
+  if (pkg->stagingVersion)
+    g_variant_dict_insert (&dict, "staging_version", "s", pkg->stagingVersion);
+  g_variant_dict_insert (&dict, "installed_size", "t", (guint64) pkg->installedSize);
+  g_variant_dict_insert (&dict, "size", "t", (guint64) pkg->size);
+  g_variant_dict_insert (&dict, "package_state", "u", (guint32) pkg->packageState);
+
+  return g_variant_dict_end (&dict);
+}
+
+/**
+ * gs_plugin_apk_table_to_upgradable:
+ * @table: A package table
+ *
+ * Scans @table in place and picks the packages that can be updated. Only
+ * those are copied out, as they are the only ones we keep around.
+ *
+ * Returns: (transfer full): an `aa{sv}` of upgradable packages
+ **/
+static GVariant *
+gs_plugin_apk_table_to_upgradable (GBytes *table)
+{
+  GVariantBuilder builder;
+  gint64 trace_begin = GS_APK_TRACE_NOW ();
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("aa{sv}"));
+  for (guint32 i = 0; i < gs_apk_table_get_n_packages (table); i++)
+    {
+      const GsApkTableRecord *record = gs_apk_table_get_record (table, i);
+      ApkdPackage pkg = { NULL, NULL, NULL, NULL, NULL, NULL, 0, 0, Available };
+
+      if (record->package_state != Upgradable && record->package_state != Downgradable)
+        continue;
+
+      pkg.name = gs_apk_table_get_string (table, record->name);
+      pkg.version = gs_apk_table_get_string (table, record->version);
+      pkg.description = gs_apk_table_get_string (table, record->description);
+      pkg.license = gs_apk_table_get_string (table, record->license);
+      pkg.url = gs_apk_table_get_string (table, record->url);
+      pkg.stagingVersion = gs_apk_table_get_string (table, record->staging_version);
+      pkg.installedSize = record->installed_size;
+      pkg.size = record->size;
+      pkg.packageState = record->package_state;
+      g_variant_builder_add_value (&builder, gs_plugin_apk_apkd_to_variant (&pkg));
+    }
+  GS_APK_TRACE_MARK (table_decode, trace_begin, gs_apk_table_get_n_packages (table));
+
+  return g_variant_ref_sink (g_variant_builder_end (&builder));
+}
+
+static void
+apk_polkit_list_packages_table_cb (GObject *object_source,
+                                   GAsyncResult *res,
+                                   gpointer user_data);
+
+static void
+apk_polkit_list_upgradable_packages_cb (GObject *object_source,
+                                        GAsyncResult *res,
+                                        gpointer user_data);
+
+/**
+ * gs_plugin_apk_list_upgradable_async:
+ * @self: The apk plugin
+ * @cancellable: A GCancellable
+ * @callback: Function to call when done
+ * @user_data: Data for @callback
+ *
+ * Asks the daemon for the upgradable packages. When the daemon supports it,
+ * the packages are transferred as a package table in a sealed memfd, which
+ * avoids marshalling one dictionary per package. Otherwise, or if that
+ * fails, ListUpgradablePackages is used.
+ **/
+static void
+gs_plugin_apk_list_upgradable_async (GsPluginApk *self,
+                                     GCancellable *cancellable,
+                                     GAsyncReadyCallback callback,
+                                     gpointer user_data)
+{
+  g_autoptr (GTask) task = NULL;
+
+  task = g_task_new (self, cancellable, callback, user_data);
+  g_task_set_source_tag (task, gs_plugin_apk_list_upgradable_async);
+
+  if (!self->table_unsupported)
+    {
+      gs_plugin_apk_call_read_async (self, "ListPackagesTable",
+                                     g_variant_new ("(su)", "upgradable",
+                                                    APK_POLKIT_CLIENT_DETAILS_FLAGS_ALL),
+                                     cancellable,
+                                     apk_polkit_list_packages_table_cb,
+                                     g_steal_pointer (&task));
+      return;
+    }
+
+  gs_plugin_apk_call_read_async (self, "ListUpgradablePackages",
+                                 g_variant_new ("(u)", APK_POLKIT_CLIENT_DETAILS_FLAGS_ALL),
+                                 cancellable,
+                                 apk_polkit_list_upgradable_packages_cb,
+                                 g_steal_pointer (&task));
+}
+
+static void
+apk_polkit_list_packages_table_cb (GObject *object_source,
+                                   GAsyncResult *res,
+                                   gpointer user_data)
+{
+  g_autoptr (GTask) task = G_TASK (g_steal_pointer (&user_data));
+  GsPluginApk *self = g_task_get_source_object (task);
+  g_autoptr (GUnixFDList) fd_list = NULL;
+  g_autoptr (GVariant) reply = NULL;
+  g_autoptr (GBytes) table = NULL;
+  g_autoptr (GError) local_error = NULL;
+
+  reply = gs_plugin_apk_call_read_finish (self, res, &fd_list, &local_error);
+  if (reply != NULL)
+    {
+      gint32 fd_index;
+      gint fd = -1;
+
+      /* The call is untyped, so it can't be trusted to match the spec */
+      if (!g_variant_is_of_type (reply, G_VARIANT_TYPE ("(h)")))
+        g_set_error (&local_error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                     "Package table reply has type %s instead of (h)",
+                     g_variant_get_type_string (reply));
+      else if (fd_list == NULL)
+        g_set_error_literal (&local_error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                             "No fd passed along the package table");
+      else
+        {
+          g_variant_get (reply, "(h)", &fd_index);
+          fd = g_unix_fd_list_get (fd_list, fd_index, &local_error);
+        }
+
+      if (fd >= 0)
+        {
+          table = gs_apk_table_map_fd (fd, &local_error);
+          g_close (fd, NULL);
+        }
+    }
+
+  if (table == NULL)
+    {
+      if (g_task_return_error_if_cancelled (task))
+        return;
+
+      g_dbus_error_strip_remote_error (local_error);
+      if (g_error_matches (local_error, G_DBUS_ERROR, G_DBUS_ERROR_UNKNOWN_METHOD))
+        self->table_unsupported = TRUE;
+
+      g_debug ("Package table unavailable, falling back to ListUpgradablePackages: %s",
+               local_error->message);
+      gs_plugin_apk_call_read_async (self, "ListUpgradablePackages",
+                                     g_variant_new ("(u)", APK_POLKIT_CLIENT_DETAILS_FLAGS_ALL),
+                                     g_task_get_cancellable (task),
+                                     apk_polkit_list_upgradable_packages_cb,
+                                     g_steal_pointer (&task));
+      return;
+    }
+
+  g_task_return_pointer (task, gs_plugin_apk_table_to_upgradable (table),
+                         (GDestroyNotify) g_variant_unref);
+}
+
+static void
+apk_polkit_list_upgradable_packages_cb (GObject *object_source,
+                                        GAsyncResult *res,
+                                        gpointer user_data)
+{
+  g_autoptr (GTask) task = G_TASK (g_steal_pointer (&user_data));
+  GsPluginApk *self = g_task_get_source_object (task);
+  g_autoptr (GVariant) reply = NULL;
+  g_autoptr (GError) local_error = NULL;
+
+  reply = gs_plugin_apk_call_read_finish (self, res, NULL, &local_error);
+  if (reply == NULL)
+    {
+      g_dbus_error_strip_remote_error (local_error);
+      g_task_return_error (task, g_steal_pointer (&local_error));
+      return;
+    }
+
+  g_task_return_pointer (task, g_variant_get_child_value (reply, 0),
+                         (GDestroyNotify) g_variant_unref);
+}
+
+static GVariant *
+gs_plugin_apk_list_upgradable_finish (GsPluginApk *self,
+                                      GAsyncResult *res,
+                                      GError **error)
+{
+  return g_task_propagate_pointer (G_TASK (res), error);
+}
+
+static GsAppList *
+gs_plugin_apk_list_apps_finish (GsPlugin *plugin,
+                                GAsyncResult *result,
+                                GError **error)
+{
+  return g_task_propagate_pointer (G_TASK (result), error);
+}
+
+static void
+apk_polkit_list_repositories_cb (GObject *object_source,
+                                 GAsyncResult *res,
+                                 gpointer user_data);
+
+static void
+apk_polkit_list_upgradable_cb (GObject *object_source,
+                               GAsyncResult *res,
+                               gpointer user_data);
+
+static void
+apk_polkit_reconcile_upgradable_cb (GObject *object_source,
+                                    GAsyncResult *res,
+                                    gpointer user_data);
+
+static GsAppList *gs_plugin_apk_upgradable_to_list (GsPluginApk *self,
+                                                    GVariant *upgradable);
+
+static void gs_plugin_apk_list_provides (GsPluginApk *self,
+                                         GTask *task,
+                                         GsAppQueryProvidesType provides_type,
+                                         const gchar *provides_tag);
+static void gs_plugin_apk_list_suggestions (GsPluginApk *self,
+                                            GTask *task,
+                                            const gchar *const *keywords);
+static void gs_plugin_apk_list_orphans (GsPluginApk *self,
+                                        GTask *task);
+
+static void
+gs_plugin_apk_list_apps_async (GsPlugin *plugin,
+                               GsAppQuery *query,
+                               GsPluginListAppsFlags flags,
+                               GCancellable *cancellable,
+                               GAsyncReadyCallback callback,
+                               gpointer user_data)
+{
+  GsPluginApk *self = GS_PLUGIN_APK (plugin);
+  g_autoptr (GTask) task = NULL;
+  gboolean is_source, is_for_updates, is_installed;
+  GsAppQueryProvidesType provides_type;
+  const gchar *provides_tag = NULL;
+  const gchar *const *keywords;
+
+  task = g_task_new (plugin, cancellable, callback, user_data);
+  g_task_set_source_tag (task, gs_plugin_apk_list_apps_async);
+
+  if (query == NULL)
     {
-      g_task_return_boolean (task, TRUE);
+      g_task_return_new_error (task, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                               "Unsupported query");
       return;
     }
 
-  g_debug ("Trying to find source packages for %d apps", gs_app_list_length (list));
-  /* The appstream plugin sets some metadata on apps that come from desktop
-   * and metainfo files. If metadata is missing, just give-up */
-  for (int i = 0; i < gs_app_list_length (list); i++)
+  provides_type = gs_app_query_get_provides (query, &provides_tag);
+  if (provides_type != GS_APP_QUERY_PROVIDES_UNKNOWN)
     {
-      GsApp *app = gs_app_list_index (list, i);
-      if (gs_app_get_metadata_item (app, "appstream::source-file"))
-        gs_app_list_add (search_list, app);
-      else
-        g_warning ("Couldn't find 'appstream::source-file' metadata for %s",
-                   gs_app_get_unique_id (app));
+      gs_plugin_apk_list_provides (self, g_steal_pointer (&task), provides_type, provides_tag);
+      return;
     }
 
-  fn_array = g_new0 (const gchar *, gs_app_list_length (search_list) + 1);
-  for (int i = 0; i < gs_app_list_length (search_list); i++)
+  keywords = gs_app_query_get_keywords (query);
+  if (keywords != NULL)
     {
-      GsApp *app = gs_app_list_index (search_list, i);
-      fn_array[i] = gs_app_get_metadata_item (app, "appstream::source-file");
-      g_assert (fn_array[i]);
+      gs_plugin_apk_list_suggestions (self, g_steal_pointer (&task), keywords);
+      return;
     }
 
-  if (gs_app_list_length (search_list) == 0)
+  is_source = gs_app_query_get_is_source (query);
+  is_for_updates = gs_app_query_get_is_for_update (query);
+  is_installed = gs_app_query_get_is_installed (query);
+
+  /* Installed packages are listed by the appstream plugin, we only add
+   * the ones nothing needs anymore */
+  if (is_installed == GS_APP_QUERY_TRISTATE_TRUE &&
+      is_source == GS_APP_QUERY_TRISTATE_UNSET &&
+      is_for_updates == GS_APP_QUERY_TRISTATE_UNSET)
     {
-      g_task_return_boolean (task, TRUE);
+      gs_plugin_apk_list_orphans (self, g_steal_pointer (&task));
       return;
     }
 
-  apk_polkit2_call_search_files_owners (self->proxy, fn_array,
-                                        APK_POLKIT_CLIENT_DETAILS_FLAGS_NONE,
-                                        cancellable, apk_polkit_search_files_owners_cb,
-                                        g_steal_pointer (&task));
+  /* Currently only support a subset of query properties, and only one set at once.
+   * This is a pattern taken from upstream!
+   */
+  if (is_source == is_for_updates ||
+      is_source == GS_APP_QUERY_TRISTATE_FALSE ||
+      is_for_updates == GS_APP_QUERY_TRISTATE_FALSE)
+    {
+      g_task_return_new_error (task, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                               "Unsupported query");
+      return;
+    }
+
+  if (is_source == GS_APP_QUERY_TRISTATE_TRUE)
+    {
+      g_debug ("Listing repositories");
+      gs_plugin_apk_call_read_async (self, "ListRepositories", NULL, cancellable,
+                                     apk_polkit_list_repositories_cb,
+                                     g_steal_pointer (&task));
+    }
+  else if (is_for_updates == GS_APP_QUERY_TRISTATE_TRUE)
+    {
+      guint64 fingerprint = gs_plugin_apk_get_fingerprint (self);
+      guint64 *task_fingerprint;
+
+      /* Serve the last known set right away, as long as it was computed
+       * from the current database. Otherwise only the daemon knows */
+      gboolean have_snapshot = self->upgradable != NULL && !self->upgradable_stale &&
+                               fingerprint != 0 && fingerprint == self->upgradable_fingerprint;
+
+      gs_apk_metrics_cache_lookup (self->metrics, "upgradable",
+                                   have_snapshot, !have_snapshot);
+      if (have_snapshot)
+        {
+          g_debug ("Listing updates from snapshot");
+          g_task_return_pointer (task,
+                                 gs_plugin_apk_upgradable_to_list (self, self->upgradable),
+                                 g_object_unref);
+          return;
+        }
+
+      g_debug ("Listing updates");
+      task_fingerprint = g_new (guint64, 1);
+      *task_fingerprint = fingerprint;
+      g_task_set_task_data (task, task_fingerprint, g_free);
+      gs_plugin_apk_list_upgradable_async (self, cancellable,
+                                           apk_polkit_list_upgradable_cb,
+                                           g_steal_pointer (&task));
+    }
+  else
+    {
+      g_assert_not_reached ();
+    }
 }
 
-static void
-apk_polkit_search_files_owners_cb (GObject *object_source,
-                                   GAsyncResult *res,
-                                   gpointer user_data)
+/**
+ * gs_plugin_apk_provides_to_list:
+ * @self: The apk plugin
+ * @apk_index: The provides index
+ * @provides_tag: What to look for
+ *
+ * Returns: (transfer full): a new GsAppList with the packages providing
+ * @provides_tag according to @apk_index.
+ **/
+static GsAppList *
+gs_plugin_apk_provides_to_list (GsPluginApk *self,
+                                GsApkIndex *apk_index,
+                                const gchar *provides_tag)
 {
-  g_autoptr (GTask) task = g_steal_pointer (&user_data);
-  GsPluginApk *self = g_task_get_source_object (task);
-  g_autoptr (GError) local_error = NULL;
-  g_autoptr (GVariant) search_results = NULL;
-  GsAppList *search_list = g_task_get_task_data (task);
+  GsAppList *list = gs_app_list_new ();
+  GPtrArray *providers = gs_apk_index_lookup (apk_index, provides_tag);
 
-  if (!apk_polkit2_call_search_files_owners_finish (self->proxy, &search_results, res, &local_error))
+  for (guint i = 0; providers != NULL && i < providers->len; i++)
     {
-      g_task_return_error (task, g_steal_pointer (&local_error));
-      return;
+      GsApkIndexPackage *provider = g_ptr_array_index (providers, i);
+      g_autoptr (GsApp) app = index_package_to_app (GS_PLUGIN (self), provider, TRUE);
+
+      gs_app_list_add (list, app);
     }
+  g_debug ("%u packages provide %s", gs_app_list_length (list), provides_tag);
 
-  g_assert (g_variant_n_children (search_results) == gs_app_list_length (search_list));
-  for (int i = 0; i < gs_app_list_length (search_list); i++)
+  return list;
+}
+
+/**
+ * gs_plugin_apk_suggestions_to_list:
+ * @self: The apk plugin
+ * @apk_index: The index to search
+ * @keyword: A search term
+ *
+ * Users searching for a package by name commonly mistype it. If no package
+ * name contains @keyword, suggest the closest ones instead, allowing more
+ * typos the longer the keyword is. The suggestions get a low match value,
+ * so that they rank below anything else matching the search.
+ *
+ * Returns: (transfer full): a new GsAppList with the suggestions
+ **/
+static GsAppList *
+gs_plugin_apk_suggestions_to_list (GsPluginApk *self, GsApkIndex *apk_index, const gchar *keyword)
+{
+  GsAppList *list = gs_app_list_new ();
+  g_autoptr (GArray) matches = NULL;
+  gsize keyword_len = strlen (keyword);
+  guint max_distance;
+  gint64 trace_begin = GS_APK_TRACE_NOW ();
+
+  if (keyword_len < 4)
+    return list;
+  max_distance = keyword_len <= 5 ? 1 : keyword_len <= 10 ? 2 : 3;
+
+  matches = gs_apk_index_suggest (apk_index, keyword, max_distance,
+                                  GS_PLUGIN_APK_SUGGESTIONS_MAX,
+                                  GS_PLUGIN_APK_SUGGESTIONS_BUDGET_USEC);
+  for (guint i = 0; i < matches->len; i++)
     {
-      g_autoptr (GVariant) apk_pkg_variant = NULL;
-      GsApp *app = gs_app_list_index (search_list, i);
-      ApkdPackage apk_pkg = { NULL, NULL, NULL, NULL, NULL, NULL, 0, 0, Available };
+      GsApkIndexMatch *match = &g_array_index (matches, GsApkIndexMatch, i);
+      /* The match value only holds for this search, keep it out of the
+       * apps other results share */
+      g_autoptr (GsApp) app = index_package_to_app (GS_PLUGIN (self), match->package, FALSE);
 
-      apk_pkg_variant = g_variant_get_child_value (search_results, i);
-      if (!gs_plugin_apk_variant_to_apkd (apk_pkg_variant, &apk_pkg))
-        {
-          // TODO: We need fn_array if we want to print this info!
-          /* g_warning ("Couldn't find any package owning file '%s'", */
-          /*            fn_array[i]); */
-          continue;
-        }
-      g_debug ("Found pkgname '%s' for app %s: adding source and setting management plugin",
-               apk_pkg.name, gs_app_get_unique_id (app));
-      gs_app_add_source (app, apk_pkg.name);
-      gs_app_set_management_plugin (app, GS_PLUGIN (self));
+      gs_app_set_match_value (app, max_distance + 1 - match->distance);
+      gs_app_list_add (list, app);
     }
-  g_task_return_boolean (task, TRUE);
+  GS_APK_TRACE_MARK (suggest, trace_begin, gs_apk_index_get_n_packages (apk_index));
+  g_debug ("%u suggestions for '%s'", gs_app_list_length (list), keyword);
+
+  return list;
 }
 
-static gboolean
-fix_app_missing_appstream_finish (GsPlugin *plugin,
-                                  GAsyncResult *res,
-                                  GError **error)
+static void
+gs_plugin_apk_load_index_thread (GTask *task,
+                                 gpointer source_object,
+                                 gpointer task_data,
+                                 GCancellable *cancellable)
 {
-  return g_task_propagate_boolean (G_TASK (res), error);
+  const gchar *root = task_data;
+  GsApkIndex *apk_index;
+  GError *local_error = NULL;
+  gint64 trace_begin = GS_APK_TRACE_NOW ();
+
+  apk_index = gs_apk_index_load (root, &local_error);
+  if (apk_index == NULL)
+    {
+      g_task_return_error (task, local_error);
+      return;
+    }
+
+  GS_APK_TRACE_MARK (provides_index_load, trace_begin, gs_apk_index_get_n_packages (apk_index));
+  g_task_return_pointer (task, apk_index, (GDestroyNotify) gs_apk_index_unref);
 }
 
+static void gs_plugin_apk_start_index_load (GsPluginApk *self,
+                                            guint64 fingerprint);
+
 static void
-apk_polkit_get_packages_details_cb (GObject *object_source,
-                                    GAsyncResult *res,
-                                    gpointer user_data);
+gs_plugin_apk_index_loaded_cb (GObject *source_object,
+                               GAsyncResult *res,
+                               gpointer user_data)
+{
+  GsPluginApk *self = GS_PLUGIN_APK (source_object);
+  g_autoptr (GPtrArray) waiters = NULL;
+  g_autoptr (GError) local_error = NULL;
+  g_autoptr (GsApkIndex) apk_index = NULL;
+  guint64 fingerprint;
+
+  apk_index = g_task_propagate_pointer (G_TASK (res), &local_error);
+  if (apk_index != NULL)
+    {
+      g_debug ("Indexed %u provides of %u packages",
+               gs_apk_index_get_n_provides (apk_index),
+               gs_apk_index_get_n_packages (apk_index));
+      g_clear_pointer (&self->provides_index, gs_apk_index_unref);
+      self->provides_index = gs_apk_index_ref (apk_index);
+      self->provides_index_fingerprint = self->index_load_fingerprint;
+    }
+  self->index_load_fingerprint = 0;
+
+  waiters = g_steal_pointer (&self->index_waiters);
+  self->index_waiters = g_steal_pointer (&self->index_next_waiters);
+  self->index_next_waiters = g_ptr_array_new_with_free_func (g_object_unref);
+  for (guint i = 0; i < waiters->len; i++)
+    {
+      GTask *task = g_ptr_array_index (waiters, i);
+
+      if (local_error != NULL)
+        g_task_return_error (task, g_error_copy (local_error));
+      else
+        g_task_return_pointer (task, gs_apk_index_ref (apk_index),
+                               (GDestroyNotify) gs_apk_index_unref);
+    }
+
+  /* Whoever asked while the database was changing waits for the next
+   * load, which sees all of their changes. A callback above may have
+   * started it already. */
+  if (self->index_waiters->len == 0 || self->index_load_fingerprint != 0)
+    return;
+  fingerprint = gs_plugin_apk_get_fingerprint (self);
+  if (fingerprint != 0)
+    {
+      gs_plugin_apk_start_index_load (self, fingerprint);
+      return;
+    }
+  while (self->index_waiters->len > 0)
+    {
+      g_autoptr (GTask) task = g_ptr_array_steal_index (self->index_waiters, 0);
+      g_task_return_pointer (task, NULL, NULL);
+    }
+}
+
+static void
+gs_plugin_apk_start_index_load (GsPluginApk *self, guint64 fingerprint)
+{
+  g_autoptr (GTask) load_task = NULL;
+
+  self->index_load_fingerprint = fingerprint;
+  load_task = g_task_new (self, NULL, gs_plugin_apk_index_loaded_cb, NULL);
+  g_task_set_source_tag (load_task, gs_plugin_apk_ensure_index_async);
+  g_task_set_task_data (load_task, g_strdup (self->root), g_free);
+  g_task_run_in_thread (load_task, gs_plugin_apk_load_index_thread);
+}
 
 /**
- * refine_apk_packages_cb:
- * @plugin: The apk GsPlugin.
- * @list: The list of apps to refine.
- * @flags: TheGsPluginRefineFlags which determine what data we add.
- * @cancellable: GCancellable to cancel resolving what app owns the appstream/desktop file.
- * @task: The task to follow the asynchronous execution.
+ * gs_plugin_apk_ensure_index_async:
+ * @self: The apk plugin
+ * @cancellable: (nullable): A GCancellable
+ * @callback: Called once self->provides_index is up to date
+ * @user_data: Data for @callback
  *
- * Get details from apk package for a list of apps and fill-in requested refine data.
+ * Makes sure self->provides_index matches the apk database. The index is
+ * only built, in a thread, when the database changed since it was last
+ * built. Only one build runs at a time: callers asking for the database
+ * it is building share it, the others wait for the one after it.
+ * Lookups themselves don't need the daemon at all.
  **/
 static void
-refine_apk_packages_cb (GObject *object_source,
-                        GAsyncResult *res,
-                        gpointer user_data)
+gs_plugin_apk_ensure_index_async (GsPluginApk *self,
+                                  GCancellable *cancellable,
+                                  GAsyncReadyCallback callback,
+                                  gpointer user_data)
 {
-  g_autoptr (GTask) task = G_TASK (g_steal_pointer (&user_data));
-  GCancellable *cancellable = g_task_get_cancellable (task);
-  GsPluginApk *self = g_task_get_source_object (task);
-  g_autofree const gchar **source_array = NULL;
-  guint details_flags = APK_POLKIT_CLIENT_DETAILS_FLAGS_PACKAGE_STATE;
-  RefineData *data = g_task_get_task_data (task);
-  GsAppList *list = data->refine_apps_list;
-  GsAppList *missing_pkgname_list = data->missing_pkgname_list;
-  GsPluginRefineFlags flags = data->flags;
-  g_autoptr (GError) local_error = NULL;
+  g_autoptr (GTask) task = NULL;
+  guint64 fingerprint;
+  gboolean index_valid;
 
-  if (!fix_app_missing_appstream_finish (GS_PLUGIN (self), res, &local_error))
+  task = g_task_new (self, cancellable, callback, user_data);
+  g_task_set_source_tag (task, gs_plugin_apk_ensure_index_async);
+  /* Asked for explicitly, see gs_plugin_apk_peek_index() */
+  self->index_prefetch_suppressed = FALSE;
+
+  fingerprint = gs_plugin_apk_get_fingerprint (self);
+  if (fingerprint == 0)
     {
-      // TODO: We should print a warning, but continue execution!
-      // There's no reason failing to find some package should stop
-      // the rest of the processing.
-      g_task_return_error (task, g_steal_pointer (&local_error));
+      g_task_return_pointer (task, NULL, NULL);
       return;
     }
 
-  if (!(flags &
-        (GS_PLUGIN_REFINE_FLAGS_REQUIRE_VERSION |
-         GS_PLUGIN_REFINE_FLAGS_REQUIRE_ORIGIN |
-         GS_PLUGIN_REFINE_FLAGS_REQUIRE_DESCRIPTION |
-         GS_PLUGIN_REFINE_FLAGS_REQUIRE_SETUP_ACTION |
-         GS_PLUGIN_REFINE_FLAGS_REQUIRE_SIZE |
-         GS_PLUGIN_REFINE_FLAGS_REQUIRE_URL |
-         GS_PLUGIN_REFINE_FLAGS_REQUIRE_LICENSE)))
+  index_valid = self->provides_index != NULL && fingerprint == self->provides_index_fingerprint;
+  gs_apk_metrics_cache_lookup (self->metrics, "provides-index", index_valid, !index_valid);
+  if (index_valid)
     {
-      g_debug ("Ignoring refine");
-      g_task_return_boolean (task, TRUE);
+      g_task_return_pointer (task, gs_apk_index_ref (self->provides_index),
+                             (GDestroyNotify) gs_apk_index_unref);
       return;
     }
 
-  for (int i = 0; i < gs_app_list_length (missing_pkgname_list); i++)
+  if (self->index_load_fingerprint == 0)
     {
-      GsApp *app = gs_app_list_index (missing_pkgname_list, i);
-      if (gs_app_get_source_default (app) != NULL)
-        gs_app_list_add (list, app);
+      g_ptr_array_add (self->index_waiters, g_steal_pointer (&task));
+      gs_plugin_apk_start_index_load (self, fingerprint);
     }
-
-  if (gs_app_list_length (list) == 0)
+  else if (self->index_load_fingerprint == fingerprint)
     {
-      g_task_return_boolean (task, TRUE);
-      return;
+      g_ptr_array_add (self->index_waiters, g_steal_pointer (&task));
+    }
+  else
+    {
+      g_ptr_array_add (self->index_next_waiters, g_steal_pointer (&task));
     }
+}
 
-  if (flags & GS_PLUGIN_REFINE_FLAGS_REQUIRE_SETUP_ACTION)
-    details_flags |= APK_POLKIT_CLIENT_DETAILS_FLAGS_ALL;
-  if (flags & GS_PLUGIN_REFINE_FLAGS_REQUIRE_VERSION)
-    details_flags |= APK_POLKIT_CLIENT_DETAILS_FLAGS_VERSION;
-  if (flags & GS_PLUGIN_REFINE_FLAGS_REQUIRE_DESCRIPTION)
-    details_flags |= APK_POLKIT_CLIENT_DETAILS_FLAGS_DESCRIPTION;
-  if (flags & GS_PLUGIN_REFINE_FLAGS_REQUIRE_SIZE)
-    details_flags |= (APK_POLKIT_CLIENT_DETAILS_FLAGS_SIZE |
-                      APK_POLKIT_CLIENT_DETAILS_FLAGS_INSTALLED_SIZE);
-  if (flags & GS_PLUGIN_REFINE_FLAGS_REQUIRE_URL)
-    details_flags |= APK_POLKIT_CLIENT_DETAILS_FLAGS_URL;
-  if (flags & GS_PLUGIN_REFINE_FLAGS_REQUIRE_LICENSE)
-    details_flags |= APK_POLKIT_CLIENT_DETAILS_FLAGS_LICENSE;
+/**
+ * gs_plugin_apk_ensure_index_finish:
+ * @self: The apk plugin
+ * @res: The GAsyncResult
+ * @error: A GError
+ *
+ * The index stays valid for the caller even if a low memory warning drops
+ * self->provides_index in the meantime.
+ *
+ * Returns: (transfer full) (nullable): the index of the apk database.
+ * %NULL without setting @error if there is no apk database to index.
+ **/
+static GsApkIndex *
+gs_plugin_apk_ensure_index_finish (GsPluginApk *self,
+                                   GAsyncResult *res,
+                                   GError **error)
+{
+  return g_task_propagate_pointer (G_TASK (res), error);
+}
 
-  source_array = g_new0 (const gchar *, gs_app_list_length (list) + 1);
-  for (int i = 0; i < gs_app_list_length (list); i++)
+static void
+gs_plugin_apk_index_prefetched_cb (GObject *source_object,
+                                   GAsyncResult *res,
+                                   gpointer user_data)
+{
+  GsPluginApk *self = GS_PLUGIN_APK (source_object);
+  g_autoptr (GsApkIndex) apk_index = NULL;
+  g_autoptr (GError) local_error = NULL;
+
+  apk_index = gs_plugin_apk_ensure_index_finish (self, res, &local_error);
+  if (local_error != NULL)
+    g_debug ("Failed to index packages in the background: %s", local_error->message);
+}
+
+/**
+ * gs_plugin_apk_peek_index:
+ * @self: The apk plugin
+ * @allow_stale: Whether an index of an older apk database will do
+ *
+ * For callers which must not wait for the index to be built, as that
+ * parses the whole database. If self->provides_index does not match the
+ * apk database, it is rebuilt in the background for later callers, unless
+ * a memory warning dropped it.
+ *
+ * Returns: (transfer none) (nullable): the index, or %NULL if there is
+ * none that will do yet
+ **/
+static GsApkIndex *
+gs_plugin_apk_peek_index (GsPluginApk *self, gboolean allow_stale)
+{
+  guint64 fingerprint = gs_plugin_apk_get_fingerprint (self);
+
+  if (self->provides_index != NULL && fingerprint != 0 &&
+      fingerprint == self->provides_index_fingerprint)
     {
-      GsApp *app = gs_app_list_index (list, i);
-      g_debug ("Requesting details for %s", gs_app_get_unique_id (app));
-      source_array[i] = gs_app_get_source_default (app);
+      gs_apk_metrics_cache_lookup (self->metrics, "provides-index", 1, 0);
+      return self->provides_index;
     }
-  source_array[gs_app_list_length (list)] = NULL;
 
-  apk_polkit2_call_get_packages_details (self->proxy, source_array,
-                                         details_flags,
-                                         cancellable,
-                                         apk_polkit_get_packages_details_cb,
-                                         g_steal_pointer (&task));
+  /* Don't queue a prefetch behind a build that already covers it, nor
+   * right after a memory warning dropped the index */
+  if (fingerprint != 0 && !self->index_prefetch_suppressed &&
+      fingerprint != self->index_load_fingerprint &&
+      self->index_next_waiters->len == 0)
+    gs_plugin_apk_ensure_index_async (self, NULL, gs_plugin_apk_index_prefetched_cb, NULL);
+
+  return allow_stale ? self->provides_index : NULL;
 }
 
 static void
-apk_polkit_get_packages_details_cb (GObject *object_source,
-                                    GAsyncResult *res,
-                                    gpointer user_data)
+gs_plugin_apk_query_index_cb (GObject *source_object,
+                              GAsyncResult *res,
+                              gpointer user_data)
 {
-  g_autoptr (GTask) task = g_steal_pointer (&user_data);
+  g_autoptr (GTask) task = G_TASK (user_data);
   GsPluginApk *self = g_task_get_source_object (task);
+  const gchar *provides_tag = g_task_get_task_data (task);
+  g_autoptr (GsApkIndex) apk_index = NULL;
   g_autoptr (GError) local_error = NULL;
-  g_autoptr (GVariant) apk_pkgs = NULL;
-  RefineData *data = g_task_get_task_data (task);
-  GsAppList *list = data->refine_apps_list;
 
-  if (!apk_polkit2_call_get_packages_details_finish (self->proxy, &apk_pkgs, res, &local_error))
+  apk_index = gs_plugin_apk_ensure_index_finish (self, res, &local_error);
+  if (apk_index == NULL)
     {
-      g_task_return_error (task, g_steal_pointer (&local_error));
+      if (local_error != NULL)
+        g_task_return_error (task, g_steal_pointer (&local_error));
+      else
+        g_task_return_pointer (task, gs_app_list_new (), g_object_unref);
       return;
     }
 
-  g_assert (gs_app_list_length (list) == g_variant_n_children (apk_pkgs));
-  for (int i = 0; i < gs_app_list_length (list); i++)
-    {
-      g_autoptr (GVariant) apk_pkg_variant = NULL;
-      GsApp *app = gs_app_list_index (list, i);
-      const gchar *source = gs_app_get_source_default (app);
-      ApkdPackage apk_pkg = { NULL, NULL, NULL, NULL, NULL, NULL, 0, 0, Available };
+  g_task_return_pointer (task, gs_plugin_apk_provides_to_list (self, apk_index, provides_tag),
+                         g_object_unref);
+}
 
-      g_debug ("Refining %s", gs_app_get_unique_id (app));
-      apk_pkg_variant = g_variant_get_child_value (apk_pkgs, i);
-      if (!gs_plugin_apk_variant_to_apkd (apk_pkg_variant, &apk_pkg))
-        {
-          if (g_strcmp0 (source, apk_pkg.name) != 0)
-            g_warning ("source: '%s' and the pkg name: '%s' differ", source, apk_pkg.name);
-          continue;
-        }
+typedef struct
+{
+  gchar *root;                /* (owned) */
+  GsApkIndex *apk_index;      /* (owned) */
+  GsApkAppstream *appstream;  /* (unowned) */
+} AppstreamUpdateData;
 
-      if (g_strcmp0 (source, apk_pkg.name) != 0)
-        {
-          g_warning ("source: '%s' and the pkg name: '%s' differ", source, apk_pkg.name);
-          continue;
-        }
-      set_app_metadata (GS_PLUGIN (self), app, &apk_pkg);
-      /* We should only set generic apps for OS updates */
-      if (gs_app_get_kind (app) == AS_COMPONENT_KIND_GENERIC)
-        gs_app_set_special_kind (app, GS_APP_SPECIAL_KIND_OS_UPDATE);
+static void
+appstream_update_data_free (AppstreamUpdateData *data)
+{
+  g_free (data->root);
+  gs_apk_index_unref (data->apk_index);
+  g_free (data);
+}
+
+static void
+gs_plugin_apk_update_appstream_thread (GTask *task,
+                                       gpointer source_object,
+                                       gpointer task_data,
+                                       GCancellable *cancellable)
+{
+  AppstreamUpdateData *data = task_data;
+  g_autoptr (GHashTable) pkgnames = NULL;
+  g_autoptr (GBytes) xml = NULL;
+  g_autofree gchar *path = NULL;
+  GError *local_error = NULL;
+  gint64 trace_begin;
+
+  pkgnames = gs_apk_appstream_scan_pkgnames (data->root, cancellable);
+  trace_begin = GS_APK_TRACE_NOW ();
+  xml = gs_apk_appstream_update (data->appstream, data->apk_index, pkgnames, NULL);
+  GS_APK_TRACE_MARK (appstream_update, trace_begin, gs_apk_index_get_n_packages (data->apk_index));
+  if (xml == NULL)
+    {
+      g_debug ("AppStream for packages is up to date");
+      g_task_return_boolean (task, TRUE);
+      return;
     }
 
+  /* The appstream plugin also loads collections from here, and reloads
+   * them when they change */
+  path = g_build_filename (g_get_user_data_dir (), "swcatalog", "xml",
+                           "alpine-packages.xml.gz", NULL);
+  if (!gs_apk_appstream_write (xml, path, cancellable, &local_error))
+    {
+      g_task_return_error (task, local_error);
+      return;
+    }
+  g_debug ("Wrote AppStream for packages without any to %s", path);
   g_task_return_boolean (task, TRUE);
 }
 
-static gboolean
-gs_plugin_apk_launch_finish (GsPlugin *plugin,
-                             GAsyncResult *result,
-                             GError **error)
+/**
+ * gs_plugin_apk_appstream_done:
+ * @self: The apk plugin
+ *
+ * Hands self->appstream back to the main thread, and sheds what a low
+ * memory warning asked for while the update was running.
+ **/
+static void
+gs_plugin_apk_appstream_done (GsPluginApk *self)
 {
-  return gs_plugin_app_launch_filtered_finish (plugin, result, error);
+  self->appstream_in_flight = FALSE;
+  if (self->appstream_shed_pending)
+    {
+      gs_apk_appstream_shed (self->appstream);
+      self->appstream_shed_pending = FALSE;
+    }
 }
 
-static gboolean
-gs_plugin_apk_filter_desktop_file_cb (GsPlugin *plugin,
-                                      GsApp *app,
-                                      const gchar *filename,
-                                      GKeyFile *key_file,
-                                      gpointer user_data)
+static void
+gs_plugin_apk_appstream_updated_cb (GObject *source_object,
+                                    GAsyncResult *res,
+                                    gpointer user_data)
 {
-  return strstr (filename, "/snapd/") == NULL &&
-         strstr (filename, "/snap/") == NULL &&
-         strstr (filename, "/flatpak/") == NULL &&
-         g_key_file_has_group (key_file, "Desktop Entry") &&
-         !g_key_file_has_key (key_file, "Desktop Entry", "X-Flatpak", NULL) &&
-         !g_key_file_has_key (key_file, "Desktop Entry", "X-SnapInstanceName", NULL);
+  GsPluginApk *self = GS_PLUGIN_APK (source_object);
+  g_autoptr (GError) local_error = NULL;
+
+  if (!g_task_propagate_boolean (G_TASK (res), &local_error))
+    g_warning ("Failed to write AppStream for packages: %s", local_error->message);
+  gs_plugin_apk_appstream_done (self);
 }
 
 static void
-gs_plugin_apk_launch_async (GsPlugin *plugin,
-                            GsApp *app,
-                            GsPluginLaunchFlags flags,
-                            GCancellable *cancellable,
-                            GAsyncReadyCallback callback,
-                            gpointer user_data)
-
+gs_plugin_apk_appstream_index_cb (GObject *source_object,
+                                  GAsyncResult *res,
+                                  gpointer user_data)
 {
-  gs_plugin_app_launch_filtered_async (plugin, app, flags, gs_plugin_apk_filter_desktop_file_cb, NULL, cancellable, callback, user_data);
-}
+  GsPluginApk *self = GS_PLUGIN_APK (source_object);
+  g_autoptr (GsApkIndex) apk_index = NULL;
+  g_autoptr (GError) local_error = NULL;
+  g_autoptr (GTask) update_task = NULL;
+  AppstreamUpdateData *data;
 
-static GsAppList *
-gs_plugin_apk_list_apps_finish (GsPlugin *plugin,
-                                GAsyncResult *result,
-                                GError **error)
-{
-  return g_task_propagate_pointer (G_TASK (result), error);
+  apk_index = gs_plugin_apk_ensure_index_finish (self, res, &local_error);
+  if (apk_index == NULL)
+    {
+      if (local_error != NULL)
+        g_warning ("Failed to index packages for AppStream: %s", local_error->message);
+      gs_plugin_apk_appstream_done (self);
+      return;
+    }
+
+  /* The thread keeps its own reference, the index may be replaced or
+   * dropped under memory pressure meanwhile */
+  data = g_new0 (AppstreamUpdateData, 1);
+  data->root = g_strdup (self->root);
+  data->apk_index = g_steal_pointer (&apk_index);
+  data->appstream = self->appstream;
+
+  update_task = g_task_new (self, NULL, gs_plugin_apk_appstream_updated_cb, NULL);
+  g_task_set_source_tag (update_task, gs_plugin_apk_update_appstream);
+  g_task_set_task_data (update_task, data, (GDestroyNotify) appstream_update_data_free);
+  g_task_run_in_thread (update_task, gs_plugin_apk_update_appstream_thread);
 }
 
+/**
+ * gs_plugin_apk_update_appstream:
+ * @self: The apk plugin
+ *
+ * Packages without AppStream data only show up as updates, the appstream
+ * plugin doesn't know them. Generates a collection for them from the
+ * package index in a thread, leaving out the packages the distribution's
+ * catalogs describe. The file is only rewritten if a package was added,
+ * removed or changed version, see gs_apk_appstream_update(). Until the
+ * update is done, self->appstream belongs to the thread.
+ **/
 static void
-apk_polkit_list_repositories_cb (GObject *object_source,
-                                 GAsyncResult *res,
-                                 gpointer user_data);
+gs_plugin_apk_update_appstream (GsPluginApk *self)
+{
+  if (self->appstream_in_flight)
+    return;
 
-static void
-apk_polkit_list_upgradable_cb (GObject *object_source,
-                               GAsyncResult *res,
-                               gpointer user_data);
+  self->appstream_in_flight = TRUE;
+  gs_plugin_apk_ensure_index_async (self, NULL, gs_plugin_apk_appstream_index_cb, NULL);
+}
 
+/**
+ * gs_plugin_apk_list_provides:
+ * @self: The apk plugin
+ * @task: (transfer full): The list-apps task
+ * @provides_type: The kind of query
+ * @provides_tag: What to look for
+ *
+ * Answers what-provides queries, e.g. from the "command not found" handler,
+ * with the packages whose `p:` field lists @provides_tag: `cmd:foo`,
+ * `so:libfoo.so.1`, `pc:foo` or a plain package name. Alpine has no
+ * provides for codecs, fonts or MIME types, so only package name queries
+ * are supported.
+ **/
 static void
-gs_plugin_apk_list_apps_async (GsPlugin *plugin,
-                               GsAppQuery *query,
-                               GsPluginListAppsFlags flags,
-                               GCancellable *cancellable,
-                               GAsyncReadyCallback callback,
-                               gpointer user_data)
+gs_plugin_apk_list_provides (GsPluginApk *self,
+                             GTask *task,
+                             GsAppQueryProvidesType provides_type,
+                             const gchar *provides_tag)
 {
-  GsPluginApk *self = GS_PLUGIN_APK (plugin);
-  g_autoptr (GTask) task = NULL;
-  gboolean is_source, is_for_updates;
-
-  task = g_task_new (plugin, cancellable, callback, user_data);
-  g_task_set_source_tag (task, gs_plugin_apk_list_apps_async);
-
-  if (query == NULL)
+  if (provides_type != GS_APP_QUERY_PROVIDES_PACKAGE_NAME || provides_tag == NULL)
     {
       g_task_return_new_error (task, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
                                "Unsupported query");
+      g_object_unref (task);
       return;
     }
 
-  is_source = gs_app_query_get_is_source (query);
-  is_for_updates = gs_app_query_get_is_for_update (query);
+  g_task_set_task_data (task, g_strdup (provides_tag), g_free);
+  gs_plugin_apk_ensure_index_async (self, g_task_get_cancellable (task),
+                                    gs_plugin_apk_query_index_cb, task);
+}
 
-  /* Currently only support a subset of query properties, and only one set at once.
-   * This is a pattern taken from upstream!
-   */
-  if (is_source == is_for_updates ||
-      is_source == GS_APP_QUERY_TRISTATE_FALSE ||
-      is_for_updates == GS_APP_QUERY_TRISTATE_FALSE)
+/**
+ * gs_plugin_apk_list_suggestions:
+ * @self: The apk plugin
+ * @task: (transfer full): The list-apps task
+ * @keywords: The search terms
+ *
+ * Keyword searches are answered by other plugins, we only add suggestions
+ * for a mistyped package name, see gs_plugin_apk_suggestions_to_list().
+ * Package names are a single word, so only single keyword searches get any.
+ * The search never waits for the index: without one, there are no
+ * suggestions until it was built in the background.
+ **/
+static void
+gs_plugin_apk_list_suggestions (GsPluginApk *self,
+                                GTask *task,
+                                const gchar *const *keywords)
+{
+  GsApkIndex *apk_index;
+  g_autofree gchar *keyword = NULL;
+
+  apk_index = g_strv_length ((gchar **) keywords) == 1 ? gs_plugin_apk_peek_index (self, TRUE) : NULL;
+  if (apk_index == NULL)
     {
-      g_task_return_new_error (task, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
-                               "Unsupported query");
+      g_task_return_pointer (task, gs_app_list_new (), g_object_unref);
+      g_object_unref (task);
       return;
     }
 
-  if (is_source == GS_APP_QUERY_TRISTATE_TRUE)
-    {
-      g_debug ("Listing repositories");
-      apk_polkit2_call_list_repositories (self->proxy, cancellable,
-                                          apk_polkit_list_repositories_cb,
-                                          g_steal_pointer (&task));
-    }
-  else if (is_for_updates == GS_APP_QUERY_TRISTATE_TRUE)
+  keyword = g_ascii_strdown (keywords[0], -1);
+  g_task_return_pointer (task, gs_plugin_apk_suggestions_to_list (self, apk_index, keyword),
+                         g_object_unref);
+  g_object_unref (task);
+}
+
+/**
+ * gs_plugin_apk_orphans_to_list:
+ * @self: The apk plugin
+ * @apk_index: The provides index
+ *
+ * Returns: (transfer full): a new GsAppList with the installed packages
+ * which are no longer needed as a single proxy app, empty if there are
+ * none.
+ **/
+static GsAppList *
+gs_plugin_apk_orphans_to_list (GsPluginApk *self, GsApkIndex *apk_index)
+{
+  GsAppList *list = gs_app_list_new ();
+  g_autoptr (GPtrArray) orphans = NULL;
+  g_autoptr (GsApp) proxy = NULL;
+  g_autofree gchar *summary = NULL;
+  guint64 size = 0;
+
+  orphans = gs_apk_index_get_orphans (apk_index);
+  g_debug ("%u packages are not needed anymore", orphans->len);
+  if (orphans->len == 0)
+    return list;
+
+  /* Removable as a whole, in a single transaction, see
+   * gs_plugin_apk_uninstall_apps_async() */
+  proxy = gs_app_new ("org.alpinelinux.apk.orphans");
+  gs_app_set_kind (proxy, AS_COMPONENT_KIND_GENERIC);
+  gs_app_set_bundle_kind (proxy, AS_BUNDLE_KIND_PACKAGE);
+  gs_app_set_scope (proxy, AS_COMPONENT_SCOPE_SYSTEM);
+  gs_app_add_quirk (proxy, GS_APP_QUIRK_IS_PROXY);
+  gs_app_set_management_plugin (proxy, GS_PLUGIN (self));
+  gs_app_set_metadata (proxy, "GnomeSoftware::PackagingFormat", "apk");
+  gs_app_set_name (proxy, GS_APP_QUALITY_NORMAL, _ ("Unused Packages"));
+  summary = g_strdup_printf (ngettext ("%u package is not needed by any installed software",
+                                       "%u packages are not needed by any installed software",
+                                       orphans->len),
+                             orphans->len);
+  gs_app_set_summary (proxy, GS_APP_QUALITY_NORMAL, summary);
+  for (guint i = 0; i < orphans->len; i++)
     {
-      /* I believe we have to invalidate the cache here! */
-      g_debug ("Listing updates");
-      apk_polkit2_call_list_upgradable_packages (self->proxy,
-                                                 APK_POLKIT_CLIENT_DETAILS_FLAGS_ALL,
-                                                 cancellable,
-                                                 apk_polkit_list_upgradable_cb,
-                                                 g_steal_pointer (&task));
+      GsApkIndexPackage *package = g_ptr_array_index (orphans, i);
+      g_autoptr (GsApp) app = index_package_to_app (GS_PLUGIN (self), package, TRUE);
+
+      size += package->installed_size;
+      gs_app_add_related (proxy, app);
     }
-  else
+  gs_app_set_size_installed (proxy, GS_SIZE_TYPE_VALID, size);
+  gs_app_set_state (proxy, GS_APP_STATE_INSTALLED);
+  gs_app_list_add (list, proxy);
+
+  return list;
+}
+
+static void
+gs_plugin_apk_orphans_indexed_cb (GObject *source_object,
+                                  GAsyncResult *res,
+                                  gpointer user_data)
+{
+  GsPluginApk *self = GS_PLUGIN_APK (source_object);
+  g_autoptr (GsApkIndex) apk_index = NULL;
+  g_autoptr (GError) local_error = NULL;
+
+  self->orphans_reload_pending = FALSE;
+  apk_index = gs_plugin_apk_ensure_index_finish (self, res, &local_error);
+  if (apk_index == NULL)
     {
-      g_assert_not_reached ();
+      if (local_error != NULL)
+        g_debug ("Failed to index packages for the orphans: %s", local_error->message);
+      return;
     }
+
+  /* The installed apps are listed again, now with the orphans */
+  gs_plugin_reload (GS_PLUGIN (self));
 }
 
+/**
+ * gs_plugin_apk_list_orphans:
+ * @self: The apk plugin
+ * @task: (transfer full): The list-apps task
+ *
+ * Lists the installed packages which are no longer reachable from the
+ * world, e.g. dependencies of removed software, as a single proxy app.
+ * Listing the installed apps must not wait for the index to be built, so
+ * while it is the list is empty, and the installed apps are reloaded
+ * once it is built.
+ **/
 static void
-apk_polkit_list_upgradable_cb (GObject *object_source,
-                               GAsyncResult *res,
-                               gpointer user_data)
+gs_plugin_apk_list_orphans (GsPluginApk *self, GTask *task)
 {
-  g_autoptr (GTask) task = G_TASK (g_steal_pointer (&user_data));
-  GsPluginApk *self = g_task_get_source_object (task);
-  g_autoptr (GVariant) upgradable_packages = NULL;
-  g_autoptr (GError) local_error = NULL;
-  g_autoptr (GsAppList) list = gs_app_list_new ();
+  GsApkIndex *apk_index = gs_plugin_apk_peek_index (self, FALSE);
 
-  if (!apk_polkit2_call_list_upgradable_packages_finish (self->proxy,
-                                                         &upgradable_packages,
-                                                         res,
-                                                         &local_error))
+  if (apk_index == NULL)
     {
-      g_dbus_error_strip_remote_error (local_error);
-      g_task_return_error (task, g_steal_pointer (&local_error));
+      if (!self->orphans_reload_pending)
+        {
+          self->orphans_reload_pending = TRUE;
+          gs_plugin_apk_ensure_index_async (self, NULL, gs_plugin_apk_orphans_indexed_cb, NULL);
+        }
+      g_task_return_pointer (task, gs_app_list_new (), g_object_unref);
+      g_object_unref (task);
       return;
     }
 
+  g_task_return_pointer (task, gs_plugin_apk_orphans_to_list (self, apk_index),
+                         g_object_unref);
+  g_object_unref (task);
+}
+
+/**
+ * gs_plugin_apk_upgradable_to_list:
+ * @self: The apk plugin
+ * @upgradable: An `aa{sv}` of upgradable packages
+ *
+ * Converts the upgradable set into apps.
+ *
+ * Returns: (transfer full): a new GsAppList
+ **/
+static GsAppList *
+gs_plugin_apk_upgradable_to_list (GsPluginApk *self, GVariant *upgradable)
+{
+  GsAppList *list = gs_app_list_new ();
+  gint64 trace_begin = GS_APK_TRACE_NOW ();
+
   g_debug ("Found %" G_GSIZE_FORMAT " upgradable packages",
-           g_variant_n_children (upgradable_packages));
+           g_variant_n_children (upgradable));
 
-  for (gsize i = 0; i < g_variant_n_children (upgradable_packages); i++)
+  for (gsize i = 0; i < g_variant_n_children (upgradable); i++)
     {
       g_autoptr (GVariant) dict = NULL;
       GsApp *app;
       ApkdPackage pkg = { NULL, NULL, NULL, NULL, NULL, NULL, 0, 0, Available };
 
-      dict = g_variant_get_child_value (upgradable_packages, i);
+      dict = g_variant_get_child_value (upgradable, i);
       /* list_upgradable_packages doesn't have array input, thus no error output */
       if (!gs_plugin_apk_variant_to_apkd (dict, &pkg))
         g_assert_not_reached ();
@@ -1334,8 +3953,111 @@ apk_polkit_list_upgradable_cb (GObject *object_source,
           gs_app_list_add (list, app);
         }
     }
+  GS_APK_TRACE_MARK (list_updates_decode, trace_begin, gs_app_list_length (list));
 
-  g_task_return_pointer (task, g_steal_pointer (&list), g_object_unref);
+  return list;
+}
+
+static void
+apk_polkit_list_upgradable_cb (GObject *object_source,
+                               GAsyncResult *res,
+                               gpointer user_data)
+{
+  g_autoptr (GTask) task = G_TASK (g_steal_pointer (&user_data));
+  GsPluginApk *self = g_task_get_source_object (task);
+  guint64 *fingerprint = g_task_get_task_data (task);
+  g_autoptr (GVariant) upgradable_packages = NULL;
+  g_autoptr (GError) local_error = NULL;
+
+  upgradable_packages = gs_plugin_apk_list_upgradable_finish (self, res, &local_error);
+  if (upgradable_packages == NULL)
+    {
+      g_task_return_error (task, g_steal_pointer (&local_error));
+      return;
+    }
+
+  gs_plugin_apk_set_upgradable (self, upgradable_packages, *fingerprint);
+  g_task_return_pointer (task,
+                         gs_plugin_apk_upgradable_to_list (self, self->upgradable),
+                         g_object_unref);
+}
+
+/**
+ * gs_plugin_apk_reconcile_upgradable:
+ * @self: The apk plugin
+ * @fingerprint: The current database fingerprint
+ *
+ * Recomputes the upgradable set in the background after an operation may
+ * have changed it, and emits updates-changed
+ * if it turned out to be different. A request arriving while one is in
+ * flight runs once that one is done, as its result may already be outdated.
+ **/
+static void
+gs_plugin_apk_reconcile_upgradable (GsPluginApk *self, guint64 fingerprint)
+{
+  g_autoptr (GTask) task = NULL;
+  guint64 *task_fingerprint = g_new (guint64, 1);
+
+  if (self->reconcile_in_flight)
+    {
+      self->reconcile_queued = TRUE;
+      g_free (task_fingerprint);
+      return;
+    }
+
+  g_debug ("Upgradable snapshot is stale, reconciling in the background");
+  self->reconcile_in_flight = TRUE;
+
+  *task_fingerprint = fingerprint;
+  task = g_task_new (self, NULL, NULL, NULL);
+  g_task_set_source_tag (task, gs_plugin_apk_reconcile_upgradable);
+  g_task_set_task_data (task, task_fingerprint, g_free);
+  gs_plugin_apk_list_upgradable_async (self, NULL,
+                                       apk_polkit_reconcile_upgradable_cb,
+                                       g_steal_pointer (&task));
+}
+
+static void
+apk_polkit_reconcile_upgradable_cb (GObject *object_source,
+                                    GAsyncResult *res,
+                                    gpointer user_data)
+{
+  g_autoptr (GTask) task = G_TASK (g_steal_pointer (&user_data));
+  GsPluginApk *self = g_task_get_source_object (task);
+  guint64 *fingerprint = g_task_get_task_data (task);
+  g_autoptr (GVariant) upgradable_packages = NULL;
+  g_autoptr (GError) local_error = NULL;
+
+  self->reconcile_in_flight = FALSE;
+
+  upgradable_packages = gs_plugin_apk_list_upgradable_finish (self, res, &local_error);
+  if (upgradable_packages == NULL)
+    {
+      g_warning ("Failed to reconcile upgradable packages: %s", local_error->message);
+      /* Without a new set there is nothing to diff against, so let
+       * gnome-software find out itself */
+      if (self->upgradable_stale)
+        gs_plugin_updates_changed (GS_PLUGIN (self));
+    }
+  else if (gs_plugin_apk_set_upgradable (self, upgradable_packages, *fingerprint))
+    {
+      gs_plugin_updates_changed (GS_PLUGIN (self));
+    }
+  else
+    {
+      g_debug ("Upgradable set unchanged, not emitting updates-changed");
+    }
+
+  if (self->reconcile_queued)
+    {
+      self->reconcile_queued = FALSE;
+      gs_plugin_apk_reconcile_upgradable (self, gs_plugin_apk_get_fingerprint (self));
+    }
+
+  if (local_error != NULL)
+    g_task_return_error (task, g_steal_pointer (&local_error));
+  else
+    g_task_return_boolean (task, TRUE);
 }
 
 static void
@@ -1346,24 +4068,27 @@ apk_polkit_list_repositories_cb (GObject *object_source,
   g_autoptr (GTask) task = G_TASK (g_steal_pointer (&user_data));
   GsPluginApk *self = g_task_get_source_object (task);
   g_autoptr (GError) local_error = NULL;
+  g_autoptr (GVariant) reply = NULL;
   g_autoptr (GVariant) repositories = NULL;
   g_autoptr (GsAppList) list = gs_app_list_new ();
+  gint64 trace_begin;
 
-  if (!apk_polkit2_call_list_repositories_finish (self->proxy,
-                                                  &repositories, res,
-                                                  &local_error))
+  reply = gs_plugin_apk_call_read_finish (self, res, NULL, &local_error);
+  if (reply == NULL)
     {
       g_dbus_error_strip_remote_error (local_error);
       g_task_return_error (task, g_steal_pointer (&local_error));
       return;
     }
+  repositories = g_variant_get_child_value (reply, 0);
 
+  trace_begin = GS_APK_TRACE_NOW ();
   for (gsize i = 0; i < g_variant_n_children (repositories); i++)
     {
-      g_autofree gchar *description = NULL;
+      const gchar *description = NULL;
       g_autofree gchar *id = NULL;
       g_autofree gchar *repo_displayname = NULL;
-      g_autofree gchar *url = NULL;
+      const gchar *url = NULL;
       g_autofree gchar *url_path = NULL;
       g_autofree gchar *url_scheme = NULL;
       g_autoptr (GsApp) app = NULL;
@@ -1371,9 +4096,10 @@ apk_polkit_list_repositories_cb (GObject *object_source,
       gboolean enabled = FALSE;
 
       value_tuple = g_variant_get_child_value (repositories, i);
-      g_variant_get (value_tuple, "(bss)", &enabled, &description, &url);
+      g_variant_get (value_tuple, "(b&s&s)", &enabled, &description, &url);
 
       app = gs_plugin_cache_lookup (GS_PLUGIN (self), url);
+      gs_apk_metrics_cache_lookup (self->metrics, "repositories", app != NULL, app == NULL);
       if (app)
         {
           gs_app_set_state (app, enabled ? GS_APP_STATE_INSTALLED : GS_APP_STATE_AVAILABLE);
@@ -1437,6 +4163,7 @@ apk_polkit_list_repositories_cb (GObject *object_source,
       gs_app_list_add (list, g_steal_pointer (&app));
     }
 
+  GS_APK_TRACE_MARK (list_repositories_decode, trace_begin, gs_app_list_length (list));
   g_debug ("Added repositories");
 
   g_task_return_pointer (task, g_steal_pointer (&list), g_object_unref);
@@ -1573,6 +4300,8 @@ apk_polkit_add_repository_cb (GObject *object_source,
       return;
     }
   g_debug ("Installed repository %s", url);
+  gs_plugin_apk_track_database (self);
+  gs_plugin_apk_invalidate_not_found (self);
   gs_app_set_state (repo, GS_APP_STATE_INSTALLED);
 
   g_task_return_boolean (task, TRUE);
@@ -1598,6 +4327,8 @@ apk_polkit_remove_repository_cb (GObject *object_source,
     }
 
   g_debug ("Removed repository %s", url);
+  gs_plugin_apk_track_database (self);
+  gs_plugin_apk_invalidate_not_found (self);
   gs_app_set_state (repo, GS_APP_STATE_AVAILABLE);
 
   g_task_return_boolean (task, TRUE);
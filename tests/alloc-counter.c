@@ -0,0 +1,201 @@
+/*
+ * Copyright (C) 2024 The gnome-software-plugin-apk contributors
+ *
+ * SPDX-License-Identifier: GPL-2.0+
+ */
+
+/*
+ * Counts heap allocations when loaded with LD_PRELOAD. gs-bench-apk looks
+ * up gs_alloc_counter_get() at runtime, and reports allocations per
+ * processed package when it finds it. The real allocator is looked up with
+ * dlsym(RTLD_NEXT), which works with glibc and musl alike. dlsym() may
+ * allocate itself, so whatever is asked for while the lookup runs is served
+ * from a small static arena and never handed to the real allocator.
+ */
+
+#define _GNU_SOURCE
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+/* Big enough for what dlsym() allocates, e.g. glibc's dlerror buffer */
+#define BOOTSTRAP_ARENA_SIZE 8192
+#define BOOTSTRAP_ALIGNMENT 16
+
+typedef void *(*MallocFunc) (size_t size);
+typedef void *(*CallocFunc) (size_t n_members, size_t size);
+typedef void *(*ReallocFunc) (void *ptr, size_t size);
+typedef void (*FreeFunc) (void *ptr);
+typedef int (*PosixMemalignFunc) (void **ptr, size_t alignment, size_t size);
+
+static MallocFunc real_malloc;
+static CallocFunc real_calloc;
+static ReallocFunc real_realloc;
+static FreeFunc real_free;
+static PosixMemalignFunc real_posix_memalign;
+
+static _Alignas (BOOTSTRAP_ALIGNMENT) unsigned char bootstrap_arena[BOOTSTRAP_ARENA_SIZE];
+static size_t bootstrap_used;
+static int resolving;
+
+static uint64_t n_allocs;
+static uint64_t n_bytes;
+
+static inline void
+count (size_t size)
+{
+  __atomic_add_fetch (&n_allocs, 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch (&n_bytes, size, __ATOMIC_RELAXED);
+}
+
+void
+gs_alloc_counter_get (uint64_t *out_allocs, uint64_t *out_bytes)
+{
+  *out_allocs = __atomic_load_n (&n_allocs, __ATOMIC_RELAXED);
+  *out_bytes = __atomic_load_n (&n_bytes, __ATOMIC_RELAXED);
+}
+
+static int
+is_bootstrap (const void *ptr)
+{
+  return (const unsigned char *) ptr >= bootstrap_arena &&
+         (const unsigned char *) ptr < bootstrap_arena + BOOTSTRAP_ARENA_SIZE;
+}
+
+/* Each block is preceded by its size, so realloc() knows what to copy.
+ * The arena is zero-initialised and never reused, which calloc() relies on. */
+static void *
+bootstrap_alloc (size_t size)
+{
+  size_t rounded;
+  size_t offset;
+
+  if (size > BOOTSTRAP_ARENA_SIZE)
+    return NULL;
+  rounded = (size + BOOTSTRAP_ALIGNMENT - 1) & ~(size_t) (BOOTSTRAP_ALIGNMENT - 1);
+  offset = __atomic_fetch_add (&bootstrap_used, BOOTSTRAP_ALIGNMENT + rounded, __ATOMIC_RELAXED);
+  if (offset + BOOTSTRAP_ALIGNMENT + rounded > BOOTSTRAP_ARENA_SIZE)
+    return NULL;
+  *(size_t *) (bootstrap_arena + offset) = size;
+  return bootstrap_arena + offset + BOOTSTRAP_ALIGNMENT;
+}
+
+static size_t
+bootstrap_size (const void *ptr)
+{
+  return *(const size_t *) ((const unsigned char *) ptr - BOOTSTRAP_ALIGNMENT);
+}
+
+__attribute__ ((constructor)) static void
+resolve (void)
+{
+  if (real_malloc != NULL || resolving)
+    return;
+
+  resolving = 1;
+  real_calloc = (CallocFunc) dlsym (RTLD_NEXT, "calloc");
+  real_realloc = (ReallocFunc) dlsym (RTLD_NEXT, "realloc");
+  real_free = (FreeFunc) dlsym (RTLD_NEXT, "free");
+  real_posix_memalign = (PosixMemalignFunc) dlsym (RTLD_NEXT, "posix_memalign");
+  /* Last, as it tells the other functions that the lookup is done */
+  __atomic_store_n (&real_malloc, (MallocFunc) dlsym (RTLD_NEXT, "malloc"), __ATOMIC_RELEASE);
+  resolving = 0;
+}
+
+/* Whether to serve from the arena, as the real allocator isn't known yet */
+static int
+needs_bootstrap (void)
+{
+  if (__atomic_load_n (&real_malloc, __ATOMIC_ACQUIRE) != NULL)
+    return 0;
+  resolve ();
+  return real_malloc == NULL;
+}
+
+void *
+malloc (size_t size)
+{
+  if (needs_bootstrap ())
+    return bootstrap_alloc (size);
+  count (size);
+  return real_malloc (size);
+}
+
+void *
+calloc (size_t n_members, size_t size)
+{
+  /* Let the real calloc() fail on overflow, and don't count it */
+  if (size != 0 && n_members > SIZE_MAX / size)
+    {
+      if (needs_bootstrap ())
+        {
+          errno = ENOMEM;
+          return NULL;
+        }
+      return real_calloc (n_members, size);
+    }
+
+  if (needs_bootstrap ())
+    return bootstrap_alloc (n_members * size);
+  count (n_members * size);
+  return real_calloc (n_members, size);
+}
+
+void *
+realloc (void *ptr, size_t size)
+{
+  void *mem;
+
+  if (ptr == NULL || !is_bootstrap (ptr))
+    {
+      if (needs_bootstrap ())
+        return bootstrap_alloc (size);
+      count (size);
+      return real_realloc (ptr, size);
+    }
+
+  /* Move blocks out of the arena, which never frees anything */
+  mem = malloc (size);
+  if (mem != NULL)
+    memcpy (mem, ptr, bootstrap_size (ptr) < size ? bootstrap_size (ptr) : size);
+  return mem;
+}
+
+void
+free (void *ptr)
+{
+  if (ptr == NULL || is_bootstrap (ptr))
+    return;
+  real_free (ptr);
+}
+
+int
+posix_memalign (void **ptr, size_t alignment, size_t size)
+{
+  if (needs_bootstrap ())
+    {
+      if (alignment > BOOTSTRAP_ALIGNMENT)
+        return ENOMEM;
+      *ptr = bootstrap_alloc (size);
+      return *ptr != NULL ? 0 : ENOMEM;
+    }
+  count (size);
+  return real_posix_memalign (ptr, alignment, size);
+}
+
+void *
+aligned_alloc (size_t alignment, size_t size)
+{
+  void *mem;
+
+  return posix_memalign (&mem, alignment < sizeof (void *) ? sizeof (void *) : alignment, size) == 0 ? mem : NULL;
+}
+
+void *
+memalign (size_t alignment, size_t size)
+{
+  return aligned_alloc (alignment, size);
+}
@@ -0,0 +1,960 @@
+/*
+ * Copyright (C) 2024 The gnome-software-plugin-apk contributors
+ *
+ * SPDX-License-Identifier: GPL-2.0+
+ */
+
+/*
+ * A GDBus implementation of dev.Cogitri.apkPolkit2 for load testing. Unlike
+ * apkpolkit2.py, it can serve large package universes without the mock
+ * itself dominating the measurements. The universe is either synthetic
+ * (--packages) or loaded from a key file (--fixture). Every method can be
+ * given an artificial latency (--latency Method=ms) and a failure rate
+ * (--fail Method=rate), so slow and failing daemons can be measured too.
+ *
+ * With --replay, calls are answered from a recording made by the plugin with
+ * GS_PLUGIN_APK_RECORD=FILE, after the latency they originally had.
+ */
+
+#define _GNU_SOURCE
+
+#include "gs-apk-call-monitor.h"
+#include "gs-apk-table.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <gio/gio.h>
+#include <gio/gunixfdlist.h>
+#include <glib/gstdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define BUS_NAME "dev.Cogitri.apkPolkit2"
+#define OBJECT_PATH "/dev/Cogitri/apkPolkit2"
+#define ERROR_NAME "dev.Cogitri.apkPolkit2.Error.Failed"
+
+/* Keep in sync with ApkPackageState in the plugin */
+typedef enum
+{
+  STATE_AVAILABLE,
+  STATE_INSTALLED,
+  STATE_PENDING_INSTALL,
+  STATE_PENDING_REMOVAL,
+  STATE_UPGRADABLE,
+  STATE_DOWNGRADABLE,
+  STATE_REINSTALLABLE,
+} MockPackageState;
+
+static const gchar introspection_xml[] =
+    "<node>"
+    "  <interface name='dev.Cogitri.apkPolkit2'>"
+    "    <method name='AddPackages'>"
+    "      <arg type='as' name='packages' direction='in'/>"
+    "    </method>"
+    "    <method name='DeletePackages'>"
+    "      <arg type='as' name='packages' direction='in'/>"
+    "    </method>"
+    "    <method name='UpgradePackages'>"
+    "      <arg type='as' name='packages' direction='in'/>"
+    "    </method>"
+    "    <method name='GetPackagesDetails'>"
+    "      <arg type='as' name='packages' direction='in'/>"
+    "      <arg type='u' name='requestedProperties' direction='in'/>"
+    "      <arg type='aa{sv}' name='details' direction='out'/>"
+    "    </method>"
+    "    <method name='ListUpgradablePackages'>"
+    "      <arg type='u' name='requestedProperties' direction='in'/>"
+    "      <arg type='aa{sv}' name='packages' direction='out'/>"
+    "    </method>"
+    "    <method name='ListPackagesTable'>"
+    "      <arg type='s' name='scope' direction='in'/>"
+    "      <arg type='u' name='requestedProperties' direction='in'/>"
+    "      <arg type='h' name='table' direction='out'/>"
+    "    </method>"
+    "    <method name='SearchFilesOwners'>"
+    "      <arg type='as' name='paths' direction='in'/>"
+    "      <arg type='u' name='requestedProperties' direction='in'/>"
+    "      <arg type='aa{sv}' name='packages' direction='out'/>"
+    "    </method>"
+    "    <method name='ListRepositories'>"
+    "      <arg type='a(bss)' name='repositories' direction='out'/>"
+    "    </method>"
+    "    <method name='AddRepository'>"
+    "      <arg type='s' name='url' direction='in'/>"
+    "    </method>"
+    "    <method name='RemoveRepository'>"
+    "      <arg type='s' name='url' direction='in'/>"
+    "    </method>"
+    "    <method name='UpdateRepositories'/>"
+    "  </interface>"
+    "</node>";
+
+typedef struct
+{
+  gchar *name;
+  gchar *version;
+  gchar *description;
+  gchar *license;
+  gchar *url;
+  gchar *staging_version;
+  guint64 installed_size;
+  guint64 size;
+  MockPackageState state;
+  GVariant *dict; /* (owned) (nullable) serialized form, rebuilt on change */
+} MockPackage;
+
+typedef struct
+{
+  gboolean enabled;
+  gchar *description;
+  gchar *url;
+} MockRepository;
+
+typedef struct
+{
+  guint latency_ms;
+  gdouble failure_rate;
+} MockMethodConfig;
+
+typedef struct
+{
+  GPtrArray *packages;     /* (element-type MockPackage) */
+  GHashTable *by_name;     /* (element-type utf8 MockPackage) */
+  GHashTable *file_owners; /* (element-type utf8 utf8) */
+  GPtrArray *repositories; /* (element-type MockRepository) */
+  GHashTable *methods;     /* (element-type utf8 MockMethodConfig) */
+  GRand *rand;
+  guint64 n_calls;
+  GHashTable *replay; /* (nullable) (element-type utf8 ReplayEntry) */
+} MockDaemon;
+
+typedef struct
+{
+  GPtrArray *records; /* (element-type GVariant) */
+  guint next;
+} ReplayEntry;
+
+static void
+mock_package_free (MockPackage *pkg)
+{
+  g_free (pkg->name);
+  g_free (pkg->version);
+  g_free (pkg->description);
+  g_free (pkg->license);
+  g_free (pkg->url);
+  g_free (pkg->staging_version);
+  g_clear_pointer (&pkg->dict, g_variant_unref);
+  g_free (pkg);
+}
+
+static void
+replay_entry_free (ReplayEntry *entry)
+{
+  g_ptr_array_unref (entry->records);
+  g_free (entry);
+}
+
+static void
+mock_repository_free (MockRepository *repo)
+{
+  g_free (repo->description);
+  g_free (repo->url);
+  g_free (repo);
+}
+
+static GVariant *
+mock_package_get_dict (MockPackage *pkg)
+{
+  GVariantDict dict;
+
+  if (pkg->dict != NULL)
+    return pkg->dict;
+
+  g_variant_dict_init (&dict, NULL);
+  g_variant_dict_insert (&dict, "name", "s", pkg->name);
+  g_variant_dict_insert (&dict, "version", "s", pkg->version);
+  g_variant_dict_insert (&dict, "description", "s", pkg->description);
+  g_variant_dict_insert (&dict, "license", "s", pkg->license);
+  g_variant_dict_insert (&dict, "url", "s", pkg->url);
+  if (pkg->staging_version != NULL)
+    g_variant_dict_insert (&dict, "staging_version", "s", pkg->staging_version);
+  g_variant_dict_insert (&dict, "installed_size", "t", pkg->installed_size);
+  g_variant_dict_insert (&dict, "size", "t", pkg->size);
+  g_variant_dict_insert (&dict, "package_state", "u", (guint32) pkg->state);
+  pkg->dict = g_variant_ref_sink (g_variant_dict_end (&dict));
+
+  return pkg->dict;
+}
+
+static void
+mock_package_set_state (MockPackage *pkg, MockPackageState state)
+{
+  pkg->state = state;
+  g_clear_pointer (&pkg->dict, g_variant_unref);
+}
+
+static void
+mock_daemon_add_package (MockDaemon *daemon, MockPackage *pkg)
+{
+  g_ptr_array_add (daemon->packages, pkg);
+  g_hash_table_replace (daemon->by_name, pkg->name, pkg);
+}
+
+static void
+mock_daemon_add_repository (MockDaemon *daemon,
+                            gboolean enabled,
+                            const gchar *description,
+                            const gchar *url)
+{
+  MockRepository *repo = g_new0 (MockRepository, 1);
+
+  repo->enabled = enabled;
+  repo->description = g_strdup (description);
+  repo->url = g_strdup (url);
+  g_ptr_array_add (daemon->repositories, repo);
+}
+
+/* Same universe as the dbusmock template, so benchmarks are comparable */
+static void
+mock_daemon_generate (MockDaemon *daemon, guint n_packages)
+{
+  for (guint i = 0; i < n_packages; i++)
+    {
+      MockPackage *pkg = g_new0 (MockPackage, 1);
+
+      pkg->name = g_strdup_printf ("bench-pkg-%u", i);
+      pkg->version = g_strdup_printf ("1.0.%u-r0", i);
+      pkg->description = g_strdup_printf ("synthetic package %u", i);
+      pkg->license = g_strdup ("MIT");
+      pkg->url = g_strdup_printf ("https://example.org/%u", i);
+      pkg->installed_size = 4096 * (i % 100 + 1);
+      pkg->size = 1024 * (i % 100 + 1);
+      pkg->state = STATE_AVAILABLE;
+      if (i % 10 == 0)
+        {
+          pkg->state = STATE_UPGRADABLE;
+          pkg->staging_version = g_strdup_printf ("1.0.%u-r1", i);
+        }
+      mock_daemon_add_package (daemon, pkg);
+    }
+
+  /* A fixture brings its own repositories */
+  if (daemon->repositories->len == 0)
+    {
+      mock_daemon_add_repository (daemon, TRUE, "a", "https://alpine.org/alpine/edge/main");
+      mock_daemon_add_repository (daemon, FALSE, "b", "https://pmos.org/pmos/master");
+      mock_daemon_add_repository (daemon, TRUE, "c", "/home/data/foo/bar/baz");
+    }
+  for (guint i = 0; i < n_packages / 1000; i++)
+    {
+      g_autofree gchar *description = g_strdup_printf ("bench %u", i);
+      g_autofree gchar *url = g_strdup_printf ("https://example.org/bench/v%u/main", i);
+      mock_daemon_add_repository (daemon, i % 2 == 0, description, url);
+    }
+}
+
+static MockPackageState
+parse_state (const gchar *state)
+{
+  const gchar *states[] = { "available", "installed", "pending-install",
+                            "pending-removal", "upgradable", "downgradable",
+                            "reinstallable", NULL };
+
+  for (guint i = 0; state != NULL && states[i] != NULL; i++)
+    {
+      if (g_str_equal (state, states[i]))
+        return i;
+    }
+  return STATE_AVAILABLE;
+}
+
+/**
+ * mock_daemon_load_fixture:
+ *
+ * Loads a key file with one `[package NAME]` group per package (keys
+ * version, description, license, url, staging-version, installed-size,
+ * size, state and files) and one `[repository URL]` group per repository
+ * (keys enabled and description).
+ **/
+static gboolean
+mock_daemon_load_fixture (MockDaemon *daemon, const gchar *path, GError **error)
+{
+  g_autoptr (GKeyFile) key_file = g_key_file_new ();
+  g_auto (GStrv) groups = NULL;
+
+  if (!g_key_file_load_from_file (key_file, path, G_KEY_FILE_NONE, error))
+    return FALSE;
+
+  groups = g_key_file_get_groups (key_file, NULL);
+  for (guint i = 0; groups[i] != NULL; i++)
+    {
+      const gchar *group = groups[i];
+
+      if (g_str_has_prefix (group, "package "))
+        {
+          MockPackage *pkg = g_new0 (MockPackage, 1);
+          g_autofree gchar *state = NULL;
+          g_auto (GStrv) files = NULL;
+
+          pkg->name = g_strdup (group + strlen ("package "));
+          pkg->version = g_key_file_get_string (key_file, group, "version", NULL);
+          pkg->description = g_key_file_get_string (key_file, group, "description", NULL);
+          pkg->license = g_key_file_get_string (key_file, group, "license", NULL);
+          pkg->url = g_key_file_get_string (key_file, group, "url", NULL);
+          pkg->staging_version = g_key_file_get_string (key_file, group, "staging-version", NULL);
+          pkg->installed_size = g_key_file_get_uint64 (key_file, group, "installed-size", NULL);
+          pkg->size = g_key_file_get_uint64 (key_file, group, "size", NULL);
+          state = g_key_file_get_string (key_file, group, "state", NULL);
+          pkg->state = parse_state (state);
+          if (pkg->version == NULL)
+            pkg->version = g_strdup ("0-r0");
+          if (pkg->description == NULL)
+            pkg->description = g_strdup ("");
+          if (pkg->license == NULL)
+            pkg->license = g_strdup ("");
+          if (pkg->url == NULL)
+            pkg->url = g_strdup ("");
+
+          files = g_key_file_get_string_list (key_file, group, "files", NULL, NULL);
+          for (guint j = 0; files != NULL && files[j] != NULL; j++)
+            g_hash_table_replace (daemon->file_owners, g_strdup (files[j]), g_strdup (pkg->name));
+
+          mock_daemon_add_package (daemon, pkg);
+        }
+      else if (g_str_has_prefix (group, "repository "))
+        {
+          g_autofree gchar *description = g_key_file_get_string (key_file, group, "description", NULL);
+          mock_daemon_add_repository (daemon,
+                                      g_key_file_get_boolean (key_file, group, "enabled", NULL),
+                                      description ? description : "",
+                                      group + strlen ("repository "));
+        }
+    }
+
+  return TRUE;
+}
+
+/**
+ * make_package_table:
+ *
+ * Writes @packages into a sealed memfd, see gs-apk-table.h for the layout.
+ *
+ * Returns: the fd, or -1 on error
+ **/
+static gint
+make_package_table (GPtrArray *packages, GError **error)
+{
+  g_autoptr (GByteArray) records = g_byte_array_new ();
+  g_autoptr (GByteArray) pool = g_byte_array_new ();
+  GsApkTableHeader header = { { 0 } };
+  gint fd;
+
+  for (guint i = 0; i < packages->len; i++)
+    {
+      MockPackage *pkg = g_ptr_array_index (packages, i);
+      GsApkTableRecord record = { 0 };
+      const gchar *strings[] = { pkg->name, pkg->version, pkg->description,
+                                 pkg->license, pkg->url, pkg->staging_version };
+      guint32 *offsets[] = { &record.name, &record.version, &record.description,
+                             &record.license, &record.url, &record.staging_version };
+
+      for (guint j = 0; j < G_N_ELEMENTS (strings); j++)
+        {
+          if (strings[j] == NULL)
+            {
+              *offsets[j] = GS_APK_TABLE_NO_STRING;
+              continue;
+            }
+          *offsets[j] = pool->len;
+          g_byte_array_append (pool, (const guint8 *) strings[j], strlen (strings[j]) + 1);
+        }
+      record.package_state = pkg->state;
+      record.installed_size = pkg->installed_size;
+      record.size = pkg->size;
+      g_byte_array_append (records, (const guint8 *) &record, sizeof (record));
+    }
+  if (pool->len == 0)
+    g_byte_array_append (pool, (const guint8 *) "", 1);
+
+  memcpy (header.magic, GS_APK_TABLE_MAGIC, sizeof (header.magic));
+  header.n_packages = packages->len;
+  header.record_size = sizeof (GsApkTableRecord);
+  header.strings_offset = sizeof (header) + records->len;
+  header.strings_size = pool->len;
+
+  fd = memfd_create ("apk-package-table", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if (fd < 0 ||
+      write (fd, &header, sizeof (header)) != sizeof (header) ||
+      write (fd, records->data, records->len) != (gssize) records->len ||
+      write (fd, pool->data, pool->len) != (gssize) pool->len ||
+      fcntl (fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) != 0)
+    {
+      g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errno),
+                   "Failed to write package table: %s", g_strerror (errno));
+      if (fd >= 0)
+        close (fd);
+      return -1;
+    }
+
+  return fd;
+}
+
+typedef struct
+{
+  GDBusMethodInvocation *invocation; /* (owned) */
+  GVariant *reply;                   /* (owned) (nullable) */
+  GVariant *replayed;                /* (owned) (nullable) */
+  GUnixFDList *fd_list;              /* (owned) (nullable) */
+  const gchar *error_name;           /* (nullable) */
+  gchar *error_message;              /* (owned) (nullable) */
+} PendingReply;
+
+static void
+pending_reply_send (PendingReply *pending)
+{
+  if (pending->error_message != NULL)
+    g_dbus_method_invocation_return_dbus_error (pending->invocation,
+                                                pending->error_name ? pending->error_name : ERROR_NAME,
+                                                pending->error_message);
+  else
+    g_dbus_method_invocation_return_value_with_unix_fd_list (pending->invocation,
+                                                             pending->reply,
+                                                             pending->fd_list);
+
+  /* return_* consumed the invocation and a floating reply */
+  g_clear_pointer (&pending->replayed, g_variant_unref);
+  g_clear_object (&pending->fd_list);
+  g_free (pending->error_message);
+  g_free (pending);
+}
+
+static gboolean
+pending_reply_timeout_cb (gpointer user_data)
+{
+  pending_reply_send (user_data);
+  return G_SOURCE_REMOVE;
+}
+
+static GVariant *
+handle_get_packages_details (MockDaemon *daemon, GVariant *parameters)
+{
+  g_autofree const gchar **names = NULL;
+  GVariantBuilder builder;
+  guint32 flags;
+
+  g_variant_get (parameters, "(^a&su)", &names, &flags);
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("aa{sv}"));
+  for (guint i = 0; names[i] != NULL; i++)
+    {
+      MockPackage *pkg = g_hash_table_lookup (daemon->by_name, names[i]);
+      g_autofree gchar *message = NULL;
+      GVariantDict dict;
+
+      if (pkg != NULL)
+        {
+          g_variant_builder_add_value (&builder, mock_package_get_dict (pkg));
+          continue;
+        }
+      /* The exact message of apk-polkit-rs */
+      message = g_strdup_printf ("Package %s not found", names[i]);
+      g_variant_dict_init (&dict, NULL);
+      g_variant_dict_insert (&dict, "name", "s", names[i]);
+      g_variant_dict_insert (&dict, "error", "s", message);
+      g_variant_builder_add_value (&builder, g_variant_dict_end (&dict));
+    }
+
+  return g_variant_new ("(@aa{sv})", g_variant_builder_end (&builder));
+}
+
+static GPtrArray *
+upgradable_packages (MockDaemon *daemon)
+{
+  GPtrArray *upgradable = g_ptr_array_new ();
+
+  for (guint i = 0; i < daemon->packages->len; i++)
+    {
+      MockPackage *pkg = g_ptr_array_index (daemon->packages, i);
+      if (pkg->state == STATE_UPGRADABLE || pkg->state == STATE_DOWNGRADABLE)
+        g_ptr_array_add (upgradable, pkg);
+    }
+  return upgradable;
+}
+
+static GVariant *
+handle_list_upgradable_packages (MockDaemon *daemon)
+{
+  g_autoptr (GPtrArray) upgradable = upgradable_packages (daemon);
+  GVariantBuilder builder;
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("aa{sv}"));
+  for (guint i = 0; i < upgradable->len; i++)
+    g_variant_builder_add_value (&builder, mock_package_get_dict (g_ptr_array_index (upgradable, i)));
+
+  return g_variant_new ("(@aa{sv})", g_variant_builder_end (&builder));
+}
+
+static GVariant *
+handle_list_packages_table (MockDaemon *daemon,
+                            GVariant *parameters,
+                            GUnixFDList **out_fd_list,
+                            GError **error)
+{
+  g_autoptr (GPtrArray) packages = NULL;
+  g_autoptr (GUnixFDList) fd_list = NULL;
+  const gchar *scope;
+  guint32 flags;
+  gint fd;
+  gint index;
+
+  g_variant_get (parameters, "(&su)", &scope, &flags);
+  if (g_str_equal (scope, "upgradable"))
+    {
+      packages = upgradable_packages (daemon);
+    }
+  else if (g_str_equal (scope, "installed") || g_str_equal (scope, "available"))
+    {
+      gboolean installed = g_str_equal (scope, "installed");
+
+      packages = g_ptr_array_new ();
+      for (guint i = 0; i < daemon->packages->len; i++)
+        {
+          MockPackage *pkg = g_ptr_array_index (daemon->packages, i);
+          if (!installed || pkg->state != STATE_AVAILABLE)
+            g_ptr_array_add (packages, pkg);
+        }
+    }
+  else
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT,
+                   "Unsupported scope %s", scope);
+      return NULL;
+    }
+
+  fd = make_package_table (packages, error);
+  if (fd < 0)
+    return NULL;
+
+  fd_list = g_unix_fd_list_new ();
+  index = g_unix_fd_list_append (fd_list, fd, error);
+  close (fd);
+  if (index < 0)
+    return NULL;
+
+  *out_fd_list = g_steal_pointer (&fd_list);
+  return g_variant_new ("(h)", index);
+}
+
+static GVariant *
+handle_search_files_owners (MockDaemon *daemon, GVariant *parameters)
+{
+  g_autofree const gchar **paths = NULL;
+  GVariantBuilder builder;
+  guint32 flags;
+
+  g_variant_get (parameters, "(^a&su)", &paths, &flags);
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("aa{sv}"));
+  for (guint i = 0; paths[i] != NULL; i++)
+    {
+      const gchar *owner = g_hash_table_lookup (daemon->file_owners, paths[i]);
+      GVariantDict dict;
+
+      g_variant_dict_init (&dict, NULL);
+      if (owner != NULL)
+        g_variant_dict_insert (&dict, "name", "s", owner);
+      g_variant_builder_add_value (&builder, g_variant_dict_end (&dict));
+    }
+
+  return g_variant_new ("(@aa{sv})", g_variant_builder_end (&builder));
+}
+
+static GVariant *
+handle_list_repositories (MockDaemon *daemon)
+{
+  GVariantBuilder builder;
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("a(bss)"));
+  for (guint i = 0; i < daemon->repositories->len; i++)
+    {
+      MockRepository *repo = g_ptr_array_index (daemon->repositories, i);
+      g_variant_builder_add (&builder, "(bss)", repo->enabled, repo->description, repo->url);
+    }
+
+  return g_variant_new ("(@a(bss))", g_variant_builder_end (&builder));
+}
+
+static gboolean
+handle_transaction (MockDaemon *daemon,
+                    const gchar *method_name,
+                    GVariant *parameters,
+                    GError **error)
+{
+  g_autofree const gchar **names = NULL;
+
+  g_variant_get (parameters, "(^a&s)", &names);
+  for (guint i = 0; names[i] != NULL; i++)
+    {
+      MockPackage *pkg = g_hash_table_lookup (daemon->by_name, names[i]);
+
+      if (pkg == NULL)
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND,
+                       "Package %s not found", names[i]);
+          return FALSE;
+        }
+
+      if (g_str_equal (method_name, "AddPackages"))
+        {
+          mock_package_set_state (pkg, STATE_INSTALLED);
+        }
+      else if (g_str_equal (method_name, "DeletePackages"))
+        {
+          mock_package_set_state (pkg, STATE_AVAILABLE);
+        }
+      else if (pkg->staging_version != NULL)
+        {
+          g_free (pkg->version);
+          pkg->version = g_steal_pointer (&pkg->staging_version);
+          mock_package_set_state (pkg, STATE_INSTALLED);
+        }
+    }
+
+  return TRUE;
+}
+
+static gchar *
+replay_key (const gchar *method_name, GVariant *parameters)
+{
+  g_autofree gchar *args = g_variant_print (parameters, FALSE);
+
+  return g_strconcat (method_name, " ", args, NULL);
+}
+
+/**
+ * mock_daemon_load_replay:
+ *
+ * Indexes a recording by method and arguments. Calls made several times
+ * with the same arguments are answered in the recorded order, repeating
+ * the last answer once the recording runs out.
+ **/
+static gboolean
+mock_daemon_load_replay (MockDaemon *daemon, const gchar *path, GError **error)
+{
+  g_autoptr (GPtrArray) records = gs_apk_recording_load (path, error);
+
+  if (records == NULL)
+    return FALSE;
+
+  daemon->replay = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                          (GDestroyNotify) replay_entry_free);
+  for (guint i = 0; i < records->len; i++)
+    {
+      GVariant *record = g_ptr_array_index (records, i);
+      g_autoptr (GVariant) args = NULL;
+      g_autofree gchar *key = NULL;
+      const gchar *method;
+      ReplayEntry *entry;
+
+      g_variant_get (record, "(&sttvsv)", &method, NULL, NULL, &args, NULL, NULL);
+      key = replay_key (method, args);
+      entry = g_hash_table_lookup (daemon->replay, key);
+      if (entry == NULL)
+        {
+          entry = g_new0 (ReplayEntry, 1);
+          entry->records = g_ptr_array_new_with_free_func ((GDestroyNotify) g_variant_unref);
+          g_hash_table_insert (daemon->replay, g_steal_pointer (&key), entry);
+        }
+      g_ptr_array_add (entry->records, g_variant_ref (record));
+    }
+
+  g_print ("Replaying %u calls from %s\n", records->len, path);
+  return TRUE;
+}
+
+/* Returns the recorded latency in ms, or -1 if the call was not recorded */
+static gint
+mock_daemon_replay (MockDaemon *daemon,
+                    const gchar *method_name,
+                    GVariant *parameters,
+                    PendingReply *pending)
+{
+  g_autofree gchar *key = replay_key (method_name, parameters);
+  ReplayEntry *entry = g_hash_table_lookup (daemon->replay, key);
+  g_autoptr (GVariant) reply = NULL;
+  GVariant *record;
+  const gchar *error_name;
+  guint64 duration_usec;
+
+  if (entry == NULL)
+    return -1;
+
+  record = g_ptr_array_index (entry->records, entry->next);
+  if (entry->next + 1 < entry->records->len)
+    entry->next++;
+
+  g_variant_get (record, "(&stt*&sv)", NULL, NULL, &duration_usec, NULL, &error_name, &reply);
+  if (*error_name != '\0')
+    {
+      pending->error_name = error_name;
+      pending->error_message = g_variant_dup_string (reply, NULL);
+    }
+  else
+    {
+      pending->replayed = g_steal_pointer (&reply);
+      pending->reply = pending->replayed;
+    }
+
+  return duration_usec / 1000;
+}
+
+static void
+handle_method_call (GDBusConnection *connection,
+                    const gchar *sender,
+                    const gchar *object_path,
+                    const gchar *interface_name,
+                    const gchar *method_name,
+                    GVariant *parameters,
+                    GDBusMethodInvocation *invocation,
+                    gpointer user_data)
+{
+  MockDaemon *daemon = user_data;
+  MockMethodConfig *config = g_hash_table_lookup (daemon->methods, method_name);
+  PendingReply *pending = g_new0 (PendingReply, 1);
+  g_autoptr (GError) local_error = NULL;
+  GVariant *reply = NULL;
+  gint latency_ms = config != NULL ? (gint) config->latency_ms : 0;
+
+  daemon->n_calls++;
+  pending->invocation = invocation;
+
+  if (daemon->replay != NULL)
+    {
+      gint recorded_ms = mock_daemon_replay (daemon, method_name, parameters, pending);
+
+      if (recorded_ms >= 0)
+        {
+          if (latency_ms == 0)
+            latency_ms = recorded_ms;
+          goto out;
+        }
+
+      /* Recordings never contain the memfd table, make the plugin fall
+       * back to the calls that were recorded */
+      if (g_str_equal (method_name, "ListPackagesTable"))
+        {
+          pending->error_name = "org.freedesktop.DBus.Error.UnknownMethod";
+          pending->error_message = g_strdup ("ListPackagesTable is not replayed");
+          goto out;
+        }
+    }
+
+  if (config != NULL && config->failure_rate > 0 &&
+      g_rand_double (daemon->rand) < config->failure_rate)
+    {
+      pending->error_message = g_strdup_printf ("Injected failure in %s", method_name);
+    }
+  else
+    {
+      if (g_str_equal (method_name, "GetPackagesDetails"))
+        reply = handle_get_packages_details (daemon, parameters);
+      else if (g_str_equal (method_name, "ListUpgradablePackages"))
+        reply = handle_list_upgradable_packages (daemon);
+      else if (g_str_equal (method_name, "ListPackagesTable"))
+        reply = handle_list_packages_table (daemon, parameters, &pending->fd_list, &local_error);
+      else if (g_str_equal (method_name, "SearchFilesOwners"))
+        reply = handle_search_files_owners (daemon, parameters);
+      else if (g_str_equal (method_name, "ListRepositories"))
+        reply = handle_list_repositories (daemon);
+      else if (g_str_equal (method_name, "AddPackages") ||
+               g_str_equal (method_name, "DeletePackages") ||
+               g_str_equal (method_name, "UpgradePackages"))
+        {
+          if (handle_transaction (daemon, method_name, parameters, &local_error))
+            reply = g_variant_new ("()");
+        }
+      else
+        {
+          /* AddRepository, RemoveRepository and UpdateRepositories */
+          reply = g_variant_new ("()");
+        }
+
+      if (reply == NULL)
+        pending->error_message = g_strdup (local_error->message);
+      pending->reply = reply;
+    }
+
+out:
+  if (latency_ms > 0)
+    g_timeout_add (latency_ms, pending_reply_timeout_cb, pending);
+  else
+    pending_reply_send (pending);
+}
+
+static const GDBusInterfaceVTable interface_vtable = {
+  handle_method_call,
+  NULL,
+  NULL,
+  { 0 }
+};
+
+static MockMethodConfig *
+mock_daemon_get_method_config (MockDaemon *daemon, const gchar *method)
+{
+  MockMethodConfig *config = g_hash_table_lookup (daemon->methods, method);
+
+  if (config == NULL)
+    {
+      config = g_new0 (MockMethodConfig, 1);
+      g_hash_table_insert (daemon->methods, g_strdup (method), config);
+    }
+  return config;
+}
+
+/* Parses a list of Method=value options, with "*" matching every method */
+static gboolean
+parse_method_options (MockDaemon *daemon,
+                      GDBusInterfaceInfo *info,
+                      gchar **options,
+                      gboolean is_latency,
+                      GError **error)
+{
+  for (guint i = 0; options != NULL && options[i] != NULL; i++)
+    {
+      g_auto (GStrv) split = g_strsplit (options[i], "=", 2);
+
+      if (g_strv_length (split) != 2)
+        {
+          g_set_error (error, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE,
+                       "Expected Method=value, got %s", options[i]);
+          return FALSE;
+        }
+
+      for (guint j = 0; info->methods[j] != NULL; j++)
+        {
+          const gchar *method = info->methods[j]->name;
+          MockMethodConfig *config;
+
+          if (!g_str_equal (split[0], "*") && !g_str_equal (split[0], method))
+            continue;
+
+          config = mock_daemon_get_method_config (daemon, method);
+          if (is_latency)
+            config->latency_ms = g_ascii_strtoull (split[1], NULL, 10);
+          else
+            config->failure_rate = g_ascii_strtod (split[1], NULL);
+        }
+    }
+
+  return TRUE;
+}
+
+static void
+on_name_lost (GDBusConnection *connection, const gchar *name, gpointer user_data)
+{
+  GMainLoop *loop = user_data;
+
+  g_printerr ("Lost or could not acquire %s\n", name);
+  g_main_loop_quit (loop);
+}
+
+int
+main (int argc, char **argv)
+{
+  g_autoptr (GOptionContext) option_context = NULL;
+  g_autoptr (GDBusNodeInfo) introspection_data = NULL;
+  g_autoptr (GDBusConnection) connection = NULL;
+  g_autoptr (GMainLoop) loop = NULL;
+  g_autoptr (GError) error = NULL;
+  g_autofree gchar *fixture = NULL;
+  g_autofree gchar *replay = NULL;
+  g_auto (GStrv) latencies = NULL;
+  g_auto (GStrv) failures = NULL;
+  gint n_packages = 0;
+  gint seed = 0;
+  gboolean system_bus = FALSE;
+  MockDaemon daemon = { NULL };
+  guint owner_id;
+  const GOptionEntry entries[] = {
+    { "packages", 'n', 0, G_OPTION_ARG_INT, &n_packages,
+      "Serve N synthetic packages", "N" },
+    { "fixture", 'f', 0, G_OPTION_ARG_FILENAME, &fixture,
+      "Load packages and repositories from a key file", "FILE" },
+    { "replay", 'r', 0, G_OPTION_ARG_FILENAME, &replay,
+      "Answer recorded calls from a recording", "FILE" },
+    { "latency", 'l', 0, G_OPTION_ARG_STRING_ARRAY, &latencies,
+      "Delay replies to a method (or * for all)", "METHOD=MS" },
+    { "fail", 0, 0, G_OPTION_ARG_STRING_ARRAY, &failures,
+      "Fail a fraction of the calls to a method (or * for all)", "METHOD=RATE" },
+    { "seed", 0, 0, G_OPTION_ARG_INT, &seed,
+      "Seed for failure injection", "SEED" },
+    { "system", 0, 0, G_OPTION_ARG_NONE, &system_bus,
+      "Use the system bus instead of the session bus", NULL },
+    { NULL }
+  };
+
+  option_context = g_option_context_new ("- mock apkPolkit2 daemon");
+  g_option_context_add_main_entries (option_context, entries, NULL);
+  if (!g_option_context_parse (option_context, &argc, &argv, &error))
+    {
+      g_printerr ("%s\n", error->message);
+      return 1;
+    }
+
+  introspection_data = g_dbus_node_info_new_for_xml (introspection_xml, &error);
+  g_assert_no_error (error);
+
+  daemon.packages = g_ptr_array_new_with_free_func ((GDestroyNotify) mock_package_free);
+  daemon.by_name = g_hash_table_new (g_str_hash, g_str_equal);
+  daemon.file_owners = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+  daemon.repositories = g_ptr_array_new_with_free_func ((GDestroyNotify) mock_repository_free);
+  daemon.methods = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+  daemon.rand = g_rand_new_with_seed (seed);
+
+  if (!parse_method_options (&daemon, introspection_data->interfaces[0], latencies, TRUE, &error) ||
+      !parse_method_options (&daemon, introspection_data->interfaces[0], failures, FALSE, &error))
+    {
+      g_printerr ("%s\n", error->message);
+      return 1;
+    }
+
+  if (fixture != NULL && !mock_daemon_load_fixture (&daemon, fixture, &error))
+    {
+      g_printerr ("Failed to load %s: %s\n", fixture, error->message);
+      return 1;
+    }
+  if (replay != NULL && !mock_daemon_load_replay (&daemon, replay, &error))
+    {
+      g_printerr ("Failed to load %s: %s\n", replay, error->message);
+      return 1;
+    }
+  mock_daemon_generate (&daemon, n_packages);
+
+  connection = g_bus_get_sync (system_bus ? G_BUS_TYPE_SYSTEM : G_BUS_TYPE_SESSION, NULL, &error);
+  if (connection == NULL)
+    {
+      g_printerr ("%s\n", error->message);
+      return 1;
+    }
+
+  g_dbus_connection_register_object (connection, OBJECT_PATH,
+                                     introspection_data->interfaces[0],
+                                     &interface_vtable, &daemon, NULL, &error);
+  g_assert_no_error (error);
+
+  loop = g_main_loop_new (NULL, FALSE);
+  /* Only take the name once the universe is ready to be served */
+  owner_id = g_bus_own_name_on_connection (connection, BUS_NAME,
+                                           G_BUS_NAME_OWNER_FLAGS_NONE,
+                                           NULL, on_name_lost, loop, NULL);
+  g_main_loop_run (loop);
+
+  g_bus_unown_name (owner_id);
+  g_ptr_array_unref (daemon.packages);
+  g_hash_table_unref (daemon.by_name);
+  g_hash_table_unref (daemon.file_owners);
+  g_ptr_array_unref (daemon.repositories);
+  g_hash_table_unref (daemon.methods);
+  g_rand_free (daemon.rand);
+  g_clear_pointer (&daemon.replay, g_hash_table_unref);
+
+  return 0;
+}
@@ -7,6 +7,9 @@
 import dbus
 import dbusmock
 
+import fcntl
+import os
+import struct
 import time
 
 # These should ideally be directly fetched from C
@@ -20,6 +23,39 @@ MAIN_OBJ   = '/dev/Cogitri/apkPolkit2'
 MAIN_IFACE = 'dev.Cogitri.apkPolkit2'
 SYSTEM_BUS = False
 
+# Layout of the package table, see src/gs-plugin-apk/gs-apk-table.h
+TABLE_MAGIC = b"APKTABL1"
+TABLE_HEADER = struct.Struct("=8sIIQQ")
+TABLE_RECORD = struct.Struct("=IIIIIIIIQQ")
+TABLE_NO_STRING = 0xFFFFFFFF
+TABLE_STRINGS = ["name", "version", "description", "license", "url", "staging_version"]
+
+
+def make_package_table(pkgs):
+    pool = bytearray()
+    records = bytearray()
+    for pkg in pkgs:
+        offsets = []
+        for key in TABLE_STRINGS:
+            if key in pkg:
+                offsets.append(len(pool))
+                pool += str(pkg[key]).encode() + b"\0"
+            else:
+                offsets.append(TABLE_NO_STRING)
+        records += TABLE_RECORD.pack(*offsets, int(pkg["package_state"]), 0,
+                                     int(pkg["installed_size"]), int(pkg["size"]))
+    if not pool:
+        pool += b"\0"
+    strings_offset = TABLE_HEADER.size + len(records)
+    header = TABLE_HEADER.pack(TABLE_MAGIC, len(pkgs), TABLE_RECORD.size,
+                               strings_offset, len(pool))
+
+    fd = os.memfd_create("apk-package-table", os.MFD_CLOEXEC | os.MFD_ALLOW_SEALING)
+    os.write(fd, header + records + pool)
+    fcntl.fcntl(fd, fcntl.F_ADD_SEALS,
+                fcntl.F_SEAL_SHRINK | fcntl.F_SEAL_GROW | fcntl.F_SEAL_WRITE | fcntl.F_SEAL_SEAL)
+    return fd
+
 def load(mock, parameters):
     repos = [
         (True, "a", "https://alpine.org/alpine/edge/main"),
@@ -47,6 +83,40 @@ def load(mock, parameters):
          "url": "url"},
     ]
     mock.pkgs = pkgs
+    mock.synthetic = {}
+    mock.added_packages = []
+    mock.deleted_packages = []
+    mock.upgradable_calls = 0
+    mock.details_calls = 0
+    # Only known to GetPackagesDetails, a rebuild of the same release
+    mock.rebuild_pkg = {"name": "apk-test-rebuild",
+                        "description": "rebuilt package",
+                        "installed_size": dbus.UInt64(50),
+                        "version": "1.0-r0",
+                        "staging_version": "1.0-r1",
+                        "license": "GPL",
+                        "package_state": dbus.UInt32(APK_POLKIT_STATE_UPGRADABLE),
+                        "size": dbus.UInt64(40),
+                        "url": "url"}
+
+    # Benchmarks ask for a synthetic package universe of a given size
+    n_packages = parameters.get("packages", 0)
+    for i in range(n_packages):
+        pkg = {"name": "bench-pkg-%d" % i,
+               "description": "synthetic package %d" % i,
+               "installed_size": dbus.UInt64(4096 * (i % 100 + 1)),
+               "version": "1.0.%d-r0" % i,
+               "license": "MIT",
+               "package_state": dbus.UInt32(APK_POLKIT_STATE_AVAILABLE),
+               "size": dbus.UInt64(1024 * (i % 100 + 1)),
+               "url": "https://example.org/%d" % i}
+        # One package in ten has an update
+        if i % 10 == 0:
+            pkg["package_state"] = dbus.UInt32(APK_POLKIT_STATE_UPGRADABLE)
+            pkg["staging_version"] = "1.0.%d-r1" % i
+        mock.synthetic[pkg["name"]] = pkg
+    for i in range(n_packages // 1000):
+        mock.repos.append((i % 2 == 0, "bench %d" % i, "https://example.org/bench/v%d/main" % i))
 
     mock.AddMethods(MAIN_IFACE, [
         ('AddRepository', 's', '', ''),
@@ -57,26 +127,49 @@ def load(mock, parameters):
 
 @dbus.service.method(MAIN_IFACE, in_signature='as', out_signature='')
 def AddPackages(self, pkg_list):
+    self.added_packages.extend(pkg_list)
     for pkg in pkg_list:
         if pkg == "slow":
             time.sleep(10)
 
+@dbus.service.method(dbusmock.MOCK_IFACE, in_signature='', out_signature='as')
+def GetAddedPackages(self):
+    return self.added_packages
+
+@dbus.service.method(dbusmock.MOCK_IFACE, in_signature='', out_signature='as')
+def GetDeletedPackages(self):
+    return self.deleted_packages
+
 @dbus.service.method(MAIN_IFACE, in_signature='as', out_signature='')
 def DeletePackages(self, pkg_list):
+    self.deleted_packages.extend(pkg_list)
     for pkg in pkg_list:
         if pkg == "slow":
             time.sleep(10)
 
+@dbus.service.method(dbusmock.MOCK_IFACE, in_signature='', out_signature='u')
+def GetDetailsCalls(self):
+    return self.details_calls
+
 @dbus.service.method(MAIN_IFACE, in_signature='asu', out_signature='aa{sv}')
 def GetPackagesDetails(self, packages, requestedProperties):
+    self.details_calls += 1
     apps = []
     # We only expect to refine the desktop app for now.
     # Ideally, the state should be updated on the different DBus calls
     for pkg in packages:
-        if pkg == "apk-test-app":
+        if pkg == "slow":
+            time.sleep(1)
+        if pkg in self.synthetic:
+            apps.append(self.synthetic[pkg])
+        elif pkg == "apk-test-app":
             apps.append(self.pkgs[0])
+        elif pkg == "apk-test-rebuild":
+            apps.append(self.rebuild_pkg)
+        elif pkg == "apk-test-broken":
+            apps.append({"name": pkg, "error": "Failed to open file not found in cache"})
         else:
-            apps.append({"name": pkg, "error": "pkg not found!"})
+            apps.append({"name": pkg, "error": "Package %s not found" % pkg})
 
     return apps
 
@@ -84,8 +177,15 @@ def GetPackagesDetails(self, packages, requestedProperties):
 def ListRepositories(self):
     return self.repos
 
-@dbus.service.method(MAIN_IFACE, in_signature='u', out_signature='aa{sv}')
-def ListUpgradablePackages(self, requestedProperties):
+def upgradable_packages(self):
+    self.upgradable_calls += 1
+    if self.synthetic:
+        return [p for p in self.synthetic.values()
+                if p["package_state"] == APK_POLKIT_STATE_UPGRADABLE]
+    mark_upgradable(self)
+    return self.pkgs
+
+def mark_upgradable(self):
     for pkg in self.pkgs:
         if pkg["name"] == "apk-test-app":
             pkg["package_state"] = dbus.UInt32(APK_POLKIT_STATE_UPGRADABLE)
@@ -93,7 +193,26 @@ def ListUpgradablePackages(self, requestedProperties):
         if pkg["name"] == "system-pkg":
             pkg["package_state"] = dbus.UInt32(APK_POLKIT_STATE_DOWNGRADABLE)
             pkg["staging_version"] = "0.1.0-r0"
-    return self.pkgs
+
+
+@dbus.service.method(dbusmock.MOCK_IFACE, in_signature='', out_signature='u')
+def GetUpgradableCalls(self):
+    return self.upgradable_calls
+
+@dbus.service.method(MAIN_IFACE, in_signature='u', out_signature='aa{sv}')
+def ListUpgradablePackages(self, requestedProperties):
+    return upgradable_packages(self)
+
+@dbus.service.method(MAIN_IFACE, in_signature='su', out_signature='h')
+def ListPackagesTable(self, scope, requestedProperties):
+    if scope != "upgradable":
+        raise dbus.exceptions.DBusException("Unsupported scope " + scope,
+                                            name="org.freedesktop.DBus.Error.InvalidArgs")
+    fd = make_package_table(upgradable_packages(self))
+    # UnixFd duplicates the descriptor
+    table = dbus.types.UnixFd(fd)
+    os.close(fd)
+    return table
 
 
 @dbus.service.method(MAIN_IFACE, in_signature='as', out_signature='')
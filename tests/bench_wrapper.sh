@@ -0,0 +1,26 @@
+#!/bin/bash
+#
+# Copyright (C) 2024 The gnome-software-plugin-apk contributors
+#
+# Usage: bench_wrapper.sh MOCK_DAEMON N_PACKAGES BENCHMARK [ARGS...]
+#
+# Runs BENCHMARK against MOCK_DAEMON serving N_PACKAGES synthetic packages.
+# Extra mock options, e.g. "--latency GetPackagesDetails=20", can be passed
+# through APK_MOCK_DAEMON_ARGS. Needs a session bus, e.g.
+# `dbus-run-session -- meson test --benchmark`.
+#
+
+set -ex
+
+mock_daemon="$1"
+n_packages="$2"
+shift 2
+
+# shellcheck disable=SC2086
+"$mock_daemon" --packages "$n_packages" $APK_MOCK_DAEMON_ARGS &
+
+trap 'kill %1' EXIT
+
+gdbus wait --session --timeout 60 dev.Cogitri.apkPolkit2
+
+"$@" --packages "$n_packages"
@@ -0,0 +1,521 @@
+/*
+ * Copyright (C) 2024 The gnome-software-plugin-apk contributors
+ *
+ * SPDX-License-Identifier: GPL-2.0+
+ */
+
+#include <dlfcn.h>
+#include <gnome-software.h>
+#include <stdio.h>
+#include <string.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+#include <gs-plugin-loader-sync.h>
+#include <gs-plugin-loader.h>
+
+/* Number of apps installed at once by the install benchmark */
+#define BENCH_INSTALL_BATCH 100
+
+/* Allocations the plugin itself may make per package, on top of what GDBus
+ * needs for the same calls, see bench_check_allocations() */
+#define BENCH_REFINE_ALLOC_BUDGET 16
+#define BENCH_INSTALL_ALLOC_BUDGET 12
+
+/* Must match the chunking of GetPackagesDetails in the plugin */
+#define BENCH_DETAILS_CHUNK_SIZE 50
+
+/* Exported by alloc-counter.so when it is preloaded */
+typedef void (*AllocCounterGetFunc) (guint64 *n_allocs, guint64 *n_bytes);
+
+typedef struct
+{
+  GsPluginLoader *plugin_loader;
+  GDBusConnection *connection;
+  guint n_packages;
+  FILE *output;
+  AllocCounterGetFunc alloc_counter_get;
+  gint64 start_usec;
+  guint64 start_allocs;
+  guint64 start_bytes;
+} BenchContext;
+
+static guint64
+bench_count_allocs (BenchContext *ctx)
+{
+  guint64 n_allocs;
+  guint64 n_bytes;
+
+  ctx->alloc_counter_get (&n_allocs, &n_bytes);
+  return n_allocs;
+}
+
+/* The resident set size of the process, in KiB, or 0 if unknown */
+static guint64
+bench_get_rss_kb (void)
+{
+  g_autofree gchar *status = NULL;
+  const gchar *line;
+
+  if (!g_file_get_contents ("/proc/self/status", &status, NULL, NULL))
+    return 0;
+  line = strstr (status, "\nVmRSS:");
+  if (line == NULL)
+    return 0;
+  return g_ascii_strtoull (line + strlen ("\nVmRSS:"), NULL, 10);
+}
+
+static void
+bench_begin (BenchContext *ctx)
+{
+  if (ctx->alloc_counter_get != NULL)
+    ctx->alloc_counter_get (&ctx->start_allocs, &ctx->start_bytes);
+  ctx->start_usec = g_get_monotonic_time ();
+}
+
+/**
+ * bench_report:
+ *
+ * Emits the result of the operation started by bench_begin() as a JSON
+ * object on its own line, both on stdout and in the output file if one was
+ * requested, so results can be collected and compared across releases.
+ * The resident set size at the end of the operation is always included.
+ * With alloc-counter.so preloaded, the number of allocations and allocated
+ * bytes are included, in total and per item.
+ **/
+static void
+bench_report (BenchContext *ctx,
+              const gchar *operation,
+              const gchar *phase,
+              guint n_items)
+{
+  gint64 elapsed_usec = g_get_monotonic_time () - ctx->start_usec;
+  g_autoptr (GString) line = g_string_new (NULL);
+
+  g_string_append_printf (line,
+                          "{\"operation\": \"%s\", \"phase\": \"%s\", "
+                          "\"packages\": %u, \"items\": %u, "
+                          "\"usec\": %" G_GINT64_FORMAT ", \"rss_kb\": %" G_GUINT64_FORMAT,
+                          operation, phase, ctx->n_packages, n_items, elapsed_usec,
+                          bench_get_rss_kb ());
+  if (ctx->alloc_counter_get != NULL)
+    {
+      guint64 n_allocs;
+      guint64 n_bytes;
+
+      ctx->alloc_counter_get (&n_allocs, &n_bytes);
+      n_allocs -= ctx->start_allocs;
+      n_bytes -= ctx->start_bytes;
+      g_string_append_printf (line,
+                              ", \"allocations\": %" G_GUINT64_FORMAT
+                              ", \"bytes\": %" G_GUINT64_FORMAT
+                              ", \"allocations_per_item\": %.1f"
+                              ", \"bytes_per_item\": %.1f",
+                              n_allocs, n_bytes,
+                              n_items > 0 ? (gdouble) n_allocs / n_items : 0.0,
+                              n_items > 0 ? (gdouble) n_bytes / n_items : 0.0);
+    }
+  g_string_append (line, "}\n");
+
+  fputs (line->str, stdout);
+  if (ctx->output != NULL)
+    fputs (line->str, ctx->output);
+}
+
+static GsAppList *
+bench_make_apps (BenchContext *ctx, guint n_apps)
+{
+  GsPlugin *plugin = gs_plugin_loader_find_plugin (ctx->plugin_loader, "apk");
+  GsAppList *list = gs_app_list_new ();
+
+  for (guint i = 0; i < n_apps; i++)
+    {
+      g_autofree gchar *name = g_strdup_printf ("bench-pkg-%u", i);
+      g_autoptr (GsApp) app = gs_app_new (name);
+
+      gs_app_set_kind (app, AS_COMPONENT_KIND_GENERIC);
+      gs_app_set_bundle_kind (app, AS_BUNDLE_KIND_PACKAGE);
+      gs_app_set_scope (app, AS_COMPONENT_SCOPE_SYSTEM);
+      gs_app_add_source (app, name);
+      gs_app_set_management_plugin (app, plugin);
+      gs_app_list_add (list, app);
+    }
+
+  return list;
+}
+
+static void
+bench_refine (BenchContext *ctx, const gchar *phase, GsAppList *apps)
+{
+  g_autoptr (GsPluginJob) plugin_job = NULL;
+  g_autoptr (GsAppList) list = NULL;
+  g_autoptr (GError) error = NULL;
+
+  plugin_job = gs_plugin_job_refine_new (apps,
+                                         GS_PLUGIN_REFINE_FLAGS_REQUIRE_VERSION |
+                                             GS_PLUGIN_REFINE_FLAGS_REQUIRE_DESCRIPTION |
+                                             GS_PLUGIN_REFINE_FLAGS_REQUIRE_SIZE |
+                                             GS_PLUGIN_REFINE_FLAGS_REQUIRE_LICENSE |
+                                             GS_PLUGIN_REFINE_FLAGS_REQUIRE_URL);
+  bench_begin (ctx);
+  list = gs_plugin_loader_job_process (ctx->plugin_loader, plugin_job, NULL, &error);
+  g_assert_no_error (error);
+  bench_report (ctx, "refine", phase, gs_app_list_length (apps));
+}
+
+static void
+bench_list_updates (BenchContext *ctx, const gchar *phase)
+{
+  g_autoptr (GsAppQuery) query = NULL;
+  g_autoptr (GsPluginJob) plugin_job = NULL;
+  g_autoptr (GsAppList) list = NULL;
+  g_autoptr (GError) error = NULL;
+
+  query = gs_app_query_new ("is-for-update", GS_APP_QUERY_TRISTATE_TRUE,
+                            "refine-flags", GS_PLUGIN_REFINE_FLAGS_REQUIRE_UPDATE_DETAILS,
+                            NULL);
+  plugin_job = gs_plugin_job_list_apps_new (query, GS_PLUGIN_LIST_APPS_FLAGS_NONE);
+  bench_begin (ctx);
+  list = gs_plugin_loader_job_process (ctx->plugin_loader, plugin_job, NULL, &error);
+  g_assert_no_error (error);
+  bench_report (ctx, "list-updates", phase, gs_app_list_length (list));
+}
+
+static void
+bench_install (BenchContext *ctx, const gchar *phase, GsAppList *apps)
+{
+  g_autoptr (GsPluginJob) plugin_job = NULL;
+  g_autoptr (GError) error = NULL;
+  gboolean ret;
+
+  for (guint i = 0; i < gs_app_list_length (apps); i++)
+    gs_app_set_state (gs_app_list_index (apps, i), GS_APP_STATE_AVAILABLE);
+
+  plugin_job = gs_plugin_job_install_apps_new (apps, GS_PLUGIN_INSTALL_APPS_FLAGS_NONE);
+  bench_begin (ctx);
+  ret = gs_plugin_loader_job_action (ctx->plugin_loader, plugin_job, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_true (ret);
+  bench_report (ctx, "install", phase, gs_app_list_length (apps));
+}
+
+static void
+bench_list_repositories (BenchContext *ctx, const gchar *phase)
+{
+  g_autoptr (GsAppQuery) query = NULL;
+  g_autoptr (GsPluginJob) plugin_job = NULL;
+  g_autoptr (GsAppList) list = NULL;
+  g_autoptr (GError) error = NULL;
+
+  query = gs_app_query_new ("is-source", GS_APP_QUERY_TRISTATE_TRUE, NULL);
+  plugin_job = gs_plugin_job_list_apps_new (query, GS_PLUGIN_LIST_APPS_FLAGS_NONE);
+  bench_begin (ctx);
+  list = gs_plugin_loader_job_process (ctx->plugin_loader, plugin_job, NULL, &error);
+  g_assert_no_error (error);
+  bench_report (ctx, "list-repositories", phase, gs_app_list_length (list));
+}
+
+/**
+ * bench_low_memory:
+ *
+ * Sends a low memory warning at @level, as the system's memory monitor
+ * would, to the default monitor the plugin listens on. The resident set
+ * size is reported before and after, so the difference is what shedding
+ * the caches gave back. Freed memory is handed back to the system first,
+ * or glibc would keep it in its arenas.
+ **/
+static void
+bench_low_memory (BenchContext *ctx,
+                  const gchar *phase,
+                  GMemoryMonitorWarningLevel level)
+{
+  g_autoptr (GMemoryMonitor) monitor = g_memory_monitor_dup_default ();
+
+#ifdef __GLIBC__
+  malloc_trim (0);
+#endif
+  bench_begin (ctx);
+  bench_report (ctx, "low-memory", "before", 0);
+
+  bench_begin (ctx);
+  g_signal_emit_by_name (monitor, "low-memory-warning", level);
+#ifdef __GLIBC__
+  malloc_trim (0);
+#endif
+  bench_report (ctx, "low-memory", phase, 0);
+}
+
+static void
+async_result_cb (GObject *source_object, GAsyncResult *result, gpointer user_data)
+{
+  GAsyncResult **result_out = user_data;
+
+  *result_out = g_object_ref (result);
+}
+
+static GAsyncResult *
+wait_for_result (GAsyncResult **result)
+{
+  while (*result == NULL)
+    g_main_context_iteration (NULL, TRUE);
+  return *result;
+}
+
+/* Calls the plugin directly, so the loader's own work is not counted */
+static void
+plugin_refine (BenchContext *ctx, GsAppList *apps)
+{
+  GsPlugin *plugin = gs_plugin_loader_find_plugin (ctx->plugin_loader, "apk");
+  g_autoptr (GAsyncResult) result = NULL;
+  g_autoptr (GError) error = NULL;
+
+  GS_PLUGIN_GET_CLASS (plugin)->refine_async (plugin, apps,
+                                              GS_PLUGIN_REFINE_FLAGS_REQUIRE_VERSION |
+                                                  GS_PLUGIN_REFINE_FLAGS_REQUIRE_SIZE,
+                                              NULL, async_result_cb, &result);
+  GS_PLUGIN_GET_CLASS (plugin)->refine_finish (plugin, wait_for_result (&result), &error);
+  g_assert_no_error (error);
+}
+
+static void
+plugin_install (BenchContext *ctx, GsAppList *apps)
+{
+  GsPlugin *plugin = gs_plugin_loader_find_plugin (ctx->plugin_loader, "apk");
+  g_autoptr (GAsyncResult) result = NULL;
+  g_autoptr (GError) error = NULL;
+
+  GS_PLUGIN_GET_CLASS (plugin)->install_apps_async (plugin, apps,
+                                                    GS_PLUGIN_INSTALL_APPS_FLAGS_NONE,
+                                                    NULL, NULL, NULL, NULL,
+                                                    NULL, async_result_cb, &result);
+  GS_PLUGIN_GET_CLASS (plugin)->install_apps_finish (plugin, wait_for_result (&result), &error);
+  g_assert_no_error (error);
+}
+
+/* The daemon calls the plugin makes for @apps, without the plugin */
+static void
+raw_call (BenchContext *ctx, const gchar *method, GsAppList *apps, guint chunk_size)
+{
+  for (guint offset = 0; offset < gs_app_list_length (apps); offset += chunk_size)
+    {
+      guint n_names = MIN (chunk_size, gs_app_list_length (apps) - offset);
+      g_autofree const gchar **names = g_new0 (const gchar *, n_names + 1);
+      g_autoptr (GVariant) reply = NULL;
+      g_autoptr (GError) error = NULL;
+      GVariant *parameters;
+
+      for (guint i = 0; i < n_names; i++)
+        names[i] = gs_app_get_source_default (gs_app_list_index (apps, offset + i));
+      if (g_str_equal (method, "GetPackagesDetails"))
+        parameters = g_variant_new ("(^asu)", names, 0xFF);
+      else
+        parameters = g_variant_new ("(^as)", names);
+
+      reply = g_dbus_connection_call_sync (ctx->connection,
+                                           "dev.Cogitri.apkPolkit2",
+                                           "/dev/Cogitri/apkPolkit2",
+                                           "dev.Cogitri.apkPolkit2",
+                                           method, parameters, NULL,
+                                           G_DBUS_CALL_FLAGS_NONE, -1, NULL, &error);
+      g_assert_no_error (error);
+    }
+}
+
+static void
+reset_apps (GsAppList *apps)
+{
+  for (guint i = 0; i < gs_app_list_length (apps); i++)
+    gs_app_set_state (gs_app_list_index (apps, i), GS_APP_STATE_AVAILABLE);
+}
+
+static guint64
+measure_allocs (BenchContext *ctx,
+                void (*operation) (BenchContext *, GsAppList *),
+                GsAppList *apps)
+{
+  guint64 before;
+
+  reset_apps (apps);
+  before = bench_count_allocs (ctx);
+  operation (ctx, apps);
+  return bench_count_allocs (ctx) - before;
+}
+
+static guint64
+measure_raw_allocs (BenchContext *ctx,
+                    const gchar *method,
+                    guint chunk_size,
+                    GsAppList *apps)
+{
+  guint64 before = bench_count_allocs (ctx);
+
+  raw_call (ctx, method, apps, chunk_size);
+  return bench_count_allocs (ctx) - before;
+}
+
+/**
+ * bench_marginal_allocs:
+ *
+ * Fixed costs (GTask, the proxy call, list growth) do not matter, only what
+ * every further package costs. So the operation runs on @small and on
+ * @large, and the difference is divided by the number of extra packages.
+ * The same is done for the bare daemon calls and subtracted, which leaves
+ * the allocations made by the plugin itself per package.
+ **/
+static gdouble
+bench_marginal_allocs (BenchContext *ctx,
+                       void (*operation) (BenchContext *, GsAppList *),
+                       const gchar *method,
+                       guint chunk_size,
+                       GsAppList *small,
+                       GsAppList *large)
+{
+  guint n_extra = gs_app_list_length (large) - gs_app_list_length (small);
+  gdouble plugin;
+  gdouble raw;
+
+  /* Warm up, the allocation-free paths are the ones hitting caches */
+  measure_allocs (ctx, operation, large);
+
+  plugin = (gdouble) measure_allocs (ctx, operation, large) - measure_allocs (ctx, operation, small);
+  raw = (gdouble) measure_raw_allocs (ctx, method, chunk_size, large) -
+        measure_raw_allocs (ctx, method, chunk_size, small);
+
+  return (plugin - raw) / n_extra;
+}
+
+/**
+ * bench_check_allocations:
+ *
+ * Holds the per-package paths of warm refines and installs to their
+ * allocation budgets.
+ *
+ * Returns: %TRUE if all of them are within budget
+ **/
+static gboolean
+bench_check_allocations (BenchContext *ctx)
+{
+  g_autoptr (GsAppList) small = NULL;
+  g_autoptr (GsAppList) large = NULL;
+  gboolean ret = TRUE;
+  gdouble per_app;
+
+  if (ctx->alloc_counter_get == NULL)
+    {
+      g_printerr ("alloc-counter.so is not preloaded\n");
+      return FALSE;
+    }
+
+  small = bench_make_apps (ctx, MIN (ctx->n_packages / 4, 250));
+  large = bench_make_apps (ctx, MIN (ctx->n_packages / 2, 500));
+  g_assert_cmpuint (gs_app_list_length (large), >, gs_app_list_length (small));
+
+  per_app = bench_marginal_allocs (ctx, plugin_refine, "GetPackagesDetails",
+                                   BENCH_DETAILS_CHUNK_SIZE, small, large);
+  g_print ("refine: %.1f allocations per package (budget %u)\n",
+           per_app, BENCH_REFINE_ALLOC_BUDGET);
+  ret &= per_app <= BENCH_REFINE_ALLOC_BUDGET;
+
+  per_app = bench_marginal_allocs (ctx, plugin_install, "AddPackages",
+                                   G_MAXUINT, small, large);
+  g_print ("install: %.1f allocations per package (budget %u)\n",
+           per_app, BENCH_INSTALL_ALLOC_BUDGET);
+  ret &= per_app <= BENCH_INSTALL_ALLOC_BUDGET;
+
+  return ret;
+}
+
+int
+main (int argc, char **argv)
+{
+  g_autoptr (GOptionContext) option_context = NULL;
+  g_autoptr (GsPluginLoader) plugin_loader = NULL;
+  g_autoptr (GDBusConnection) bus_connection = NULL;
+  g_autoptr (GsAppList) apps = NULL;
+  g_autoptr (GsAppList) install_apps = NULL;
+  g_autoptr (GError) error = NULL;
+  g_autofree gchar *tmp_root = NULL;
+  g_autofree gchar *output_path = NULL;
+  BenchContext ctx = { NULL };
+  gint n_packages = 1000;
+  gboolean check_allocations = FALSE;
+  gboolean ret;
+  const gchar *allowlist[] = {
+    "apk",
+    NULL
+  };
+  const GOptionEntry entries[] = {
+    { "packages", 'n', 0, G_OPTION_ARG_INT, &n_packages,
+      "Number of packages served by the daemon", "N" },
+    { "output", 'o', 0, G_OPTION_ARG_FILENAME, &output_path,
+      "Append results as JSON lines to FILE", "FILE" },
+    { "check-allocations", 0, 0, G_OPTION_ARG_NONE, &check_allocations,
+      "Check allocations per package against their budgets, needs alloc-counter.so preloaded", NULL },
+    { NULL }
+  };
+
+  option_context = g_option_context_new ("- benchmark the apk plugin");
+  g_option_context_add_main_entries (option_context, entries, NULL);
+  if (!g_option_context_parse (option_context, &argc, &argv, &error))
+    {
+      g_printerr ("%s\n", error->message);
+      return 1;
+    }
+  ctx.n_packages = n_packages;
+  ctx.alloc_counter_get = (AllocCounterGetFunc) dlsym (RTLD_DEFAULT, "gs_alloc_counter_get");
+
+  /* Keep real settings and caches out of the measurements, and start
+   * every run cold */
+  g_setenv ("GSETTINGS_BACKEND", "memory", TRUE);
+  tmp_root = g_dir_make_tmp ("gnome-software-apk-bench-XXXXXX", NULL);
+  g_assert_nonnull (tmp_root);
+  g_setenv ("XDG_CACHE_HOME", tmp_root, TRUE);
+  g_setenv ("GS_SELF_TEST_CACHEDIR", tmp_root, TRUE);
+
+  if (output_path != NULL)
+    {
+      ctx.output = fopen (output_path, "a");
+      g_assert_nonnull (ctx.output);
+    }
+
+  bus_connection = g_bus_get_sync (G_BUS_TYPE_SESSION, NULL, &error);
+  g_assert_no_error (error);
+  plugin_loader = gs_plugin_loader_new (bus_connection, bus_connection);
+  gs_plugin_loader_add_location (plugin_loader, LOCALPLUGINDIR);
+  ret = gs_plugin_loader_setup (plugin_loader, allowlist, NULL, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_true (ret);
+  ctx.plugin_loader = plugin_loader;
+  ctx.connection = bus_connection;
+
+  if (check_allocations)
+    {
+      ret = bench_check_allocations (&ctx);
+      gs_utils_rmtree (tmp_root, NULL);
+      return ret ? 0 : 1;
+    }
+
+  apps = bench_make_apps (&ctx, ctx.n_packages);
+  install_apps = bench_make_apps (&ctx, MIN (ctx.n_packages, BENCH_INSTALL_BATCH));
+
+  bench_refine (&ctx, "cold", apps);
+  bench_refine (&ctx, "warm", apps);
+  bench_list_updates (&ctx, "cold");
+  bench_list_updates (&ctx, "warm");
+  bench_install (&ctx, "cold", install_apps);
+  bench_install (&ctx, "warm", install_apps);
+  bench_list_repositories (&ctx, "cold");
+  bench_list_repositories (&ctx, "warm");
+
+  /* What shedding the caches gives back, and what rebuilding them costs */
+  bench_low_memory (&ctx, "critical", G_MEMORY_MONITOR_WARNING_LEVEL_CRITICAL);
+  bench_refine (&ctx, "after-low-memory", apps);
+  bench_list_updates (&ctx, "after-low-memory");
+
+  if (ctx.output != NULL)
+    fclose (ctx.output);
+  gs_utils_rmtree (tmp_root, NULL);
+
+  return 0;
+}
@@ -5,11 +5,16 @@
  */
 
 #include <gnome-software.h>
+#include <string.h>
 
 #include <gs-plugin-loader-sync.h>
 #include <gs-plugin-loader.h>
 #include <gs-test.h>
 
+#include "gs-apk-appstream.h"
+#include "gs-apk-index.h"
+#include "gs-apk-refresh-scheduler.h"
+
 /* static void */
 /* gs_plugin_adopt_app_func (void) */
 /* { */
@@ -129,6 +134,8 @@ gs_plugins_apk_updates (GsPluginLoader *plugin_loader)
   g_assert_false (gs_app_has_quirk (desktop_app, GS_APP_QUIRK_IS_PROXY));
   g_assert_cmpstr (gs_app_get_name (desktop_app), ==, "ApkTestApp");
   g_assert_cmpint (gs_app_get_state (desktop_app), ==, GS_APP_STATE_UPDATABLE_LIVE);
+  g_assert_nonnull (gs_app_get_update_details_markup (desktop_app));
+  g_assert_cmpint (gs_app_get_update_urgency (desktop_app), ==, AS_URGENCY_KIND_MEDIUM);
   // Check generic proxy app
   generic_app = gs_app_list_index (update_list, 1);
   g_assert_nonnull (generic_app);
@@ -164,6 +171,239 @@ gs_plugins_apk_updates (GsPluginLoader *plugin_loader)
   g_assert_cmpint (gs_app_get_state (foreign_app), ==, GS_APP_STATE_UPDATABLE_LIVE);
 }
 
+static guint
+get_mock_calls (const gchar *method)
+{
+  g_autoptr (GError) error = NULL;
+  g_autoptr (GDBusConnection) bus = NULL;
+  g_autoptr (GVariant) reply = NULL;
+  guint n_calls = 0;
+
+  bus = g_bus_get_sync (G_BUS_TYPE_SESSION, NULL, &error);
+  g_assert_no_error (error);
+  reply = g_dbus_connection_call_sync (bus, "dev.Cogitri.apkPolkit2",
+                                       "/dev/Cogitri/apkPolkit2",
+                                       "org.freedesktop.DBus.Mock",
+                                       method, NULL,
+                                       G_VARIANT_TYPE ("(u)"),
+                                       G_DBUS_CALL_FLAGS_NONE, -1, NULL, &error);
+  g_assert_no_error (error);
+  g_variant_get (reply, "(u)", &n_calls);
+
+  return n_calls;
+}
+
+static guint
+list_updates (GsPluginLoader *plugin_loader)
+{
+  g_autoptr (GError) error = NULL;
+  g_autoptr (GsAppQuery) query = NULL;
+  g_autoptr (GsPluginJob) plugin_job = NULL;
+  g_autoptr (GsAppList) list = NULL;
+
+  query = gs_app_query_new ("is-for-update", GS_APP_QUERY_TRISTATE_TRUE, NULL);
+  plugin_job = gs_plugin_job_list_apps_new (query, GS_PLUGIN_LIST_APPS_FLAGS_NONE);
+  list = gs_plugin_loader_job_process (plugin_loader, plugin_job, NULL, &error);
+  gs_test_flush_main_context ();
+  g_assert_no_error (error);
+  g_assert_nonnull (list);
+
+  // How often the daemon computed the upgradable set so far
+  return get_mock_calls ("GetUpgradableCalls");
+}
+
+static GsApp *
+refine_update_details (GsPluginLoader *plugin_loader)
+{
+  g_autoptr (GError) error = NULL;
+  g_autoptr (GsPluginJob) plugin_job = NULL;
+  g_autoptr (GsAppList) list = gs_app_list_new ();
+  g_autoptr (GsAppList) refined = NULL;
+  g_autoptr (GsApp) app = gs_app_new ("apk-test-rebuild");
+
+  gs_app_set_kind (app, AS_COMPONENT_KIND_GENERIC);
+  gs_app_set_bundle_kind (app, AS_BUNDLE_KIND_PACKAGE);
+  gs_app_set_scope (app, AS_COMPONENT_SCOPE_SYSTEM);
+  gs_app_add_source (app, "apk-test-rebuild");
+  gs_app_set_version (app, "1.0-r0");
+  gs_app_set_update_version (app, "1.0-r1");
+  gs_app_set_state (app, GS_APP_STATE_UPDATABLE_LIVE);
+  gs_app_set_management_plugin (app, gs_plugin_loader_find_plugin (plugin_loader, "apk"));
+  gs_app_list_add (list, app);
+
+  plugin_job = gs_plugin_job_refine_new (list, GS_PLUGIN_REFINE_FLAGS_REQUIRE_UPDATE_DETAILS);
+  refined = gs_plugin_loader_job_process (plugin_loader, plugin_job, NULL, &error);
+  gs_test_flush_main_context ();
+  g_assert_no_error (error);
+
+  return g_steal_pointer (&app);
+}
+
+static GsPluginJob *
+refine_version_job (GsPluginLoader *plugin_loader, const gchar *const *sources)
+{
+  g_autoptr (GsAppList) list = gs_app_list_new ();
+
+  for (guint i = 0; sources[i] != NULL; i++)
+    {
+      g_autoptr (GsApp) app = gs_app_new (sources[i]);
+
+      gs_app_set_kind (app, AS_COMPONENT_KIND_GENERIC);
+      gs_app_set_bundle_kind (app, AS_BUNDLE_KIND_PACKAGE);
+      gs_app_set_scope (app, AS_COMPONENT_SCOPE_SYSTEM);
+      gs_app_add_source (app, sources[i]);
+      gs_app_set_state (app, GS_APP_STATE_AVAILABLE);
+      gs_app_set_management_plugin (app, gs_plugin_loader_find_plugin (plugin_loader, "apk"));
+      gs_app_list_add (list, app);
+    }
+
+  return gs_plugin_job_refine_new (list, GS_PLUGIN_REFINE_FLAGS_REQUIRE_VERSION);
+}
+
+static void
+refine_version (GsPluginLoader *plugin_loader, const gchar *source)
+{
+  g_autoptr (GError) error = NULL;
+  g_autoptr (GsPluginJob) plugin_job = NULL;
+  g_autoptr (GsAppList) refined = NULL;
+  const gchar *sources[] = { source, NULL };
+
+  plugin_job = refine_version_job (plugin_loader, sources);
+  refined = gs_plugin_loader_job_process (plugin_loader, plugin_job, NULL, &error);
+  gs_test_flush_main_context ();
+  g_assert_no_error (error);
+}
+
+static void
+gs_plugins_apk_not_found (GsPluginLoader *plugin_loader)
+{
+  guint n_calls;
+
+  // A package no repository has is only asked for once
+  refine_version (plugin_loader, "apk-test-missing");
+  n_calls = get_mock_calls ("GetDetailsCalls");
+  refine_version (plugin_loader, "apk-test-missing");
+  g_assert_cmpuint (get_mock_calls ("GetDetailsCalls"), ==, n_calls);
+
+  // Any other error, even one mentioning something not found, may be gone
+  // on the next attempt
+  refine_version (plugin_loader, "apk-test-broken");
+  g_assert_cmpuint (get_mock_calls ("GetDetailsCalls"), ==, n_calls + 1);
+  refine_version (plugin_loader, "apk-test-broken");
+  g_assert_cmpuint (get_mock_calls ("GetDetailsCalls"), ==, n_calls + 2);
+}
+
+static void
+refine_lanes_cb (GObject *source_object,
+                 GAsyncResult *res,
+                 gpointer user_data)
+{
+  GsAppList **out_list = user_data;
+  g_autoptr (GError) error = NULL;
+
+  *out_list = gs_plugin_loader_job_process_finish (GS_PLUGIN_LOADER (source_object), res, &error);
+  g_assert_no_error (error);
+  g_assert_nonnull (*out_list);
+}
+
+static void
+gs_plugins_apk_details_lanes (GsPluginLoader *plugin_loader)
+{
+  g_autoptr (GPtrArray) bulk_sources = g_ptr_array_new_with_free_func (g_free);
+  const gchar *interactive_sources[] = { "apk-test-app", NULL };
+  g_autoptr (GsPluginJob) bulk_job = NULL;
+  g_autoptr (GsPluginJob) interactive_job = NULL;
+  g_autoptr (GsAppList) bulk_list = NULL;
+  g_autoptr (GsAppList) interactive_list = NULL;
+
+  // A background refine big enough for several chunks, the first of which
+  // keeps the daemon busy for a while
+  g_ptr_array_add (bulk_sources, g_strdup ("slow"));
+  for (guint i = 0; i < 120; i++)
+    g_ptr_array_add (bulk_sources, g_strdup_printf ("apk-test-bulk-%u", i));
+  g_ptr_array_add (bulk_sources, NULL);
+  bulk_job = refine_version_job (plugin_loader, (const gchar *const *) bulk_sources->pdata);
+  gs_plugin_loader_job_process_async (plugin_loader, bulk_job, NULL,
+                                      refine_lanes_cb, &bulk_list);
+
+  // Let the first bulk chunk reach the daemon
+  for (guint i = 0; i < 2; i++)
+    {
+      g_usleep (100 * 1000);
+      gs_test_flush_main_context ();
+    }
+
+  // What the user is looking at does not wait for the queued chunks
+  interactive_job = refine_version_job (plugin_loader, interactive_sources);
+  gs_plugin_job_set_interactive (interactive_job, TRUE);
+  gs_plugin_loader_job_process_async (plugin_loader, interactive_job, NULL,
+                                      refine_lanes_cb, &interactive_list);
+  while (interactive_list == NULL)
+    g_main_context_iteration (NULL, TRUE);
+  g_assert_null (bulk_list);
+
+  while (bulk_list == NULL)
+    g_main_context_iteration (NULL, TRUE);
+}
+
+static void
+gs_plugins_apk_update_details (GsPluginLoader *plugin_loader)
+{
+  g_autoptr (GsApp) app = NULL;
+  g_autoptr (GsApp) cached_app = NULL;
+  guint n_calls;
+
+  // Only the -rN suffix differs, the same release was rebuilt
+  app = refine_update_details (plugin_loader);
+  g_assert_cmpint (gs_app_get_update_urgency (app), ==, AS_URGENCY_KIND_LOW);
+  g_assert_nonnull (gs_app_get_update_details_markup (app));
+  n_calls = get_mock_calls ("GetDetailsCalls");
+
+  // The same update again is served from the cache, without the daemon
+  cached_app = refine_update_details (plugin_loader);
+  g_assert_cmpint (gs_app_get_update_urgency (cached_app), ==, AS_URGENCY_KIND_LOW);
+  g_assert_cmpstr (gs_app_get_update_details_markup (cached_app), ==,
+                   gs_app_get_update_details_markup (app));
+  g_assert_cmpuint (get_mock_calls ("GetDetailsCalls"), ==, n_calls);
+}
+
+static void
+gs_plugins_apk_updates_snapshot (GsPluginLoader *plugin_loader)
+{
+  g_autoptr (GError) error = NULL;
+  g_autofree gchar *installed_path = NULL;
+  g_autofree gchar *installed = NULL;
+  g_autofree gchar *changed = NULL;
+  guint n_calls;
+
+  installed_path = g_build_filename (g_getenv ("GS_SELF_TEST_APK_ROOT"),
+                                     "lib", "apk", "db", "installed", NULL);
+  g_assert_true (g_file_get_contents (installed_path, &installed, NULL, &error));
+  g_assert_no_error (error);
+
+  // Let the check for updates queued by the previous test run first
+  for (guint i = 0; i < 10; i++)
+    {
+      g_usleep (100 * 1000);
+      gs_test_flush_main_context ();
+    }
+
+  // An unchanged database is answered from the last known set
+  n_calls = list_updates (plugin_loader);
+  g_assert_cmpuint (list_updates (plugin_loader), ==, n_calls);
+
+  // Once it changed, e.g. by apk outside of gnome-software, only the
+  // daemon knows the upgradable set
+  changed = g_strconcat (installed, "P:apk-test-extra\nV:1.0-r0\n\n", NULL);
+  g_assert_true (g_file_set_contents (installed_path, changed, -1, &error));
+  g_assert_no_error (error);
+  g_assert_cmpuint (list_updates (plugin_loader), ==, n_calls + 1);
+  g_assert_cmpuint (list_updates (plugin_loader), ==, n_calls + 1);
+
+  g_assert_true (g_file_set_contents (installed_path, installed, -1, &error));
+  g_assert_no_error (error);
+}
+
 static void
 gs_plugins_apk_app_install_remove (GsPluginLoader *plugin_loader)
 {
@@ -252,11 +492,585 @@ gs_plugins_apk_refine_app_missing_source (GsPluginLoader *plugin_loader)
   g_assert_nonnull (gs_app_get_source_default (app));
 }
 
+static void
+gs_plugins_apk_what_provides (GsPluginLoader *plugin_loader)
+{
+  g_autoptr (GError) error = NULL;
+  g_autoptr (GsPluginJob) plugin_job = NULL;
+  g_autoptr (GsAppList) list = NULL;
+  g_autoptr (GsAppQuery) query = NULL;
+  GsApp *app;
+
+  // The command is only listed in the p: field of the fake database
+  query = gs_app_query_new ("provides-tag", "cmd:apk-test",
+                            "provides-type", GS_APP_QUERY_PROVIDES_PACKAGE_NAME,
+                            NULL);
+  plugin_job = gs_plugin_job_list_apps_new (query, GS_PLUGIN_LIST_APPS_FLAGS_NONE);
+  list = gs_plugin_loader_job_process (plugin_loader, plugin_job, NULL, &error);
+  gs_test_flush_main_context ();
+  g_assert_no_error (error);
+  g_assert_nonnull (list);
+  g_assert_cmpint (gs_app_list_length (list), ==, 1);
+  app = gs_app_list_index (list, 0);
+  g_assert_cmpstr (gs_app_get_source_default (app), ==, "apk-test-app");
+}
+
+static void
+gs_plugins_apk_addons (GsPluginLoader *plugin_loader)
+{
+  g_autoptr (GError) error = NULL;
+  g_autoptr (GsPluginJob) plugin_job = NULL;
+  g_autoptr (GsApp) app = NULL;
+  g_autoptr (GsAppList) addons = NULL;
+  g_autoptr (GsAppQuery) query = NULL;
+  const char *keywords[2] = { "apk-test", NULL };
+
+  // apk-test-app-doc is built from the same origin as apk-test-app
+  query = gs_app_query_new ("keywords", keywords,
+                            "refine-flags", GS_PLUGIN_REFINE_FLAGS_REQUIRE_ADDONS,
+                            NULL);
+  plugin_job = gs_plugin_job_list_apps_new (query, GS_PLUGIN_LIST_APPS_FLAGS_NONE);
+  app = gs_plugin_loader_job_process_app (plugin_loader, plugin_job, NULL, &error);
+  gs_test_flush_main_context ();
+  g_assert_no_error (error);
+  g_assert_nonnull (app);
+  g_assert_cmpstr (gs_app_get_source_default (app), ==, "apk-test-app");
+
+  addons = gs_app_dup_addons (app);
+  g_assert_nonnull (addons);
+  g_assert_cmpint (gs_app_list_length (addons), ==, 1);
+  g_assert_cmpstr (gs_app_get_source_default (gs_app_list_index (addons, 0)), ==,
+                   "apk-test-app-doc");
+}
+
+static GsApp *
+list_orphans_proxy (GsPluginLoader *plugin_loader)
+{
+  g_autoptr (GError) error = NULL;
+  g_autoptr (GsPluginJob) plugin_job = NULL;
+  g_autoptr (GsAppList) list = NULL;
+  g_autoptr (GsAppQuery) query = NULL;
+
+  query = gs_app_query_new ("is-installed", GS_APP_QUERY_TRISTATE_TRUE,
+                            NULL);
+  plugin_job = gs_plugin_job_list_apps_new (query, GS_PLUGIN_LIST_APPS_FLAGS_NONE);
+  list = gs_plugin_loader_job_process (plugin_loader, plugin_job, NULL, &error);
+  gs_test_flush_main_context ();
+  g_assert_no_error (error);
+  g_assert_nonnull (list);
+  for (guint i = 0; i < gs_app_list_length (list); i++)
+    {
+      GsApp *app = gs_app_list_index (list, i);
+      if (g_strcmp0 (gs_app_get_id (app), "org.alpinelinux.apk.orphans") == 0)
+        return g_object_ref (app);
+    }
+
+  return NULL;
+}
+
+static void
+gs_plugins_apk_orphans (GsPluginLoader *plugin_loader)
+{
+  g_autoptr (GsApp) proxy = NULL;
+  GsAppList *related;
+
+  // apk-test-app-doc and musl are not in the world of the fake database,
+  // and nothing installed depends on them. The list is empty while the
+  // index is built, the orphans are there once it is.
+  for (guint i = 0; i < 50 && proxy == NULL; i++)
+    {
+      proxy = list_orphans_proxy (plugin_loader);
+      if (proxy == NULL)
+        g_usleep (100 * 1000);
+    }
+  g_assert_nonnull (proxy);
+  g_assert_true (gs_app_has_quirk (proxy, GS_APP_QUIRK_IS_PROXY));
+  related = gs_app_get_related (proxy);
+  g_assert_cmpint (gs_app_list_length (related), ==, 2);
+}
+
+static void
+gs_apk_refresh_scheduler_func (void)
+{
+  g_autofree gchar *root = g_dir_make_tmp ("gnome-software-apk-scheduler-XXXXXX", NULL);
+  g_autofree gchar *cache_dir = NULL;
+  g_autofree gchar *index_path = NULL;
+  g_autoptr (GsApkRefreshScheduler) scheduler = NULL;
+  g_autoptr (GError) error = NULL;
+  const gchar *reason = NULL;
+  guint64 backoff_secs = 0;
+
+  g_assert_nonnull (root);
+  scheduler = gs_apk_refresh_scheduler_new (root);
+
+  // Without any index a refresh is due, however old the indexes may be
+  g_assert_true (gs_apk_refresh_scheduler_should_refresh (scheduler, G_MAXUINT64, FALSE, &reason));
+  g_assert_null (reason);
+  g_assert_true (gs_apk_refresh_scheduler_should_refresh (scheduler, 60 * 60, FALSE, &reason));
+
+  // Failures back off exponentially, up to a day
+  g_assert_cmpuint (gs_apk_refresh_scheduler_report (scheduler, FALSE), ==, 15 * 60);
+  g_assert_false (gs_apk_refresh_scheduler_should_refresh (scheduler, G_MAXUINT64, FALSE, &reason));
+  g_assert_cmpstr (reason, ==, "backing off after failures");
+  g_assert_true (gs_apk_refresh_scheduler_should_refresh (scheduler, G_MAXUINT64, TRUE, NULL));
+  g_assert_cmpuint (gs_apk_refresh_scheduler_report (scheduler, FALSE), ==, 30 * 60);
+  g_assert_cmpuint (gs_apk_refresh_scheduler_report (scheduler, FALSE), ==, 60 * 60);
+  for (guint i = 0; i < 20; i++)
+    backoff_secs = gs_apk_refresh_scheduler_report (scheduler, FALSE);
+  g_assert_cmpuint (backoff_secs, ==, 24 * 60 * 60);
+  g_assert_cmpuint (gs_apk_refresh_scheduler_report (scheduler, TRUE), ==, 0);
+  g_assert_true (gs_apk_refresh_scheduler_should_refresh (scheduler, G_MAXUINT64, FALSE, NULL));
+
+  // A fresh index is recent enough for any cache age
+  cache_dir = g_build_filename (root, "var", "cache", "apk", NULL);
+  g_assert_cmpint (g_mkdir_with_parents (cache_dir, 0755), ==, 0);
+  index_path = g_build_filename (cache_dir, "APKINDEX.12345678.tar.gz", NULL);
+  g_assert_true (g_file_set_contents (index_path, "", -1, &error));
+  g_assert_no_error (error);
+  g_assert_false (gs_apk_refresh_scheduler_should_refresh (scheduler, 60 * 60, FALSE, &reason));
+  g_assert_cmpstr (reason, ==, "the indexes are recent enough");
+  g_assert_false (gs_apk_refresh_scheduler_should_refresh (scheduler, G_MAXUINT64, FALSE, NULL));
+
+  gs_utils_rmtree (root, NULL);
+}
+
+static void
+gs_apk_index_exclusive_size_func (void)
+{
+  g_autoptr (GsApkIndex) apk_index = gs_apk_index_new ();
+  const gchar *installed = "P:app\nV:1.0-r0\nI:100\nD:libexclusive libshared>=2\n\n"
+                           "P:tool\nV:1.0-r0\nI:10\nD:libshared\n\n"
+                           "P:libexclusive\nV:1.0-r0\nI:20\nD:libdeep\n\n"
+                           "P:libdeep\nV:1.0-r0\nI:5\nD:libexclusive\n\n"
+                           "P:libshared\nV:2.0-r0\nI:30\n\n"
+                           "P:app-extra\nV:1.0-r0\nI:7\ni:app\n\n"
+                           "P:orphan\nV:1.0-r0\nI:1000\n\n";
+  const gchar *available = "P:other\nV:1.0-r0\nI:1\n\n";
+  const gchar *world = "app tool\n";
+
+  gs_apk_index_add_text (apk_index, installed, strlen (installed), TRUE);
+  gs_apk_index_add_text (apk_index, available, strlen (available), FALSE);
+  gs_apk_index_set_world (apk_index, world, strlen (world));
+
+  // libexclusive, libdeep (despite the cycle) and app-extra only go with app
+  g_assert_cmpuint (gs_apk_index_get_exclusive_size (apk_index, "app"), ==, 100 + 20 + 5 + 7);
+  g_assert_cmpuint (gs_apk_index_get_exclusive_size (apk_index, "libexclusive"), ==, 20 + 5);
+  // libshared is needed by tool too
+  g_assert_cmpuint (gs_apk_index_get_exclusive_size (apk_index, "tool"), ==, 10);
+  g_assert_cmpuint (gs_apk_index_get_exclusive_size (apk_index, "libshared"), ==, 30);
+  g_assert_cmpuint (gs_apk_index_get_exclusive_size (apk_index, "orphan"), ==, 1000);
+  g_assert_cmpuint (gs_apk_index_get_exclusive_size (apk_index, "other"), ==, 0);
+  g_assert_cmpuint (gs_apk_index_get_exclusive_size (apk_index, "missing"), ==, 0);
+
+  // Without app, tool is the only one left needing libshared
+  gs_apk_index_set_world (apk_index, "tool\n", strlen ("tool\n"));
+  g_assert_cmpuint (gs_apk_index_get_exclusive_size (apk_index, "tool"), ==, 10 + 30);
+}
+
+static void
+gs_apk_index_orphans_func (void)
+{
+  g_autoptr (GsApkIndex) apk_index = gs_apk_index_new ();
+  g_autoptr (GPtrArray) orphans = NULL;
+  const gchar *installed = "P:app\nV:1.0-r0\nD:cmd:sh\n\n"
+                           "P:busybox\nV:1.36-r0\np:cmd:sh=1.36\n\n"
+                           "P:tool\nV:1.0-r0\nD:so:libfoo.so.1 !app-legacy\n\n"
+                           "P:libfoo\nV:1.0-r0\np:so:libfoo.so.1=1.0\n\n"
+                           "P:app-legacy\nV:0.9-r0\n\n";
+  const gchar *world = "app\n";
+
+  gs_apk_index_add_text (apk_index, installed, strlen (installed), TRUE);
+  gs_apk_index_set_world (apk_index, world, strlen (world));
+
+  // libfoo is only needed by tool, through its virtual so: provide, so it
+  // is kept until tool is gone. A conflict is not a dependency.
+  orphans = gs_apk_index_get_orphans (apk_index);
+  g_assert_cmpuint (orphans->len, ==, 2);
+  g_assert_cmpstr (((GsApkIndexPackage *) g_ptr_array_index (orphans, 0))->name, ==, "tool");
+  g_assert_cmpstr (((GsApkIndexPackage *) g_ptr_array_index (orphans, 1))->name, ==, "app-legacy");
+}
+
+static void
+ensure_index (GsPluginLoader *plugin_loader)
+{
+  g_autoptr (GError) error = NULL;
+  g_autoptr (GsPluginJob) plugin_job = NULL;
+  g_autoptr (GsAppList) list = NULL;
+  g_autoptr (GsAppQuery) query = NULL;
+
+  // What-provides queries wait for the index to be up to date
+  query = gs_app_query_new ("provides-tag", "cmd:apk-test",
+                            "provides-type", GS_APP_QUERY_PROVIDES_PACKAGE_NAME,
+                            NULL);
+  plugin_job = gs_plugin_job_list_apps_new (query, GS_PLUGIN_LIST_APPS_FLAGS_NONE);
+  list = gs_plugin_loader_job_process (plugin_loader, plugin_job, NULL, &error);
+  gs_test_flush_main_context ();
+  g_assert_no_error (error);
+}
+
+static GStrv
+get_mock_packages (const gchar *method)
+{
+  g_autoptr (GError) error = NULL;
+  g_autoptr (GDBusConnection) bus = NULL;
+  g_autoptr (GVariant) reply = NULL;
+  GStrv packages = NULL;
+
+  bus = g_bus_get_sync (G_BUS_TYPE_SESSION, NULL, &error);
+  g_assert_no_error (error);
+  reply = g_dbus_connection_call_sync (bus, "dev.Cogitri.apkPolkit2",
+                                       "/dev/Cogitri/apkPolkit2",
+                                       "org.freedesktop.DBus.Mock",
+                                       method, NULL,
+                                       G_VARIANT_TYPE ("(as)"),
+                                       G_DBUS_CALL_FLAGS_NONE, -1, NULL, &error);
+  g_assert_no_error (error);
+  g_variant_get (reply, "(^as)", &packages);
+
+  return packages;
+}
+
+static void
+gs_plugins_apk_install_lang (GsPluginLoader *plugin_loader)
+{
+  g_autoptr (GError) error = NULL;
+  g_autoptr (GsPluginJob) plugin_job = NULL;
+  g_autoptr (GsApp) app = gs_app_new ("foo");
+  g_autoptr (GsAppList) list = gs_app_list_new ();
+  g_auto (GStrv) added = NULL;
+  g_autofree gchar *language = g_strdup (g_getenv ("LANGUAGE"));
+  GsPlugin *plugin = gs_plugin_loader_find_plugin (plugin_loader, "apk");
+  gboolean rc;
+
+  gs_app_set_management_plugin (app, plugin);
+  gs_app_add_source (app, "foo");
+  gs_app_set_state (app, GS_APP_STATE_AVAILABLE);
+  gs_app_list_add (list, app);
+
+  // Translations are only added from an up to date index
+  ensure_index (plugin_loader);
+
+  // foo-lang-de is from another origin, and must not be added
+  g_setenv ("LANGUAGE", "de", TRUE);
+  plugin_job = gs_plugin_job_install_apps_new (list,
+                                               GS_PLUGIN_INSTALL_APPS_FLAGS_NONE);
+  rc = gs_plugin_loader_job_action (plugin_loader, plugin_job, NULL, &error);
+  gs_test_flush_main_context ();
+  if (language != NULL)
+    g_setenv ("LANGUAGE", language, TRUE);
+  else
+    g_unsetenv ("LANGUAGE");
+  g_assert_no_error (error);
+  g_assert_true (rc);
+
+  added = get_mock_packages ("GetAddedPackages");
+  g_assert_true (g_strv_contains ((const gchar *const *) added, "foo"));
+  g_assert_true (g_strv_contains ((const gchar *const *) added, "foo-lang"));
+  g_assert_false (g_strv_contains ((const gchar *const *) added, "foo-lang-de"));
+}
+
+static void
+gs_plugins_apk_uninstall_lang (GsPluginLoader *plugin_loader)
+{
+  g_autoptr (GError) error = NULL;
+  g_autoptr (GsPluginJob) plugin_job = NULL;
+  g_autoptr (GsApp) app = gs_app_new ("apk-test-tool");
+  g_autoptr (GsAppList) list = gs_app_list_new ();
+  g_auto (GStrv) deleted = NULL;
+  gboolean rc;
+
+  gs_app_set_management_plugin (app, gs_plugin_loader_find_plugin (plugin_loader, "apk"));
+  gs_app_add_source (app, "apk-test-tool");
+  gs_app_set_state (app, GS_APP_STATE_INSTALLED);
+  gs_app_list_add (list, app);
+
+  // Its translations were installed with it, and are in the world too
+  plugin_job = gs_plugin_job_uninstall_apps_new (list,
+                                                 GS_PLUGIN_UNINSTALL_APPS_FLAGS_NONE);
+  rc = gs_plugin_loader_job_action (plugin_loader, plugin_job, NULL, &error);
+  gs_test_flush_main_context ();
+  g_assert_no_error (error);
+  g_assert_true (rc);
+
+  deleted = get_mock_packages ("GetDeletedPackages");
+  g_assert_true (g_strv_contains ((const gchar *const *) deleted, "apk-test-tool"));
+  g_assert_true (g_strv_contains ((const gchar *const *) deleted, "apk-test-tool-lang"));
+}
+
+static void
+gs_plugins_apk_removal_impact (GsPluginLoader *plugin_loader)
+{
+  g_autoptr (GError) error = NULL;
+  g_autoptr (GsPluginJob) plugin_job = NULL;
+  g_autoptr (GsAppList) list = gs_app_list_new ();
+  g_autoptr (GsAppList) refined = NULL;
+  g_autoptr (GsApp) app = gs_app_new ("apk-test-lib");
+
+  gs_app_set_kind (app, AS_COMPONENT_KIND_GENERIC);
+  gs_app_set_bundle_kind (app, AS_BUNDLE_KIND_PACKAGE);
+  gs_app_set_scope (app, AS_COMPONENT_SCOPE_SYSTEM);
+  gs_app_add_source (app, "apk-test-lib");
+  gs_app_set_management_plugin (app, gs_plugin_loader_find_plugin (plugin_loader, "apk"));
+  gs_app_list_add (list, app);
+
+  // apk-test-app depends on apk-test-lib in the fake database
+  plugin_job = gs_plugin_job_refine_new (list, GS_PLUGIN_REFINE_FLAGS_REQUIRE_RELATED);
+  refined = gs_plugin_loader_job_process (plugin_loader, plugin_job, NULL, &error);
+  gs_test_flush_main_context ();
+  g_assert_no_error (error);
+  g_assert_cmpstr (gs_app_get_metadata_item (app, "apk::removal-impact"), ==, "apk-test-app");
+}
+
+static void
+gs_apk_index_removal_impact_func (void)
+{
+  g_autoptr (GsApkIndex) apk_index = gs_apk_index_new ();
+  g_autoptr (GPtrArray) impact = NULL;
+  const gchar *installed = "P:app\nV:1.0-r0\nD:so:libssl.so.3 cmd:sh\n\n"
+                           "P:openssl\nV:3.0-r0\np:so:libssl.so.3=3.0\n\n"
+                           "P:libressl\nV:3.9-r0\np:so:libssl.so.3=3.9\n\n"
+                           "P:busybox\nV:1.36-r0\np:cmd:sh=1.36\n\n"
+                           "P:plugin\nV:1.0-r0\nD:app\n\n";
+  const gchar *openssl_names[] = { "openssl", NULL };
+  const gchar *ssl_names[] = { "openssl", "libressl", NULL };
+  const gchar *busybox_names[] = { "busybox", NULL };
+
+  gs_apk_index_add_text (apk_index, installed, strlen (installed), TRUE);
+
+  // Another installed provider keeps the dependency satisfied
+  impact = gs_apk_index_get_removal_impact (apk_index, openssl_names);
+  g_assert_cmpuint (impact->len, ==, 0);
+  g_clear_pointer (&impact, g_ptr_array_unref);
+
+  // Dependents of dependents are followed
+  impact = gs_apk_index_get_removal_impact (apk_index, ssl_names);
+  g_assert_cmpuint (impact->len, ==, 2);
+  g_assert_cmpstr (((GsApkIndexPackage *) g_ptr_array_index (impact, 0))->name, ==, "app");
+  g_assert_cmpstr (((GsApkIndexPackage *) g_ptr_array_index (impact, 1))->name, ==, "plugin");
+  g_clear_pointer (&impact, g_ptr_array_unref);
+
+  impact = gs_apk_index_get_removal_impact (apk_index, busybox_names);
+  g_assert_cmpuint (impact->len, ==, 2);
+}
+
+static void
+gs_apk_appstream_update_func (void)
+{
+  g_autoptr (GsApkAppstream) appstream = gs_apk_appstream_new ();
+  g_autoptr (GsApkIndex) apk_index = gs_apk_index_new ();
+  g_autoptr (GsApkIndex) new_index = gs_apk_index_new ();
+  g_autoptr (GHashTable) pkgnames = g_hash_table_new (g_str_hash, g_str_equal);
+  g_autoptr (GBytes) xml = NULL;
+  g_autofree gchar *text = NULL;
+  GsApkAppstreamStats stats;
+  const gchar *packages = "P:foo\nV:1.0-r0\nT:Foo\np:cmd:foo=1.0-r0\nD:so:libfoo.so.1 cmd:foo-helper\n\n"
+                          "P:foo-doc\nV:1.0-r0\nT:Foo (documentation)\np:cmd:foo-doc=1.0-r0\n\n"
+                          "P:foo-libs\nV:1.0-r0\nT:Foo (libraries)\np:so:libfoo.so.1=1.0\n\n"
+                          "P:foo-helper\nV:1.0-r0\nT:Foo helper\np:cmd:foo-helper=1.0-r0\n\n"
+                          "P:bar\nV:2.0-r0\nT:Bar\np:cmd:bar=2.0-r0\n\n"
+                          "P:keep\nV:1.0-r0\nT:Keep\np:cmd:keep=1.0-r0\n\n"
+                          "P:described\nV:1.0-r0\nT:Described\np:cmd:described=1.0-r0\n\n";
+  const gchar *new_packages = "P:foo\nV:1.1-r0\nT:Foo\np:cmd:foo=1.1-r0\n\n"
+                              "P:keep\nV:1.0-r0\nT:Keep\np:cmd:keep=1.0-r0\n\n"
+                              "P:qux\nV:1.0-r0\nT:Qux\np:cmd:qux=1.0-r0\n\n";
+
+  gs_apk_index_add_text (apk_index, packages, strlen (packages), FALSE);
+  gs_apk_index_add_text (new_index, new_packages, strlen (new_packages), FALSE);
+  // Already in the distribution's catalog
+  g_hash_table_add (pkgnames, (gpointer) "described");
+
+  xml = gs_apk_appstream_update (appstream, apk_index, pkgnames, &stats);
+  g_assert_nonnull (xml);
+  g_assert_cmpuint (stats.n_formatted, ==, 3);
+  g_assert_cmpuint (stats.n_reused, ==, 0);
+  g_assert_cmpuint (stats.n_dropped, ==, 0);
+  text = g_strndup (g_bytes_get_data (xml, NULL), g_bytes_get_size (xml));
+  g_assert_nonnull (strstr (text, "<id>org.alpinelinux.packages.foo</id>"));
+  g_assert_nonnull (strstr (text, "<pkgname>foo</pkgname>"));
+  g_assert_null (strstr (text, "<pkgname>foo-doc</pkgname>"));
+  g_assert_null (strstr (text, "<pkgname>described</pkgname>"));
+  // A library only providing so: is no software to look for
+  g_assert_null (strstr (text, "<pkgname>foo-libs</pkgname>"));
+  // Neither is a tool other packages depend on
+  g_assert_null (strstr (text, "<pkgname>foo-helper</pkgname>"));
+  g_clear_pointer (&xml, g_bytes_unref);
+
+  // Nothing changed, nothing to write
+  g_assert_null (gs_apk_appstream_update (appstream, apk_index, pkgnames, &stats));
+  g_assert_cmpuint (stats.n_formatted, ==, 0);
+  g_assert_cmpuint (stats.n_dropped, ==, 0);
+
+  // foo changed version, qux is new, bar was removed and keep is reused
+  xml = gs_apk_appstream_update (appstream, new_index, pkgnames, &stats);
+  g_assert_nonnull (xml);
+  g_assert_cmpuint (stats.n_formatted, ==, 2);
+  g_assert_cmpuint (stats.n_reused, ==, 1);
+  g_assert_cmpuint (stats.n_dropped, ==, 1);
+}
+
+static void
+gs_apk_appstream_shed_func (void)
+{
+  g_autoptr (GsApkAppstream) appstream = gs_apk_appstream_new ();
+  g_autoptr (GsApkAppstream) fresh = gs_apk_appstream_new ();
+  g_autoptr (GsApkIndex) apk_index = gs_apk_index_new ();
+  g_autoptr (GsApkIndex) new_index = gs_apk_index_new ();
+  g_autoptr (GHashTable) pkgnames = g_hash_table_new (g_str_hash, g_str_equal);
+  g_autoptr (GBytes) xml = NULL;
+  g_autoptr (GBytes) fresh_xml = NULL;
+  const gchar *packages = "P:foo\nV:1.0-r0\nT:Foo\np:cmd:foo=1.0-r0\n\n"
+                          "P:bar\nV:2.0-r0\nT:Bar\np:cmd:bar=2.0-r0\n\n";
+  const gchar *new_packages = "P:foo\nV:1.1-r0\nT:Foo\np:cmd:foo=1.1-r0\n\n"
+                              "P:bar\nV:2.0-r0\nT:Bar\np:cmd:bar=2.0-r0\n\n";
+
+  gs_apk_index_add_text (apk_index, packages, strlen (packages), FALSE);
+  gs_apk_index_add_text (new_index, new_packages, strlen (new_packages), FALSE);
+
+  xml = gs_apk_appstream_update (appstream, apk_index, pkgnames, NULL);
+  g_assert_nonnull (xml);
+  g_clear_pointer (&xml, g_bytes_unref);
+
+  // Shedding the XML doesn't make an unchanged collection look new
+  gs_apk_appstream_shed (appstream);
+  g_assert_null (gs_apk_appstream_update (appstream, apk_index, pkgnames, NULL));
+
+  // The shed components are formatted again once something changed
+  gs_apk_appstream_shed (appstream);
+  xml = gs_apk_appstream_update (appstream, new_index, pkgnames, NULL);
+  g_assert_nonnull (xml);
+  fresh_xml = gs_apk_appstream_update (fresh, new_index, pkgnames, NULL);
+  g_assert_true (g_bytes_equal (xml, fresh_xml));
+}
+
+/* Where apk caches the index of the repository @url */
+static gchar *
+cached_index_path (const gchar *root, const gchar *url)
+{
+  g_autofree gchar *checksum = g_compute_checksum_for_string (G_CHECKSUM_SHA1, url, -1);
+  g_autofree gchar *file_name = g_strdup_printf ("APKINDEX.%.8s.tar.gz", checksum);
+
+  return g_build_filename (root, "etc", "apk", "cache", file_name, NULL);
+}
+
+static void
+gs_apk_index_repositories_func (void)
+{
+  g_autofree gchar *root = g_dir_make_tmp ("gs-apk-index-XXXXXX", NULL);
+  g_autofree gchar *path = NULL;
+  g_autoptr (GsApkIndex) apk_index = NULL;
+  g_autoptr (GError) error = NULL;
+
+  path = g_build_filename (root, "lib", "apk", "db", NULL);
+  g_assert_cmpint (g_mkdir_with_parents (path, 0755), ==, 0);
+  g_clear_pointer (&path, g_free);
+  path = g_build_filename (root, "etc", "apk", "cache", NULL);
+  g_assert_cmpint (g_mkdir_with_parents (path, 0755), ==, 0);
+  g_clear_pointer (&path, g_free);
+  path = g_build_filename (root, "lib", "apk", "db", "installed", NULL);
+  g_assert_true (g_file_set_contents (path, "P:musl\nV:1.2.5-r0\n\n", -1, &error));
+  g_assert_no_error (error);
+  g_clear_pointer (&path, g_free);
+  path = g_build_filename (root, "etc", "apk", "repositories", NULL);
+  g_assert_true (g_file_set_contents (path,
+                                      "# comment\n"
+                                      "https://a.example/main\n"
+                                      "@testing https://b.example/testing\n",
+                                      -1, &error));
+  g_assert_no_error (error);
+  g_clear_pointer (&path, g_free);
+
+  path = cached_index_path (root, "https://a.example/main");
+  g_assert_true (g_file_set_contents (path, "P:both\nV:1.0-r0\n\nP:main\nV:1.0-r0\n\n", -1, &error));
+  g_assert_no_error (error);
+  g_clear_pointer (&path, g_free);
+  path = cached_index_path (root, "https://b.example/testing");
+  g_assert_true (g_file_set_contents (path, "P:both\nV:2.0-r0\n\nP:testing\nV:1.0-r0\n\n", -1, &error));
+  g_assert_no_error (error);
+  g_clear_pointer (&path, g_free);
+  // Still cached, but no longer configured
+  path = cached_index_path (root, "https://removed.example/main");
+  g_assert_true (g_file_set_contents (path, "P:removed\nV:1.0-r0\n\n", -1, &error));
+  g_assert_no_error (error);
+  g_clear_pointer (&path, g_free);
+
+  apk_index = gs_apk_index_load (root, &error);
+  g_assert_no_error (error);
+  g_assert_nonnull (apk_index);
+  g_assert_nonnull (gs_apk_index_get_package (apk_index, "main"));
+  g_assert_nonnull (gs_apk_index_get_package (apk_index, "testing"));
+  g_assert_null (gs_apk_index_get_package (apk_index, "removed"));
+  // The first configured repository wins
+  g_assert_cmpstr (gs_apk_index_get_package (apk_index, "both")->version, ==, "1.0-r0");
+
+  gs_utils_rmtree (root, NULL);
+}
+
+static void
+gs_apk_index_suggest_func (void)
+{
+  g_autoptr (GsApkIndex) apk_index = gs_apk_index_new ();
+  g_autoptr (GArray) matches = NULL;
+  g_autofree gchar *a63 = g_strnfill (63, 'a');
+  g_autofree gchar *a64 = g_strnfill (64, 'a');
+  g_autofree gchar *available = g_strdup_printf ("P:firefox\nV:1.0-r0\n\n"
+                                                 "P:thunderbird\nV:1.0-r0\n\n"
+                                                 "P:sitting\nV:1.0-r0\n\n"
+                                                 "P:b%s\nV:1.0-r0\n\n"
+                                                 "P:b%s\nV:1.0-r0\n\n",
+                                                 a63, a64);
+  g_autofree gchar *keyword64 = g_strconcat ("c", a63, NULL);
+  g_autofree gchar *keyword65 = g_strconcat ("c", a64, NULL);
+  GsApkIndexMatch *match;
+
+  gs_apk_index_add_text (apk_index, available, strlen (available), FALSE);
+
+  matches = gs_apk_index_suggest (apk_index, "firefx", 3, 10, G_USEC_PER_SEC);
+  g_assert_cmpuint (matches->len, ==, 1);
+  match = &g_array_index (matches, GsApkIndexMatch, 0);
+  g_assert_cmpstr (match->package->name, ==, "firefox");
+  g_assert_cmpuint (match->distance, ==, 1);
+  g_clear_pointer (&matches, g_array_unref);
+
+  // A transposition is two edits
+  matches = gs_apk_index_suggest (apk_index, "thunderbrid", 3, 10, G_USEC_PER_SEC);
+  g_assert_cmpuint (matches->len, ==, 1);
+  g_assert_cmpuint (g_array_index (matches, GsApkIndexMatch, 0).distance, ==, 2);
+  g_clear_pointer (&matches, g_array_unref);
+
+  matches = gs_apk_index_suggest (apk_index, "kitten", 3, 10, G_USEC_PER_SEC);
+  g_assert_cmpuint (matches->len, ==, 1);
+  g_assert_cmpstr (g_array_index (matches, GsApkIndexMatch, 0).package->name, ==, "sitting");
+  g_assert_cmpuint (g_array_index (matches, GsApkIndexMatch, 0).distance, ==, 3);
+  g_clear_pointer (&matches, g_array_unref);
+
+  // Beyond the maximum distance
+  matches = gs_apk_index_suggest (apk_index, "kitten", 2, 10, G_USEC_PER_SEC);
+  g_assert_cmpuint (matches->len, ==, 0);
+  g_clear_pointer (&matches, g_array_unref);
+
+  // A name containing the keyword means it isn't a typo
+  matches = gs_apk_index_suggest (apk_index, "firefo", 3, 10, G_USEC_PER_SEC);
+  g_assert_cmpuint (matches->len, ==, 0);
+  g_clear_pointer (&matches, g_array_unref);
+
+  // 64 bytes is the longest keyword that fits the bit-parallel pattern
+  matches = gs_apk_index_suggest (apk_index, keyword64, 1, 10, G_USEC_PER_SEC);
+  g_assert_cmpuint (matches->len, ==, 1);
+  g_assert_cmpuint (strlen (g_array_index (matches, GsApkIndexMatch, 0).package->name), ==, 64);
+  g_assert_cmpuint (g_array_index (matches, GsApkIndexMatch, 0).distance, ==, 1);
+  g_clear_pointer (&matches, g_array_unref);
+
+  matches = gs_apk_index_suggest (apk_index, keyword65, 1, 10, G_USEC_PER_SEC);
+  g_assert_cmpuint (matches->len, ==, 0);
+}
+
 int
 main (int argc, char **argv)
 {
   g_autofree gchar *xml = NULL;
   g_autofree gchar *tmp_root = NULL;
+  g_autofree gchar *apk_root = NULL;
+  g_autofree gchar *apk_db = NULL;
   g_autoptr (GsPluginLoader) plugin_loader = NULL;
   g_autoptr (GSettings) settings = NULL;
   g_autoptr (GDBusConnection) bus_connection = NULL;
@@ -307,6 +1121,81 @@ main (int argc, char **argv)
   g_assert_true (tmp_root != NULL);
   g_setenv ("GS_SELF_TEST_CACHEDIR", tmp_root, TRUE);
 
+  /* A fake apk database, for what the plugin reads directly */
+  apk_root = g_build_filename (tmp_root, "root", NULL);
+  apk_db = g_build_filename (apk_root, "lib", "apk", "db", NULL);
+  g_assert_cmpint (g_mkdir_with_parents (apk_db, 0755), ==, 0);
+  g_clear_pointer (&apk_db, g_free);
+  apk_db = g_build_filename (apk_root, "lib", "apk", "db", "installed", NULL);
+  g_assert_true (g_file_set_contents (apk_db,
+                                      "P:apk-test-app\n"
+                                      "V:0.1.0-r0\n"
+                                      "T:Alpine Package Keeper test app\n"
+                                      "o:apk-test-app\n"
+                                      "p:cmd:apk-test=0.1.0-r0 so:libapktest.so.1=1.0\n"
+                                      "D:apk-test-lib>=1.0\n"
+                                      "\n"
+                                      "P:apk-test-lib\n"
+                                      "V:1.0.0-r0\n"
+                                      "T:Library of the test app\n"
+                                      "o:apk-test-lib\n"
+                                      "\n"
+                                      "P:apk-test-app-doc\n"
+                                      "V:0.1.0-r0\n"
+                                      "T:Alpine Package Keeper test app (documentation)\n"
+                                      "o:apk-test-app\n"
+                                      "\n"
+                                      "P:musl\n"
+                                      "V:1.2.5-r0\n"
+                                      "p:so:libc.musl-x86_64.so.1=1\n"
+                                      "\n"
+                                      "P:apk-test-tool\n"
+                                      "V:1.0-r0\n"
+                                      "o:apk-test-tool\n"
+                                      "\n"
+                                      "P:apk-test-tool-lang\n"
+                                      "V:1.0-r0\n"
+                                      "o:apk-test-tool\n"
+                                      "\n",
+                                      -1, &error));
+  g_assert_no_error (error);
+  g_clear_pointer (&apk_db, g_free);
+  apk_db = g_build_filename (apk_root, "etc", "apk", NULL);
+  g_assert_cmpint (g_mkdir_with_parents (apk_db, 0755), ==, 0);
+  g_clear_pointer (&apk_db, g_free);
+  apk_db = g_build_filename (apk_root, "etc", "apk", "world", NULL);
+  g_assert_true (g_file_set_contents (apk_db, "apk-test-app apk-test-tool apk-test-tool-lang\n", -1, &error));
+  g_assert_no_error (error);
+  g_clear_pointer (&apk_db, g_free);
+  apk_db = g_build_filename (apk_root, "etc", "apk", "cache", NULL);
+  g_assert_cmpint (g_mkdir_with_parents (apk_db, 0755), ==, 0);
+  g_clear_pointer (&apk_db, g_free);
+  apk_db = g_build_filename (apk_root, "etc", "apk", "repositories", NULL);
+  g_assert_true (g_file_set_contents (apk_db, "https://alpine.org/alpine/edge/main\n", -1, &error));
+  g_assert_no_error (error);
+  g_clear_pointer (&apk_db, g_free);
+  /* Its index, uncompressed text is read as is */
+  apk_db = cached_index_path (apk_root, "https://alpine.org/alpine/edge/main");
+  g_assert_true (g_file_set_contents (apk_db,
+                                      "P:foo\n"
+                                      "V:1.0-r0\n"
+                                      "T:Package with translations\n"
+                                      "o:foo\n"
+                                      "\n"
+                                      "P:foo-lang\n"
+                                      "V:1.0-r0\n"
+                                      "T:Package with translations (translations)\n"
+                                      "o:foo\n"
+                                      "\n"
+                                      "P:foo-lang-de\n"
+                                      "V:1.0-r0\n"
+                                      "T:Not the translations of foo\n"
+                                      "o:bar\n"
+                                      "\n",
+                                      -1, &error));
+  g_assert_no_error (error);
+  g_setenv ("GS_SELF_TEST_APK_ROOT", apk_root, TRUE);
+
   bus_connection = g_bus_get_sync (G_BUS_TYPE_SESSION, NULL, &error);
   g_assert_no_error (error);
   /* we can only load this once per process */
@@ -326,6 +1215,22 @@ main (int argc, char **argv)
   g_assert_true (gs_plugin_loader_get_enabled (plugin_loader, "generic-updates"));
   g_assert_true (gs_plugin_loader_get_enabled (plugin_loader, "appstream"));
 
+  g_test_add_func ("/gnome-software/plugins/apk/refresh-scheduler",
+                   gs_apk_refresh_scheduler_func);
+  g_test_add_func ("/gnome-software/plugins/apk/index/exclusive-size",
+                   gs_apk_index_exclusive_size_func);
+  g_test_add_func ("/gnome-software/plugins/apk/index/removal-impact",
+                   gs_apk_index_removal_impact_func);
+  g_test_add_func ("/gnome-software/plugins/apk/index/orphans",
+                   gs_apk_index_orphans_func);
+  g_test_add_func ("/gnome-software/plugins/apk/index/repositories",
+                   gs_apk_index_repositories_func);
+  g_test_add_func ("/gnome-software/plugins/apk/index/suggest",
+                   gs_apk_index_suggest_func);
+  g_test_add_func ("/gnome-software/plugins/apk/appstream/update",
+                   gs_apk_appstream_update_func);
+  g_test_add_func ("/gnome-software/plugins/apk/appstream/shed",
+                   gs_apk_appstream_shed_func);
   g_test_add_data_func ("/gnome-software/plugins/apk/repo-actions",
                         plugin_loader,
                         (GTestDataFunc) gs_plugins_apk_repo_actions);
@@ -335,9 +1240,39 @@ main (int argc, char **argv)
   g_test_add_data_func ("/gnome-software/plugins/apk/updates",
                         plugin_loader,
                         (GTestDataFunc) gs_plugins_apk_updates);
+  g_test_add_data_func ("/gnome-software/plugins/apk/updates-snapshot",
+                        plugin_loader,
+                        (GTestDataFunc) gs_plugins_apk_updates_snapshot);
+  g_test_add_data_func ("/gnome-software/plugins/apk/update-details",
+                        plugin_loader,
+                        (GTestDataFunc) gs_plugins_apk_update_details);
+  g_test_add_data_func ("/gnome-software/plugins/apk/not-found",
+                        plugin_loader,
+                        (GTestDataFunc) gs_plugins_apk_not_found);
+  g_test_add_data_func ("/gnome-software/plugins/apk/details-lanes",
+                        plugin_loader,
+                        (GTestDataFunc) gs_plugins_apk_details_lanes);
   g_test_add_data_func ("/gnome-software/plugins/apk/missing-source",
                         plugin_loader,
                         (GTestDataFunc) gs_plugins_apk_refine_app_missing_source);
+  g_test_add_data_func ("/gnome-software/plugins/apk/what-provides",
+                        plugin_loader,
+                        (GTestDataFunc) gs_plugins_apk_what_provides);
+  g_test_add_data_func ("/gnome-software/plugins/apk/addons",
+                        plugin_loader,
+                        (GTestDataFunc) gs_plugins_apk_addons);
+  g_test_add_data_func ("/gnome-software/plugins/apk/install-lang",
+                        plugin_loader,
+                        (GTestDataFunc) gs_plugins_apk_install_lang);
+  g_test_add_data_func ("/gnome-software/plugins/apk/uninstall-lang",
+                        plugin_loader,
+                        (GTestDataFunc) gs_plugins_apk_uninstall_lang);
+  g_test_add_data_func ("/gnome-software/plugins/apk/removal-impact",
+                        plugin_loader,
+                        (GTestDataFunc) gs_plugins_apk_removal_impact);
+  g_test_add_data_func ("/gnome-software/plugins/apk/orphans",
+                        plugin_loader,
+                        (GTestDataFunc) gs_plugins_apk_orphans);
   retval = g_test_run ();
 
   /* Clean up. */